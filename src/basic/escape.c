@@ -1,6 +1,9 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 
@@ -75,8 +78,50 @@ int cescape_char(char c, char *buf) {
         return buf - buf_old;
 }
 
+/* Returns the length of the initial part of s that may be copied verbatim by any of the escaping functions:
+ * everything but control characters, DEL, the characters listed in bad, and, unless eight_bit is true,
+ * bytes outside of the ASCII range. */
+size_t escape_span(const char *s, size_t n, const char *bad, bool eight_bit) {
+        const uint8_t *p = (const uint8_t*) s, *e = p + n;
+#if defined(__SSE2__)
+        const __m128i space = _mm_set1_epi8(' '), del = _mm_set1_epi8(0x7F);
+#endif
+
+        assert(s || n == 0);
+        assert(bad);
+
+#if defined(__SSE2__)
+        for (; e - p >= 16; p += 16) {
+                __m128i v, ok;
+                const char *b;
+                unsigned m;
+
+                v = _mm_loadu_si128((const __m128i*) p);
+
+                if (eight_bit) /* v >= ' ', unsigned */
+                        ok = _mm_cmpeq_epi8(_mm_max_epu8(v, space), v);
+                else /* ' ' <= v <= 0x7F, as bytes >= 0x80 are negative when signed */
+                        ok = _mm_cmpgt_epi8(v, _mm_set1_epi8(' ' - 1));
+
+                ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), ok);
+                for (b = bad; *b; b++)
+                        ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(*b)), ok);
+
+                m = _mm_movemask_epi8(ok) ^ 0xFFFF;
+                if (m != 0)
+                        return p - (const uint8_t*) s + __builtin_ctz(m);
+        }
+#endif
+
+        for (; p < e; p++)
+                if (*p < ' ' || *p == 0x7F || (!eight_bit && *p > 0x7F) || strchr(bad, *p))
+                        break;
+
+        return p - (const uint8_t*) s;
+}
+
 char *cescape_length(const char *s, size_t n) {
-        const char *f;
+        const char *f, *e;
         char *r, *t;
 
         assert(s || n == 0);
@@ -88,8 +133,18 @@ char *cescape_length(const char *s, size_t n) {
         if (!r)
                 return NULL;
 
-        for (f = s, t = r; f < s + n; f++)
+        for (f = s, e = s + n, t = r; f < e; f++) {
+                size_t k;
+
+                /* Copy whatever needs no escaping in one go */
+                k = escape_span(f, e - f, "\\\"'", false);
+                t = mempcpy(t, f, k);
+                f += k;
+                if (f >= e)
+                        break;
+
                 t += cescape_char(*f, t);
+        }
 
         *t = 0;
 
@@ -568,3 +568,43 @@ static inline int rt_sigqueueinfo(pid_t tgid, int sig, siginfo_t *info) {
         return syscall(__NR_rt_sigqueueinfo, tgid, sig, info);
 }
 #endif
+
+#if !HAVE_IO_URING_SETUP
+/* may be (invalid) negative number due to libseccomp, see PR 13319 */
+#  if ! (defined __NR_io_uring_setup && __NR_io_uring_setup >= 0)
+#    if defined __NR_io_uring_setup
+#      undef __NR_io_uring_setup
+#    endif
+#    define __NR_io_uring_setup 425
+#  endif
+struct io_uring_params;
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+#endif
+
+#if !HAVE_IO_URING_ENTER
+/* may be (invalid) negative number due to libseccomp, see PR 13319 */
+#  if ! (defined __NR_io_uring_enter && __NR_io_uring_enter >= 0)
+#    if defined __NR_io_uring_enter
+#      undef __NR_io_uring_enter
+#    endif
+#    define __NR_io_uring_enter 426
+#  endif
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, sigset_t *sig) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, sig, _NSIG / 8);
+}
+#endif
+
+#if !HAVE_IO_URING_REGISTER
+/* may be (invalid) negative number due to libseccomp, see PR 13319 */
+#  if ! (defined __NR_io_uring_register && __NR_io_uring_register >= 0)
+#    if defined __NR_io_uring_register
+#      undef __NR_io_uring_register
+#    endif
+#    define __NR_io_uring_register 427
+#  endif
+static inline int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
@@ -64,6 +64,26 @@ int prioq_ensure_allocated(Prioq **q, compare_func_t compare_func) {
         return 0;
 }
 
+int prioq_reserve(Prioq *q, unsigned n) {
+        struct prioq_item *j;
+
+        assert(q);
+
+        /* Makes sure the queue can hold n items, so that prioq_put() can't fail until it does */
+
+        if (n <= q->n_allocated)
+                return 0;
+
+        j = reallocarray(q->items, n, sizeof(struct prioq_item));
+        if (!j)
+                return -ENOMEM;
+
+        q->items = j;
+        q->n_allocated = n;
+
+        return 0;
+}
+
 static void swap(Prioq *q, unsigned j, unsigned k) {
         assert(q);
         assert(j < q->n_items);
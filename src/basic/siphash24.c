@@ -204,3 +204,92 @@ uint64_t siphash24(const void *in, size_t inlen, const uint8_t k[static 16]) {
 
         return siphash24_finalize(&state);
 }
+
+/* SipHash-1-3, i.e. one compression round per block and three finalization rounds instead of two and four.
+ * This is the variant other hash table implementations settled on for protecting against hash flooding, at
+ * about twice the speed. Since it has no incremental interface it can keep its state in registers. */
+
+static uint64_t tail_read_le(const uint8_t *in, size_t inlen) {
+        uint64_t b = ((uint64_t) inlen) << 56;
+        size_t i;
+
+        for (i = 0; i < (inlen & 7); i++)
+                b |= ((uint64_t) in[i]) << (i * 8);
+
+        return b;
+}
+
+static uint64_t siphash13_finalize(struct siphash *state, uint64_t b) {
+        state->v3 ^= b;
+        sipround(state);
+        state->v0 ^= b;
+
+        state->v2 ^= 0xff;
+
+        sipround(state);
+        sipround(state);
+        sipround(state);
+
+        return state->v0 ^ state->v1 ^ state->v2 ^ state->v3;
+}
+
+uint64_t siphash13(const void *_in, size_t inlen, const uint8_t k[static 16]) {
+        const uint8_t *in = _in, *end = in + (inlen & ~(size_t) 7);
+        struct siphash state;
+
+        assert(in || inlen == 0);
+        assert(k);
+
+        siphash24_init(&state, k);
+
+        for ( ; in < end; in += 8) {
+                uint64_t m = unaligned_read_le64(in);
+
+                state.v3 ^= m;
+                sipround(&state);
+                state.v0 ^= m;
+        }
+
+        return siphash13_finalize(&state, tail_read_le(in, inlen));
+}
+
+void siphash13_pair(
+                const void *_in,
+                size_t inlen,
+                const uint8_t k[static 16],
+                const uint8_t l[static 16],
+                uint64_t *ret_k,
+                uint64_t *ret_l) {
+
+        const uint8_t *in = _in, *end = in + (inlen & ~(size_t) 7);
+        struct siphash a, b;
+        uint64_t m;
+
+        assert(in || inlen == 0);
+        assert(k);
+        assert(l);
+        assert(ret_k);
+        assert(ret_l);
+
+        /* Calculates the hashes for two keys in a single pass. The two states don't depend on each other,
+         * hence the CPU can run their rounds side by side, which makes this much cheaper than two calls to
+         * siphash13(). */
+
+        siphash24_init(&a, k);
+        siphash24_init(&b, l);
+
+        for ( ; in < end; in += 8) {
+                m = unaligned_read_le64(in);
+
+                a.v3 ^= m;
+                b.v3 ^= m;
+                sipround(&a);
+                sipround(&b);
+                a.v0 ^= m;
+                b.v0 ^= m;
+        }
+
+        m = tail_read_le(in, inlen);
+        *ret_k = siphash13_finalize(&a, m);
+        *ret_l = siphash13_finalize(&b, m);
+}
@@ -24,6 +24,9 @@ uint64_t siphash24_finalize(struct siphash *state);
 
 uint64_t siphash24(const void *in, size_t inlen, const uint8_t k[static 16]);
 
+uint64_t siphash13(const void *in, size_t inlen, const uint8_t k[static 16]);
+void siphash13_pair(const void *in, size_t inlen, const uint8_t k[static 16], const uint8_t l[static 16], uint64_t *ret_k, uint64_t *ret_l);
+
 static inline uint64_t siphash24_string(const char *s, const uint8_t k[static 16]) {
         return siphash24(s, strlen(s) + 1, k);
 }
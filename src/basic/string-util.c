@@ -1,6 +1,9 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -1207,3 +1210,40 @@ int string_extract_line(const char *s, size_t i, char **ret) {
                 c++;
         }
 }
+
+/* Like memchr(), but looks for either of two bytes in a single pass over the memory block. This is what
+ * finding the end of a log line needs, as lines may be terminated by a newline or by NUL. */
+void *memchr2(const void *s, int a, int b, size_t n) {
+#if defined(__SSE2__)
+        const uint8_t *p = s, *e = p + n;
+        const __m128i va = _mm_set1_epi8((char) a), vb = _mm_set1_epi8((char) b);
+
+        assert(s || n == 0);
+
+        for (; e - p >= 16; p += 16) {
+                __m128i v;
+                unsigned m;
+
+                v = _mm_loadu_si128((const __m128i*) p);
+                m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+                if (m != 0)
+                        return (void*) (p + __builtin_ctz(m));
+        }
+
+        for (; p < e; p++)
+                if (*p == (uint8_t) a || *p == (uint8_t) b)
+                        return (void*) p;
+
+        return NULL;
+#else
+        const uint8_t *x, *y;
+
+        assert(s || n == 0);
+
+        /* Without vector instructions two passes of the libc implementation beat a byte-wise loop */
+        x = memchr(s, a, n);
+        y = memchr(s, b, x ? (size_t) (x - (const uint8_t*) s) : n);
+
+        return (void*) (y ?: x);
+#endif
+}
@@ -247,6 +247,8 @@ static inline void *memory_startswith(const void *p, size_t sz, const char *toke
         return (uint8_t*) p + n;
 }
 
+void *memchr2(const void *s, int a, int b, size_t n) _pure_;
+
 /* Like startswith_no_case(), but operates on arbitrary memory blocks.
  * It works only for ASCII strings.
  */
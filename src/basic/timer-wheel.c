@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+/*
+ * Timer Wheel
+ * The timer wheel object orders objects by a 64bit key, typically a point in
+ * time, for uses where objects are added, moved and removed a lot more often
+ * than the smallest one is looked at, like timers that are rearmed all the
+ * time. Insertion and removal are O(1), finding the smallest object is O(1)
+ * amortized.
+ *
+ * The wheel is hierarchical: it has eleven levels of 64 slots each. Every
+ * object is in the level of the highest 6bit digit in which its key differs
+ * from the base of the wheel, in the slot of its own digit there. Hence all
+ * objects in a slot of level 0 have the same key, and all objects in a level
+ * have larger keys than the objects in the levels below. When the smallest
+ * object is looked for and there is nothing in level 0, the base is moved up
+ * to the smallest key in the first occupied slot, and the objects in that
+ * slot are spread over the levels below. Objects only ever move down, hence
+ * each object moves at most eleven times.
+ *
+ * Objects whose key is below the base, i.e. smaller than the smallest key
+ * looked at before, are kept in a Prioq next to the wheel.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "prioq.h"
+#include "timer-wheel.h"
+#include "util.h"
+
+#define TIMER_WHEEL_BITS 6U
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS ((64U + TIMER_WHEEL_BITS - 1) / TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVEL_EARLY (UINT8_MAX - 1)
+
+struct TimerWheel {
+        uint64_t base;
+        unsigned n_entries; /* in the wheel itself, not counting the early ones */
+
+        /* Which slots of each level have any entries */
+        uint64_t occupied[TIMER_WHEEL_LEVELS];
+        LIST_HEAD(TimerWheelEntry, slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]);
+
+        Prioq *early;
+};
+
+TimerWheel *timer_wheel_new(void) {
+        return new0(TimerWheel, 1);
+}
+
+TimerWheel* timer_wheel_free(TimerWheel *w) {
+        if (!w)
+                return NULL;
+
+        prioq_free(w->early);
+        return mfree(w);
+}
+
+int timer_wheel_ensure_allocated(TimerWheel **w) {
+        assert(w);
+
+        if (*w)
+                return 0;
+
+        *w = timer_wheel_new();
+        if (!*w)
+                return -ENOMEM;
+
+        return 0;
+}
+
+static int entry_compare(const TimerWheelEntry *x, const TimerWheelEntry *y) {
+        return CMP(x->key, y->key);
+}
+
+int timer_wheel_reserve(TimerWheel *w, unsigned n) {
+        int r;
+
+        assert(w);
+
+        /* Entries in the wheel itself need no memory of their own, only the early ones do. Once there is
+         * room for n of them, putting up to n entries into the wheel can't fail. */
+
+        r = prioq_ensure_allocated(&w->early, (compare_func_t) entry_compare);
+        if (r < 0)
+                return r;
+
+        return prioq_reserve(w->early, n);
+}
+
+static void timer_wheel_place(TimerWheel *w, TimerWheelEntry *e) {
+        unsigned level;
+
+        assert(w);
+        assert(e);
+        assert(e->key >= w->base);
+
+        level = u64log2(e->key ^ w->base) / TIMER_WHEEL_BITS;
+
+        e->level = level;
+        e->slot = (e->key >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+
+        LIST_PREPEND(entries, w->slots[e->level][e->slot], e);
+        w->occupied[e->level] |= UINT64_C(1) << e->slot;
+}
+
+int timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, uint64_t key) {
+        int r;
+
+        assert(w);
+        assert(e);
+        assert(!timer_wheel_entry_linked(e));
+
+        e->key = key;
+
+        /* An empty wheel may start anywhere */
+        if (w->n_entries == 0)
+                w->base = key;
+
+        if (key < w->base) {
+                r = prioq_ensure_allocated(&w->early, (compare_func_t) entry_compare);
+                if (r < 0)
+                        return r;
+
+                r = prioq_put(w->early, e, &e->idx);
+                if (r < 0)
+                        return r;
+
+                e->level = TIMER_WHEEL_LEVEL_EARLY;
+                return 0;
+        }
+
+        timer_wheel_place(w, e);
+        w->n_entries++;
+
+        return 0;
+}
+
+bool timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e) {
+        assert(e);
+
+        if (!w || !timer_wheel_entry_linked(e))
+                return false;
+
+        if (e->level == TIMER_WHEEL_LEVEL_EARLY)
+                assert_se(prioq_remove(w->early, e, &e->idx) > 0);
+        else {
+                assert(w->n_entries > 0);
+
+                LIST_REMOVE(entries, w->slots[e->level][e->slot], e);
+                if (!w->slots[e->level][e->slot])
+                        w->occupied[e->level] &= ~(UINT64_C(1) << e->slot);
+
+                w->n_entries--;
+        }
+
+        e->level = UINT8_MAX;
+        return true;
+}
+
+static TimerWheelEntry *timer_wheel_first(TimerWheel *w) {
+        assert(w);
+
+        if (w->n_entries == 0)
+                return NULL;
+
+        for (;;) {
+                TimerWheelEntry *i, *min, *list;
+                unsigned level, slot;
+
+                for (level = 0; w->occupied[level] == 0; level++)
+                        assert(level + 1 < TIMER_WHEEL_LEVELS);
+
+                slot = __builtin_ctzll(w->occupied[level]);
+                list = w->slots[level][slot];
+
+                if (level == 0)
+                        return list;
+
+                /* Move the base up to the smallest key in the slot, and spread the slot over the levels
+                 * below. Nothing else needs to move, as all other entries have larger keys in a digit above
+                 * the ones that change. */
+                min = list;
+                LIST_FOREACH(entries, i, list)
+                        if (i->key < min->key)
+                                min = i;
+
+                w->base = min->key;
+                w->slots[level][slot] = NULL;
+                w->occupied[level] &= ~(UINT64_C(1) << slot);
+
+                while ((i = list)) {
+                        list = i->entries_next;
+                        timer_wheel_place(w, i);
+                }
+        }
+}
+
+TimerWheelEntry *timer_wheel_peek(TimerWheel *w) {
+        TimerWheelEntry *e, *f;
+
+        if (!w)
+                return NULL;
+
+        e = timer_wheel_first(w);
+        f = prioq_peek(w->early);
+
+        if (!e || (f && f->key < e->key))
+                return f;
+
+        return e;
+}
+
+TimerWheelEntry *timer_wheel_pop(TimerWheel *w) {
+        TimerWheelEntry *e;
+
+        e = timer_wheel_peek(w);
+        if (e)
+                assert_se(timer_wheel_remove(w, e));
+
+        return e;
+}
+
+unsigned timer_wheel_size(TimerWheel *w) {
+        if (!w)
+                return 0;
+
+        return w->n_entries + prioq_size(w->early);
+}
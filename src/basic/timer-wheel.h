@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "list.h"
+#include "macro.h"
+
+typedef struct TimerWheel TimerWheel;
+typedef struct TimerWheelEntry TimerWheelEntry;
+
+/* Embed this in the objects to put in the wheel, and use container_of() to get back to them */
+struct TimerWheelEntry {
+        LIST_FIELDS(TimerWheelEntry, entries);
+        uint64_t key;
+        unsigned idx;
+        uint8_t level;
+        uint8_t slot;
+};
+
+#define TIMER_WHEEL_ENTRY_NULL ((TimerWheelEntry) { .level = UINT8_MAX })
+
+TimerWheel *timer_wheel_new(void);
+TimerWheel *timer_wheel_free(TimerWheel *w);
+DEFINE_TRIVIAL_CLEANUP_FUNC(TimerWheel*, timer_wheel_free);
+int timer_wheel_ensure_allocated(TimerWheel **w);
+int timer_wheel_reserve(TimerWheel *w, unsigned n);
+
+int timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, uint64_t key);
+bool timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e);
+
+TimerWheelEntry *timer_wheel_peek(TimerWheel *w);
+TimerWheelEntry *timer_wheel_pop(TimerWheel *w);
+
+static inline bool timer_wheel_entry_linked(const TimerWheelEntry *e) {
+        return e->level != UINT8_MAX;
+}
+
+unsigned timer_wheel_size(TimerWheel *w) _pure_;
@@ -24,6 +24,9 @@
  */
 
 #include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -123,6 +126,41 @@ int utf8_encoded_to_unichar(const char *str, char32_t *ret_unichar) {
         return 0;
 }
 
+static bool ascii_is_printable(uint8_t c, bool newline) {
+        return (c >= ' ' && c < 0x7F) || c == '\t' || (newline && c == '\n');
+}
+
+/* Returns the length of the initial part of str that consists of printable ASCII characters only, which is
+ * all that most log messages are made of. Those need no decoding, and can be checked 16 at a time. */
+static size_t ascii_printable_span(const char *str, size_t length, bool newline) {
+        const uint8_t *p = (const uint8_t*) str, *e = p + length;
+#if defined(__SSE2__)
+        const __m128i space = _mm_set1_epi8(' ' - 1), del = _mm_set1_epi8(0x7F),
+                tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8(newline ? '\n' : '\t');
+
+        for (; e - p >= 16; p += 16) {
+                __m128i v, ok;
+                unsigned m;
+
+                /* Bytes >= 0x80 are negative as signed chars, hence a single signed comparison rules out
+                 * both them and the C0 control characters */
+                v = _mm_loadu_si128((const __m128i*) p);
+                ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, space));
+                ok = _mm_or_si128(ok, _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl)));
+
+                m = _mm_movemask_epi8(ok) ^ 0xFFFF;
+                if (m != 0)
+                        return p - (const uint8_t*) str + __builtin_ctz(m);
+        }
+#endif
+
+        for (; p < e; p++)
+                if (!ascii_is_printable(*p, newline))
+                        break;
+
+        return p - (const uint8_t*) str;
+}
+
 bool utf8_is_printable_newline(const char* str, size_t length, bool newline) {
         const char *p;
 
@@ -131,6 +169,13 @@ bool utf8_is_printable_newline(const char* str, size_t length, bool newline) {
         for (p = str; length > 0;) {
                 int encoded_len, r;
                 char32_t val;
+                size_t n;
+
+                n = ascii_printable_span(p, length, newline);
+                p += n;
+                length -= n;
+                if (length == 0)
+                        break;
 
                 encoded_len = utf8_encoded_valid_unichar(p, length);
                 if (encoded_len < 0)
@@ -38,6 +38,7 @@
 #include "dirent-util.h"
 #include "env-util.h"
 #include "escape.h"
+#include "event-util.h"
 #include "exec-util.h"
 #include "execute.h"
 #include "exit-status.h"
@@ -2123,6 +2124,9 @@ void manager_dump(Manager *m, FILE *f, const char *prefix) {
 
         manager_dump_units(m, f, prefix);
         manager_dump_jobs(m, f, prefix);
+
+        /* Only if profiling was turned on with $SD_EVENT_PROFILE_SOURCES */
+        event_dump_source_profiles(m->event, f, prefix);
 }
 
 int manager_get_dump_string(Manager *m, char **ret) {
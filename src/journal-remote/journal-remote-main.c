@@ -147,7 +147,7 @@ static int dispatch_http_event(sd_event_source *event,
                                uint32_t revents,
                                void *userdata);
 
-static int request_meta(void **connection_cls, int fd, char *hostname) {
+static int request_meta(void **connection_cls, int fd, char *hostname, bool binary) {
         RemoteSource *source;
         Writer *writer;
         int r;
@@ -167,6 +167,8 @@ static int request_meta(void **connection_cls, int fd, char *hostname) {
                 return log_oom();
         }
 
+        source->importer.binary = binary;
+
         log_debug("Added RemoteSource as connection metadata %p", source);
 
         *connection_cls = source;
@@ -266,7 +268,7 @@ static mhd_result request_handler(
         const char *header;
         int r, code, fd;
         _cleanup_free_ char *hostname = NULL;
-        bool chunked = false;
+        bool chunked = false, binary;
 
         assert(connection);
         assert(connection_cls);
@@ -287,9 +289,12 @@ static mhd_result request_handler(
                 return mhd_respond(connection, MHD_HTTP_NOT_FOUND, "Not found.");
 
         header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Content-Type");
-        if (!header || !streq(header, "application/vnd.fdo.journal"))
+        if (!header || !STR_IN_SET(header, "application/vnd.fdo.journal", JOURNAL_BINARY_CONTENT_TYPE))
                 return mhd_respond(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
-                                   "Content-Type: application/vnd.fdo.journal is required.");
+                                   "Content-Type: application/vnd.fdo.journal or "
+                                   JOURNAL_BINARY_CONTENT_TYPE " is required.");
+
+        binary = streq(header, JOURNAL_BINARY_CONTENT_TYPE);
 
         header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Transfer-Encoding");
         if (header) {
@@ -349,7 +354,7 @@ static mhd_result request_handler(
 
         assert(hostname);
 
-        r = request_meta(connection_cls, fd, hostname);
+        r = request_meta(connection_cls, fd, hostname, binary);
         if (r == -ENOMEM)
                 return respond_oom(connection);
         else if (r < 0)
@@ -1164,6 +1169,8 @@ static int run(int argc, char **argv) {
                         return log_error_errno(r, "Failed to run event loop: %m");
         }
 
+        journal_remote_server_flush(&s);
+
         notify_message = NULL;
         (void) sd_notifyf(false,
                           "STOPPING=1\n"
@@ -53,6 +53,16 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
         assert(source);
         assert(source->writer);
 
+        /* Don't take in more data than the writer can keep up with. Sources we read from ourselves are
+         * paused by the caller, which leaves the data in the socket and thus slows down the sender. Data
+         * pushed to us can't be refused, so wait for the writer instead, which stalls the HTTP daemon. */
+        if (writer_congested(source->writer)) {
+                if (!source->importer.passive_fd)
+                        return -EBUSY;
+
+                writer_wait_uncongested(source->writer);
+        }
+
         r = journal_importer_process_data(&source->importer);
         if (r <= 0)
                 return r;
@@ -68,16 +78,13 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
 
         assert(source->importer.iovw.iovec);
 
-        r = writer_write(source->writer,
-                         &source->importer.iovw,
-                         &source->importer.ts,
-                         &source->importer.boot_id,
-                         compress, seal);
-        if (r == -EBADMSG) {
-                log_error_errno(r, "Entry is invalid, ignoring.");
-                r = 0;
-        } else if (r < 0)
-                log_error_errno(r, "Failed to write entry of %zu bytes: %m",
+        r = writer_enqueue(source->writer,
+                           &source->importer.iovw,
+                           &source->importer.ts,
+                           &source->importer.boot_id,
+                           compress, seal);
+        if (r < 0)
+                log_error_errno(r, "Failed to queue entry of %zu bytes: %m",
                                 iovw_size(&source->importer.iovw));
         else
                 r = 1;
@@ -1,7 +1,30 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <signal.h>
+#include <sys/eventfd.h>
+
 #include "alloc-util.h"
 #include "journal-remote.h"
+#include "pthread-util.h"
+
+/* Once this much data is queued for a shard, the sources writing to it are throttled until the queue
+ * shrank to the low watermark again. */
+#define WRITER_QUEUE_BYTES_HIGH (16U*1024U*1024U)
+#define WRITER_QUEUE_BYTES_LOW (WRITER_QUEUE_BYTES_HIGH / 2)
+
+struct WriterEntry {
+        Writer *writer;
+        dual_timestamp ts;
+        sd_id128_t boot_id;
+        bool compress;
+        bool seal;
+        size_t size;            /* payload bytes, following the iovec array */
+
+        LIST_FIELDS(WriterEntry, queue);
+
+        size_t n_iovec;
+        struct iovec iovec[];
+};
 
 static int do_rotate(JournalFile **f, bool compress, bool seal) {
         int r = journal_file_rotate(f, compress, (uint64_t) -1, seal, NULL);
@@ -38,6 +61,10 @@ static Writer* writer_free(Writer *w) {
         if (!w)
                 return NULL;
 
+        /* Queued entries still refer to us */
+        if (w->shard)
+                writer_flush(w);
+
         if (w->journal) {
                 log_debug("Closing journal file %s.", w->journal->path);
                 journal_file_close(w->journal);
@@ -79,11 +106,9 @@ int writer_write(Writer *w,
         r = journal_file_append_entry(w->journal, ts, boot_id,
                                       iovw->iovec, iovw->count,
                                       &w->seqnum, NULL, NULL);
-        if (r >= 0) {
-                if (w->server)
-                        w->server->event_count += 1;
+        if (r >= 0)
                 return 0;
-        } else if (r == -EBADMSG)
+        else if (r == -EBADMSG)
                 return r;
 
         log_debug_errno(r, "%s: Write failed, rotating: %m", w->journal->path);
@@ -100,7 +125,265 @@ int writer_write(Writer *w,
         if (r < 0)
                 return r;
 
-        if (w->server)
-                w->server->event_count += 1;
         return 0;
 }
+
+static int writer_write_entry(WriterEntry *e) {
+        struct iovec_wrapper iovw;
+        int r;
+
+        assert(e);
+
+        iovw = (struct iovec_wrapper) {
+                .iovec = e->iovec,
+                .count = e->n_iovec,
+        };
+
+        r = writer_write(e->writer, &iovw, &e->ts, &e->boot_id, e->compress, e->seal);
+        if (r == -EBADMSG)
+                return log_error_errno(r, "Entry is invalid, ignoring.");
+        if (r < 0)
+                return log_error_errno(r, "Failed to write entry of %zu bytes: %m", e->size);
+
+        return 0;
+}
+
+static void* writer_shard_thread(void *p) {
+        WriterShard *shard = p;
+
+        (void) pthread_setname_np(pthread_self(), "journal-writer");
+
+        assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+
+        for (;;) {
+                WriterEntry *e;
+                Writer *w;
+                size_t size;
+                int r;
+
+                while (!shard->queue && !shard->stop)
+                        assert_se(pthread_cond_wait(&shard->queued, &shard->mutex) == 0);
+
+                e = shard->queue;
+                if (!e)
+                        break; /* Asked to stop, and everything is written */
+
+                LIST_REMOVE(queue, shard->queue, e);
+                if (shard->queue_tail == e)
+                        shard->queue_tail = NULL;
+
+                assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+                r = writer_write_entry(e);
+                w = e->writer;
+                size = e->size;
+                free(e);
+
+                assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+
+                if (r >= 0)
+                        shard->n_written++;
+
+                /* Once this drops to zero the writer may go away any moment, don't touch it anymore */
+                w->n_queued--;
+                shard->n_queued--;
+                shard->queue_bytes -= size;
+
+                if (shard->wakeup && shard->queue_bytes <= WRITER_QUEUE_BYTES_LOW) {
+                        shard->wakeup = false;
+                        (void) eventfd_write(shard->notify_fd, 1);
+                }
+
+                assert_se(pthread_cond_broadcast(&shard->done) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+        return NULL;
+}
+
+static int writer_shard_start(WriterShard *shard) {
+        sigset_t ss, saved_ss;
+        int r, k;
+
+        /* Must be called with the shard's mutex held */
+
+        assert_se(sigfillset(&ss) >= 0);
+        /* Don't block SIGBUS since the worker accesses memory mapped files.
+         * Asynchronous SIGBUS signals can safely be handled by either thread. */
+        assert_se(sigdelset(&ss, SIGBUS) >= 0);
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
+
+        r = pthread_create(&shard->thread, NULL, writer_shard_thread, shard);
+        if (r == 0)
+                shard->running = true;
+
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0)
+                return -r;
+        if (k > 0)
+                return -k;
+
+        return 0;
+}
+
+int writer_enqueue(Writer *w,
+                   struct iovec_wrapper *iovw,
+                   dual_timestamp *ts,
+                   sd_id128_t *boot_id,
+                   bool compress,
+                   bool seal) {
+
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+        WriterShard *shard;
+        WriterEntry *e;
+        size_t i, size;
+        char *p;
+        int r;
+
+        assert(w);
+        assert(w->shard);
+        assert(iovw);
+        assert(iovw->count > 0);
+        assert(ts);
+        assert(boot_id);
+
+        shard = w->shard;
+        size = iovw_size(iovw);
+
+        /* The iovecs point into the importer's buffer, which is reused for the next entry right away,
+         * hence copy everything into a single allocation owned by the queue. */
+        e = malloc(offsetof(WriterEntry, iovec) + iovw->count * sizeof(struct iovec) + size);
+        if (!e)
+                return -ENOMEM;
+
+        *e = (WriterEntry) {
+                .writer = w,
+                .ts = *ts,
+                .boot_id = *boot_id,
+                .compress = compress,
+                .seal = seal,
+                .size = size,
+                .n_iovec = iovw->count,
+        };
+
+        p = (char*) (e->iovec + e->n_iovec);
+        for (i = 0; i < iovw->count; i++) {
+                e->iovec[i] = IOVEC_MAKE(p, iovw->iovec[i].iov_len);
+                p = mempcpy(p, iovw->iovec[i].iov_base, iovw->iovec[i].iov_len);
+        }
+
+        m = pthread_mutex_lock_assert(&shard->mutex);
+
+        if (!shard->running) {
+                r = writer_shard_start(shard);
+                if (r < 0) {
+                        free(e);
+                        return r;
+                }
+        }
+
+        LIST_INSERT_AFTER(queue, shard->queue, shard->queue_tail, e);
+        shard->queue_tail = e;
+        shard->queue_bytes += size;
+        shard->n_queued++;
+        w->n_queued++;
+
+        assert_se(pthread_cond_signal(&shard->queued) == 0);
+        return 0;
+}
+
+bool writer_congested(Writer *w) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+
+        assert(w);
+        assert(w->shard);
+
+        m = pthread_mutex_lock_assert(&w->shard->mutex);
+
+        if (w->shard->queue_bytes < WRITER_QUEUE_BYTES_HIGH)
+                return false;
+
+        /* Have the worker tell us when it caught up */
+        w->shard->wakeup = true;
+        return true;
+}
+
+void writer_wait_uncongested(Writer *w) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+
+        assert(w);
+        assert(w->shard);
+
+        m = pthread_mutex_lock_assert(&w->shard->mutex);
+
+        while (w->shard->queue_bytes > WRITER_QUEUE_BYTES_LOW)
+                assert_se(pthread_cond_wait(&w->shard->done, &w->shard->mutex) == 0);
+}
+
+void writer_flush(Writer *w) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+
+        assert(w);
+        assert(w->shard);
+
+        m = pthread_mutex_lock_assert(&w->shard->mutex);
+
+        while (w->n_queued > 0)
+                assert_se(pthread_cond_wait(&w->shard->done, &w->shard->mutex) == 0);
+}
+
+void writer_shard_init(WriterShard *shard, int notify_fd) {
+        assert(shard);
+
+        *shard = (WriterShard) {
+                .notify_fd = notify_fd,
+        };
+
+        assert_se(pthread_mutex_init(&shard->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&shard->queued, NULL) == 0);
+        assert_se(pthread_cond_init(&shard->done, NULL) == 0);
+}
+
+uint64_t writer_shard_flush(WriterShard *shard) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+        uint64_t n;
+
+        assert(shard);
+
+        /* Waits until everything queued so far is written, and returns the number of entries written
+         * since the last call. */
+
+        m = pthread_mutex_lock_assert(&shard->mutex);
+
+        while (shard->n_queued > 0)
+                assert_se(pthread_cond_wait(&shard->done, &shard->mutex) == 0);
+
+        n = shard->n_written;
+        shard->n_written = 0;
+
+        return n;
+}
+
+void writer_shard_done(WriterShard *shard) {
+        assert(shard);
+
+        if (shard->running) {
+                assert_se(pthread_mutex_lock(&shard->mutex) == 0);
+                shard->stop = true;
+                assert_se(pthread_cond_signal(&shard->queued) == 0);
+                assert_se(pthread_mutex_unlock(&shard->mutex) == 0);
+
+                assert_se(pthread_join(shard->thread, NULL) == 0);
+                shard->running = false;
+        }
+
+        assert(!shard->queue);
+
+        assert_se(pthread_mutex_destroy(&shard->mutex) == 0);
+        assert_se(pthread_cond_destroy(&shard->queued) == 0);
+        assert_se(pthread_cond_destroy(&shard->done) == 0);
+}
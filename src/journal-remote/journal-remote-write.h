@@ -1,10 +1,35 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 #pragma once
 
+#include <pthread.h>
+
 #include "journal-file.h"
 #include "journal-importer.h"
+#include "list.h"
 
 typedef struct RemoteServer RemoteServer;
+typedef struct WriterEntry WriterEntry;
+
+/* Entries are appended to the journal files by a small pool of worker threads, so that hosts that are
+ * split into separate files are written in parallel, and parsing never waits for the disk. Each writer is
+ * bound to one shard, whose thread processes its entries in order. */
+typedef struct WriterShard {
+        pthread_mutex_t mutex;
+        pthread_cond_t queued;  /* signalled when an entry is added to the queue */
+        pthread_cond_t done;    /* broadcast when the worker is done with an entry */
+        pthread_t thread;
+        bool running;
+        bool stop;
+        bool wakeup;            /* somebody waits for the queue to shrink below the low watermark */
+
+        LIST_HEAD(WriterEntry, queue);
+        WriterEntry *queue_tail;
+        size_t n_queued;        /* queued entries, including the one being written */
+        size_t queue_bytes;
+
+        uint64_t n_written;
+        int notify_fd;          /* eventfd written to when the queue shrank and wakeup is set */
+} WriterShard;
 
 typedef struct Writer {
         JournalFile *journal;
@@ -14,6 +39,9 @@ typedef struct Writer {
         RemoteServer *server;
         char *hashmap_key;
 
+        WriterShard *shard;
+        size_t n_queued;        /* protected by the shard's mutex */
+
         uint64_t seqnum;
 
         unsigned n_ref;
@@ -31,6 +59,19 @@ int writer_write(Writer *s,
                  sd_id128_t *boot_id,
                  bool compress,
                  bool seal);
+int writer_enqueue(Writer *w,
+                   struct iovec_wrapper *iovw,
+                   dual_timestamp *ts,
+                   sd_id128_t *boot_id,
+                   bool compress,
+                   bool seal);
+bool writer_congested(Writer *w);
+void writer_wait_uncongested(Writer *w);
+void writer_flush(Writer *w);
+
+void writer_shard_init(WriterShard *shard, int notify_fd);
+uint64_t writer_shard_flush(WriterShard *shard);
+void writer_shard_done(WriterShard *shard);
 
 typedef enum JournalWriteSplitMode {
         JOURNAL_WRITE_SPLIT_NONE,
@@ -3,12 +3,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <stdint.h>
 
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "cpu-set-util.h"
 #include "def.h"
 #include "errno-util.h"
 #include "escape.h"
@@ -27,6 +29,9 @@
 
 #define REMOTE_JOURNAL_PATH "/var/log/journal/remote"
 
+/* More writer threads than this hardly help, they all compete for the same disk */
+#define WRITER_SHARDS_MAX 8U
+
 #define filename_escape(s) xescape((s), "/ ")
 
 static int open_output(RemoteServer *s, Writer *w, const char* host) {
@@ -126,6 +131,9 @@ int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer
                                 return log_oom();
                 }
 
+                /* Spread the hosts over the writer threads as they come in */
+                w->shard = s->writer_shards + s->next_writer_shard++ % s->n_writer_shards;
+
                 r = open_output(s, w, host);
                 if (r < 0)
                         return r;
@@ -140,6 +148,79 @@ int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer
         return 0;
 }
 
+static int dispatch_writer_event(sd_event_source *event,
+                                 int fd,
+                                 uint32_t revents,
+                                 void *userdata) {
+        RemoteServer *s = userdata;
+        eventfd_t x;
+        size_t i;
+
+        /* Some writer caught up, resume reading from the sources we paused for it */
+
+        (void) eventfd_read(fd, &x);
+
+        for (i = 0; i < s->sources_size; i++) {
+                RemoteSource *source = s->sources[i];
+
+                if (!source || !source->congested)
+                        continue;
+
+                if (writer_congested(source->writer))
+                        continue;
+
+                source->congested = false;
+                (void) sd_event_source_set_enabled(source->event, SD_EVENT_ON);
+
+                /* There might be complete entries in the buffer already, which no new data would
+                 * wake us up for */
+                if (source->buffer_event)
+                        (void) sd_event_source_set_enabled(source->buffer_event, SD_EVENT_ON);
+        }
+
+        return 0;
+}
+
+static int init_writer_shards(RemoteServer *s) {
+        _cleanup_close_ int fd = -1;
+        size_t i, n = 1;
+        int r, notify_fd;
+
+        assert(s);
+
+        /* With a single output file there's nothing to parallelize, but a thread of its own still
+         * keeps the disk from stalling the reading of sources. */
+        if (s->split_mode == JOURNAL_WRITE_SPLIT_HOST) {
+                r = cpus_in_affinity_mask();
+                if (r > 0)
+                        n = MIN((size_t) r, WRITER_SHARDS_MAX);
+        }
+
+        fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (fd < 0)
+                return log_error_errno(errno, "Failed to allocate eventfd: %m");
+
+        r = sd_event_add_io(s->events, &s->writer_event, fd, EPOLLIN, dispatch_writer_event, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to watch writer eventfd: %m");
+
+        r = sd_event_source_set_io_fd_own(s->writer_event, true);
+        if (r < 0)
+                return log_error_errno(r, "Failed to pass ownership of writer eventfd: %m");
+        notify_fd = TAKE_FD(fd);
+
+        s->writer_shards = new(WriterShard, n);
+        if (!s->writer_shards)
+                return log_oom();
+
+        for (i = 0; i < n; i++)
+                writer_shard_init(s->writer_shards + i, notify_fd);
+        s->n_writer_shards = n;
+
+        log_debug("Writing with %zu thread(s).", s->n_writer_shards);
+        return 0;
+}
+
 /**********************************************************************
  **********************************************************************
  **********************************************************************/
@@ -332,6 +413,10 @@ int journal_remote_server_init(
         if (r < 0)
                 return r;
 
+        r = init_writer_shards(s);
+        if (r < 0)
+                return r;
+
         return 0;
 }
 
@@ -344,6 +429,17 @@ static void MHDDaemonWrapper_free(MHDDaemonWrapper *d) {
 }
 #endif
 
+void journal_remote_server_flush(RemoteServer *s) {
+        size_t i;
+
+        assert(s);
+
+        /* Waits for everything queued so far to be written, and updates the entry counter */
+
+        for (i = 0; i < s->n_writer_shards; i++)
+                s->event_count += writer_shard_flush(s->writer_shards + i);
+}
+
 void journal_remote_server_destroy(RemoteServer *s) {
         size_t i;
 
@@ -359,6 +455,11 @@ void journal_remote_server_destroy(RemoteServer *s) {
         writer_unref(s->_single_writer);
         hashmap_free(s->writers);
 
+        for (i = 0; i < s->n_writer_shards; i++)
+                writer_shard_done(s->writer_shards + i);
+        free(s->writer_shards);
+        sd_event_source_unref(s->writer_event);
+
         sd_event_source_unref(s->sigterm_event);
         sd_event_source_unref(s->sigint_event);
         sd_event_source_unref(s->listen_event);
@@ -412,6 +513,12 @@ int journal_remote_handle_raw_source(
                 return 1;
         } else if (r == -EAGAIN) {
                 return 0;
+        } else if (r == -EBUSY) {
+                /* Stop reading until the writer caught up, so that the sender is throttled too */
+                log_trace("Writer for source %s is congested, pausing", source->importer.name);
+                source->congested = true;
+                (void) sd_event_source_set_enabled(source->event, SD_EVENT_OFF);
+                return 0;
         } else if (r < 0) {
                 log_debug_errno(r, "Closing connection: %m");
                 remove_source(s, fd);
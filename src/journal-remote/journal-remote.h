@@ -33,6 +33,11 @@ struct RemoteServer {
         Writer *_single_writer;
         uint64_t event_count;
 
+        WriterShard *writer_shards;
+        size_t n_writer_shards;
+        size_t next_writer_shard;
+        sd_event_source *writer_event;
+
 #if HAVE_MICROHTTPD
         Hashmap *daemons;
 #endif
@@ -62,4 +67,5 @@ int journal_remote_handle_raw_source(
                 uint32_t revents,
                 RemoteServer *s);
 
+void journal_remote_server_flush(RemoteServer *s);
 void journal_remote_server_destroy(RemoteServer *s);
@@ -6,12 +6,18 @@
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "compress.h"
+#include "journal-importer.h"
 #include "journal-upload.h"
 #include "log.h"
 #include "string-util.h"
+#include "unaligned.h"
 #include "utf8.h"
 #include "util.h"
 
+/* Entries in the binary format are collected up to this size, so that they can be compressed together */
+#define BINARY_BATCH_SIZE (128U*1024U)
+
 /**
  * Write up to size bytes to buf. Return negative on error, and number of
  * bytes written otherwise. The last case is a kind of an error too.
@@ -235,6 +241,192 @@ static ssize_t write_entry(char *buf, size_t size, Uploader *u) {
         assert_not_reached("WTF?");
 }
 
+static int binary_append_entry(Uploader *u) {
+        JournalBinaryFrameHeader h;
+        JournalBinaryEntryHeader e;
+        usec_t realtime, monotonic;
+        sd_id128_t boot_id;
+        size_t start;
+        int r;
+
+        assert(u);
+
+        u->current_cursor = mfree(u->current_cursor);
+
+        r = sd_journal_get_cursor(u->journal, &u->current_cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get cursor: %m");
+
+        r = sd_journal_get_realtime_usec(u->journal, &realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(u->journal, &monotonic, &boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        start = u->batch_size;
+
+        if (!GREEDY_REALLOC(u->batch, u->batch_allocated, start + sizeof(h) + sizeof(e)))
+                return log_oom();
+
+        e = (JournalBinaryEntryHeader) {
+                .realtime = htole64(realtime),
+                .monotonic = htole64(monotonic),
+                .boot_id = boot_id,
+        };
+        memcpy(u->batch + start + sizeof(h), &e, sizeof(e));
+        u->batch_size += sizeof(h) + sizeof(e);
+
+        /* Unlike the export format, all fields are passed on as they are, _BOOT_ID included */
+        sd_journal_restart_data(u->journal);
+        for (;;) {
+                const void *data;
+                size_t length;
+
+                r = sd_journal_enumerate_data(u->journal, &data, &length);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to move to next field in entry: %m");
+                if (r == 0)
+                        break;
+
+                if (!GREEDY_REALLOC(u->batch, u->batch_allocated, u->batch_size + sizeof(uint64_t) + length))
+                        return log_oom();
+
+                unaligned_write_le64(u->batch + u->batch_size, length);
+                memcpy(u->batch + u->batch_size + sizeof(uint64_t), data, length);
+                u->batch_size += sizeof(uint64_t) + length;
+        }
+
+        h = (JournalBinaryFrameHeader) {
+                .size = htole64(u->batch_size - start - sizeof(h)),
+                .type = JOURNAL_BINARY_FRAME_ENTRY,
+        };
+        memcpy(u->batch + start, &h, sizeof(h));
+
+        u->entries_sent++;
+        return 0;
+}
+
+#if HAVE_ZSTD || HAVE_LZ4
+static int binary_compress_batch(Uploader *u) {
+        JournalBinaryFrameHeader h;
+        size_t k;
+        int r;
+
+        assert(u);
+
+        if (!GREEDY_REALLOC(u->frame, u->frame_allocated, sizeof(h) + u->batch_size))
+                return -ENOMEM;
+
+        r = compress_blob(u->batch, u->batch_size, u->frame + sizeof(h), u->batch_size, &k);
+        if (r < 0)
+                return log_debug_errno(r, "Not compressing batch of %zu bytes: %m", u->batch_size);
+
+        h = (JournalBinaryFrameHeader) {
+                .size = htole64(k),
+                .type = JOURNAL_BINARY_FRAME_BATCH,
+                .compression = r,
+        };
+        memcpy(u->frame, &h, sizeof(h));
+
+        log_debug("Compressed batch of %zu bytes to %zu bytes.", u->batch_size, k);
+
+        u->out = u->frame;
+        u->out_size = sizeof(h) + k;
+        return 0;
+}
+#endif
+
+static void binary_finish_batch(Uploader *u) {
+        assert(u);
+        assert(u->batch_size > 0);
+
+        /* The entry frames are fine to send as they are, unless they compress */
+        u->out = u->batch;
+        u->out_size = u->batch_size;
+        u->out_pos = 0;
+
+        /* xz is too slow to keep up with a busy journal, only bother with the fast algorithms */
+#if HAVE_ZSTD || HAVE_LZ4
+        if (u->batch_size <= JOURNAL_BINARY_BATCH_MAX)
+                (void) binary_compress_batch(u);
+#endif
+}
+
+static void journal_input_exhausted(Uploader *u) {
+        assert(u);
+
+        if (u->input_event)
+                log_debug("No more entries, waiting for journal.");
+        else {
+                log_info("No more entries, closing journal.");
+                close_journal_input(u);
+        }
+
+        u->uploading = false;
+}
+
+static int binary_fill_batch(Uploader *u) {
+        int r;
+
+        assert(u);
+
+        /* Returns > 0 if there's something to hand out, 0 if there are no more entries */
+
+        u->batch_size = 0;
+
+        while (u->journal && u->batch_size < BINARY_BATCH_SIZE) {
+                if (u->entry_state == ENTRY_DONE) {
+                        r = sd_journal_next(u->journal);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to move to next entry in journal: %m");
+                        if (r == 0) {
+                                journal_input_exhausted(u);
+                                break;
+                        }
+                }
+
+                r = binary_append_entry(u);
+                if (r < 0)
+                        return r;
+
+                u->entry_state = ENTRY_DONE;
+        }
+
+        if (u->batch_size == 0)
+                return 0;
+
+        binary_finish_batch(u);
+
+        log_debug("Entries up to %zu (%s) are being uploaded.", u->entries_sent, u->current_cursor);
+        return 1;
+}
+
+static size_t journal_input_callback_binary(char *buf, size_t size, Uploader *u) {
+        size_t filled = 0;
+        int r;
+
+        while (filled < size) {
+                size_t n;
+
+                if (u->out_pos >= u->out_size) {
+                        r = binary_fill_batch(u);
+                        if (r < 0)
+                                return CURL_READFUNC_ABORT;
+                        if (r == 0)
+                                break;
+                }
+
+                n = MIN(size - filled, u->out_size - u->out_pos);
+                memcpy(buf + filled, u->out + u->out_pos, n);
+                u->out_pos += n;
+                filled += n;
+        }
+
+        return filled;
+}
+
 static void check_update_watchdog(Uploader *u) {
         usec_t after;
         usec_t elapsed_time;
@@ -263,6 +455,9 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
 
         check_update_watchdog(u);
 
+        if (u->binary)
+                return journal_input_callback_binary(buf, size * nmemb, u);
+
         j = u->journal;
 
         while (j && filled < size * nmemb) {
@@ -272,15 +467,7 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
                                 log_error_errno(r, "Failed to move to next entry in journal: %m");
                                 return CURL_READFUNC_ABORT;
                         } else if (r == 0) {
-                                if (u->input_event)
-                                        log_debug("No more entries, waiting for journal.");
-                                else {
-                                        log_info("No more entries, closing journal.");
-                                        close_journal_input(u);
-                                }
-
-                                u->uploading = false;
-
+                                journal_input_exhausted(u);
                                 break;
                         }
 
@@ -332,6 +519,7 @@ static int process_journal_input(Uploader *u, int skip) {
 
         /* have data */
         u->entry_state = ENTRY_CURSOR;
+        u->out_size = u->out_pos = 0;
         return start_upload(u, journal_input_callback, u);
 }
 
@@ -45,6 +45,14 @@ typedef struct Uploader {
         const void *field_data;
         size_t field_pos, field_length;
 
+        /* binary format: entry frames are collected in batch, and possibly compressed into frame, before
+         * they are handed out from out */
+        bool binary;
+        char *batch, *frame;
+        size_t batch_allocated, batch_size, frame_allocated;
+        const char *out;
+        size_t out_size, out_pos;
+
         /* general metrics */
         const char *state_file;
 
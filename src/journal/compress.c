@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -17,6 +18,7 @@
 #endif
 
 #if HAVE_ZSTD
+#include <zdict.h>
 #include <zstd.h>
 #include <zstd_errors.h>
 #endif
@@ -39,9 +41,19 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_decompressionContext_t, LZ4F_freeDecompressionC
 #endif
 
 #if HAVE_ZSTD
+struct CompressDictionary {
+        ZSTD_CDict *cdict; /* only if created for compression */
+        ZSTD_DDict *ddict;
+        unsigned id;
+};
+
 DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_CCtx *, ZSTD_freeCCtx);
 DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_DCtx *, ZSTD_freeDCtx);
 
+/* The most decompression of a single blob may grow the buffer to up front, based on the frame header alone */
+#define ZSTD_TRUSTED_RATIO 64U
+#define ZSTD_TRUSTED_SIZE_MIN (1024U * 1024U)
+
 static int zstd_ret_to_errno(size_t ret) {
         switch (ZSTD_getErrorCode(ret)) {
         case ZSTD_error_dstSize_tooSmall:
@@ -54,6 +66,108 @@ static int zstd_ret_to_errno(size_t ret) {
 }
 #endif
 
+/* The per-thread contexts below are released automatically when a thread exits, through the destructor
+ * of a thread-specific key that is set as soon as a thread allocated one of them. That way no thread that
+ * happens to (de)compress something, including those of applications using sd-journal, has to remember
+ * to clean up after itself. */
+#if HAVE_XZ || HAVE_ZSTD
+static pthread_once_t contexts_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t contexts_key;
+static bool contexts_key_valid = false;
+static thread_local bool contexts_registered = false;
+
+static void contexts_destroy(void *p) {
+        compress_thread_contexts_free();
+}
+
+static void contexts_key_create(void) {
+        contexts_key_valid = pthread_key_create(&contexts_key, contexts_destroy) == 0;
+}
+
+static void contexts_register(void) {
+        if (contexts_registered)
+                return;
+
+        if (pthread_once(&contexts_key_once, contexts_key_create) != 0 || !contexts_key_valid)
+                return;
+
+        /* The value doesn't matter, only that it is non-NULL, so that the destructor is called */
+        if (pthread_setspecific(contexts_key, INT_TO_PTR(1)) == 0)
+                contexts_registered = true;
+}
+#endif
+
+#if HAVE_ZSTD
+/* Setting up a (de)compression context costs more than (de)compressing a typical journal field, hence the
+ * blob functions keep one of each around per thread. Dictionaries are shared between threads, they are
+ * only ever read once created. */
+static thread_local ZSTD_CCtx *zstd_cctx = NULL;
+static thread_local ZSTD_DCtx *zstd_dctx = NULL;
+
+static ZSTD_CCtx *zstd_cctx_get(void) {
+        if (!zstd_cctx) {
+                zstd_cctx = ZSTD_createCCtx();
+                contexts_register();
+        }
+
+        return zstd_cctx;
+}
+
+static int zstd_dctx_get(const CompressDictionary *d, const void *src, size_t src_size, ZSTD_DCtx **ret) {
+        unsigned id;
+        size_t k;
+
+        if (!zstd_dctx) {
+                zstd_dctx = ZSTD_createDCtx();
+                if (!zstd_dctx)
+                        return -ENOMEM;
+
+                contexts_register();
+        } else
+                (void) ZSTD_DCtx_reset(zstd_dctx, ZSTD_reset_session_and_parameters);
+
+        /* Frames compressed with a dictionary carry its ID, all others are decompressed without one */
+        id = ZSTD_getDictID_fromFrame(src, src_size);
+        if (id != 0) {
+                if (!d || d->id != id)
+                        return -EBADMSG;
+
+                k = ZSTD_DCtx_refDDict(zstd_dctx, d->ddict);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+        }
+
+        *ret = zstd_dctx;
+        return 0;
+}
+#endif
+
+#if HAVE_XZ
+/* liblzma reuses the match finder of a stream that is set up again, which saves allocating a couple of MiB
+ * for every blob */
+static thread_local lzma_stream xz_stream = LZMA_STREAM_INIT;
+#endif
+
+void compress_thread_contexts_free(void) {
+        /* Called automatically when a thread exits, but may also be called earlier to release the memory */
+#if HAVE_XZ
+        lzma_end(&xz_stream);
+#endif
+#if HAVE_ZSTD
+        (void) ZSTD_freeCCtx(zstd_cctx);
+        zstd_cctx = NULL;
+        (void) ZSTD_freeDCtx(zstd_dctx);
+        zstd_dctx = NULL;
+#endif
+
+#if HAVE_XZ || HAVE_ZSTD
+        if (contexts_registered) {
+                (void) pthread_setspecific(contexts_key, NULL);
+                contexts_registered = false;
+        }
+#endif
+}
+
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
@@ -78,7 +192,6 @@ int compress_blob_xz(const void *src, uint64_t src_size,
                 { LZMA_VLI_UNKNOWN, NULL }
         };
         lzma_ret ret;
-        size_t out_pos = 0;
 
         assert(src);
         assert(src_size > 0);
@@ -92,12 +205,22 @@ int compress_blob_xz(const void *src, uint64_t src_size,
         if (src_size < 80)
                 return -ENOBUFS;
 
-        ret = lzma_stream_buffer_encode((lzma_filter*) filters, LZMA_CHECK_NONE, NULL,
-                                        src, src_size, dst, &out_pos, dst_alloc_size);
+        contexts_register();
+
+        ret = lzma_stream_encoder(&xz_stream, filters, LZMA_CHECK_NONE);
         if (ret != LZMA_OK)
+                return -ENOMEM;
+
+        xz_stream.next_in = src;
+        xz_stream.avail_in = src_size;
+        xz_stream.next_out = dst;
+        xz_stream.avail_out = dst_alloc_size;
+
+        ret = lzma_code(&xz_stream, LZMA_FINISH);
+        if (ret != LZMA_STREAM_END)
                 return -ENOBUFS;
 
-        *dst_size = out_pos;
+        *dst_size = dst_alloc_size - xz_stream.avail_out;
         return 0;
 #else
         return -EPROTONOSUPPORT;
@@ -134,19 +257,29 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
-int compress_blob_zstd(
+int compress_blob_zstd_dict(
+                const CompressDictionary *d,
                 const void *src, uint64_t src_size,
                 void *dst, size_t dst_alloc_size, size_t *dst_size) {
 #if HAVE_ZSTD
+        ZSTD_CCtx *cctx;
         size_t k;
 
+        assert(!d || d->cdict);
         assert(src);
         assert(src_size > 0);
         assert(dst);
         assert(dst_alloc_size > 0);
         assert(dst_size);
 
-        k = ZSTD_compress(dst, dst_alloc_size, src, src_size, 0);
+        cctx = zstd_cctx_get();
+        if (!cctx)
+                return -ENOMEM;
+
+        if (d)
+                k = ZSTD_compress_usingCDict(cctx, dst, dst_alloc_size, src, src_size, d->cdict);
+        else
+                k = ZSTD_compressCCtx(cctx, dst, dst_alloc_size, src, src_size, ZSTD_CLEVEL_DEFAULT);
         if (ZSTD_isError(k))
                 return zstd_ret_to_errno(k);
 
@@ -157,6 +290,92 @@ int compress_blob_zstd(
 #endif
 }
 
+int compress_blob_zstd(
+                const void *src, uint64_t src_size,
+                void *dst, size_t dst_alloc_size, size_t *dst_size) {
+
+        return compress_blob_zstd_dict(NULL, src, src_size, dst, dst_alloc_size, dst_size);
+}
+
+int compress_dictionary_train(
+                const void *samples, const size_t *sample_sizes, size_t n_samples,
+                size_t max_size,
+                void **ret, size_t *ret_size) {
+#if HAVE_ZSTD
+        _cleanup_free_ void *buf = NULL;
+        size_t k;
+
+        assert(samples || n_samples == 0);
+        assert(sample_sizes || n_samples == 0);
+        assert(max_size > 0);
+        assert(ret);
+        assert(ret_size);
+
+        if (n_samples > UINT_MAX)
+                return -E2BIG;
+
+        buf = malloc(max_size);
+        if (!buf)
+                return -ENOMEM;
+
+        /* Fails if there isn't enough to learn from */
+        k = ZDICT_trainFromBuffer(buf, max_size, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(k)) {
+                log_debug("Failed to train ZSTD dictionary: %s", ZDICT_getErrorName(k));
+                return -ENODATA;
+        }
+
+        *ret = TAKE_PTR(buf);
+        *ret_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_dictionary_new(const void *data, size_t size, bool compress, CompressDictionary **ret) {
+#if HAVE_ZSTD
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+
+        assert(data || size == 0);
+        assert(ret);
+
+        d = new0(CompressDictionary, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->id = ZDICT_getDictID(data, size);
+        if (d->id == 0) /* Not a trained dictionary, hence frames wouldn't reference it */
+                return -EBADMSG;
+
+        d->ddict = ZSTD_createDDict(data, size);
+        if (!d->ddict)
+                return -ENOMEM;
+
+        if (compress) {
+                d->cdict = ZSTD_createCDict(data, size, ZSTD_CLEVEL_DEFAULT);
+                if (!d->cdict)
+                        return -ENOMEM;
+        }
+
+        *ret = TAKE_PTR(d);
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDictionary* compress_dictionary_free(CompressDictionary *d) {
+        if (!d)
+                return NULL;
+
+#if HAVE_ZSTD
+        (void) ZSTD_freeCDict(d->cdict);
+        (void) ZSTD_freeDDict(d->ddict);
+#endif
+        return mfree(d);
+}
+
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
 
@@ -257,12 +476,17 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
-int decompress_blob_zstd(
+int decompress_blob_zstd_dict(
+                const CompressDictionary *d,
                 const void *src, uint64_t src_size,
                 void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
 
 #if HAVE_ZSTD
+        unsigned long long size;
+        uint64_t trusted;
+        ZSTD_DCtx *dctx;
         size_t space;
+        int r;
 
         assert(src);
         assert(src_size > 0);
@@ -271,19 +495,36 @@ int decompress_blob_zstd(
         assert(dst_size);
         assert(*dst_alloc_size == 0 || *dst);
 
-        if (src_size > SIZE_MAX/2) /* Overflow? */
+        /* The frame header usually tells us how much space we need, so that we don't have to guess and
+         * decompress the whole thing again each time the guess was too small. The header comes from the
+         * file though, hence only believe it as long as the claimed size is plausible for the compressed
+         * size, and otherwise grow the buffer step by step as for frames that don't carry a size. */
+        if (src_size > SIZE_MAX / ZSTD_TRUSTED_RATIO)
+                trusted = SIZE_MAX;
+        else
+                trusted = MAX(src_size * ZSTD_TRUSTED_RATIO, ZSTD_TRUSTED_SIZE_MIN);
+
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR && size < SIZE_MAX && size <= trusted)
+                space = MAX((size_t) size, 1U);
+        else if (src_size > SIZE_MAX/2) /* Overflow? */
                 return -ENOBUFS;
-        space = src_size * 2;
+        else
+                space = src_size * 2;
         if (dst_max > 0 && space > dst_max)
                 space = dst_max;
 
+        r = zstd_dctx_get(d, src, src_size, &dctx);
+        if (r < 0)
+                return r;
+
         if (!greedy_realloc(dst, dst_alloc_size, space, 1))
                 return -ENOMEM;
 
         for (;;) {
                 size_t k;
 
-                k = ZSTD_decompress(*dst, *dst_alloc_size, src, src_size);
+                k = ZSTD_decompressDCtx(dctx, *dst, *dst_alloc_size, src, src_size);
                 if (!ZSTD_isError(k)) {
                         *dst_size = k;
                         return 0;
@@ -308,8 +549,16 @@ int decompress_blob_zstd(
 #endif
 }
 
-int decompress_blob(
+int decompress_blob_zstd(
+                const void *src, uint64_t src_size,
+                void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+
+        return decompress_blob_zstd_dict(NULL, src, src_size, dst, dst_alloc_size, dst_size, dst_max);
+}
+
+int decompress_blob_dict(
                 int compression,
+                const CompressDictionary *d,
                 const void *src, uint64_t src_size,
                 void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
 
@@ -322,13 +571,22 @@ int decompress_blob(
                                 src, src_size,
                                 dst, dst_alloc_size, dst_size, dst_max);
         else if (compression == OBJECT_COMPRESSED_ZSTD)
-                return decompress_blob_zstd(
+                return decompress_blob_zstd_dict(
+                                d,
                                 src, src_size,
                                 dst, dst_alloc_size, dst_size, dst_max);
         else
                 return -EBADMSG;
 }
 
+int decompress_blob(
+                int compression,
+                const void *src, uint64_t src_size,
+                void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+
+        return decompress_blob_dict(compression, NULL, src, src_size, dst, dst_alloc_size, dst_size, dst_max);
+}
+
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer, size_t *buffer_size,
                              const void *prefix, size_t prefix_len,
@@ -450,14 +708,16 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
-int decompress_startswith_zstd(
+int decompress_startswith_zstd_dict(
+                const CompressDictionary *d,
                 const void *src, uint64_t src_size,
                 void **buffer, size_t *buffer_size,
                 const void *prefix, size_t prefix_len,
                 uint8_t extra) {
 #if HAVE_ZSTD
-        _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = NULL;
+        ZSTD_DCtx *dctx;
         size_t k;
+        int r;
 
         assert(src);
         assert(src_size > 0);
@@ -466,9 +726,9 @@ int decompress_startswith_zstd(
         assert(prefix);
         assert(*buffer_size == 0 || *buffer);
 
-        dctx = ZSTD_createDCtx();
-        if (!dctx)
-                return -ENOMEM;
+        r = zstd_dctx_get(d, src, src_size, &dctx);
+        if (r < 0)
+                return r;
 
         if (!(greedy_realloc(buffer, buffer_size, MAX(ZSTD_DStreamOutSize(), prefix_len + 1), 1)))
                 return -ENOMEM;
@@ -510,8 +770,18 @@ int decompress_startswith_zstd(
 #endif
 }
 
-int decompress_startswith(
+int decompress_startswith_zstd(
+                const void *src, uint64_t src_size,
+                void **buffer, size_t *buffer_size,
+                const void *prefix, size_t prefix_len,
+                uint8_t extra) {
+
+        return decompress_startswith_zstd_dict(NULL, src, src_size, buffer, buffer_size, prefix, prefix_len, extra);
+}
+
+int decompress_startswith_dict(
                 int compression,
+                const CompressDictionary *d,
                 const void *src, uint64_t src_size,
                 void **buffer, size_t *buffer_size,
                 const void *prefix, size_t prefix_len,
@@ -531,7 +801,8 @@ int decompress_startswith(
                                 prefix, prefix_len,
                                 extra);
         else if (compression == OBJECT_COMPRESSED_ZSTD)
-                return decompress_startswith_zstd(
+                return decompress_startswith_zstd_dict(
+                                d,
                                 src, src_size,
                                 buffer, buffer_size,
                                 prefix, prefix_len,
@@ -540,6 +811,16 @@ int decompress_startswith(
                 return -EBADMSG;
 }
 
+int decompress_startswith(
+                int compression,
+                const void *src, uint64_t src_size,
+                void **buffer, size_t *buffer_size,
+                const void *prefix, size_t prefix_len,
+                uint8_t extra) {
+
+        return decompress_startswith_dict(compression, NULL, src, src_size, buffer, buffer_size, prefix, prefix_len, extra);
+}
+
 int compress_stream_xz(int fdf, int fdt, uint64_t max_bytes) {
 #if HAVE_XZ
         _cleanup_(lzma_end) lzma_stream s = LZMA_STREAM_INIT;
@@ -1,9 +1,24 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 #pragma once
 
+#include <stdbool.h>
 #include <unistd.h>
 
 #include "journal-def.h"
+#include "macro.h"
+
+/* A trained ZSTD dictionary. Once created it is only read from, hence may be used by several threads at
+ * once. */
+typedef struct CompressDictionary CompressDictionary;
+
+int compress_dictionary_train(const void *samples, const size_t *sample_sizes, size_t n_samples,
+                              size_t max_size,
+                              void **ret, size_t *ret_size);
+int compress_dictionary_new(const void *data, size_t size, bool compress, CompressDictionary **ret);
+CompressDictionary* compress_dictionary_free(CompressDictionary *d);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CompressDictionary*, compress_dictionary_free);
+
+void compress_thread_contexts_free(void);
 
 const char* object_compressed_to_string(int compression);
 int object_compressed_from_string(const char *compression);
@@ -14,6 +29,9 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
                       void *dst, size_t dst_alloc_size, size_t *dst_size);
 int compress_blob_zstd(const void *src, uint64_t src_size,
                        void *dst, size_t dst_alloc_size, size_t *dst_size);
+int compress_blob_zstd_dict(const CompressDictionary *d,
+                            const void *src, uint64_t src_size,
+                            void *dst, size_t dst_alloc_size, size_t *dst_size);
 
 static inline int compress_blob(const void *src, uint64_t src_size,
                                 void *dst, size_t dst_alloc_size, size_t *dst_size) {
@@ -36,15 +54,38 @@ static inline int compress_blob(const void *src, uint64_t src_size,
         return r;
 }
 
+static inline int compress_blob_dict(const CompressDictionary *d,
+                                     const void *src, uint64_t src_size,
+                                     void *dst, size_t dst_alloc_size, size_t *dst_size) {
+        int r;
+
+        /* Dictionaries only exist for ZSTD */
+        if (!d)
+                return compress_blob(src, src_size, dst, dst_alloc_size, dst_size);
+
+        r = compress_blob_zstd_dict(d, src, src_size, dst, dst_alloc_size, dst_size);
+        if (r < 0)
+                return r;
+
+        return OBJECT_COMPRESSED_ZSTD;
+}
+
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob_lz4(const void *src, uint64_t src_size,
                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob_zstd(const void *src, uint64_t src_size,
                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd_dict(const CompressDictionary *d,
+                              const void *src, uint64_t src_size,
+                              void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
                     void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_dict(int compression,
+                         const CompressDictionary *d,
+                         const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer, size_t *buffer_size,
@@ -58,11 +99,22 @@ int decompress_startswith_zstd(const void *src, uint64_t src_size,
                                void **buffer, size_t *buffer_size,
                                const void *prefix, size_t prefix_len,
                                uint8_t extra);
+int decompress_startswith_zstd_dict(const CompressDictionary *d,
+                                    const void *src, uint64_t src_size,
+                                    void **buffer, size_t *buffer_size,
+                                    const void *prefix, size_t prefix_len,
+                                    uint8_t extra);
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
                           uint8_t extra);
+int decompress_startswith_dict(int compression,
+                               const CompressDictionary *d,
+                               const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra);
 
 int compress_stream_xz(int fdf, int fdt, uint64_t max_bytes);
 int compress_stream_lz4(int fdf, int fdt, uint64_t max_bytes);
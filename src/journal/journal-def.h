@@ -23,6 +23,8 @@ typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
 typedef struct TagObject TagObject;
+typedef struct BloomFilterObject BloomFilterObject;
+typedef struct DictionaryObject DictionaryObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
@@ -39,6 +41,8 @@ typedef enum ObjectType {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_BLOOM_FILTER,
+        OBJECT_DICTIONARY,
         _OBJECT_TYPE_MAX
 } ObjectType;
 
@@ -91,14 +95,21 @@ struct EntryItem {
         le64_t hash;
 } _packed_;
 
-#define EntryObject__contents { \
-        ObjectHeader object;    \
-        le64_t seqnum;          \
-        le64_t realtime;        \
-        le64_t monotonic;       \
-        sd_id128_t boot_id;     \
-        le64_t xor_hash;        \
-        EntryItem items[];      \
+/* In files with HEADER_INCOMPATIBLE_COMPACT, entries only store 32bit offsets of their DATA objects, the
+ * hashes are found in the objects themselves */
+#define EntryObject__contents {                 \
+        ObjectHeader object;                    \
+        le64_t seqnum;                          \
+        le64_t realtime;                        \
+        le64_t monotonic;                       \
+        sd_id128_t boot_id;                     \
+        le64_t xor_hash;                        \
+        union {                                 \
+                EntryItem regular[0];           \
+                struct {                        \
+                        le32_t object_offset;   \
+                } _packed_ compact[0];          \
+        } items;                                \
         }
 
 struct EntryObject EntryObject__contents;
@@ -118,7 +129,10 @@ struct HashTableObject {
 struct EntryArrayObject {
         ObjectHeader object;
         le64_t next_entry_array_offset;
-        le64_t items[];
+        union {
+                le64_t regular[0];
+                le32_t compact[0];
+        } items;
 } _packed_;
 
 #define TAG_LENGTH (256/8)
@@ -130,6 +144,18 @@ struct TagObject {
         uint8_t tag[TAG_LENGTH]; /* SHA-256 HMAC */
 } _packed_;
 
+struct BloomFilterObject {
+        ObjectHeader object;
+        le64_t n_hashes;
+        uint8_t bits[];
+} _packed_;
+
+/* A ZSTD dictionary, trained from the first DATA objects of the file */
+struct DictionaryObject {
+        ObjectHeader object;
+        uint8_t payload[];
+} _packed_;
+
 union Object {
         ObjectHeader object;
         DataObject data;
@@ -138,6 +164,8 @@ union Object {
         HashTableObject hash_table;
         EntryArrayObject entry_array;
         TagObject tag;
+        BloomFilterObject bloom_filter;
+        DictionaryObject dictionary;
 };
 
 enum {
@@ -149,45 +177,54 @@ enum {
 
 /* Header flags */
 enum {
-        HEADER_INCOMPATIBLE_COMPRESSED_XZ   = 1 << 0,
-        HEADER_INCOMPATIBLE_COMPRESSED_LZ4  = 1 << 1,
-        HEADER_INCOMPATIBLE_KEYED_HASH      = 1 << 2,
-        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD = 1 << 3,
+        HEADER_INCOMPATIBLE_COMPRESSED_XZ       = 1 << 0,
+        HEADER_INCOMPATIBLE_COMPRESSED_LZ4      = 1 << 1,
+        HEADER_INCOMPATIBLE_KEYED_HASH          = 1 << 2,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD     = 1 << 3,
+        HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE = 1 << 4,
+        HEADER_INCOMPATIBLE_FAST_KEYED_HASH     = 1 << 5,
+        HEADER_INCOMPATIBLE_COMPACT             = 1 << 6,
+        HEADER_INCOMPATIBLE_ZSTD_DICTIONARY     = 1 << 7,
 };
 
-#define HEADER_INCOMPATIBLE_ANY               \
-        (HEADER_INCOMPATIBLE_COMPRESSED_XZ |  \
-         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 | \
-         HEADER_INCOMPATIBLE_KEYED_HASH |     \
-         HEADER_INCOMPATIBLE_COMPRESSED_ZSTD)
+#define HEADER_INCOMPATIBLE_ANY                    \
+        (HEADER_INCOMPATIBLE_COMPRESSED_XZ |       \
+         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |      \
+         HEADER_INCOMPATIBLE_KEYED_HASH |          \
+         HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |     \
+         HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE | \
+         HEADER_INCOMPATIBLE_FAST_KEYED_HASH |     \
+         HEADER_INCOMPATIBLE_COMPACT |             \
+         HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
 
 #if HAVE_XZ && HAVE_LZ4 && HAVE_ZSTD
 #  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
 #elif HAVE_XZ && HAVE_LZ4
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT)
 #elif HAVE_XZ && HAVE_ZSTD
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT|HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
 #elif HAVE_LZ4 && HAVE_ZSTD
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT|HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
 #elif HAVE_XZ
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT)
 #elif HAVE_LZ4
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT)
 #elif HAVE_ZSTD
-#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT|HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
 #else
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_KEYED_HASH
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_KEYED_HASH|HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE|HEADER_INCOMPATIBLE_FAST_KEYED_HASH|HEADER_INCOMPATIBLE_COMPACT)
 #endif
 
 enum {
-        HEADER_COMPATIBLE_SEALED = 1 << 0,
+        HEADER_COMPATIBLE_SEALED       = 1 << 0,
+        HEADER_COMPATIBLE_BLOOM_FILTER = 1 << 1,
 };
 
-#define HEADER_COMPATIBLE_ANY HEADER_COMPATIBLE_SEALED
+#define HEADER_COMPATIBLE_ANY (HEADER_COMPATIBLE_SEALED|HEADER_COMPATIBLE_BLOOM_FILTER)
 #if HAVE_GCRYPT
-#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_SEALED
+#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_ANY
 #else
-#  define HEADER_COMPATIBLE_SUPPORTED 0
+#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_BLOOM_FILTER
 #endif
 
 #define HEADER_SIGNATURE                                                \
@@ -227,12 +264,15 @@ enum {
         /* Added in 246 */                              \
         le64_t data_hash_chain_depth;                   \
         le64_t field_hash_chain_depth;                  \
+        /* Added in 247 */                              \
+        le64_t bloom_filter_offset;                     \
+        le64_t dictionary_offset;                       \
         }
 
 struct Header struct_Header__contents;
 struct Header__packed struct_Header__contents _packed_;
 assert_cc(sizeof(struct Header) == sizeof(struct Header__packed));
-assert_cc(sizeof(struct Header) == 256);
+assert_cc(sizeof(struct Header) == 272);
 
 #define FSS_HEADER_SIGNATURE                                            \
         ((const char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
@@ -23,11 +23,15 @@
 #include "journal-authenticate.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "lookup3.h"
 #include "memory-util.h"
 #include "path-util.h"
+#include "prioq.h"
+#include "pthread-util.h"
 #include "random-util.h"
 #include "set.h"
+#include "siphash24.h"
 #include "sort-util.h"
 #include "stat-util.h"
 #include "string-util.h"
@@ -40,6 +44,19 @@
 #define DEFAULT_COMPRESS_THRESHOLD (512ULL)
 #define MIN_COMPRESS_THRESHOLD (8ULL)
 
+/* Once this much of the first new fields of a file has been seen, train a ZSTD dictionary from them. With
+ * it fields much smaller than the regular compression threshold compress well. */
+#define DICTIONARY_SAMPLES_SIZE (256 * 1024ULL)          /* 256 KiB */
+#define DICTIONARY_SAMPLE_SIZE_MIN 16U
+#define DICTIONARY_SAMPLE_SIZE_MAX 4096U
+#define DICTIONARY_SIZE_MAX (16 * 1024U)                 /* 16 KiB */
+#define DICTIONARY_COMPRESS_THRESHOLD 64ULL
+
+/* Size the bloom filter of archived files for a false positive rate of about 1% */
+#define BLOOM_FILTER_BITS_PER_ITEM 10ULL
+#define BLOOM_FILTER_N_HASHES 7ULL
+#define BLOOM_FILTER_N_HASHES_MAX 32ULL
+
 /* This is the minimum journal file size */
 #define JOURNAL_FILE_SIZE_MIN (512 * 1024ULL)             /* 512 KiB */
 
@@ -89,9 +106,51 @@
 #  pragma GCC diagnostic ignored "-Waddress-of-packed-member"
 #endif
 
-/* This may be called from a separate thread to prevent blocking the caller for the duration of fsync().
+/* All asynchronous offlining of a process is done by a single worker thread, which works through the files
+ * queued to it one after the other. This keeps the number of threads constant however many files are open,
+ * and repeated requests for a file that is still queued are coalesced into a single sync. A caller that needs
+ * a file the worker didn't get to yet takes it back, instead of waiting for everything queued before it. */
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t queued;  /* signalled when a file is added to the queue */
+        pthread_cond_t done;    /* broadcast when the worker is done with a file */
+        bool running;
+        LIST_HEAD(JournalFile, queue);
+        JournalFile *current;   /* the file the worker is busy with, if any */
+        JournalFileSyncStats stats;
+} offline_worker = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .queued = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void journal_file_account_stall(usec_t begin) {
+        usec_t d;
+
+        /* Must be called with the offline worker's mutex held */
+
+        d = usec_sub_unsigned(now(CLOCK_MONOTONIC), begin);
+
+        offline_worker.stats.n_stalls++;
+        offline_worker.stats.stall_usec += d;
+        offline_worker.stats.stall_max_usec = MAX(offline_worker.stats.stall_max_usec, d);
+}
+
+void journal_file_get_sync_stats(JournalFileSyncStats *ret) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+
+        assert(ret);
+
+        m = pthread_mutex_lock_assert(&offline_worker.mutex);
+        *ret = offline_worker.stats;
+}
+
+/* This may be called from the offline worker to prevent blocking the caller for the duration of the sync.
  * As a result we use atomic operations on f->offline_state for inter-thread communications with
- * journal_file_set_offline() and journal_file_set_online(). */
+ * journal_file_set_offline() and journal_file_set_online().
+ *
+ * fdatasync() is sufficient for our purposes: it flushes the file size along with the data, we only skip
+ * the timestamps, which nobody relies on after a crash. */
 static void journal_file_set_offline_internal(JournalFile *f) {
         assert(f);
         assert(f->fd >= 0);
@@ -115,13 +174,13 @@ static void journal_file_set_offline_internal(JournalFile *f) {
                         break;
 
                 case OFFLINE_SYNCING:
-                        (void) fsync(f->fd);
+                        (void) fdatasync(f->fd);
 
                         if (!__sync_bool_compare_and_swap(&f->offline_state, OFFLINE_SYNCING, OFFLINE_OFFLINING))
                                 continue;
 
                         f->header->state = f->archive ? STATE_ARCHIVED : STATE_OFFLINE;
-                        (void) fsync(f->fd);
+                        (void) fdatasync(f->fd);
                         break;
 
                 case OFFLINE_OFFLINING:
@@ -138,27 +197,118 @@ static void journal_file_set_offline_internal(JournalFile *f) {
         }
 }
 
-static void * journal_file_set_offline_thread(void *arg) {
-        JournalFile *f = arg;
-
+static void * journal_file_offline_worker_thread(void *arg) {
         (void) pthread_setname_np(pthread_self(), "journal-offline");
 
-        journal_file_set_offline_internal(f);
+        assert_se(pthread_mutex_lock(&offline_worker.mutex) == 0);
+
+        for (;;) {
+                JournalFile *f;
+
+                while (!offline_worker.queue)
+                        assert_se(pthread_cond_wait(&offline_worker.queued, &offline_worker.mutex) == 0);
+
+                f = offline_worker.queue;
+                LIST_REMOVE(offline_queue, offline_worker.queue, f);
+                offline_worker.current = f;
+
+                assert_se(pthread_mutex_unlock(&offline_worker.mutex) == 0);
+                journal_file_set_offline_internal(f);
+                assert_se(pthread_mutex_lock(&offline_worker.mutex) == 0);
+
+                /* Once this is reset the file may go away any moment, don't touch it anymore */
+                f->offline_queued = false;
+                offline_worker.current = NULL;
+                offline_worker.stats.n_syncs++;
+
+                assert_se(pthread_cond_broadcast(&offline_worker.done) == 0);
+        }
 
         return NULL;
 }
 
-static int journal_file_set_offline_thread_join(JournalFile *f) {
+static int journal_file_offline_worker_queue(JournalFile *f) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
         int r;
 
         assert(f);
 
+        m = pthread_mutex_lock_assert(&offline_worker.mutex);
+
+        if (!offline_worker.running) {
+                sigset_t ss, saved_ss;
+                pthread_t t;
+                int k;
+
+                assert_se(sigfillset(&ss) >= 0);
+                /* Don't block SIGBUS since the offlining thread accesses a memory mapped file.
+                 * Asynchronous SIGBUS signals can safely be handled by either thread. */
+                assert_se(sigdelset(&ss, SIGBUS) >= 0);
+
+                r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+                if (r > 0)
+                        return -r;
+
+                r = pthread_create(&t, NULL, journal_file_offline_worker_thread, NULL);
+
+                k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+                if (r > 0)
+                        return -r;
+                if (k > 0)
+                        return -k;
+
+                /* The worker lives as long as the process, nobody ever joins it */
+                assert_se(pthread_detach(t) == 0);
+                offline_worker.running = true;
+        }
+
+        f->offline_queued = true;
+        LIST_APPEND(offline_queue, offline_worker.queue, f);
+
+        assert_se(pthread_cond_signal(&offline_worker.queued) == 0);
+        return 0;
+}
+
+static int journal_file_set_offline_thread_join(JournalFile *f) {
+        bool dequeued = false;
+        usec_t begin = 0;
+
+        assert(f);
+
         if (f->offline_state == OFFLINE_JOINED)
                 return 0;
 
-        r = pthread_join(f->offline_thread, NULL);
-        if (r)
-                return -r;
+        assert_se(pthread_mutex_lock(&offline_worker.mutex) == 0);
+
+        if (f->offline_queued) {
+                begin = now(CLOCK_MONOTONIC);
+
+                if (offline_worker.current != f) {
+                        /* The worker didn't get to the file yet, don't wait for it to work through all the
+                         * files queued before, but do what's left right here. */
+                        LIST_REMOVE(offline_queue, offline_worker.queue, f);
+                        f->offline_queued = false;
+                        dequeued = true;
+                } else {
+                        do
+                                assert_se(pthread_cond_wait(&offline_worker.done, &offline_worker.mutex) == 0);
+                        while (f->offline_queued);
+
+                        journal_file_account_stall(begin);
+                }
+        }
+
+        assert_se(pthread_mutex_unlock(&offline_worker.mutex) == 0);
+
+        if (dequeued) {
+                _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+
+                journal_file_set_offline_internal(f);
+
+                m = pthread_mutex_lock_assert(&offline_worker.mutex);
+                offline_worker.stats.n_syncs++;
+                journal_file_account_stall(begin);
+        }
 
         f->offline_state = OFFLINE_JOINED;
 
@@ -199,12 +349,12 @@ static bool journal_file_set_offline_try_restart(JournalFile *f) {
 
 /* Sets a journal offline.
  *
- * If wait is false then an offline is dispatched in a separate thread for a
- * subsequent journal_file_set_offline() or journal_file_set_online() of the
+ * If wait is false then an offline is queued to the offline worker thread for
+ * a subsequent journal_file_set_offline() or journal_file_set_online() of the
  * same journal to synchronize with.
  *
- * If wait is true, then either an existing offline thread will be restarted
- * and joined, or if none exists the offline is simply performed in this
+ * If wait is true, then either an already queued offline will be restarted
+ * and waited for, or if none exists the offline is simply performed in this
  * context without involving another thread.
  */
 int journal_file_set_offline(JournalFile *f, bool wait) {
@@ -241,27 +391,11 @@ int journal_file_set_offline(JournalFile *f, bool wait) {
         if (wait) /* Without using a thread if waiting. */
                 journal_file_set_offline_internal(f);
         else {
-                sigset_t ss, saved_ss;
-                int k;
-
-                assert_se(sigfillset(&ss) >= 0);
-                /* Don't block SIGBUS since the offlining thread accesses a memory mapped file.
-                 * Asynchronous SIGBUS signals can safely be handled by either thread. */
-                assert_se(sigdelset(&ss, SIGBUS) >= 0);
-
-                r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
-                if (r > 0)
-                        return -r;
-
-                r = pthread_create(&f->offline_thread, NULL, journal_file_set_offline_thread, f);
-
-                k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
-                if (r > 0) {
+                r = journal_file_offline_worker_queue(f);
+                if (r < 0) {
                         f->offline_state = OFFLINE_JOINED;
-                        return -r;
+                        return r;
                 }
-                if (k > 0)
-                        return -k;
         }
 
         return 0;
@@ -324,10 +458,21 @@ static int journal_file_set_online(JournalFile *f) {
                 case STATE_ONLINE:
                         return 0;
 
-                case STATE_OFFLINE:
+                case STATE_OFFLINE: {
+                        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *m = NULL;
+                        usec_t begin;
+
+                        /* The state change has to hit the disk before any further writes do, hence this
+                         * blocks the caller just like waiting for the offline worker does */
+                        begin = now(CLOCK_MONOTONIC);
+
                         f->header->state = STATE_ONLINE;
-                        (void) fsync(f->fd);
+                        (void) fdatasync(f->fd);
+
+                        m = pthread_mutex_lock_assert(&offline_worker.mutex);
+                        journal_file_account_stall(begin);
                         return 0;
+                }
 
                 default:
                         return -EINVAL;
@@ -394,6 +539,9 @@ JournalFile* journal_file_close(JournalFile *f) {
 
 #if HAVE_COMPRESSION
         free(f->compress_buffer);
+        compress_dictionary_free(f->dictionary);
+        free(f->dictionary_samples);
+        free(f->dictionary_sample_sizes);
 #endif
 
 #if HAVE_GCRYPT
@@ -425,7 +573,10 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
                 f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
                 f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
-                f->keyed_hash * HEADER_INCOMPATIBLE_KEYED_HASH);
+                f->keyed_hash * HEADER_INCOMPATIBLE_KEYED_HASH |
+                f->grow_hash_table * HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE |
+                f->fast_keyed_hash * HEADER_INCOMPATIBLE_FAST_KEYED_HASH |
+                f->compact * HEADER_INCOMPATIBLE_COMPACT);
 
         h.compatible_flags = htole32(
                 f->seal * HEADER_COMPATIBLE_SEALED);
@@ -492,13 +643,15 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                   f->path, type, flags & ~any);
                 flags = (flags & any) & ~supported;
                 if (flags) {
-                        const char* strv[5];
+                        const char* strv[9];
                         unsigned n = 0;
                         _cleanup_free_ char *t = NULL;
 
                         if (compatible) {
                                 if (flags & HEADER_COMPATIBLE_SEALED)
                                         strv[n++] = "sealed";
+                                if (flags & HEADER_COMPATIBLE_BLOOM_FILTER)
+                                        strv[n++] = "bloom-filter";
                         } else {
                                 if (flags & HEADER_INCOMPATIBLE_COMPRESSED_XZ)
                                         strv[n++] = "xz-compressed";
@@ -508,6 +661,14 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                         strv[n++] = "zstd-compressed";
                                 if (flags & HEADER_INCOMPATIBLE_KEYED_HASH)
                                         strv[n++] = "keyed-hash";
+                                if (flags & HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE)
+                                        strv[n++] = "growable-hash-table";
+                                if (flags & HEADER_INCOMPATIBLE_FAST_KEYED_HASH)
+                                        strv[n++] = "fast-keyed-hash";
+                                if (flags & HEADER_INCOMPATIBLE_COMPACT)
+                                        strv[n++] = "compact";
+                                if (flags & HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
+                                        strv[n++] = "zstd-dictionary";
                         }
                         strv[n] = NULL;
                         assert(n < ELEMENTSOF(strv));
@@ -552,6 +713,10 @@ static int journal_file_verify_header(JournalFile *f) {
         if (JOURNAL_HEADER_SEALED(f->header) && !JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays))
                 return -EBADMSG;
 
+        /* The fast keyed hash is a variant of the keyed hash, never set one without the other */
+        if (JOURNAL_HEADER_FAST_KEYED_HASH(f->header) && !JOURNAL_HEADER_KEYED_HASH(f->header))
+                return -EBADMSG;
+
         arena_size = le64toh(READ_NOW(f->header->arena_size));
 
         if (UINT64_MAX - header_size < arena_size || header_size + arena_size > (uint64_t) f->last_stat.st_size)
@@ -610,6 +775,9 @@ static int journal_file_verify_header(JournalFile *f) {
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
         f->keyed_hash = JOURNAL_HEADER_KEYED_HASH(f->header);
+        f->grow_hash_table = JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header);
+        f->fast_keyed_hash = JOURNAL_HEADER_FAST_KEYED_HASH(f->header);
+        f->compact = JOURNAL_HEADER_COMPACT(f->header);
 
         return 0;
 }
@@ -638,7 +806,7 @@ int journal_file_fstat(JournalFile *f) {
 }
 
 static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size) {
-        uint64_t old_size, new_size, old_header_size, old_arena_size;
+        uint64_t old_size, new_size, old_header_size, old_arena_size, max_size;
         int r;
 
         assert(f);
@@ -676,9 +844,16 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
                 return journal_file_fstat(f);
         }
 
-        /* Allocate more space. */
+        /* Allocate more space. Files being archived usually are so because they hit the size limit, and
+         * the only thing still appended to them is the bloom filter. Let it exceed the limit, it's small
+         * compared to the rest of the file, and the file won't grow any further anyway. */
+
+        max_size = f->archive ? 0 : f->metrics.max_size;
 
-        if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
+        if (max_size > 0 && new_size > max_size)
+                return -E2BIG;
+
+        if (JOURNAL_HEADER_COMPACT(f->header) && new_size > JOURNAL_COMPACT_SIZE_MAX)
                 return -E2BIG;
 
         if (new_size > f->metrics.min_size && f->metrics.keep_free > 0) {
@@ -694,10 +869,13 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
                 }
         }
 
-        /* Increase by larger blocks at once */
-        new_size = DIV_ROUND_UP(new_size, FILE_SIZE_INCREASE) * FILE_SIZE_INCREASE;
-        if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
-                new_size = f->metrics.max_size;
+        /* Increase by larger blocks at once, unless nothing is going to be added anymore */
+        if (!f->archive)
+                new_size = DIV_ROUND_UP(new_size, FILE_SIZE_INCREASE) * FILE_SIZE_INCREASE;
+        if (max_size > 0 && new_size > max_size)
+                new_size = max_size;
+        if (JOURNAL_HEADER_COMPACT(f->header))
+                new_size = MIN(new_size, PAGE_ALIGN_DOWN(JOURNAL_COMPACT_SIZE_MAX));
 
         /* Note that the glibc fallocate() fallback is very
            inefficient, hence we try to minimize the allocation area
@@ -764,6 +942,8 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_BLOOM_FILTER] = sizeof(BloomFilterObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -830,17 +1010,17 @@ static int journal_file_check_object(JournalFile *f, uint64_t offset, Object *o)
 
                 sz = le64toh(READ_NOW(o->object.size));
                 if (sz < offsetof(EntryObject, items) ||
-                    (sz - offsetof(EntryObject, items)) % sizeof(EntryItem) != 0)
+                    (sz - offsetof(EntryObject, items)) % journal_file_entry_item_size(f) != 0)
                         return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
                                                "Bad entry size (<= %zu): %" PRIu64 ": %" PRIu64,
                                                offsetof(EntryObject, items),
                                                sz,
                                                offset);
 
-                if ((sz - offsetof(EntryObject, items)) / sizeof(EntryItem) <= 0)
+                if ((sz - offsetof(EntryObject, items)) / journal_file_entry_item_size(f) <= 0)
                         return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
                                                "Invalid number items in entry: %" PRIu64 ": %" PRIu64,
-                                               (sz - offsetof(EntryObject, items)) / sizeof(EntryItem),
+                                               (sz - offsetof(EntryObject, items)) / journal_file_entry_item_size(f),
                                                offset);
 
                 if (le64toh(o->entry.seqnum) <= 0)
@@ -886,8 +1066,8 @@ static int journal_file_check_object(JournalFile *f, uint64_t offset, Object *o)
 
                 sz = le64toh(READ_NOW(o->object.size));
                 if (sz < offsetof(EntryArrayObject, items) ||
-                    (sz - offsetof(EntryArrayObject, items)) % sizeof(le64_t) != 0 ||
-                    (sz - offsetof(EntryArrayObject, items)) / sizeof(le64_t) <= 0)
+                    (sz - offsetof(EntryArrayObject, items)) % journal_file_entry_array_item_size(f) != 0 ||
+                    (sz - offsetof(EntryArrayObject, items)) / journal_file_entry_array_item_size(f) <= 0)
                         return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
                                                "Invalid object entry array size: %" PRIu64 ": %" PRIu64,
                                                sz,
@@ -915,6 +1095,33 @@ static int journal_file_check_object(JournalFile *f, uint64_t offset, Object *o)
                                                le64toh(o->tag.epoch), offset);
 
                 break;
+
+        case OBJECT_BLOOM_FILTER:
+                if (le64toh(o->object.size) <= offsetof(BloomFilterObject, bits))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Bad bloom filter size (<= %zu): %" PRIu64 ": %" PRIu64,
+                                               offsetof(BloomFilterObject, bits),
+                                               le64toh(o->object.size),
+                                               offset);
+
+                if (le64toh(o->bloom_filter.n_hashes) <= 0 ||
+                    le64toh(o->bloom_filter.n_hashes) > BLOOM_FILTER_N_HASHES_MAX)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Invalid number of bloom filter hashes: %" PRIu64 ": %" PRIu64,
+                                               le64toh(o->bloom_filter.n_hashes),
+                                               offset);
+
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Bad dictionary size (<= %zu): %" PRIu64 ": %" PRIu64,
+                                               offsetof(DictionaryObject, payload),
+                                               le64toh(o->object.size),
+                                               offset);
+
+                break;
         }
 
         return 0;
@@ -1155,11 +1362,30 @@ int journal_file_map_data_hash_table(JournalFile *f) {
         assert(f);
         assert(f->header);
 
-        if (f->data_hash_table)
+        /* If the file has a growable hash table the writer might have replaced it by a larger one since we
+         * mapped it, hence always check whether the header still points to the table we know. */
+        p = le64toh(READ_NOW(f->header->data_hash_table_offset));
+        if (f->data_hash_table && p == f->data_hash_table_offset)
                 return 0;
 
-        p = le64toh(f->header->data_hash_table_offset);
-        s = le64toh(f->header->data_hash_table_size);
+        if (JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header)) {
+                Object *o;
+
+                /* The writer updates the offset and the size fields in the header one after the other, hence
+                 * don't rely on them being in sync, but take the size from the table object itself, which
+                 * never changes once it has been linked in. */
+                if (p < offsetof(Object, hash_table.items))
+                        return -EBADMSG;
+
+                r = journal_file_move_to_object(f, OBJECT_DATA_HASH_TABLE, p - offsetof(Object, hash_table.items), &o);
+                if (r < 0)
+                        return r;
+
+                s = journal_file_hash_table_n_items(o) * sizeof(HashItem);
+                if (s <= 0)
+                        return -EBADMSG;
+        } else
+                s = le64toh(f->header->data_hash_table_size);
 
         r = journal_file_move_to(f,
                                  OBJECT_DATA_HASH_TABLE,
@@ -1170,6 +1396,8 @@ int journal_file_map_data_hash_table(JournalFile *f) {
                 return r;
 
         f->data_hash_table = t;
+        f->data_hash_table_offset = p;
+        f->data_hash_table_size = s;
         return 0;
 }
 
@@ -1199,6 +1427,102 @@ int journal_file_map_field_hash_table(JournalFile *f) {
         return 0;
 }
 
+static uint64_t bloom_filter_bit(uint64_t hash, uint64_t i, uint64_t n_bits) {
+        /* Derive the i-th probe from the two halves of the data hash (Kirsch/Mitzenmacher), so that readers
+         * don't have to hash anything they wouldn't hash anyway */
+        return ((hash & UINT32_MAX) + i * ((hash >> 32) | 1U)) % n_bits;
+}
+
+int journal_file_bloom_filter_may_contain(JournalFile *f, uint64_t hash) {
+        uint64_t i, n_hashes;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        /* Returns 0 if the file definitely contains no data object with the specified hash, 1 if it might,
+         * including when the file has no bloom filter at all. */
+
+        if (!JOURNAL_HEADER_BLOOM_FILTER(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset))
+                return 1;
+
+        if (!f->bloom_filter) {
+                uint64_t p, s;
+                Object *o;
+                void *t;
+
+                p = le64toh(READ_NOW(f->header->bloom_filter_offset));
+                if (p == 0)
+                        return 1;
+
+                r = journal_file_move_to_object(f, OBJECT_BLOOM_FILTER, p, &o);
+                if (r < 0)
+                        return r;
+
+                s = le64toh(o->object.size);
+
+                /* Keep it mapped, it's consulted for every single lookup */
+                r = journal_file_move_to(f, OBJECT_BLOOM_FILTER, true, p, s, &t, NULL);
+                if (r < 0)
+                        return r;
+
+                f->bloom_filter = t;
+                f->bloom_filter_n_bits = (s - offsetof(BloomFilterObject, bits)) * 8;
+        }
+
+        n_hashes = le64toh(f->bloom_filter->n_hashes);
+        for (i = 0; i < n_hashes; i++) {
+                uint64_t b;
+
+                b = bloom_filter_bit(hash, i, f->bloom_filter_n_bits);
+                if (!(f->bloom_filter->bits[b / 8] & (1U << (b % 8))))
+                        return 0;
+        }
+
+        return 1;
+}
+
+int journal_file_get_dictionary(JournalFile *f, CompressDictionary **ret) {
+        assert(f);
+        assert(f->header);
+        assert(ret);
+
+        /* Returns the ZSTD dictionary of the file, or NULL if it has none (yet) */
+
+#if HAVE_COMPRESSION
+        if (!f->dictionary &&
+            JOURNAL_HEADER_ZSTD_DICTIONARY(f->header) &&
+            JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset)) {
+                uint64_t p;
+                Object *o;
+                int r;
+
+                p = le64toh(READ_NOW(f->header->dictionary_offset));
+                if (p == 0)
+                        return -EBADMSG;
+
+                /* The dictionary has a mmap context of its own, hence this doesn't invalidate any data
+                 * object the caller is looking at */
+                r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
+                if (r < 0)
+                        return r;
+
+                r = compress_dictionary_new(o->dictionary.payload,
+                                            le64toh(o->object.size) - offsetof(DictionaryObject, payload),
+                                            f->writable,
+                                            &f->dictionary);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = f->dictionary;
+#else
+        *ret = NULL;
+#endif
+        return 0;
+}
+
 static int journal_file_link_field(
                 JournalFile *f,
                 Object *o,
@@ -1262,7 +1586,7 @@ static int journal_file_link_data(
         if (o->object.type != OBJECT_DATA)
                 return -EINVAL;
 
-        m = le64toh(READ_NOW(f->header->data_hash_table_size)) / sizeof(HashItem);
+        m = f->data_hash_table_size / sizeof(HashItem);
         if (m <= 0)
                 return -EBADMSG;
 
@@ -1391,7 +1715,11 @@ uint64_t journal_file_hash_data(
         assert(data || sz == 0);
 
         /* We try to unify our codebase on siphash, hence new-styled journal files utilizing the keyed hash
-         * function use siphash. Old journal files use the Jenkins hash. */
+         * function use siphash, in its faster 1-3 variant if the file says so. Old journal files use the
+         * Jenkins hash. */
+
+        if (JOURNAL_HEADER_FAST_KEYED_HASH(f->header))
+                return siphash13(data, sz, f->header->file_id.bytes);
 
         if (JOURNAL_HEADER_KEYED_HASH(f->header))
                 return siphash24(data, sz, f->header->file_id.bytes);
@@ -1399,6 +1727,46 @@ uint64_t journal_file_hash_data(
         return jenkins_hash64(data, sz);
 }
 
+/* Fixed key of the hash that goes into the XOR hash of entries in files with the fast keyed hash */
+#define XOR_HASH_KEY SD_ID128_MAKE(3e,f1,24,b7,0f,2d,4e,b7,9c,61,67,9d,dd,d9,08,82)
+
+static uint64_t journal_file_hash_entry_item(
+                JournalFile *f,
+                const void *data,
+                size_t sz,
+                uint64_t *xor_hash) {
+
+        uint64_t h, x;
+
+        assert(f);
+        assert(data || sz == 0);
+        assert(xor_hash);
+
+        /* Returns the hash of a DATA object like journal_file_hash_data(), and folds the payload into the
+         * XOR hash of the entry it is part of.
+         *
+         * We use the XOR hash field to quickly determine the identity of a specific record, and give
+         * records with otherwise identical position (i.e. match in seqno, timestamp, …) a stable
+         * ordering. But for that we can't have it that the hash of the objects in each file is different
+         * since they are keyed. Hence for "keyed-hash" files let's calculate the Jenkins hash here for
+         * that, so that cursors for old and new journal files are completely identical (they include the
+         * XOR hash after all). That means hashing every payload twice though, hence files with the
+         * "fast-keyed-hash" flag instead take a second SipHash-1-3 with a fixed key, calculated in the
+         * same pass as the keyed one. For classic Jenkins-hash files things are easier, we can just take
+         * the hash of the DATA object directly. */
+
+        if (JOURNAL_HEADER_FAST_KEYED_HASH(f->header))
+                siphash13_pair(data, sz, f->header->file_id.bytes, XOR_HASH_KEY.bytes, &h, &x);
+        else if (JOURNAL_HEADER_KEYED_HASH(f->header)) {
+                h = siphash24(data, sz, f->header->file_id.bytes);
+                x = jenkins_hash64(data, sz);
+        } else
+                h = x = jenkins_hash64(data, sz);
+
+        *xor_hash ^= x;
+        return h;
+}
+
 int journal_file_find_field_object(
                 JournalFile *f,
                 const void *field, uint64_t size,
@@ -1430,6 +1798,11 @@ int journal_file_find_data_object_with_hash(
         if (le64toh(f->header->data_hash_table_size) <= 0)
                 return 0;
 
+        /* Archived files might tell us right away that we needn't look any further */
+        r = journal_file_bloom_filter_may_contain(f, hash);
+        if (r <= 0)
+                return r;
+
         /* Map the data hash table, if it isn't mapped yet. */
         r = journal_file_map_data_hash_table(f);
         if (r < 0)
@@ -1437,7 +1810,7 @@ int journal_file_find_data_object_with_hash(
 
         osize = offsetof(Object, data.payload) + size;
 
-        m = le64toh(READ_NOW(f->header->data_hash_table_size)) / sizeof(HashItem);
+        m = f->data_hash_table_size / sizeof(HashItem);
         if (m <= 0)
                 return -EBADMSG;
 
@@ -1456,6 +1829,7 @@ int journal_file_find_data_object_with_hash(
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
 #if HAVE_COMPRESSION
+                        CompressDictionary *d;
                         uint64_t l;
                         size_t rsize = 0;
 
@@ -1465,8 +1839,12 @@ int journal_file_find_data_object_with_hash(
 
                         l -= offsetof(Object, data.payload);
 
-                        r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                        r = journal_file_get_dictionary(f, &d);
+                        if (r < 0)
+                                return r;
+
+                        r = decompress_blob_dict(o->object.flags & OBJECT_COMPRESSION_MASK, d,
+                                                 o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
                         if (r < 0)
                                 return r;
 
@@ -1587,22 +1965,253 @@ static int journal_file_append_field(
         return 0;
 }
 
+static int journal_file_grow_data_hash_table(JournalFile *f) {
+        uint64_t m, s, p, i;
+        HashItem *table;
+        Object *o;
+        void *t;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(f->data_hash_table);
+
+        /* Replaces the data hash table by one twice the size. Since hash % (2*m) is either hash % m or
+         * hash % m + m, each old chain is split into exactly two new ones, in the same order. Hence the
+         * offsets in every chain remain strictly increasing, without any sorting. Readers that walk a chain
+         * while we relink it might miss an object, but will not loop or go out of bounds, and will pick up
+         * the new table on their next lookup. */
+
+        m = f->data_hash_table_size / sizeof(HashItem);
+        if (m <= 0)
+                return -EBADMSG;
+
+        if (m > UINT64_MAX / 2 / sizeof(HashItem))
+                return -E2BIG;
+
+        s = m * 2 * sizeof(HashItem);
+
+        r = journal_file_append_object(f,
+                                       OBJECT_DATA_HASH_TABLE,
+                                       offsetof(Object, hash_table.items) + s,
+                                       &o, &p);
+        if (r < 0)
+                return r;
+
+        memzero(o->hash_table.items, s);
+
+        p += offsetof(Object, hash_table.items);
+
+        /* Keep the new table mapped, we are going to use it from now on */
+        r = journal_file_move_to(f, OBJECT_DATA_HASH_TABLE, true, p, s, &t, NULL);
+        if (r < 0)
+                return r;
+
+        table = t;
+
+        for (i = 0; i < m; i++) {
+                uint64_t q;
+
+                q = le64toh(f->data_hash_table[i].head_hash_offset);
+                while (q > 0) {
+                        uint64_t next, h, tail;
+
+                        r = journal_file_move_to_object(f, OBJECT_DATA, q, &o);
+                        if (r < 0)
+                                return r;
+
+                        next = le64toh(READ_NOW(o->data.next_hash_offset));
+                        if (next > 0 && next <= q) /* Refuse going in loops */
+                                return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                                       "Detected hash item loop in %s, refusing.", f->path);
+
+                        o->data.next_hash_offset = 0;
+
+                        h = le64toh(o->data.hash) % (m * 2);
+                        tail = le64toh(table[h].tail_hash_offset);
+                        if (tail == 0)
+                                table[h].head_hash_offset = htole64(q);
+                        else {
+                                r = journal_file_move_to_object(f, OBJECT_DATA, tail, &o);
+                                if (r < 0)
+                                        return r;
+
+                                o->data.next_hash_offset = htole64(q);
+                        }
+
+                        table[h].tail_hash_offset = htole64(q);
+                        q = next;
+                }
+        }
+
+        __sync_synchronize();
+
+        f->header->data_hash_table_offset = htole64(p);
+        f->header->data_hash_table_size = htole64(s);
+
+        /* The chains got shorter, start measuring them anew */
+        if (JOURNAL_HEADER_CONTAINS(f->header, data_hash_chain_depth))
+                f->header->data_hash_chain_depth = 0;
+
+        f->data_hash_table = table;
+        f->data_hash_table_offset = p;
+        f->data_hash_table_size = s;
+
+        log_debug("Grew data hash table of %s from %"PRIu64" to %"PRIu64" entries.", f->path, m, m * 2);
+        return 0;
+}
+
+static int journal_file_maybe_grow_data_hash_table(JournalFile *f) {
+        uint64_t m;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        if (!JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, n_data))
+                return 0;
+
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0)
+                return r;
+
+        /* Grow at the same 75% fill level at which journal_file_rotate_suggested() would otherwise ask for
+         * a rotation. */
+        m = f->data_hash_table_size / sizeof(HashItem);
+        if (le64toh(f->header->n_data) * 4ULL <= m * 3ULL)
+                return 0;
+
+        r = journal_file_grow_data_hash_table(f);
+        if (r == -E2BIG) {
+                /* The file reached its size limit. Keep using the old table, the file will be rotated soon
+                 * anyway. */
+                log_debug_errno(r, "Not enough space to grow data hash table of %s, continuing with the old one.", f->path);
+                return 0;
+        }
+
+        return r;
+}
+
+#if HAVE_COMPRESSION
+static bool journal_file_wants_dictionary(JournalFile *f) {
+        assert(f);
+
+        return f->compress_dictionary &&
+                f->compress_zstd &&
+                f->writable &&
+                JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+                !JOURNAL_HEADER_ZSTD_DICTIONARY(f->header);
+}
+
+static void journal_file_sample_data(JournalFile *f, const void *data, uint64_t size) {
+        assert(f);
+        assert(data || size == 0);
+
+        /* Remembers a new field to train the dictionary from, see journal_file_maybe_append_dictionary() */
+
+        if (size < DICTIONARY_SAMPLE_SIZE_MIN || size > DICTIONARY_SAMPLE_SIZE_MAX)
+                return;
+
+        if (f->dictionary_samples_size >= DICTIONARY_SAMPLES_SIZE ||
+            !journal_file_wants_dictionary(f))
+                return;
+
+        /* Failing is not fatal, that just means the file won't get a dictionary as early */
+        if (!GREEDY_REALLOC(f->dictionary_samples, f->dictionary_samples_allocated, f->dictionary_samples_size + size) ||
+            !GREEDY_REALLOC(f->dictionary_sample_sizes, f->n_dictionary_sample_sizes_allocated, f->n_dictionary_samples + 1))
+                return;
+
+        memcpy(f->dictionary_samples + f->dictionary_samples_size, data, size);
+        f->dictionary_samples_size += size;
+        f->dictionary_sample_sizes[f->n_dictionary_samples++] = size;
+}
+
+static int journal_file_append_dictionary(JournalFile *f) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        _cleanup_free_ void *dict = NULL;
+        size_t dict_size;
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        r = compress_dictionary_train(f->dictionary_samples, f->dictionary_sample_sizes, f->n_dictionary_samples,
+                                      DICTIONARY_SIZE_MAX, &dict, &dict_size);
+        if (r < 0)
+                return r;
+
+        r = compress_dictionary_new(dict, dict_size, true, &d);
+        if (r < 0)
+                return r;
+
+        r = journal_file_append_object(f, OBJECT_DICTIONARY, offsetof(Object, dictionary.payload) + dict_size, &o, &p);
+        if (r < 0)
+                return r;
+
+        memcpy(o->dictionary.payload, dict, dict_size);
+
+#if HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, o, p);
+        if (r < 0)
+                return r;
+#endif
+
+        f->header->dictionary_offset = htole64(p);
+        __sync_synchronize();
+        f->header->incompatible_flags = htole32(le32toh(f->header->incompatible_flags) | HEADER_INCOMPATIBLE_ZSTD_DICTIONARY);
+
+        f->dictionary = TAKE_PTR(d);
+
+        log_debug("Added compression dictionary of %zu bytes, trained from %zu fields, to %s.",
+                  dict_size, f->n_dictionary_samples, f->path);
+        return 0;
+}
+
+static void journal_file_maybe_append_dictionary(JournalFile *f) {
+        int r;
+
+        assert(f);
+
+        if (f->dictionary_samples_size < DICTIONARY_SAMPLES_SIZE)
+                return;
+
+        /* Only ever try once per file, whatever happens */
+        if (journal_file_wants_dictionary(f)) {
+                r = journal_file_append_dictionary(f);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to add compression dictionary to %s, ignoring: %m", f->path);
+        }
+
+        f->compress_dictionary = false;
+        f->dictionary_samples = mfree(f->dictionary_samples);
+        f->dictionary_sample_sizes = mfree(f->dictionary_sample_sizes);
+        f->dictionary_samples_size = f->dictionary_samples_allocated = 0;
+        f->n_dictionary_samples = f->n_dictionary_sample_sizes_allocated = 0;
+}
+#endif
+
 static int journal_file_append_data(
                 JournalFile *f,
                 const void *data, uint64_t size,
+                uint64_t hash,
                 Object **ret, uint64_t *ret_offset) {
 
-        uint64_t hash, p;
+        uint64_t p;
         uint64_t osize;
         Object *o;
         int r, compression = 0;
         const void *eq;
+#if HAVE_COMPRESSION
+        CompressDictionary *d;
+        uint64_t threshold;
+#endif
 
         assert(f);
         assert(data || size == 0);
 
-        hash = journal_file_hash_data(f, data, size);
-
         r = journal_file_find_data_object_with_hash(f, data, size, hash, &o, &p);
         if (r < 0)
                 return r;
@@ -1617,6 +2226,10 @@ static int journal_file_append_data(
                 return 0;
         }
 
+        r = journal_file_maybe_grow_data_hash_table(f);
+        if (r < 0)
+                return r;
+
         osize = offsetof(Object, data.payload) + size;
         r = journal_file_append_object(f, OBJECT_DATA, osize, &o, &p);
         if (r < 0)
@@ -1625,10 +2238,19 @@ static int journal_file_append_data(
         o->data.hash = htole64(hash);
 
 #if HAVE_COMPRESSION
-        if (JOURNAL_FILE_COMPRESS(f) && size >= f->compress_threshold_bytes) {
+        r = journal_file_get_dictionary(f, &d);
+        if (r < 0)
+                return r;
+
+        /* With a dictionary even small fields compress well */
+        threshold = f->compress_threshold_bytes;
+        if (d)
+                threshold = MIN(threshold, DICTIONARY_COMPRESS_THRESHOLD);
+
+        if (JOURNAL_FILE_COMPRESS(f) && size >= threshold) {
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
+                compression = compress_blob_dict(d, data, size, o->data.payload, size - 1, &rsize);
 
                 if (compression >= 0) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
@@ -1645,6 +2267,10 @@ static int journal_file_append_data(
         if (compression == 0)
                 memcpy_safe(o->data.payload, data, size);
 
+#if HAVE_COMPRESSION
+        journal_file_sample_data(f, data, size);
+#endif
+
         r = journal_file_link_data(f, o, p, hash);
         if (r < 0)
                 return r;
@@ -1688,8 +2314,10 @@ static int journal_file_append_data(
         return 0;
 }
 
-uint64_t journal_file_entry_n_items(Object *o) {
+uint64_t journal_file_entry_n_items(JournalFile *f, Object *o) {
         uint64_t sz;
+
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY)
@@ -1699,12 +2327,13 @@ uint64_t journal_file_entry_n_items(Object *o) {
         if (sz < offsetof(Object, entry.items))
                 return 0;
 
-        return (sz - offsetof(Object, entry.items)) / sizeof(EntryItem);
+        return (sz - offsetof(Object, entry.items)) / journal_file_entry_item_size(f);
 }
 
-uint64_t journal_file_entry_array_n_items(Object *o) {
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) {
         uint64_t sz;
 
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY_ARRAY)
@@ -1714,7 +2343,7 @@ uint64_t journal_file_entry_array_n_items(Object *o) {
         if (sz < offsetof(Object, entry_array.items))
                 return 0;
 
-        return (sz - offsetof(Object, entry_array.items)) / sizeof(uint64_t);
+        return (sz - offsetof(Object, entry_array.items)) / journal_file_entry_array_item_size(f);
 }
 
 uint64_t journal_file_hash_table_n_items(Object *o) {
@@ -1732,6 +2361,17 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
         return (sz - offsetof(Object, hash_table.items)) / sizeof(HashItem);
 }
 
+static void write_entry_array_item(JournalFile *f, Object *o, uint64_t i, uint64_t p) {
+        assert(f);
+        assert(o);
+
+        if (JOURNAL_HEADER_COMPACT(f->header)) {
+                assert(p <= JOURNAL_COMPACT_SIZE_MAX);
+                o->entry_array.items.compact[i] = htole32(p);
+        } else
+                o->entry_array.items.regular[i] = htole64(p);
+}
+
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
@@ -1754,9 +2394,9 @@ static int link_entry_into_array(JournalFile *f,
                 if (r < 0)
                         return r;
 
-                n = journal_file_entry_array_n_items(o);
+                n = journal_file_entry_array_n_items(f, o);
                 if (i < n) {
-                        o->entry_array.items[i] = htole64(p);
+                        write_entry_array_item(f, o, i, p);
                         *idx = htole64(hidx + 1);
                         return 0;
                 }
@@ -1775,7 +2415,7 @@ static int link_entry_into_array(JournalFile *f,
                 n = 4;
 
         r = journal_file_append_object(f, OBJECT_ENTRY_ARRAY,
-                                       offsetof(Object, entry_array.items) + n * sizeof(uint64_t),
+                                       offsetof(Object, entry_array.items) + n * journal_file_entry_array_item_size(f),
                                        &o, &q);
         if (r < 0)
                 return r;
@@ -1786,7 +2426,7 @@ static int link_entry_into_array(JournalFile *f,
                 return r;
 #endif
 
-        o->entry_array.items[i] = htole64(p);
+        write_entry_array_item(f, o, i, p);
 
         if (ap == 0)
                 *first = htole64(q);
@@ -1847,7 +2487,7 @@ static int journal_file_link_entry_item(JournalFile *f, Object *o, uint64_t offs
         assert(o);
         assert(offset > 0);
 
-        p = le64toh(o->entry.items[i].object_offset);
+        p = journal_file_entry_item_object_offset(f, o, i);
         r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
         if (r < 0)
                 return r;
@@ -1890,7 +2530,7 @@ static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
         f->header->tail_entry_monotonic = o->entry.monotonic;
 
         /* Link up the items */
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 r = journal_file_link_entry_item(f, o, offset, i);
                 if (r < 0)
@@ -1918,14 +2558,22 @@ static int journal_file_append_entry_internal(
         assert(items || n_items == 0);
         assert(ts);
 
-        osize = offsetof(Object, entry.items) + (n_items * sizeof(EntryItem));
+        osize = offsetof(Object, entry.items) + (n_items * journal_file_entry_item_size(f));
 
         r = journal_file_append_object(f, OBJECT_ENTRY, osize, &o, &np);
         if (r < 0)
                 return r;
 
         o->entry.seqnum = htole64(journal_file_entry_seqnum(f, seqnum));
-        memcpy_safe(o->entry.items, items, n_items * sizeof(EntryItem));
+        if (JOURNAL_HEADER_COMPACT(f->header)) {
+                unsigned i;
+
+                for (i = 0; i < n_items; i++) {
+                        assert(le64toh(items[i].object_offset) <= JOURNAL_COMPACT_SIZE_MAX);
+                        o->entry.items.compact[i].object_offset = htole32(le64toh(items[i].object_offset));
+                }
+        } else
+                memcpy_safe(o->entry.items.regular, items, n_items * sizeof(EntryItem));
         o->entry.realtime = htole64(ts->realtime);
         o->entry.monotonic = htole64(ts->monotonic);
         o->entry.xor_hash = htole64(xor_hash);
@@ -2083,31 +2731,24 @@ int journal_file_append_entry(
                 return r;
 #endif
 
+#if HAVE_COMPRESSION
+        journal_file_maybe_append_dictionary(f);
+#endif
+
         /* alloca() can't take 0, hence let's allocate at least one */
         items = newa(EntryItem, MAX(1u, n_iovec));
 
+        for (i = 0; i < n_iovec; i++)
+                items[i].hash = htole64(journal_file_hash_entry_item(f, iovec[i].iov_base, iovec[i].iov_len, &xor_hash));
+
         for (i = 0; i < n_iovec; i++) {
                 uint64_t p;
                 Object *o;
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, le64toh(items[i].hash), &o, &p);
                 if (r < 0)
                         return r;
 
-                /* When calculating the XOR hash field, we need to take special care if the "keyed-hash"
-                 * journal file flag is on. We use the XOR hash field to quickly determine the identity of a
-                 * specific record, and give records with otherwise identical position (i.e. match in seqno,
-                 * timestamp, …) a stable ordering. But for that we can't have it that the hash of the
-                 * objects in each file is different since they are keyed. Hence let's calculate the Jenkins
-                 * hash here for that. This also has the benefit that cursors for old and new journal files
-                 * are completely identical (they include the XOR hash after all). For classic Jenkins-hash
-                 * files things are easier, we can just take the value from the stored record directly. */
-
-                if (JOURNAL_HEADER_KEYED_HASH(f->header))
-                        xor_hash ^= jenkins_hash64(iovec[i].iov_base, iovec[i].iov_len);
-                else
-                        xor_hash ^= le64toh(o->data.hash);
-
                 items[i].object_offset = htole64(p);
                 items[i].hash = o->data.hash;
         }
@@ -2211,9 +2852,9 @@ static int generic_array_get(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(o);
+                k = journal_file_entry_array_n_items(f, o);
                 if (i < k) {
-                        p = le64toh(o->entry_array.items[i]);
+                        p = journal_file_entry_array_item(f, o, i);
                         goto found;
                 }
 
@@ -2226,7 +2867,7 @@ static int generic_array_get(
 
 found:
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(o->entry_array.items[0]), t, i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, o, 0), t, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -2332,13 +2973,13 @@ static int generic_array_bisect(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(array);
+                k = journal_file_entry_array_n_items(f, array);
                 right = MIN(k, n);
                 if (right <= 0)
                         return 0;
 
                 i = right - 1;
-                lp = p = le64toh(array->entry_array.items[i]);
+                lp = p = journal_file_entry_array_item(f, array, i);
                 if (p <= 0)
                         r = -EBADMSG;
                 else
@@ -2371,7 +3012,7 @@ static int generic_array_bisect(
                                 if (last_index > 0) {
                                         uint64_t x = last_index - 1;
 
-                                        p = le64toh(array->entry_array.items[x]);
+                                        p = journal_file_entry_array_item(f, array, x);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -2391,7 +3032,7 @@ static int generic_array_bisect(
                                 if (last_index < right) {
                                         uint64_t y = last_index + 1;
 
-                                        p = le64toh(array->entry_array.items[y]);
+                                        p = journal_file_entry_array_item(f, array, y);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -2421,7 +3062,7 @@ static int generic_array_bisect(
                                 assert(left < right);
                                 i = (left + right) / 2;
 
-                                p = le64toh(array->entry_array.items[i]);
+                                p = journal_file_entry_array_item(f, array, i);
                                 if (p <= 0)
                                         r = -EBADMSG;
                                 else
@@ -2469,14 +3110,14 @@ found:
                 return 0;
 
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(array->entry_array.items[0]), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, array, 0), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
 
         if (subtract_one && i == 0)
                 p = last_p;
         else if (subtract_one)
-                p = le64toh(array->entry_array.items[i-1]);
+                p = journal_file_entry_array_item(f, array, i - 1);
         else
-                p = le64toh(array->entry_array.items[i]);
+                p = journal_file_entry_array_item(f, array, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -3183,6 +3824,15 @@ void journal_file_dump(JournalFile *f) {
                                le64toh(o->tag.epoch));
                         break;
 
+                case OBJECT_BLOOM_FILTER:
+                        printf("Type: OBJECT_BLOOM_FILTER n_hashes=%"PRIu64"\n",
+                               le64toh(o->bloom_filter.n_hashes));
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY\n");
+                        break;
+
                 default:
                         printf("Type: unknown (%i)\n", o->object.type);
                         break;
@@ -3227,8 +3877,8 @@ void journal_file_print_header(JournalFile *f) {
                "Boot ID: %s\n"
                "Sequential number ID: %s\n"
                "State: %s\n"
-               "Compatible flags:%s%s\n"
-               "Incompatible flags:%s%s%s%s%s\n"
+               "Compatible flags:%s%s%s\n"
+               "Incompatible flags:%s%s%s%s%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data hash table size: %"PRIu64"\n"
@@ -3250,11 +3900,16 @@ void journal_file_print_header(JournalFile *f) {
                f->header->state == STATE_ONLINE ? "ONLINE" :
                f->header->state == STATE_ARCHIVED ? "ARCHIVED" : "UNKNOWN",
                JOURNAL_HEADER_SEALED(f->header) ? " SEALED" : "",
+               JOURNAL_HEADER_BLOOM_FILTER(f->header) ? " BLOOM-FILTER" : "",
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
                JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
                JOURNAL_HEADER_KEYED_HASH(f->header) ? " KEYED-HASH" : "",
+               JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header) ? " GROWABLE-HASH-TABLE" : "",
+               JOURNAL_HEADER_FAST_KEYED_HASH(f->header) ? " FAST-KEYED-HASH" : "",
+               JOURNAL_HEADER_COMPACT(f->header) ? " COMPACT" : "",
+               JOURNAL_HEADER_ZSTD_DICTIONARY(f->header) ? " ZSTD-DICTIONARY" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
@@ -3374,6 +4029,7 @@ int journal_file_open(
                 .flags = flags,
                 .prot = prot_from_flags(flags),
                 .writable = (flags & O_ACCMODE) != O_RDONLY,
+                .prioq_idx = PRIOQ_IDX_NULL,
 
 #if HAVE_ZSTD
                 .compress_zstd = compress,
@@ -3400,6 +4056,43 @@ int journal_file_open(
         } else
                 f->keyed_hash = r;
 
+        /* Similar, we let the data hash table grow instead of rotating early, unless turned off */
+        r = getenv_bool("SYSTEMD_JOURNAL_GROWABLE_HASH_TABLE");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_GROWABLE_HASH_TABLE environment variable, ignoring.");
+                f->grow_hash_table = true;
+        } else
+                f->grow_hash_table = r;
+
+        /* And where keyed hashes are used, we use the faster variant of siphash by default */
+        r = getenv_bool("SYSTEMD_JOURNAL_FAST_KEYED_HASH");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_FAST_KEYED_HASH environment variable, ignoring.");
+                f->fast_keyed_hash = f->keyed_hash;
+        } else
+                f->fast_keyed_hash = f->keyed_hash && r;
+
+        /* Store 32bit offsets in entries and entry arrays, which limits files to 4G, unless turned off */
+        r = getenv_bool("SYSTEMD_JOURNAL_COMPACT");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_COMPACT environment variable, ignoring.");
+                f->compact = true;
+        } else
+                f->compact = r;
+
+        /* Train a ZSTD dictionary for small fields from the first ones written to the file, unless turned
+         * off */
+        r = getenv_bool("SYSTEMD_JOURNAL_COMPRESSION_DICTIONARY");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_COMPRESSION_DICTIONARY environment variable, ignoring.");
+                f->compress_dictionary = true;
+        } else
+                f->compress_dictionary = r;
+
         if (DEBUG_LOGGING) {
                 static int last_seal = -1, last_compress = -1, last_keyed_hash = -1;
                 static uint64_t last_bytes = UINT64_MAX;
@@ -3502,6 +4195,11 @@ int journal_file_open(
                 }
 #endif
 
+                /* The HMAC of the header covers the location of the data hash table, hence we can't move it
+                 * elsewhere in sealed files. */
+                if (f->seal)
+                        f->grow_hash_table = false;
+
                 r = journal_file_init_header(f, template);
                 if (r < 0)
                         goto fail;
@@ -3611,8 +4309,83 @@ fail:
         return r;
 }
 
+static int journal_file_append_bloom_filter(JournalFile *f) {
+        _cleanup_free_ uint8_t *bits = NULL;
+        uint64_t n_bits, i, p, n = 0;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        /* Records the hashes of all data objects in a bloom filter, so that readers can quickly rule out
+         * that the file contains anything matching. Once the filter is written, nothing may be added to the
+         * file anymore, hence this is only done when archiving. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, n_data) ||
+            le64toh(f->header->n_data) <= 0)
+                return 0;
+
+        /* The HMAC doesn't cover objects appended after the last tag */
+        if (JOURNAL_HEADER_SEALED(f->header))
+                return 0;
+
+        n_bits = ALIGN_TO(le64toh(f->header->n_data) * BLOOM_FILTER_BITS_PER_ITEM, 64);
+        bits = new0(uint8_t, n_bits / 8);
+        if (!bits)
+                return -ENOMEM;
+
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < f->data_hash_table_size / sizeof(HashItem); i++) {
+                uint64_t q;
+
+                q = le64toh(f->data_hash_table[i].head_hash_offset);
+                while (q > 0) {
+                        uint64_t j, next;
+
+                        r = journal_file_move_to_object(f, OBJECT_DATA, q, &o);
+                        if (r < 0)
+                                return r;
+
+                        for (j = 0; j < BLOOM_FILTER_N_HASHES; j++) {
+                                uint64_t b;
+
+                                b = bloom_filter_bit(le64toh(o->data.hash), j, n_bits);
+                                bits[b / 8] |= 1U << (b % 8);
+                        }
+
+                        next = le64toh(o->data.next_hash_offset);
+                        if (next > 0 && next <= q) /* Refuse going in loops */
+                                return -EBADMSG;
+
+                        q = next;
+                        n++;
+                }
+        }
+
+        r = journal_file_append_object(f, OBJECT_BLOOM_FILTER, offsetof(Object, bloom_filter.bits) + n_bits / 8, &o, &p);
+        if (r < 0)
+                return r;
+
+        o->bloom_filter.n_hashes = htole64(BLOOM_FILTER_N_HASHES);
+        memcpy(o->bloom_filter.bits, bits, n_bits / 8);
+
+        f->header->bloom_filter_offset = htole64(p);
+        __sync_synchronize();
+        f->header->compatible_flags = htole32(le32toh(f->header->compatible_flags) | HEADER_COMPATIBLE_BLOOM_FILTER);
+
+        log_debug("Added bloom filter of %"PRIu64" bytes for %"PRIu64" data objects to %s.", n_bits / 8, n, f->path);
+        return 0;
+}
+
 int journal_file_archive(JournalFile *f) {
         _cleanup_free_ char *p = NULL;
+        bool renamed = false;
+        int r;
 
         assert(f);
 
@@ -3636,19 +4409,39 @@ int journal_file_archive(JournalFile *f) {
 
         /* Try to rename the file to the archived version. If the file already was deleted, we'll get ENOENT, let's
          * ignore that case. */
-        if (rename(f->path, p) < 0 && errno != ENOENT)
-                return -errno;
-
-        /* Sync the rename to disk */
-        (void) fsync_directory_of_file(f->fd);
+        if (rename(f->path, p) < 0) {
+                if (errno != ENOENT)
+                        return -errno;
+        } else
+                renamed = true;
 
         /* Set as archive so offlining commits w/state=STATE_ARCHIVED. Previously we would set old_file->header->state
          * to STATE_ARCHIVED directly here, but journal_file_set_offline() short-circuits when state != STATE_ONLINE,
          * which would result in the rotated journal never getting fsync() called before closing.  Now we simply queue
          * the archive state by setting an archive bit, leaving the state as STATE_ONLINE so proper offlining
-         * occurs. */
+         * occurs. This also allows the bloom filter below to be appended even if the file hit its size limit. */
         f->archive = true;
 
+        /* Nothing is going to be added to the file anymore, which makes this the right time to summarize
+         * what's in it. Not before the rename succeeded though, as otherwise we'd continue to append to a
+         * file whose filter doesn't know about the new data. This is merely an optimization for readers,
+         * hence failing is not fatal. */
+        if (!JOURNAL_HEADER_BLOOM_FILTER(f->header)) {
+                r = journal_file_append_bloom_filter(f);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to add bloom filter to %s, ignoring: %m", f->path);
+        }
+
+        /* Only now the file has its final size, record it in the index */
+        if (renamed) {
+                r = journal_index_add_file(f, p);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to add %s to journal index, ignoring: %m", p);
+        }
+
+        /* Sync the rename to disk */
+        (void) fsync_directory_of_file(f->fd);
+
         /* Currently, btrfs is not very good with out write patterns and fragments heavily. Let's defrag our journal
          * files when we archive them */
         f->defrag_on_close = true;
@@ -3718,6 +4511,7 @@ int journal_file_rotate(
 int journal_file_dispose(int dir_fd, const char *fname) {
         _cleanup_free_ char *p = NULL;
         _cleanup_close_ int fd = -1;
+        int r;
 
         assert(fname);
 
@@ -3738,6 +4532,11 @@ int journal_file_dispose(int dir_fd, const char *fname) {
         if (renameat(dir_fd, fname, dir_fd, p) < 0)
                 return -errno;
 
+        /* So that vacuuming learns about it without looking at the whole directory */
+        r = journal_index_add_disposed_file(dir_fd, p);
+        if (r < 0)
+                log_debug_errno(r, "Failed to add %s to journal index, ignoring: %m", p);
+
         /* btrfs doesn't cope well with our write pattern and fragments heavily. Let's defrag all files we rotate */
         fd = openat(dir_fd, p, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
         if (fd < 0)
@@ -3819,25 +4618,26 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
         ts.realtime = le64toh(o->entry.realtime);
         boot_id = &o->entry.boot_id;
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(from, o);
         /* alloca() can't take 0, hence let's allocate at least one */
         items = newa(EntryItem, MAX(1u, n));
 
         for (i = 0; i < n; i++) {
                 uint64_t l, h;
-                le64_t le_hash;
+                le64_t le_hash = 0;
                 size_t t;
                 void *data;
                 Object *u;
 
-                q = le64toh(o->entry.items[i].object_offset);
-                le_hash = o->entry.items[i].hash;
+                q = journal_file_entry_item_object_offset(from, o, i);
+                if (!JOURNAL_HEADER_COMPACT(from->header))
+                        le_hash = o->entry.items.regular[i].hash;
 
                 r = journal_file_move_to_object(from, OBJECT_DATA, q, &o);
                 if (r < 0)
                         return r;
 
-                if (le_hash != o->data.hash)
+                if (!JOURNAL_HEADER_COMPACT(from->header) && le_hash != o->data.hash)
                         return -EBADMSG;
 
                 l = le64toh(READ_NOW(o->object.size));
@@ -3853,10 +4653,15 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
 #if HAVE_COMPRESSION
+                        CompressDictionary *d;
                         size_t rsize = 0;
 
-                        r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                        r = journal_file_get_dictionary(from, &d);
+                        if (r < 0)
+                                return r;
+
+                        r = decompress_blob_dict(o->object.flags & OBJECT_COMPRESSION_MASK, d,
+                                                 o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
                         if (r < 0)
                                 return r;
 
@@ -3868,15 +4673,10 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 } else
                         data = o->data.payload;
 
-                r = journal_file_append_data(to, data, l, &u, &h);
+                r = journal_file_append_data(to, data, l, journal_file_hash_entry_item(to, data, l, &xor_hash), &u, &h);
                 if (r < 0)
                         return r;
 
-                if (JOURNAL_HEADER_KEYED_HASH(to->header))
-                        xor_hash ^= jenkins_hash64(data, l);
-                else
-                        xor_hash ^= le64toh(u->data.hash);
-
                 items[i].object_offset = htole64(h);
                 items[i].hash = u->data.hash;
 
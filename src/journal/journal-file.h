@@ -11,8 +11,10 @@
 #include "sd-event.h"
 #include "sd-id128.h"
 
+#include "compress.h"
 #include "hashmap.h"
 #include "journal-def.h"
+#include "list.h"
 #include "mmap-cache.h"
 #include "sparse-endian.h"
 #include "time-util.h"
@@ -73,10 +75,15 @@ typedef struct JournalFile {
         bool close_fd:1;
         bool archive:1;
         bool keyed_hash:1;
+        bool grow_hash_table:1;
+        bool fast_keyed_hash:1;
+        bool compact:1;
+        bool compress_dictionary:1;
 
         direction_t last_direction;
         LocationType location_type;
         uint64_t last_n_entries;
+        unsigned prioq_idx; /* position in sd_journal's queue of files to read from next */
 
         char *path;
         struct stat last_stat;
@@ -84,7 +91,11 @@ typedef struct JournalFile {
 
         Header *header;
         HashItem *data_hash_table;
+        uint64_t data_hash_table_offset; /* where the mapped data hash table is located, and how large it is */
+        uint64_t data_hash_table_size;
         HashItem *field_hash_table;
+        BloomFilterObject *bloom_filter;
+        uint64_t bloom_filter_n_bits;
 
         uint64_t current_offset;
         uint64_t current_seqnum;
@@ -101,8 +112,9 @@ typedef struct JournalFile {
 
         OrderedHashmap *chain_cache;
 
-        pthread_t offline_thread;
         volatile OfflineState offline_state;
+        bool offline_queued; /* protected by the offline worker's mutex */
+        LIST_FIELDS(struct JournalFile, offline_queue);
 
         unsigned last_seen_generation;
 
@@ -110,6 +122,16 @@ typedef struct JournalFile {
 #if HAVE_COMPRESSION
         void *compress_buffer;
         size_t compress_buffer_size;
+
+        CompressDictionary *dictionary;
+
+        /* The data objects we train the dictionary from, if the file has none yet */
+        uint8_t *dictionary_samples;
+        size_t dictionary_samples_size;
+        size_t dictionary_samples_allocated;
+        size_t *dictionary_sample_sizes;
+        size_t n_dictionary_samples;
+        size_t n_dictionary_sample_sizes_allocated;
 #endif
 
 #if HAVE_GCRYPT
@@ -130,6 +152,12 @@ typedef struct JournalFile {
 #endif
 } JournalFile;
 
+typedef struct JournalFileSyncStats {
+        uint64_t n_syncs;       /* files queued to the offline worker that were synced and set offline */
+        uint64_t n_stalls;      /* how often a caller had to wait for the disk */
+        usec_t stall_usec;      /* how long callers waited in total */
+        usec_t stall_max_usec;  /* … and the longest single wait */
+} JournalFileSyncStats;
 int journal_file_open(
                 int fd,
                 const char *fname,
@@ -146,6 +174,7 @@ int journal_file_open(
 
 int journal_file_set_offline(JournalFile *f, bool wait);
 bool journal_file_is_offlining(JournalFile *f);
+void journal_file_get_sync_stats(JournalFileSyncStats *ret);
 JournalFile* journal_file_close(JournalFile *j);
 int journal_file_fstat(JournalFile *f);
 DEFINE_TRIVIAL_CLEANUP_FUNC(JournalFile*, journal_file_close);
@@ -191,6 +220,9 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_SEALED(h) \
         FLAGS_SET(le32toh((h)->compatible_flags), HEADER_COMPATIBLE_SEALED)
 
+#define JOURNAL_HEADER_BLOOM_FILTER(h) \
+        FLAGS_SET(le32toh((h)->compatible_flags), HEADER_COMPATIBLE_BLOOM_FILTER)
+
 #define JOURNAL_HEADER_COMPRESSED_XZ(h) \
         FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_COMPRESSED_XZ)
 
@@ -203,10 +235,62 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_KEYED_HASH(h) \
         FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_KEYED_HASH)
 
+#define JOURNAL_HEADER_GROWABLE_HASH_TABLE(h) \
+        FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_GROWABLE_HASH_TABLE)
+
+#define JOURNAL_HEADER_FAST_KEYED_HASH(h) \
+        FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_FAST_KEYED_HASH)
+
+#define JOURNAL_HEADER_COMPACT(h) \
+        FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_COMPACT)
+
+#define JOURNAL_HEADER_ZSTD_DICTIONARY(h) \
+        FLAGS_SET(le32toh((h)->incompatible_flags), HEADER_INCOMPATIBLE_ZSTD_DICTIONARY)
+
+/* Compact files store 32bit offsets, hence must not grow beyond 4G */
+#define JOURNAL_COMPACT_SIZE_MAX ((uint64_t) UINT32_MAX)
+
+static inline size_t journal_file_entry_item_size(JournalFile *f) {
+        assert(f);
+
+        return JOURNAL_HEADER_COMPACT(f->header) ?
+                sizeof_field(Object, entry.items.compact[0]) :
+                sizeof_field(Object, entry.items.regular[0]);
+}
+
+static inline size_t journal_file_entry_array_item_size(JournalFile *f) {
+        assert(f);
+
+        return JOURNAL_HEADER_COMPACT(f->header) ?
+                sizeof_field(Object, entry_array.items.compact[0]) :
+                sizeof_field(Object, entry_array.items.regular[0]);
+}
+
+static inline uint64_t journal_file_entry_item_object_offset(JournalFile *f, Object *o, uint64_t i) {
+        assert(f);
+        assert(o);
+
+        return JOURNAL_HEADER_COMPACT(f->header) ?
+                le32toh(o->entry.items.compact[i].object_offset) :
+                le64toh(o->entry.items.regular[i].object_offset);
+}
+
+static inline uint64_t journal_file_entry_array_item(JournalFile *f, Object *o, uint64_t i) {
+        assert(f);
+        assert(o);
+
+        return JOURNAL_HEADER_COMPACT(f->header) ?
+                le32toh(o->entry_array.items.compact[i]) :
+                le64toh(o->entry_array.items.regular[i]);
+}
+
 int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset, Object **ret);
 
-uint64_t journal_file_entry_n_items(Object *o) _pure_;
-uint64_t journal_file_entry_array_n_items(Object *o) _pure_;
+int journal_file_bloom_filter_may_contain(JournalFile *f, uint64_t hash);
+int journal_file_get_dictionary(JournalFile *f, CompressDictionary **ret);
+
+uint64_t journal_file_entry_n_items(JournalFile *f, Object *o) _pure_;
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) _pure_;
 uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
 
 int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, Object **ret, uint64_t *offset);
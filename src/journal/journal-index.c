@@ -0,0 +1,600 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "journal-index.h"
+#include "log.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tmpfile-util.h"
+#include "xattr-util.h"
+
+/* One line per archived file, with whitespace separated fields in this order. Readers ignore fields they
+ * don't know about, so that new ones may be appended later on. Lines are only ever appended, later ones
+ * taking precedence, and a line consisting of REMOVED_MARKER and a file name drops what earlier lines said
+ * about that file. Whoever reads the whole file anyway may replace it with a compacted version. */
+enum {
+        FIELD_FILENAME,
+        FIELD_INODE,
+        FIELD_SIZE,
+        FIELD_N_ENTRIES,
+        FIELD_FILE_ID,
+        FIELD_MACHINE_ID,
+        FIELD_SEQNUM_ID,
+        FIELD_HEAD_SEQNUM,
+        FIELD_TAIL_SEQNUM,
+        FIELD_HEAD_REALTIME,
+        FIELD_TAIL_REALTIME,
+        FIELD_HEAD_BOOT_ID,
+        FIELD_HEAD_MONOTONIC,
+        FIELD_TAIL_BOOT_ID,
+        FIELD_TAIL_MONOTONIC,
+        _FIELD_MAX,
+};
+
+#define REMOVED_MARKER "-"
+
+/* Archived and disposed files are named like this, see journal_file_archive() and journal_file_dispose() */
+#define ARCHIVED_SUFFIX_LEN (1 + 32 + 1 + 16 + 1 + 16 + STRLEN(".journal"))
+#define DISPOSED_SUFFIX_LEN (1 + 16 + 1 + 16 + STRLEN(".journal~"))
+
+/* How often adding a file to an index failed in this process, see journal_index_get_add_failures() */
+static uint64_t n_add_failures = 0;
+
+JournalIndexEntry* journal_index_entry_free(JournalIndexEntry *e) {
+        if (!e)
+                return NULL;
+
+        free(e->filename);
+        return mfree(e);
+}
+
+DEFINE_PRIVATE_HASH_OPS_WITH_VALUE_DESTRUCTOR(journal_index_hash_ops, char, string_hash_func, string_compare_func,
+                                              JournalIndexEntry, journal_index_entry_free);
+
+static bool same_seqnum_source(const JournalIndexEntry *e, const sd_id128_t *seqnum_id) {
+        return seqnum_id && sd_id128_equal(e->seqnum_id, *seqnum_id);
+}
+
+bool journal_index_entry_before(const JournalIndexEntry *e, const sd_id128_t *seqnum_id, uint64_t seqnum, uint64_t realtime) {
+        assert(e);
+
+        /* Returns true if all entries of the file are ordered before the specified location. Like
+         * journal_file_compare_locations() we prefer sequence numbers if they come from the same source. */
+
+        if (e->n_entries == 0)
+                return true;
+
+        if (same_seqnum_source(e, seqnum_id))
+                return e->tail_seqnum < seqnum;
+
+        return e->tail_realtime < realtime;
+}
+
+bool journal_index_entry_after(const JournalIndexEntry *e, const sd_id128_t *seqnum_id, uint64_t seqnum, uint64_t realtime) {
+        assert(e);
+
+        if (e->n_entries == 0)
+                return true;
+
+        if (same_seqnum_source(e, seqnum_id))
+                return e->head_seqnum > seqnum;
+
+        return e->head_realtime > realtime;
+}
+
+static bool filename_is_archived_journal(const char *fn) {
+        size_t l;
+
+        l = strlen(fn);
+        return filename_is_valid(fn) &&
+                endswith(fn, ".journal") &&
+                l > ARCHIVED_SUFFIX_LEN &&
+                fn[l - ARCHIVED_SUFFIX_LEN] == '@';
+}
+
+static bool filename_is_disposed_journal(const char *fn) {
+        size_t l;
+
+        l = strlen(fn);
+        return filename_is_valid(fn) &&
+                endswith(fn, ".journal~") &&
+                l > DISPOSED_SUFFIX_LEN &&
+                fn[l - DISPOSED_SUFFIX_LEN] == '@';
+}
+
+static bool filename_is_indexed_journal(const char *fn) {
+        return filename_is_archived_journal(fn) || filename_is_disposed_journal(fn);
+}
+
+bool journal_index_entry_is_disposed(const JournalIndexEntry *e) {
+        assert(e);
+
+        return endswith(e->filename, ".journal~");
+}
+
+static int journal_index_entry_parse(const char *line, char **ret_removed, JournalIndexEntry **ret) {
+        _cleanup_(journal_index_entry_freep) JournalIndexEntry *e = NULL;
+        _cleanup_strv_free_ char **fields = NULL;
+        uint64_t *numbers[_FIELD_MAX] = {};
+        sd_id128_t *ids[_FIELD_MAX] = {};
+        unsigned i;
+        int r;
+
+        assert(line);
+        assert(ret_removed);
+        assert(ret);
+
+        fields = strv_split(line, WHITESPACE);
+        if (!fields)
+                return -ENOMEM;
+
+        if (strv_length(fields) == 2 && streq(fields[0], REMOVED_MARKER)) {
+                if (!filename_is_indexed_journal(fields[1]))
+                        return -EBADMSG;
+
+                *ret_removed = TAKE_PTR(fields[1]);
+                *ret = NULL;
+                return 0;
+        }
+
+        if (strv_length(fields) < _FIELD_MAX)
+                return -EBADMSG;
+
+        if (!filename_is_indexed_journal(fields[FIELD_FILENAME]))
+                return -EBADMSG;
+
+        e = new0(JournalIndexEntry, 1);
+        if (!e)
+                return -ENOMEM;
+
+        numbers[FIELD_INODE] = &e->inode;
+        numbers[FIELD_SIZE] = &e->size;
+        numbers[FIELD_N_ENTRIES] = &e->n_entries;
+        numbers[FIELD_HEAD_SEQNUM] = &e->head_seqnum;
+        numbers[FIELD_TAIL_SEQNUM] = &e->tail_seqnum;
+        numbers[FIELD_HEAD_REALTIME] = &e->head_realtime;
+        numbers[FIELD_TAIL_REALTIME] = &e->tail_realtime;
+        numbers[FIELD_HEAD_MONOTONIC] = &e->head_monotonic;
+        numbers[FIELD_TAIL_MONOTONIC] = &e->tail_monotonic;
+        ids[FIELD_FILE_ID] = &e->file_id;
+        ids[FIELD_MACHINE_ID] = &e->machine_id;
+        ids[FIELD_SEQNUM_ID] = &e->seqnum_id;
+        ids[FIELD_HEAD_BOOT_ID] = &e->head_boot_id;
+        ids[FIELD_TAIL_BOOT_ID] = &e->tail_boot_id;
+
+        for (i = 0; i < _FIELD_MAX; i++) {
+                if (numbers[i])
+                        r = safe_atou64(fields[i], numbers[i]);
+                else if (ids[i])
+                        r = sd_id128_from_string(fields[i], ids[i]);
+                else
+                        continue;
+                if (r < 0)
+                        return r;
+        }
+
+        e->filename = TAKE_PTR(fields[FIELD_FILENAME]);
+
+        *ret_removed = NULL;
+        *ret = TAKE_PTR(e);
+        return 0;
+}
+
+int journal_index_parse(FILE *f, JournalIndexHandler handler, void *userdata) {
+        unsigned line = 0;
+        int r;
+
+        assert(f);
+        assert(handler);
+
+        /* Parses index lines from the current position up to the end, and passes each valid one to the
+         * handler, which may take the entry. For lines that remove a file the entry is NULL. */
+
+        for (;;) {
+                _cleanup_(journal_index_entry_freep) JournalIndexEntry *e = NULL;
+                _cleanup_free_ char *l = NULL, *removed = NULL;
+
+                r = read_line(f, LONG_LINE_MAX, &l);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return 0;
+
+                line++;
+
+                if (IN_SET(l[0], 0, '#'))
+                        continue;
+
+                r = journal_index_entry_parse(l, &removed, &e);
+                if (r == -ENOMEM)
+                        return r;
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to parse line %u of journal index, ignoring: %m", line);
+                        continue;
+                }
+
+                r = handler(e ? e->filename : removed, &e, userdata);
+                if (r < 0)
+                        return r;
+        }
+}
+
+static int journal_index_load_one(const char *filename, JournalIndexEntry **e, void *userdata) {
+        Hashmap *index = userdata;
+        int r;
+
+        assert(filename);
+        assert(e);
+
+        journal_index_entry_free(hashmap_remove(index, filename));
+
+        if (!*e)
+                return 0;
+
+        r = hashmap_put(index, (*e)->filename, *e);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(*e);
+        return 0;
+}
+
+int journal_index_new(Hashmap **ret) {
+        Hashmap *index;
+
+        assert(ret);
+
+        index = hashmap_new(&journal_index_hash_ops);
+        if (!index)
+                return -ENOMEM;
+
+        *ret = index;
+        return 0;
+}
+
+int journal_index_load(int dir_fd, Hashmap **ret) {
+        _cleanup_hashmap_free_ Hashmap *index = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        int r;
+
+        assert(dir_fd >= 0);
+        assert(ret);
+
+        r = xfopenat(dir_fd, JOURNAL_INDEX_FILENAME, "re", O_NOFOLLOW, &f);
+        if (r < 0)
+                return r;
+
+        r = journal_index_new(&index);
+        if (r < 0)
+                return r;
+
+        r = journal_index_parse(f, journal_index_load_one, index);
+        if (r < 0)
+                return r;
+
+        *ret = TAKE_PTR(index);
+        return 0;
+}
+
+static void journal_index_entry_write(FILE *f, const JournalIndexEntry *e) {
+        assert(f);
+        assert(e);
+
+        fprintf(f,
+                "%s %"PRIu64" %"PRIu64" %"PRIu64" %s %s %s %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %s %"PRIu64" %s %"PRIu64"\n",
+                e->filename, e->inode, e->size, e->n_entries,
+                SD_ID128_CONST_STR(e->file_id), SD_ID128_CONST_STR(e->machine_id), SD_ID128_CONST_STR(e->seqnum_id),
+                e->head_seqnum, e->tail_seqnum, e->head_realtime, e->tail_realtime,
+                SD_ID128_CONST_STR(e->head_boot_id), e->head_monotonic,
+                SD_ID128_CONST_STR(e->tail_boot_id), e->tail_monotonic);
+}
+
+int journal_index_save(const char *directory, Hashmap *index, struct stat *ret_st) {
+        _cleanup_free_ char *p = NULL, *temp_path = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        JournalIndexEntry *e;
+        Iterator i;
+        int r;
+
+        assert(directory);
+
+        /* If ret_st is non-NULL, it is set to what the written file looked like before it was put in place,
+         * so that the caller can tell whether it has been appended to since. */
+
+        p = path_join(directory, JOURNAL_INDEX_FILENAME);
+        if (!p)
+                return -ENOMEM;
+
+        if (hashmap_isempty(index)) {
+                if (unlink(p) < 0 && errno != ENOENT)
+                        return -errno;
+
+                if (ret_st)
+                        *ret_st = (struct stat) {};
+                return 0;
+        }
+
+        /* Several processes might vacuum the same directory, hence always replace the index atomically. If
+         * an update gets lost on the way, readers fall back to looking at the files themselves. */
+        r = fopen_temporary(p, &f, &temp_path);
+        if (r < 0)
+                return r;
+
+        /* Same access mode as the journal files themselves */
+        (void) fchmod(fileno(f), 0640);
+
+        fputs("# This file is generated by systemd-journald, do not edit.\n", f);
+
+        HASHMAP_FOREACH(e, index, i)
+                journal_index_entry_write(f, e);
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto fail;
+
+        if (ret_st && fstat(fileno(f), ret_st) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (rename(temp_path, p) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        temp_path = mfree(temp_path);
+        return 0;
+
+fail:
+        (void) unlink(temp_path);
+        return r;
+}
+
+static int journal_index_open_append(int dir_fd, FILE **ret) {
+        _cleanup_close_ int fd = -1;
+        FILE *f;
+
+        assert(dir_fd >= 0);
+        assert(ret);
+
+        fd = openat(dir_fd, JOURNAL_INDEX_FILENAME, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0640);
+        if (fd < 0)
+                return -errno;
+
+        f = take_fdopen(&fd, "a");
+        if (!f)
+                return -errno;
+
+        *ret = f;
+        return 0;
+}
+
+int journal_index_remove_files(int dir_fd, char **filenames) {
+        _cleanup_fclose_ FILE *f = NULL;
+        char **fn;
+        int r;
+
+        assert(dir_fd >= 0);
+
+        /* Records that the specified archived files are gone, without rewriting the index */
+
+        if (strv_isempty(filenames))
+                return 0;
+
+        r = journal_index_open_append(dir_fd, &f);
+        if (r < 0)
+                return r;
+
+        STRV_FOREACH(fn, filenames) {
+                fprintf(f, REMOVED_MARKER " %s\n", *fn);
+
+                r = fflush_and_check(f);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int journal_index_append(int dir_fd, const JournalIndexEntry *e) {
+        _cleanup_fclose_ FILE *index = NULL;
+        int r;
+
+        assert(dir_fd >= 0);
+        assert(e);
+
+        r = journal_index_open_append(dir_fd, &index);
+        if (r < 0)
+                return r;
+
+        /* Lines are much shorter than the stdio buffer, hence each goes out with a single write() and
+         * concurrent writers don't interleave */
+        journal_index_entry_write(index, e);
+
+        return fflush_and_check(index);
+}
+
+static int journal_index_add_archived(JournalFile *f, const char *path) {
+        _cleanup_(journal_index_entry_freep) JournalIndexEntry *e = NULL;
+        _cleanup_free_ char *directory = NULL;
+        _cleanup_close_ int dir_fd = -1;
+        struct stat st;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(path);
+
+        /* Adds the specified file, which must have been archived to the specified path already, to the index
+         * of its directory */
+
+        if (!filename_is_archived_journal(basename(path)))
+                return -EINVAL;
+
+        if (fstat(f->fd, &st) < 0)
+                return -errno;
+
+        e = new(JournalIndexEntry, 1);
+        if (!e)
+                return -ENOMEM;
+
+        *e = (JournalIndexEntry) {
+                .inode = st.st_ino,
+                .size = 512UL * (uint64_t) st.st_blocks,
+                .n_entries = le64toh(f->header->n_entries),
+                .file_id = f->header->file_id,
+                .machine_id = f->header->machine_id,
+                .seqnum_id = f->header->seqnum_id,
+                .head_seqnum = le64toh(f->header->head_entry_seqnum),
+                .tail_seqnum = le64toh(f->header->tail_entry_seqnum),
+                .head_realtime = le64toh(f->header->head_entry_realtime),
+                .tail_realtime = le64toh(f->header->tail_entry_realtime),
+        };
+
+        /* The header only knows the boot ID of the last writer, look at the entries themselves */
+        if (e->n_entries > 0) {
+                r = journal_file_next_entry(f, 0, DIRECTION_DOWN, &o, NULL);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        e->head_boot_id = o->entry.boot_id;
+                        e->head_monotonic = le64toh(o->entry.monotonic);
+                }
+
+                r = journal_file_next_entry(f, 0, DIRECTION_UP, &o, NULL);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        e->tail_boot_id = o->entry.boot_id;
+                        e->tail_monotonic = le64toh(o->entry.monotonic);
+                }
+        }
+
+        e->filename = strdup(basename(path));
+        if (!e->filename)
+                return -ENOMEM;
+
+        directory = dirname_malloc(path);
+        if (!directory)
+                return -ENOMEM;
+
+        /* Appending keeps this cheap however many files the index knows about, and lets whoever keeps the
+         * index in memory pick up just the new line, see journal_directory_vacuum_cached(). */
+        dir_fd = open(directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dir_fd < 0)
+                return -errno;
+
+        return journal_index_append(dir_fd, e);
+}
+
+int journal_index_add_file(JournalFile *f, const char *path) {
+        int r;
+
+        r = journal_index_add_archived(f, path);
+        if (r < 0)
+                (void) __sync_fetch_and_add(&n_add_failures, 1);
+
+        return r;
+}
+
+static int journal_index_add_disposed(int dir_fd, const char *path) {
+        _cleanup_(journal_index_entry_freep) JournalIndexEntry *e = NULL;
+        _cleanup_close_ int fd = -1, parent_fd = -1;
+        unsigned long long realtime, tmp;
+        _cleanup_free_ char *directory = NULL;
+        le64_t n_entries = 0;
+        const char *fn;
+        usec_t crtime;
+        struct stat st;
+        ssize_t n;
+
+        assert(path);
+
+        fn = basename(path);
+        if (!filename_is_disposed_journal(fn))
+                return -EINVAL;
+
+        if (sscanf(fn + strlen(fn) - DISPOSED_SUFFIX_LEN + 1, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                return -EINVAL;
+
+        if (fn != path) {
+                directory = dirname_malloc(path);
+                if (!directory)
+                        return -ENOMEM;
+
+                parent_fd = openat(dir_fd, directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (parent_fd < 0)
+                        return -errno;
+
+                dir_fd = parent_fd;
+        } else if (dir_fd == AT_FDCWD) {
+                parent_fd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (parent_fd < 0)
+                        return -errno;
+
+                dir_fd = parent_fd;
+        }
+
+        /* Nothing the file says about itself can be trusted anymore, hence only record what vacuuming needs
+         * to know, the same way it would find out by looking at the file */
+        fd = openat(dir_fd, fn, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (st.st_size >= (off_t) sizeof(Header)) {
+                n = pread(fd, &n_entries, sizeof(n_entries), offsetof(Header, n_entries));
+                if (n < 0)
+                        return -errno;
+                if (n != sizeof(n_entries))
+                        return -EIO;
+        }
+
+        /* The file was most likely written to for a while before it was disposed of */
+        if (le64toh(n_entries) > 0 && fd_getcrtime(fd, &crtime) >= 0 && crtime < realtime)
+                realtime = crtime;
+
+        e = new(JournalIndexEntry, 1);
+        if (!e)
+                return -ENOMEM;
+
+        *e = (JournalIndexEntry) {
+                .filename = strdup(fn),
+                .inode = st.st_ino,
+                .size = 512UL * (uint64_t) st.st_blocks,
+                .n_entries = le64toh(n_entries),
+                .head_realtime = realtime,
+                .tail_realtime = realtime,
+        };
+        if (!e->filename)
+                return -ENOMEM;
+
+        return journal_index_append(dir_fd, e);
+}
+
+int journal_index_add_disposed_file(int dir_fd, const char *path) {
+        int r;
+
+        r = journal_index_add_disposed(dir_fd, path);
+        if (r < 0)
+                (void) __sync_fetch_and_add(&n_add_failures, 1);
+
+        return r;
+}
+
+uint64_t journal_index_get_add_failures(void) {
+        return __sync_fetch_and_add(&n_add_failures, 0);
+}
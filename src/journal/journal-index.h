@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "sd-id128.h"
+
+#include "hashmap.h"
+#include "journal-file.h"
+
+/* Every journal directory may carry a small index describing the archived journal files in it, so that
+ * readers can tell which files they need before opening any of them, and vacuuming doesn't have to look at
+ * each file. Archived files never change, hence entries never go stale, they only go away together with
+ * the file. Files disposed of as corrupted are listed too, but only with what vacuuming needs, readers
+ * must not rely on anything else said about them. The index is purely an optimization: files it doesn't
+ * know about are simply looked at as before. */
+
+#define JOURNAL_INDEX_FILENAME ".journal-index"
+
+typedef struct JournalIndexEntry {
+        char *filename;
+        uint64_t inode;
+        uint64_t size;          /* allocated bytes, like st_blocks * 512 */
+        uint64_t n_entries;
+
+        sd_id128_t file_id;
+        sd_id128_t machine_id;
+        sd_id128_t seqnum_id;
+
+        uint64_t head_seqnum;
+        uint64_t tail_seqnum;
+        uint64_t head_realtime;
+        uint64_t tail_realtime;
+
+        sd_id128_t head_boot_id;
+        uint64_t head_monotonic;
+        sd_id128_t tail_boot_id;
+        uint64_t tail_monotonic;
+} JournalIndexEntry;
+
+JournalIndexEntry* journal_index_entry_free(JournalIndexEntry *e);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalIndexEntry*, journal_index_entry_free);
+
+bool journal_index_entry_is_disposed(const JournalIndexEntry *e);
+bool journal_index_entry_before(const JournalIndexEntry *e, const sd_id128_t *seqnum_id, uint64_t seqnum, uint64_t realtime);
+bool journal_index_entry_after(const JournalIndexEntry *e, const sd_id128_t *seqnum_id, uint64_t seqnum, uint64_t realtime);
+
+/* Called for each line of the index with the entry it describes, or NULL if it removes the file. The handler
+ * may take ownership of the entry. */
+typedef int (*JournalIndexHandler)(const char *filename, JournalIndexEntry **e, void *userdata);
+
+int journal_index_new(Hashmap **ret);
+int journal_index_parse(FILE *f, JournalIndexHandler handler, void *userdata);
+int journal_index_load(int dir_fd, Hashmap **ret);
+int journal_index_save(const char *directory, Hashmap *index, struct stat *ret_st);
+
+int journal_index_add_file(JournalFile *f, const char *path);
+int journal_index_add_disposed_file(int dir_fd, const char *path);
+uint64_t journal_index_get_add_failures(void);
+int journal_index_remove_files(int dir_fd, char **filenames);
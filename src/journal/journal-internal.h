@@ -11,12 +11,15 @@
 #include "hashmap.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "list.h"
+#include "prioq.h"
 #include "set.h"
 
 typedef struct Match Match;
 typedef struct Location Location;
 typedef struct Directory Directory;
+typedef struct DeferredFile DeferredFile;
 
 typedef enum MatchType {
         MATCH_DISCRETE,
@@ -64,6 +67,13 @@ struct Directory {
         unsigned last_seen_generation;
 };
 
+/* An archived file we know about from the index of its directory, but didn't need to open yet */
+struct DeferredFile {
+        char *path;
+        JournalIndexEntry entry;
+        unsigned last_seen_generation;
+};
+
 struct sd_journal {
         int toplevel_fd;
 
@@ -73,6 +83,7 @@ struct sd_journal {
 
         OrderedHashmap *files;
         IteratedCache *files_cache;
+        Hashmap *deferred_files;
         MMapCache *mmap;
 
         Location current_location;
@@ -80,6 +91,10 @@ struct sd_journal {
         JournalFile *current_file;
         uint64_t current_field;
 
+        /* Files that are positioned on their next candidate entry, ordered by that entry */
+        Prioq *files_prioq;
+        direction_t files_prioq_direction;
+
         Match *level0, *level1, *level2;
 
         pid_t original_pid;
@@ -113,6 +128,8 @@ struct sd_journal {
         bool fields_file_lost:1;
         bool has_runtime_files:1;
         bool has_persistent_files:1;
+        bool use_index:1;
+        bool deferred_files_dirty:1;
 
         size_t data_threshold;
 
@@ -122,6 +139,9 @@ struct sd_journal {
         Hashmap *errors;
 };
 
+int journal_open_deferred_files(sd_journal *j);
+bool journal_has_files(sd_journal *j);
+
 char *journal_make_match_string(sd_journal *j);
 void journal_print_header(sd_journal *j);
 
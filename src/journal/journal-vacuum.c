@@ -9,16 +9,25 @@
 #include "alloc-util.h"
 #include "dirent-util.h"
 #include "fd-util.h"
+#include "fileio.h"
 #include "format-util.h"
 #include "fs-util.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "journal-vacuum.h"
-#include "sort-util.h"
+#include "prioq.h"
+#include "set.h"
 #include "string-util.h"
+#include "strv.h"
 #include "time-util.h"
 #include "xattr-util.h"
 
+/* Don't trust the state for longer than this. Whatever happened behind our back that the index doesn't tell
+ * about, e.g. files removed or put there by other tools, is picked up by looking at the whole directory
+ * again. */
+#define VACUUM_RESCAN_USEC (1*USEC_PER_HOUR)
+
 struct vacuum_info {
         uint64_t usage;
         char *filename;
@@ -28,11 +37,41 @@ struct vacuum_info {
         sd_id128_t seqnum_id;
         uint64_t seqnum;
         bool have_seqnum;
+
+        /* Empty files are always vacuumed */
+        bool empty;
+
+        unsigned prioq_idx;
+};
+
+/* What we know about a directory, so that vacuuming it again doesn't need to look at all files again. The
+ * archived files are ordered by age in a priority queue, so that vacuuming is only as expensive as the number
+ * of files it deletes. Files archived in the meantime are picked up from the end of the index, which is only
+ * ever appended to. */
+struct JournalVacuumState {
+        Prioq *queue;
+        Hashmap *files;
+        uint64_t sum;
+        uint64_t n_active_files;
+
+        /* What the index says, and how far we read it */
+        Hashmap *index;
+        ino_t index_inode;
+        off_t index_offset;
+        unsigned n_index_lines;
+        bool index_dirty;
+        uint64_t index_add_failures;
+
+        usec_t timestamp;
 };
 
 static int vacuum_compare(const struct vacuum_info *a, const struct vacuum_info *b) {
         int r;
 
+        r = CMP(!a->empty, !b->empty);
+        if (r != 0)
+                return r;
+
         if (a->have_seqnum && b->have_seqnum &&
             sd_id128_equal(a->seqnum_id, b->seqnum_id))
                 return CMP(a->seqnum, b->seqnum);
@@ -118,37 +157,278 @@ static int journal_file_empty(int dir_fd, const char *name) {
         return le64toh(n_entries) <= 0;
 }
 
-int journal_directory_vacuum(
-                const char *directory,
-                uint64_t max_use,
-                uint64_t n_max_files,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec,
-                bool verbose) {
 
-        uint64_t sum = 0, freed = 0, n_active_files = 0;
-        size_t n_list = 0, n_allocated = 0, i;
-        _cleanup_closedir_ DIR *d = NULL;
-        struct vacuum_info *list = NULL;
-        usec_t retention_limit = 0;
-        char sbytes[FORMAT_BYTES_MAX];
-        struct dirent *de;
+static struct vacuum_info* vacuum_info_free(struct vacuum_info *i) {
+        if (!i)
+                return NULL;
+
+        free(i->filename);
+        return mfree(i);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct vacuum_info*, vacuum_info_free);
+
+static int vacuum_info_compare_func(const void *a, const void *b) {
+        return vacuum_compare(a, b);
+}
+
+static void vacuum_state_remove(JournalVacuumState *s, struct vacuum_info *i) {
+        assert(s);
+        assert(i);
+
+        prioq_remove(s->queue, i, &i->prioq_idx);
+        hashmap_remove(s->files, i->filename);
+
+        if (i->usage < s->sum)
+                s->sum -= i->usage;
+        else
+                s->sum = 0;
+
+        vacuum_info_free(i);
+}
+
+static int vacuum_state_add(JournalVacuumState *s, struct vacuum_info *i) {
+        struct vacuum_info *old;
         int r;
 
-        assert(directory);
+        assert(s);
+        assert(i);
 
-        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+        /* Takes ownership of i on success */
+
+        old = hashmap_get(s->files, i->filename);
+        if (old)
+                vacuum_state_remove(s, old);
+
+        r = hashmap_ensure_allocated(&s->files, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = prioq_ensure_allocated(&s->queue, vacuum_info_compare_func);
+        if (r < 0)
+                return r;
+
+        r = hashmap_put(s->files, i->filename, i);
+        if (r < 0)
+                return r;
+
+        r = prioq_put(s->queue, i, &i->prioq_idx);
+        if (r < 0) {
+                hashmap_remove(s->files, i->filename);
+                return r;
+        }
+
+        s->sum += i->usage;
+        return 0;
+}
+
+static int vacuum_state_add_index_entry(JournalVacuumState *s, const JournalIndexEntry *e) {
+        _cleanup_(vacuum_info_freep) struct vacuum_info *i = NULL;
+        int r;
+
+        assert(s);
+        assert(e);
+
+        i = new(struct vacuum_info, 1);
+        if (!i)
+                return -ENOMEM;
+
+        /* Archived files are named after their first entry, hence this is what we'd get from the name.
+         * Disposed files aren't, and there's nothing to trust in them beyond the time. */
+        *i = (struct vacuum_info) {
+                .filename = strdup(e->filename),
+                .usage = e->size,
+                .realtime = e->head_realtime,
+                .seqnum_id = e->seqnum_id,
+                .seqnum = e->head_seqnum,
+                .have_seqnum = !journal_index_entry_is_disposed(e),
+                .empty = e->n_entries <= 0,
+                .prioq_idx = PRIOQ_IDX_NULL,
+        };
+        if (!i->filename)
+                return -ENOMEM;
+
+        r = vacuum_state_add(s, i);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(i);
+        return 0;
+}
+
+static void vacuum_state_reset(JournalVacuumState *s) {
+        struct vacuum_info *i;
+
+        assert(s);
+
+        while ((i = prioq_peek(s->queue)))
+                vacuum_state_remove(s, i);
+
+        s->index = hashmap_free(s->index);
+
+        s->sum = 0;
+        s->n_active_files = 0;
+        s->index_inode = 0;
+        s->index_offset = 0;
+        s->n_index_lines = 0;
+        s->index_dirty = false;
+        s->timestamp = 0;
+}
+
+JournalVacuumState* journal_vacuum_state_free(JournalVacuumState *s) {
+        if (!s)
+                return NULL;
+
+        vacuum_state_reset(s);
+
+        prioq_free(s->queue);
+        hashmap_free(s->files);
+
+        return mfree(s);
+}
+
+static int vacuum_index_handler(const char *filename, JournalIndexEntry **e, void *userdata) {
+        JournalVacuumState *s = userdata;
+        struct vacuum_info *i;
+        int r;
+
+        assert(filename);
+        assert(e);
+        assert(s);
+
+        s->n_index_lines++;
+
+        journal_index_entry_free(hashmap_remove(s->index, filename));
+
+        /* Once we know the directory, files archived or removed by somebody else since are taken into
+         * account right away */
+        if (s->timestamp > 0) {
+                i = hashmap_get(s->files, filename);
+                if (i)
+                        vacuum_state_remove(s, i);
+
+                if (*e) {
+                        r = vacuum_state_add_index_entry(s, *e);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        if (!*e)
                 return 0;
 
-        if (max_retention_usec > 0)
-                retention_limit = usec_sub_unsigned(now(CLOCK_REALTIME), max_retention_usec);
+        if (!s->index) {
+                r = journal_index_new(&s->index);
+                if (r < 0)
+                        return r;
+        }
 
-        d = opendir(directory);
-        if (!d)
+        r = hashmap_put(s->index, (*e)->filename, *e);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(*e);
+        return 0;
+}
+
+static int vacuum_state_read_index(JournalVacuumState *s, int dir_fd) {
+        _cleanup_fclose_ FILE *f = NULL;
+        struct stat st;
+        off_t offset;
+        int r;
+
+        assert(s);
+        assert(dir_fd >= 0);
+
+        /* Reads whatever was appended to the index since we last looked. Returns -ESTALE if it was replaced
+         * in the meantime, since we can't tell what changed then. */
+
+        r = xfopenat(dir_fd, JOURNAL_INDEX_FILENAME, "re", O_NOFOLLOW, &f);
+        if (r == -ENOENT)
+                return s->index_inode != 0 ? -ESTALE : 0;
+        if (r < 0)
+                return r;
+
+        if (fstat(fileno(f), &st) < 0)
+                return -errno;
+
+        if (s->index_inode != 0 && (st.st_ino != s->index_inode || st.st_size < s->index_offset))
+                return -ESTALE;
+
+        s->index_inode = st.st_ino;
+
+        if (st.st_size == s->index_offset)
+                return 0;
+
+        if (fseeko(f, s->index_offset, SEEK_SET) < 0)
+                return -errno;
+
+        r = journal_index_parse(f, vacuum_index_handler, s);
+        if (r < 0)
+                return r;
+
+        offset = ftello(f);
+        if (offset < 0)
                 return -errno;
 
-        FOREACH_DIRENT_ALL(de, d, r = -errno; goto finish) {
+        s->index_offset = offset;
+        return 0;
+}
+
+static int vacuum_state_write_index(JournalVacuumState *s, int dir_fd, const char *directory, char **removed) {
+        struct stat st;
+        int r;
+
+        assert(s);
+        assert(dir_fd >= 0);
+        assert(directory);
+
+        /* Replace the index once it knows about files that are gone, or mostly consists of lines that don't
+         * matter anymore. Otherwise just note what we removed. */
+
+        if (!s->index_dirty &&
+            s->n_index_lines <= 2 * hashmap_size(s->index) + 64 &&
+            (!hashmap_isempty(s->index) || s->n_index_lines == 0))
+                return journal_index_remove_files(dir_fd, removed);
+
+        r = journal_index_save(directory, s->index, &st);
+        if (r < 0)
+                return r;
+
+        s->index_inode = st.st_ino;
+        s->index_offset = st.st_size;
+        s->n_index_lines = hashmap_size(s->index);
+        s->index_dirty = false;
 
+        return 0;
+}
+
+static int vacuum_state_scan(JournalVacuumState *s, DIR *d, const char *directory) {
+        _cleanup_set_free_ Set *seen = NULL;
+        JournalIndexEntry *e;
+        struct dirent *de;
+        Iterator it;
+        int r;
+
+        assert(s);
+        assert(d);
+        assert(directory);
+
+        vacuum_state_reset(s);
+
+        /* Whatever failed to be added to the index after this is found by looking at the directory again */
+        s->index_add_failures = journal_index_get_add_failures();
+
+        /* The index knows everything we need about archived files, so that we don't have to look at each of
+         * them individually */
+        r = vacuum_state_read_index(s, dirfd(d));
+        if (r < 0) {
+                log_debug_errno(r, "Failed to load journal index of %s, ignoring: %m", directory);
+                s->index_dirty = true;
+        }
+
+        FOREACH_DIRENT_ALL(de, d, return -errno) {
+                _cleanup_(vacuum_info_freep) struct vacuum_info *i = NULL;
                 unsigned long long seqnum = 0, realtime;
                 _cleanup_free_ char *p = NULL;
                 sd_id128_t seqnum_id;
@@ -157,6 +437,25 @@ int journal_directory_vacuum(
                 struct stat st;
                 size_t q;
 
+                e = hashmap_get(s->index, de->d_name);
+                if (e) {
+                        /* Only trust the index if it talks about the very same file */
+                        if (de->d_type == DT_REG && e->inode == de->d_ino) {
+                                r = set_ensure_put(&seen, NULL, e);
+                                if (r < 0)
+                                        return r;
+                        } else
+                                e = NULL;
+                }
+
+                if (e) {
+                        r = vacuum_state_add_index_entry(s, e);
+                        if (r < 0)
+                                return r;
+
+                        continue;
+                }
+
                 if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
                         log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", de->d_name);
                         continue;
@@ -173,31 +472,29 @@ int journal_directory_vacuum(
                          * left around */
 
                         if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8) {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
                         if (de->d_name[q-8-16-1] != '-' ||
                             de->d_name[q-8-16-1-16-1] != '-' ||
                             de->d_name[q-8-16-1-16-1-32-1] != '@') {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
                         p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                        if (!p)
+                                return -ENOMEM;
 
                         de->d_name[q-8-16-1-16-1] = 0;
                         if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
                         if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
@@ -209,24 +506,22 @@ int journal_directory_vacuum(
                         /* Vacuum corrupted files */
 
                         if (q < 1 + 16 + 1 + 16 + 8 + 1) {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
                         if (de->d_name[q-1-8-16-1] != '-' ||
                             de->d_name[q-1-8-16-1-16-1] != '@') {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
                         p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                        if (!p)
+                                return -ENOMEM;
 
                         if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                n_active_files++;
+                                s->n_active_files++;
                                 continue;
                         }
 
@@ -244,78 +539,182 @@ int journal_directory_vacuum(
                         log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", p);
                         continue;
                 }
-                if (r > 0) {
-                        /* Always vacuum empty non-online files. */
-
-                        r = unlinkat_deallocate(dirfd(d), p, 0);
-                        if (r >= 0) {
-
-                                log_full(verbose ? LOG_INFO : LOG_DEBUG,
-                                         "Deleted empty archived journal %s/%s (%s).", directory, p, format_bytes(sbytes, sizeof(sbytes), size));
-
-                                freed += size;
-                        } else if (r != -ENOENT)
-                                log_warning_errno(r, "Failed to delete empty archived journal %s/%s: %m", directory, p);
-
-                        continue;
-                }
-
-                patch_realtime(dirfd(d), p, &st, &realtime);
+                if (r == 0)
+                        patch_realtime(dirfd(d), p, &st, &realtime);
 
-                if (!GREEDY_REALLOC(list, n_allocated, n_list + 1)) {
-                        r = -ENOMEM;
-                        goto finish;
-                }
+                i = new(struct vacuum_info, 1);
+                if (!i)
+                        return -ENOMEM;
 
-                list[n_list++] = (struct vacuum_info) {
+                *i = (struct vacuum_info) {
                         .filename = TAKE_PTR(p),
                         .usage = size,
                         .seqnum = seqnum,
                         .realtime = realtime,
                         .seqnum_id = seqnum_id,
                         .have_seqnum = have_seqnum,
+                        .empty = r > 0,
+                        .prioq_idx = PRIOQ_IDX_NULL,
                 };
 
-                sum += size;
+                r = vacuum_state_add(s, i);
+                if (r < 0)
+                        return r;
+
+                TAKE_PTR(i);
         }
 
-        typesafe_qsort(list, n_list, vacuum_compare);
+        /* Drop whatever the index knows about files that are gone */
+        HASHMAP_FOREACH(e, s->index, it)
+                if (!set_contains(seen, e)) {
+                        journal_index_entry_free(hashmap_remove(s->index, e->filename));
+                        s->index_dirty = true;
+                }
 
-        for (i = 0; i < n_list; i++) {
-                uint64_t left;
+        s->timestamp = now(CLOCK_MONOTONIC);
+        return 0;
+}
 
-                left = n_active_files + n_list - i;
+int journal_directory_vacuum_cached(
+                JournalVacuumState **state,
+                const char *directory,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_strv_free_ char **removed = NULL;
+        _cleanup_closedir_ DIR *d = NULL;
+        char sbytes[FORMAT_BYTES_MAX];
+        usec_t retention_limit = 0;
+        struct vacuum_info *i;
+        JournalVacuumState *s;
+        uint64_t freed = 0;
+        int r;
+
+        assert(state);
+        assert(directory);
+
+        /* Like journal_directory_vacuum(), but keeps what it learnt about the directory in *state, so that
+         * the next call only needs to look at what changed since */
+
+        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+                return 0;
 
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
-                    (max_use <= 0 || sum <= max_use) &&
+        if (max_retention_usec > 0)
+                retention_limit = usec_sub_unsigned(now(CLOCK_REALTIME), max_retention_usec);
+
+        if (!*state) {
+                *state = new0(JournalVacuumState, 1);
+                if (!*state)
+                        return -ENOMEM;
+        }
+        s = *state;
+
+        d = opendir(directory);
+        if (!d) {
+                vacuum_state_reset(s);
+                return -errno;
+        }
+
+        if (s->timestamp > 0 && s->index_add_failures != journal_index_get_add_failures()) {
+                log_debug("Files were archived or disposed of without being added to the journal index, "
+                          "looking at all files of %s.", directory);
+                s->timestamp = 0;
+        }
+
+        if (s->timestamp > 0 && s->timestamp + VACUUM_RESCAN_USEC > now(CLOCK_MONOTONIC)) {
+                r = vacuum_state_read_index(s, dirfd(d));
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to update journal index of %s, looking at all files: %m", directory);
+                        s->timestamp = 0;
+                }
+        } else
+                s->timestamp = 0;
+
+        if (s->timestamp == 0) {
+                r = vacuum_state_scan(s, d, directory);
+                if (r < 0)
+                        goto finish;
+        }
+
+        while ((i = prioq_peek(s->queue))) {
+                uint64_t left, usage;
+                bool empty;
+                int k;
+
+                left = s->n_active_files + prioq_size(s->queue);
+
+                if (!i->empty &&
+                    (max_retention_usec <= 0 || i->realtime >= retention_limit) &&
+                    (max_use <= 0 || s->sum <= max_use) &&
                     (n_max_files <= 0 || left <= n_max_files))
                         break;
 
-                r = unlinkat_deallocate(dirfd(d), list[i].filename, 0);
-                if (r >= 0) {
-                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", directory, list[i].filename, format_bytes(sbytes, sizeof(sbytes), list[i].usage));
-                        freed += list[i].usage;
-
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
-                        else
-                                sum = 0;
+                empty = i->empty;
+                usage = i->usage;
+
+                k = unlinkat_deallocate(dirfd(d), i->filename, 0);
+                if (k >= 0) {
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG,
+                                 "Deleted %sarchived journal %s/%s (%s).", empty ? "empty " : "",
+                                 directory, i->filename, format_bytes(sbytes, sizeof(sbytes), usage));
+                        freed += usage;
+                } else if (k != -ENOENT)
+                        log_warning_errno(k, "Failed to delete %sarchived journal %s/%s: %m", empty ? "empty " : "",
+                                          directory, i->filename);
+
+                if (k >= 0 || k == -ENOENT) {
+                        JournalIndexEntry *e;
+
+                        e = hashmap_remove(s->index, i->filename);
+                        if (e) {
+                                journal_index_entry_free(e);
+
+                                r = strv_extend(&removed, i->filename);
+                                if (r < 0)
+                                        goto finish;
+                        }
+                }
 
-                } else if (r != -ENOENT)
-                        log_warning_errno(r, "Failed to delete archived journal %s/%s: %m", directory, list[i].filename);
+                /* A file we couldn't delete still takes up space, but we don't try again before we look at
+                 * the whole directory the next time */
+                vacuum_state_remove(s, i);
+                if (k < 0 && k != -ENOENT && !empty)
+                        s->sum += usage;
         }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+        i = prioq_peek(s->queue);
+        if (oldest_usec && i && (*oldest_usec == 0 || i->realtime < *oldest_usec))
+                *oldest_usec = i->realtime;
+
+        r = vacuum_state_write_index(s, dirfd(d), directory, removed);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to update journal index of %s, ignoring: %m", directory);
+                s->timestamp = 0;
+        }
 
         r = 0;
 
 finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        if (r < 0)
+                vacuum_state_reset(s);
 
         log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.", format_bytes(sbytes, sizeof(sbytes), freed), directory);
 
         return r;
 }
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_(journal_vacuum_state_freep) JournalVacuumState *s = NULL;
+
+        return journal_directory_vacuum_cached(&s, directory, max_use, n_max_files, max_retention_usec, oldest_usec, verbose);
+}
@@ -4,6 +4,13 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "macro.h"
 #include "time-util.h"
 
+typedef struct JournalVacuumState JournalVacuumState;
+
+JournalVacuumState* journal_vacuum_state_free(JournalVacuumState *s);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalVacuumState*, journal_vacuum_state_free);
+
 int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
+int journal_directory_vacuum_cached(JournalVacuumState **state, const char *directory, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
@@ -1,15 +1,19 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "alloc-util.h"
 #include "compress.h"
+#include "env-util.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "fs-util.h"
+#include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-def.h"
 #include "journal-file.h"
@@ -152,11 +156,18 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 if (compression) {
                         _cleanup_free_ void *b = NULL;
                         size_t alloc = 0, b_size;
+                        CompressDictionary *d;
 
-                        r = decompress_blob(compression,
-                                            o->data.payload,
-                                            le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &alloc, &b_size, 0);
+                        r = journal_file_get_dictionary(f, &d);
+                        if (r < 0) {
+                                error_errno(offset, r, "Failed to load compression dictionary: %m");
+                                return r;
+                        }
+
+                        r = decompress_blob_dict(compression, d,
+                                                 o->data.payload,
+                                                 le64toh(o->object.size) - offsetof(Object, data.payload),
+                                                 &b, &alloc, &b_size, 0);
                         if (r < 0) {
                                 error_errno(offset, r, "%s decompression failed: %m",
                                             object_compressed_to_string(compression));
@@ -207,7 +218,7 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 break;
 
         case OBJECT_ENTRY:
-                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) % sizeof(EntryItem) != 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) % journal_file_entry_item_size(f) != 0) {
                         error(offset,
                               "Bad entry size (<= %zu): %"PRIu64,
                               offsetof(EntryObject, items),
@@ -215,10 +226,10 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem) <= 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) / journal_file_entry_item_size(f) <= 0) {
                         error(offset,
                               "Invalid number items in entry: %"PRIu64,
-                              (le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem));
+                              (le64toh(o->object.size) - offsetof(EntryObject, items)) / journal_file_entry_item_size(f));
                         return -EBADMSG;
                 }
 
@@ -243,13 +254,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_n_items(o); i++) {
-                        if (le64toh(o->entry.items[i].object_offset) == 0 ||
-                            !VALID64(le64toh(o->entry.items[i].object_offset))) {
+                for (i = 0; i < journal_file_entry_n_items(f, o); i++) {
+                        if (journal_file_entry_item_object_offset(f, o, i) == 0 ||
+                            !VALID64(journal_file_entry_item_object_offset(f, o, i))) {
                                 error(offset,
                                       "Invalid entry item (%"PRIu64"/%"PRIu64" offset: "OFSfmt,
-                                      i, journal_file_entry_n_items(o),
-                                      le64toh(o->entry.items[i].object_offset));
+                                      i, journal_file_entry_n_items(f, o),
+                                      journal_file_entry_item_object_offset(f, o, i));
                                 return -EBADMSG;
                         }
                 }
@@ -302,8 +313,8 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 break;
 
         case OBJECT_ENTRY_ARRAY:
-                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % sizeof(le64_t) != 0 ||
-                    (le64toh(o->object.size) - offsetof(EntryArrayObject, items)) / sizeof(le64_t) <= 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % journal_file_entry_array_item_size(f) != 0 ||
+                    (le64toh(o->object.size) - offsetof(EntryArrayObject, items)) / journal_file_entry_array_item_size(f) <= 0) {
                         error(offset,
                               "Invalid object entry array size: %"PRIu64,
                               le64toh(o->object.size));
@@ -317,13 +328,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_array_n_items(o); i++)
-                        if (le64toh(o->entry_array.items[i]) != 0 &&
-                            !VALID64(le64toh(o->entry_array.items[i]))) {
+                for (i = 0; i < journal_file_entry_array_n_items(f, o); i++)
+                        if (journal_file_entry_array_item(f, o, i) != 0 &&
+                            !VALID64(journal_file_entry_array_item(f, o, i))) {
                                 error(offset,
                                       "Invalid object entry array item (%"PRIu64"/%"PRIu64"): "OFSfmt,
-                                      i, journal_file_entry_array_n_items(o),
-                                      le64toh(o->entry_array.items[i]));
+                                      i, journal_file_entry_array_n_items(f, o),
+                                      journal_file_entry_array_item(f, o, i));
                                 return -EBADMSG;
                         }
 
@@ -344,74 +355,199 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                if (le64toh(o->object.size) <= offsetof(BloomFilterObject, bits)) {
+                        error(offset,
+                              "Invalid object bloom filter size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                if (le64toh(o->bloom_filter.n_hashes) <= 0) {
+                        error(offset,
+                              "Invalid object bloom filter n_hashes: %"PRIu64,
+                              le64toh(o->bloom_filter.n_hashes));
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "Invalid object dictionary size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
         return 0;
 }
 
-static int write_uint64(int fd, uint64_t p) {
-        ssize_t k;
+/* The sorted offsets of all objects of one type, as collected in the first pass. There might be a lot of them,
+ * hence they are kept in an unlinked temporary file, which is written in larger chunks and mapped in one piece
+ * for the second pass, so that all threads can look things up in it without going through an MMapCache. */
+typedef struct OffsetArray {
+        int fd;
+        const uint64_t *items;
+        uint64_t n;
+        size_t n_buffered;
+        uint64_t buffer[512];
+} OffsetArray;
 
-        k = write(fd, &p, sizeof(p));
-        if (k < 0)
-                return -errno;
-        if (k != sizeof(p))
-                return -EIO;
+static int offset_array_flush(OffsetArray *a) {
+        size_t n;
+
+        assert(a);
+
+        n = a->n_buffered;
+        a->n_buffered = 0;
+
+        return loop_write(a->fd, a->buffer, n * sizeof(uint64_t), false);
+}
+
+static int offset_array_append(OffsetArray *a, uint64_t p) {
+        int r;
+
+        assert(a);
+
+        if (a->n_buffered >= ELEMENTSOF(a->buffer)) {
+                r = offset_array_flush(a);
+                if (r < 0)
+                        return r;
+        }
+
+        a->buffer[a->n_buffered++] = p;
+        a->n++;
 
         return 0;
 }
 
-static int contains_uint64(MMapCache *m, MMapFileDescriptor *f, uint64_t n, uint64_t p) {
-        uint64_t a, b;
+static int offset_array_map(OffsetArray *a) {
+        void *p;
         int r;
 
-        assert(m);
-        assert(f);
+        assert(a);
 
-        /* Bisection ... */
+        r = offset_array_flush(a);
+        if (r < 0)
+                return r;
 
-        a = 0; b = n;
-        while (a < b) {
-                uint64_t c, *z;
+        if (a->n == 0)
+                return 0;
 
-                c = (a + b) / 2;
+        p = mmap(NULL, a->n * sizeof(uint64_t), PROT_READ, MAP_SHARED, a->fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
 
-                r = mmap_cache_get(m, f, PROT_READ|PROT_WRITE, 0, false, c * sizeof(uint64_t), sizeof(uint64_t), NULL, (void **) &z, NULL);
-                if (r < 0)
-                        return r;
+        a->items = p;
+        return 0;
+}
 
-                if (*z == p)
-                        return 1;
+static void offset_array_done(OffsetArray *a) {
+        assert(a);
 
-                if (a + 1 >= b)
-                        return 0;
+        if (a->items)
+                (void) munmap((void*) a->items, a->n * sizeof(uint64_t));
+
+        a->items = NULL;
+        a->fd = safe_close(a->fd);
+}
+
+static bool offset_array_contains(const OffsetArray *a, uint64_t p) {
+        uint64_t l = 0, h;
+
+        assert(a);
 
-                if (p < *z)
-                        b = c;
+        /* Bisection ... */
+
+        h = a->n;
+        while (l < h) {
+                uint64_t m = l + (h - l) / 2;
+
+                if (a->items[m] == p)
+                        return true;
+
+                if (a->items[m] < p)
+                        l = m + 1;
                 else
-                        a = c;
+                        h = m;
         }
 
-        return 0;
+        return false;
+}
+
+/* Where each entry array object of the main entry array chain is, and the index of its first entry */
+typedef struct EntryArrayLink {
+        uint64_t offset;
+        uint64_t first;
+} EntryArrayLink;
+
+/* The second pass follows the references from every entry of the main entry array and from every bucket of
+ * the data hash table. These are independent of each other, hence they are handed out in chunks to as many
+ * threads as we have, each looking at the file through its own JournalFile object. */
+#define VERIFY_CHUNK 1024U
+#define VERIFY_THREADS_MAX 16U
+
+typedef struct VerifyContext {
+        OffsetArray data, entries, entry_arrays;
+
+        EntryArrayLink *chain;
+        size_t n_chain, n_allocated_chain;
+
+        uint64_t n_entries;
+        uint64_t n_buckets;
+
+        uint64_t next;          /* first work unit of the next chunk, updated atomically */
+        uint64_t done;          /* work units done, updated atomically */
+        int error;              /* the first error any thread ran into, set atomically */
+
+        uint64_t *progress;     /* if set, progress is reported here rather than drawn */
+        bool show_progress;
+        usec_t last_usec;
+} VerifyContext;
+
+static void verify_context_done(VerifyContext *c) {
+        assert(c);
+
+        offset_array_done(&c->data);
+        offset_array_done(&c->entries);
+        offset_array_done(&c->entry_arrays);
+
+        c->chain = mfree(c->chain);
+        c->n_chain = c->n_allocated_chain = 0;
+}
+
+static void verify_progress(VerifyContext *c, uint64_t p) {
+        assert(c);
+
+        if (c->progress)
+                __atomic_store_n(c->progress, p, __ATOMIC_RELAXED);
+
+        if (c->show_progress)
+                draw_progress(p, &c->last_usec);
 }
 
 static int entry_points_to_data(
                 JournalFile *f,
-                MMapFileDescriptor *cache_entry_fd,
-                uint64_t n_entries,
+                VerifyContext *c,
                 uint64_t entry_p,
                 uint64_t data_p) {
 
         int r;
-        uint64_t i, n, a;
+        uint64_t i, n;
+        size_t k;
         Object *o;
         bool found = false;
 
         assert(f);
-        assert(cache_entry_fd);
+        assert(c);
 
-        if (!contains_uint64(f->mmap, cache_entry_fd, n_entries, entry_p)) {
+        if (!offset_array_contains(&c->entries, entry_p)) {
                 error(data_p, "Data object references invalid entry at "OFSfmt, entry_p);
                 return -EBADMSG;
         }
@@ -420,9 +556,9 @@ static int entry_points_to_data(
         if (r < 0)
                 return r;
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++)
-                if (le64toh(o->entry.items[i].object_offset) == data_p) {
+                if (journal_file_entry_item_object_offset(f, o, i) == data_p) {
                         found = true;
                         break;
                 }
@@ -432,25 +568,23 @@ static int entry_points_to_data(
                 return -EBADMSG;
         }
 
-        /* Check if this entry is also in main entry array. Since the
-         * main entry array has already been verified we can rely on
-         * its consistency. */
+        /* Check if this entry is also in main entry array. The chain of the main entry array has already
+         * been verified, hence we can rely on its consistency. */
 
-        i = 0;
-        n = le64toh(f->header->n_entries);
-        a = le64toh(f->header->entry_array_offset);
+        n = c->n_entries;
 
-        while (i < n) {
-                uint64_t m, u;
+        for (k = 0; k < c->n_chain; k++) {
+                uint64_t u;
 
-                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, c->chain[k].offset, &o);
                 if (r < 0)
                         return r;
 
-                m = journal_file_entry_array_n_items(o);
-                u = MIN(n - i, m);
+                u = MIN(n - c->chain[k].first, journal_file_entry_array_n_items(f, o));
+                if (u == 0)
+                        continue;
 
-                if (entry_p <= le64toh(o->entry_array.items[u-1])) {
+                if (entry_p <= journal_file_entry_array_item(f, o, u - 1)) {
                         uint64_t x, y, z;
 
                         x = 0;
@@ -459,13 +593,13 @@ static int entry_points_to_data(
                         while (x < y) {
                                 z = (x + y) / 2;
 
-                                if (le64toh(o->entry_array.items[z]) == entry_p)
+                                if (journal_file_entry_array_item(f, o, z) == entry_p)
                                         return 0;
 
                                 if (x + 1 >= y)
                                         break;
 
-                                if (entry_p < le64toh(o->entry_array.items[z]))
+                                if (entry_p < journal_file_entry_array_item(f, o, z))
                                         y = z;
                                 else
                                         x = z;
@@ -474,9 +608,6 @@ static int entry_points_to_data(
                         error(entry_p, "Entry object doesn't exist in main entry array");
                         return -EBADMSG;
                 }
-
-                i += u;
-                a = le64toh(o->entry_array.next_entry_array_offset);
         }
 
         return 0;
@@ -484,17 +615,15 @@ static int entry_points_to_data(
 
 static int verify_data(
                 JournalFile *f,
-                Object *o, uint64_t p,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays) {
+                VerifyContext *c,
+                Object *o, uint64_t p) {
 
         uint64_t i, n, a, last, q;
         int r;
 
         assert(f);
+        assert(c);
         assert(o);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
 
         n = le64toh(o->data.n_entries);
         a = le64toh(o->data.entry_array_offset);
@@ -512,7 +641,7 @@ static int verify_data(
         assert(o->data.entry_offset);
 
         last = q = le64toh(o->data.entry_offset);
-        r = entry_points_to_data(f, cache_entry_fd, n_entries, q, p);
+        r = entry_points_to_data(f, c, q, p);
         if (r < 0)
                 return r;
 
@@ -525,7 +654,7 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, cache_entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_array_contains(&c->entry_arrays, a)) {
                         error(p, "Invalid array offset "OFSfmt, a);
                         return -EBADMSG;
                 }
@@ -540,17 +669,17 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
 
-                        q = le64toh(o->entry_array.items[j]);
+                        q = journal_file_entry_array_item(f, o, j);
                         if (q <= last) {
                                 error(p, "Data object's entry array not sorted");
                                 return -EBADMSG;
                         }
                         last = q;
 
-                        r = entry_points_to_data(f, cache_entry_fd, n_entries, q, p);
+                        r = entry_points_to_data(f, c, q, p);
                         if (r < 0)
                                 return r;
 
@@ -566,43 +695,30 @@ static int verify_data(
         return 0;
 }
 
-static int verify_hash_table(
-                JournalFile *f,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
-
+static int verify_hash_table_range(JournalFile *f, VerifyContext *c, uint64_t from, uint64_t to) {
         uint64_t i, n;
         int r;
 
         assert(f);
-        assert(cache_data_fd);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
-        assert(last_usec);
-
-        n = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
-        if (n <= 0)
-                return 0;
+        assert(c);
+        assert(from <= to);
+        assert(to <= c->n_buckets);
 
         r = journal_file_map_data_hash_table(f);
         if (r < 0)
                 return log_error_errno(r, "Failed to map data hash table: %m");
 
-        for (i = 0; i < n; i++) {
-                uint64_t last = 0, p;
+        n = c->n_buckets;
 
-                if (show_progress)
-                        draw_progress(0xC000 + scale_progress(0x3FFF, i, n), last_usec);
+        for (i = from; i < to; i++) {
+                uint64_t last = 0, p;
 
                 p = le64toh(f->data_hash_table[i].head_hash_offset);
                 while (p != 0) {
                         Object *o;
                         uint64_t next;
 
-                        if (!contains_uint64(f->mmap, cache_data_fd, n_data, p)) {
+                        if (!offset_array_contains(&c->data, p)) {
                                 error(p, "Invalid data object at hash entry %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
                         }
@@ -622,7 +738,7 @@ static int verify_hash_table(
                                 return -EBADMSG;
                         }
 
-                        r = verify_data(f, o, p, cache_entry_fd, n_entries, cache_entry_array_fd, n_entry_arrays);
+                        r = verify_data(f, c, o, p);
                         if (r < 0)
                                 return r;
 
@@ -644,14 +760,15 @@ static int data_object_in_hash_table(JournalFile *f, uint64_t hash, uint64_t p)
         int r;
         assert(f);
 
-        n = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
-        if (n <= 0)
+        if (le64toh(f->header->data_hash_table_size) <= 0)
                 return 0;
 
         r = journal_file_map_data_hash_table(f);
         if (r < 0)
                 return log_error_errno(r, "Failed to map data hash table: %m");
 
+        n = f->data_hash_table_size / sizeof(HashItem);
+
         h = hash % n;
 
         q = le64toh(f->data_hash_table[h].head_hash_offset);
@@ -673,25 +790,25 @@ static int data_object_in_hash_table(JournalFile *f, uint64_t hash, uint64_t p)
 
 static int verify_entry(
                 JournalFile *f,
-                Object *o, uint64_t p,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data) {
+                VerifyContext *c,
+                Object *o, uint64_t p) {
 
         uint64_t i, n;
         int r;
 
         assert(f);
+        assert(c);
         assert(o);
-        assert(cache_data_fd);
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 uint64_t q, h;
                 Object *u;
 
-                q = le64toh(o->entry.items[i].object_offset);
-                h = le64toh(o->entry.items[i].hash);
+                q = journal_file_entry_item_object_offset(f, o, i);
+                h = JOURNAL_HEADER_COMPACT(f->header) ? 0 : le64toh(o->entry.items.regular[i].hash);
 
-                if (!contains_uint64(f->mmap, cache_data_fd, n_data, q)) {
+                if (!offset_array_contains(&c->data, q)) {
                         error(p, "Invalid data object of entry");
                         return -EBADMSG;
                 }
@@ -700,7 +817,10 @@ static int verify_entry(
                 if (r < 0)
                         return r;
 
-                if (le64toh(u->data.hash) != h) {
+                /* Compact entries don't repeat the hash of their data objects */
+                if (JOURNAL_HEADER_COMPACT(f->header))
+                        h = le64toh(u->data.hash);
+                else if (le64toh(u->data.hash) != h) {
                         error(p, "Hash mismatch for data object of entry");
                         return -EBADMSG;
                 }
@@ -717,38 +837,28 @@ static int verify_entry(
         return 0;
 }
 
-static int verify_entry_array(
-                JournalFile *f,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
-
-        uint64_t i = 0, a, n, last = 0;
+static int verify_entry_array_chain(JournalFile *f, VerifyContext *c) {
+        uint64_t i = 0, a, n;
         int r;
 
         assert(f);
-        assert(cache_data_fd);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
-        assert(last_usec);
+        assert(c);
+
+        /* Follows the main entry array chain once, so that the entries in it can be verified in any order
+         * afterwards. */
 
-        n = le64toh(f->header->n_entries);
+        n = c->n_entries;
         a = le64toh(f->header->entry_array_offset);
         while (i < n) {
-                uint64_t next, m, j;
+                uint64_t next;
                 Object *o;
 
-                if (show_progress)
-                        draw_progress(0x8000 + scale_progress(0x3FFF, i, n), last_usec);
-
                 if (a == 0) {
                         error(a, "Array chain too short at %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, cache_entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_array_contains(&c->entry_arrays, a)) {
                         error(a, "Invalid array %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
@@ -763,18 +873,84 @@ static int verify_entry_array(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
-                for (j = 0; i < n && j < m; i++, j++) {
+                if (!GREEDY_REALLOC(c->chain, c->n_allocated_chain, c->n_chain + 1))
+                        return log_oom();
+
+                c->chain[c->n_chain++] = (EntryArrayLink) {
+                        .offset = a,
+                        .first = i,
+                };
+
+                i += MIN(n - i, journal_file_entry_array_n_items(f, o));
+                a = next;
+        }
+
+        return 0;
+}
+
+static size_t entry_array_link_find(VerifyContext *c, uint64_t i) {
+        size_t l = 0, h;
+
+        assert(c);
+        assert(c->n_chain > 0);
+
+        /* Finds the last link whose first entry is at or before the i-th entry */
+
+        h = c->n_chain;
+        while (h - l > 1) {
+                size_t m = l + (h - l) / 2;
+
+                if (c->chain[m].first <= i)
+                        l = m;
+                else
+                        h = m;
+        }
+
+        return l;
+}
+
+static int verify_entry_array_range(JournalFile *f, VerifyContext *c, uint64_t from, uint64_t to) {
+        uint64_t i, last = 0, n;
+        size_t k;
+        int r;
+
+        assert(f);
+        assert(c);
+        assert(from < to);
+        assert(to <= c->n_entries);
+
+        n = c->n_entries;
+
+        /* Start one early, so that we can tell whether the range is sorted against what comes before it */
+        i = from > 0 ? from - 1 : 0;
+
+        for (k = entry_array_link_find(c, i); i < to && k < c->n_chain; k++) {
+                uint64_t a, m, j;
+                Object *o;
+
+                a = c->chain[k].offset;
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
+                if (r < 0)
+                        return r;
+
+                m = journal_file_entry_array_n_items(f, o);
+                for (j = i - c->chain[k].first; i < to && j < m; i++, j++) {
                         uint64_t p;
 
-                        p = le64toh(o->entry_array.items[j]);
+                        p = journal_file_entry_array_item(f, o, j);
+                        if (i < from) {
+                                last = p;
+                                continue;
+                        }
+
                         if (p <= last) {
                                 error(a, "Entry array not sorted at %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
                         }
                         last = p;
 
-                        if (!contains_uint64(f->mmap, cache_entry_fd, n_entries, p)) {
+                        if (!offset_array_contains(&c->entries, p)) {
                                 error(a, "Invalid array entry at %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
                         }
@@ -783,7 +959,7 @@ static int verify_entry_array(
                         if (r < 0)
                                 return r;
 
-                        r = verify_entry(f, o, p, cache_data_fd, n_data);
+                        r = verify_entry(f, c, o, p);
                         if (r < 0)
                                 return r;
 
@@ -792,29 +968,185 @@ static int verify_entry_array(
                         if (r < 0)
                                 return r;
                 }
+        }
 
-                a = next;
+        return 0;
+}
+
+static int verify_chunks(JournalFile *f, VerifyContext *c, bool show_progress) {
+        uint64_t total;
+        int r;
+
+        assert(f);
+        assert(c);
+
+        total = c->n_entries + c->n_buckets;
+
+        for (;;) {
+                uint64_t from, to, done;
+
+                /* Somebody else found a problem already, no need to look any further */
+                if (__atomic_load_n(&c->error, __ATOMIC_RELAXED) < 0)
+                        return 0;
+
+                from = __sync_fetch_and_add(&c->next, VERIFY_CHUNK);
+                if (from >= total)
+                        return 0;
+
+                to = MIN(from + VERIFY_CHUNK, total);
+
+                r = 0;
+                if (from < c->n_entries)
+                        r = verify_entry_array_range(f, c, from, MIN(to, c->n_entries));
+                if (r >= 0 && to > c->n_entries)
+                        r = verify_hash_table_range(f, c, MAX(from, c->n_entries) - c->n_entries, to - c->n_entries);
+                if (r < 0) {
+                        (void) __sync_bool_compare_and_swap(&c->error, 0, r);
+                        return r;
+                }
+
+                done = __sync_add_and_fetch(&c->done, to - from);
+                if (show_progress)
+                        verify_progress(c, 0x8000 + scale_progress(0x7FFF, done, total));
         }
+}
+
+static int verify_file_open_copy(JournalFile *f, JournalFile **ret) {
+        _cleanup_close_ int fd = -1;
+        int r;
+
+        assert(f);
+        assert(ret);
+
+        /* JournalFile objects, and the MMapCache they might share with others, are not thread-safe. Hence
+         * a thread that wants to look at a file opens its own view of it, with a cache of its own. */
+
+        fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = journal_file_open(fd, f->path, O_RDONLY, 0, false, 0, false, NULL, NULL, NULL, NULL, ret);
+        if (r < 0)
+                return r;
 
+        TAKE_FD(fd);
         return 0;
 }
 
-int journal_file_verify(
+typedef struct VerifyThread {
+        VerifyContext *context;
+        JournalFile *file;
+        pthread_t thread;
+} VerifyThread;
+
+static void *verify_thread(void *arg) {
+        VerifyThread *t = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-verify");
+
+        (void) verify_chunks(t->file, t->context, false);
+
+        return NULL;
+}
+
+static int verify_references(JournalFile *f, VerifyContext *c, unsigned n_threads) {
+        VerifyThread threads[VERIFY_THREADS_MAX - 1];
+        unsigned i, n = 0;
+        sigset_t ss, saved_ss;
+        int r;
+
+        assert(f);
+        assert(c);
+
+        r = verify_entry_array_chain(f, c);
+        if (r < 0)
+                return r;
+
+        if (le64toh(f->header->data_hash_table_size) > 0) {
+                r = journal_file_map_data_hash_table(f);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to map data hash table: %m");
+
+                c->n_buckets = f->data_hash_table_size / sizeof(HashItem);
+        }
+
+        /* Don't bother with threads for small files. Note that the entries and the data hash table are
+         * looked at in parallel, hence we can't rely on all entries being in the main entry array while
+         * looking at the data objects, but if they are not that's detected either way. */
+        n_threads = MIN3(n_threads, VERIFY_THREADS_MAX, DIV_ROUND_UP(c->n_entries + c->n_buckets, 4 * VERIFY_CHUNK));
+
+        if (n_threads > 1) {
+                /* Like the offlining thread, these threads shouldn't handle any signals, except for SIGBUS,
+                 * which the sigbus logic needs to see on the thread that touched the truncated file. */
+                assert_se(sigfillset(&ss) >= 0);
+                assert_se(sigdelset(&ss, SIGBUS) >= 0);
+                r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+                if (r > 0)
+                        n_threads = 1;
+        }
+
+        for (i = 0; i + 1 < n_threads; i++) {
+                VerifyThread *t = threads + n;
+
+                *t = (VerifyThread) {
+                        .context = c,
+                };
+
+                r = verify_file_open_copy(f, &t->file);
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to open %s for verification thread, ignoring: %m", f->path);
+                        break;
+                }
+
+                r = pthread_create(&t->thread, NULL, verify_thread, t);
+                if (r > 0) {
+                        /* Not fatal, we'll just do more of the work ourselves */
+                        log_debug_errno(r, "Failed to start verification thread, ignoring: %m");
+                        (void) journal_file_close(t->file);
+                        break;
+                }
+
+                n++;
+        }
+
+        if (n_threads > 1)
+                assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        (void) verify_chunks(f, c, true);
+
+        for (i = 0; i < n; i++) {
+                assert_se(pthread_join(threads[i].thread, NULL) == 0);
+                (void) journal_file_close(threads[i].file);
+        }
+
+        if (n > 0)
+                log_debug("Verified references of %s using %u additional threads.", f->path, n);
+
+        return c->error;
+}
+
+static int verify_journal_file(
                 JournalFile *f,
                 const char *key,
-                usec_t *first_contained, usec_t *last_validated, usec_t *last_contained,
-                bool show_progress) {
+                unsigned n_threads,
+                uint64_t *progress,
+                bool show_progress,
+                usec_t *first_contained, usec_t *last_validated, usec_t *last_contained) {
         int r;
         Object *o;
         uint64_t p = 0, last_epoch = 0, last_tag_realtime = 0, last_sealed_realtime = 0;
 
         uint64_t entry_seqnum = 0, entry_monotonic = 0, entry_realtime = 0;
         sd_id128_t entry_boot_id;
-        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
+        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false, found_bloom_filter = false, found_dictionary = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
-        usec_t last_usec = 0;
-        int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
-        MMapFileDescriptor *cache_data_fd = NULL, *cache_entry_fd = NULL, *cache_entry_array_fd = NULL;
+        VerifyContext c = {
+                .data.fd = -1,
+                .entries.fd = -1,
+                .entry_arrays.fd = -1,
+                .progress = progress,
+                .show_progress = show_progress,
+        };
         unsigned i;
         bool found_last = false;
         const char *tmp_dir = NULL;
@@ -843,43 +1175,25 @@ int journal_file_verify(
                 goto fail;
         }
 
-        data_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (data_fd < 0) {
-                r = log_error_errno(data_fd, "Failed to create data file: %m");
+        c.data.fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
+        if (c.data.fd < 0) {
+                r = log_error_errno(c.data.fd, "Failed to create data file: %m");
                 goto fail;
         }
 
-        entry_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (entry_fd < 0) {
-                r = log_error_errno(entry_fd, "Failed to create entry file: %m");
+        c.entries.fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
+        if (c.entries.fd < 0) {
+                r = log_error_errno(c.entries.fd, "Failed to create entry file: %m");
                 goto fail;
         }
 
-        entry_array_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (entry_array_fd < 0) {
-                r = log_error_errno(entry_array_fd,
+        c.entry_arrays.fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
+        if (c.entry_arrays.fd < 0) {
+                r = log_error_errno(c.entry_arrays.fd,
                                     "Failed to create entry array file: %m");
                 goto fail;
         }
 
-        cache_data_fd = mmap_cache_add_fd(f->mmap, data_fd);
-        if (!cache_data_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
-        cache_entry_fd = mmap_cache_add_fd(f->mmap, entry_fd);
-        if (!cache_entry_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
-        cache_entry_array_fd = mmap_cache_add_fd(f->mmap, entry_array_fd);
-        if (!cache_entry_array_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
         if (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED) {
                 log_error("Cannot verify file with unknown extensions.");
                 r = -EOPNOTSUPP;
@@ -902,8 +1216,7 @@ int journal_file_verify(
                 if (le64toh(f->header->tail_object_offset) == 0)
                         break;
 
-                if (show_progress)
-                        draw_progress(scale_progress(0x7FFF, p, le64toh(f->header->tail_object_offset)), &last_usec);
+                verify_progress(&c, scale_progress(0x7FFF, p, le64toh(f->header->tail_object_offset)));
 
                 r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
                 if (r < 0) {
@@ -954,10 +1267,21 @@ int journal_file_verify(
                 switch (o->object.type) {
 
                 case OBJECT_DATA:
-                        r = write_uint64(data_fd, p);
+                        r = offset_array_append(&c.data, p);
                         if (r < 0)
                                 goto fail;
 
+                        r = journal_file_bloom_filter_may_contain(f, le64toh(o->data.hash));
+                        if (r < 0) {
+                                error_errno(p, r, "Failed to look up data object in bloom filter: %m");
+                                goto fail;
+                        }
+                        if (r == 0) {
+                                error(p, "Data object missing from bloom filter");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
                         n_data++;
                         break;
 
@@ -972,7 +1296,7 @@ int journal_file_verify(
                                 goto fail;
                         }
 
-                        r = write_uint64(entry_fd, p);
+                        r = offset_array_append(&c.entries, p);
                         if (r < 0)
                                 goto fail;
 
@@ -1025,6 +1349,12 @@ int journal_file_verify(
                         break;
 
                 case OBJECT_DATA_HASH_TABLE:
+                        /* Files with a growable hash table may contain tables that have been replaced by a
+                         * larger one since. Only the one the header points to is in use. */
+                        if (JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header) &&
+                            le64toh(f->header->data_hash_table_offset) != p + offsetof(HashTableObject, items))
+                                break;
+
                         if (n_data_hash_tables > 1) {
                                 error(p, "More than one data hash table");
                                 r = -EBADMSG;
@@ -1059,7 +1389,7 @@ int journal_file_verify(
                         break;
 
                 case OBJECT_ENTRY_ARRAY:
-                        r = write_uint64(entry_array_fd, p);
+                        r = offset_array_append(&c.entry_arrays, p);
                         if (r < 0)
                                 goto fail;
 
@@ -1164,6 +1494,38 @@ int journal_file_verify(
                         n_tags++;
                         break;
 
+                case OBJECT_BLOOM_FILTER:
+                        if (!JOURNAL_HEADER_BLOOM_FILTER(f->header)) {
+                                error(p, "Bloom filter object in file without bloom filter");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (found_bloom_filter || p != le64toh(f->header->bloom_filter_offset)) {
+                                error(p, "More than one bloom filter");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_bloom_filter = true;
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_ZSTD_DICTIONARY(f->header)) {
+                                error(p, "Dictionary object in file without dictionary");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (found_dictionary || p != le64toh(f->header->dictionary_offset)) {
+                                error(p, "More than one dictionary");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_dictionary = true;
+                        break;
+
                 default:
                         n_weird++;
                 }
@@ -1182,6 +1544,18 @@ int journal_file_verify(
                 goto fail;
         }
 
+        if (JOURNAL_HEADER_BLOOM_FILTER(f->header) && !found_bloom_filter) {
+                error(le64toh(f->header->bloom_filter_offset), "Bloom filter pointer dead");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (JOURNAL_HEADER_ZSTD_DICTIONARY(f->header) && !found_dictionary) {
+                error(le64toh(f->header->dictionary_offset), "Dictionary pointer dead");
+                r = -EBADMSG;
+                goto fail;
+        }
+
         if (n_objects != le64toh(f->header->n_objects)) {
                 error(offsetof(Header, n_objects), "Object number mismatch");
                 r = -EBADMSG;
@@ -1257,34 +1631,26 @@ int journal_file_verify(
          * unreferenced objects. We only care that everything that is
          * referenced is consistent. */
 
-        r = verify_entry_array(f,
-                               cache_data_fd, n_data,
-                               cache_entry_fd, n_entries,
-                               cache_entry_array_fd, n_entry_arrays,
-                               &last_usec,
-                               show_progress);
-        if (r < 0)
+        r = offset_array_map(&c.data);
+        if (r >= 0)
+                r = offset_array_map(&c.entries);
+        if (r >= 0)
+                r = offset_array_map(&c.entry_arrays);
+        if (r < 0) {
+                log_error_errno(r, "Failed to map object offsets: %m");
                 goto fail;
+        }
 
-        r = verify_hash_table(f,
-                              cache_data_fd, n_data,
-                              cache_entry_fd, n_entries,
-                              cache_entry_array_fd, n_entry_arrays,
-                              &last_usec,
-                              show_progress);
+        c.n_entries = n_entries;
+
+        r = verify_references(f, &c, n_threads);
         if (r < 0)
                 goto fail;
 
         if (show_progress)
                 flush_progress();
 
-        mmap_cache_free_fd(f->mmap, cache_data_fd);
-        mmap_cache_free_fd(f->mmap, cache_entry_fd);
-        mmap_cache_free_fd(f->mmap, cache_entry_array_fd);
-
-        safe_close(data_fd);
-        safe_close(entry_fd);
-        safe_close(entry_array_fd);
+        verify_context_done(&c);
 
         if (first_contained)
                 *first_contained = le64toh(f->header->head_entry_realtime);
@@ -1305,23 +1671,193 @@ fail:
                   (unsigned long long) f->last_stat.st_size,
                   100 * p / f->last_stat.st_size);
 
-        if (data_fd >= 0)
-                safe_close(data_fd);
+        verify_context_done(&c);
 
-        if (entry_fd >= 0)
-                safe_close(entry_fd);
+        return r;
+}
 
-        if (entry_array_fd >= 0)
-                safe_close(entry_array_fd);
+static unsigned verify_n_threads(void) {
+        long k;
+        int r;
 
-        if (cache_data_fd)
-                mmap_cache_free_fd(f->mmap, cache_data_fd);
+        r = getenv_bool("SYSTEMD_JOURNAL_PARALLEL_VERIFY");
+        if (r == 0)
+                return 1;
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_PARALLEL_VERIFY environment variable, ignoring.");
 
-        if (cache_entry_fd)
-                mmap_cache_free_fd(f->mmap, cache_entry_fd);
+        k = sysconf(_SC_NPROCESSORS_ONLN);
+        return k > 1 ? (unsigned) MIN(k, (long) VERIFY_THREADS_MAX) : 1;
+}
 
-        if (cache_entry_array_fd)
-                mmap_cache_free_fd(f->mmap, cache_entry_array_fd);
+int journal_file_verify(
+                JournalFile *f,
+                const char *key,
+                usec_t *first_contained, usec_t *last_validated, usec_t *last_contained,
+                bool show_progress) {
 
-        return r;
+        return verify_journal_file(f, key, verify_n_threads(), NULL, show_progress, first_contained, last_validated, last_contained);
+}
+
+typedef struct VerifyJobs {
+        JournalFile **files;
+        JournalVerifyResult *results;
+        uint64_t *progress;
+        size_t n_files;
+        const char *key;
+        unsigned n_threads_per_file;
+        size_t next;
+        unsigned n_running;
+} VerifyJobs;
+
+static void verify_jobs_run(VerifyJobs *v) {
+        assert(v);
+
+        for (;;) {
+                JournalVerifyResult *result;
+                JournalFile *f;
+                size_t i;
+                int r;
+
+                i = __sync_fetch_and_add(&v->next, 1);
+                if (i >= v->n_files)
+                        break;
+
+                result = v->results + i;
+
+                r = verify_file_open_copy(v->files[i], &f);
+                if (r < 0)
+                        result->error = log_error_errno(r, "Failed to open %s for verification: %m", v->files[i]->path);
+                else {
+                        result->error = verify_journal_file(f, v->key, v->n_threads_per_file, v->progress + i, false,
+                                                            &result->first_contained, &result->last_validated, &result->last_contained);
+                        (void) journal_file_close(f);
+                }
+
+                __atomic_store_n(v->progress + i, 0xFFFF, __ATOMIC_RELAXED);
+        }
+}
+
+static void *verify_jobs_thread(void *arg) {
+        VerifyJobs *v = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-verify");
+
+        verify_jobs_run(v);
+        (void) __sync_fetch_and_sub(&v->n_running, 1);
+
+        return NULL;
+}
+
+static uint64_t verify_jobs_progress(VerifyJobs *v) {
+        uint64_t done = 0, total = 0;
+        size_t i;
+
+        assert(v);
+
+        /* Weighs the progress of each file by its size */
+
+        for (i = 0; i < v->n_files; i++) {
+                uint64_t size = MAX(v->files[i]->last_stat.st_size, 1);
+
+                done += size * __atomic_load_n(v->progress + i, __ATOMIC_RELAXED) / 0xFFFF;
+                total += size;
+        }
+
+        return scale_progress(0xFFFF, done, total);
+}
+
+int journal_files_verify(
+                JournalFile **files,
+                size_t n_files,
+                const char *key,
+                unsigned n_threads,
+                JournalVerifyResult *results,
+                bool show_progress) {
+
+        pthread_t threads[VERIFY_THREADS_MAX];
+        _cleanup_free_ uint64_t *progress = NULL;
+        sigset_t ss, saved_ss;
+        usec_t last_usec = 0;
+        unsigned i, n = 0;
+        VerifyJobs v;
+        int r;
+
+        assert(files || n_files == 0);
+        assert(results || n_files == 0);
+
+        if (n_threads == 0)
+                n_threads = verify_n_threads();
+        n_threads = MIN(n_threads, VERIFY_THREADS_MAX);
+
+        for (i = 0; i < n_files; i++)
+                results[i] = (JournalVerifyResult) {};
+
+        /* Without threads to spare, or just a single file, the files are verified one after the other as
+         * they are, and each shows its own progress */
+        if (n_threads <= 1 || n_files <= 1) {
+                for (i = 0; i < n_files; i++)
+                        results[i].error = verify_journal_file(files[i], key, n_threads, NULL, show_progress,
+                                                               &results[i].first_contained, &results[i].last_validated, &results[i].last_contained);
+
+                return 0;
+        }
+
+        progress = new0(uint64_t, n_files);
+        if (!progress)
+                return -ENOMEM;
+
+        v = (VerifyJobs) {
+                .files = files,
+                .results = results,
+                .progress = progress,
+                .n_files = n_files,
+                .key = key,
+                /* If there are fewer files than threads, the remaining threads help with the files */
+                .n_threads_per_file = MAX(1U, n_threads / (unsigned) MIN(n_files, (size_t) n_threads)),
+        };
+
+        /* Like the offlining thread, these threads shouldn't handle any signals, except for SIGBUS, which
+         * the sigbus logic needs to see on the thread that touched the truncated file. */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(sigdelset(&ss, SIGBUS) >= 0);
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
+
+        for (i = 0; i < MIN(n_files, (size_t) n_threads); i++) {
+                (void) __sync_fetch_and_add(&v.n_running, 1);
+
+                r = pthread_create(threads + n, NULL, verify_jobs_thread, &v);
+                if (r > 0) {
+                        /* Not fatal, we'll just do more of the work ourselves */
+                        log_debug_errno(r, "Failed to start verification thread, ignoring: %m");
+                        (void) __sync_fetch_and_sub(&v.n_running, 1);
+                        break;
+                }
+
+                n++;
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        /* We only draw the progress of all files here, the threads do the work */
+        if (show_progress)
+                while (__atomic_load_n(&v.n_running, __ATOMIC_RELAXED) > 0) {
+                        draw_progress(verify_jobs_progress(&v), &last_usec);
+                        (void) usleep(40 * USEC_PER_MSEC);
+                }
+
+        /* Anything no thread took care of is done here */
+        verify_jobs_run(&v);
+
+        for (i = 0; i < n; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        if (show_progress)
+                flush_progress();
+
+        log_debug("Verified %zu journal files using %u threads.", n_files, n);
+
+        return 0;
 }
@@ -3,4 +3,15 @@
 
 #include "journal-file.h"
 
+typedef struct JournalVerifyResult {
+        int error;
+        usec_t first_contained;
+        usec_t last_validated;
+        usec_t last_contained;
+} JournalVerifyResult;
+
 int journal_file_verify(JournalFile *f, const char *key, usec_t *first_contained, usec_t *last_validated, usec_t *last_contained, bool show_progress);
+
+/* Verifies a number of files at once, using up to n_threads threads, or one per CPU if 0. The result for
+ * each file is stored in the results array, which has to have room for n_files entries. */
+int journal_files_verify(JournalFile **files, size_t n_files, const char *key, unsigned n_threads, JournalVerifyResult *results, bool show_progress);
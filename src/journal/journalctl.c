@@ -9,6 +9,7 @@
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
@@ -72,6 +73,7 @@
 
 #define DEFAULT_FSS_INTERVAL_USEC (15*USEC_PER_MINUTE)
 #define PROCESS_INOTIFY_INTERVAL 1024   /* Every 1,024 messages processed */
+#define OUTPUT_BUFFER_SIZE (128U*1024U)
 
 enum {
         /* Special values for arg_lines */
@@ -1969,43 +1971,63 @@ finish:
 }
 
 static int verify(sd_journal *j) {
-        int r = 0;
+        _cleanup_free_ JournalVerifyResult *results = NULL;
+        _cleanup_free_ JournalFile **files = NULL;
+        size_t n = 0, k;
         Iterator i;
         JournalFile *f;
+        int r = 0, q;
 
         assert(j);
 
         log_show_color(true);
 
-        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                int k;
-                usec_t first = 0, validated = 0, last = 0;
+        /* Verification needs to look at each file, not just at the index */
+        (void) journal_open_deferred_files(j);
+
+        files = new0(JournalFile*, ordered_hashmap_size(j->files));
+        results = new0(JournalVerifyResult, ordered_hashmap_size(j->files));
+        if (!files || !results)
+                return log_oom();
 
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
 #if HAVE_GCRYPT
                 if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
                         log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
 #endif
 
-                k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
-                if (k == -EINVAL) {
-                        /* If the key was invalid give up right-away. */
-                        return k;
-                } else if (k < 0) {
-                        log_warning_errno(k, "FAIL: %s (%m)", f->path);
-                        r = k;
+                files[n++] = f;
+        }
+
+        /* Independent files are verified in parallel, and large files are split up further */
+        q = journal_files_verify(files, n, arg_verify_key, 0, results, true);
+        if (q < 0)
+                return log_error_errno(q, "Failed to verify journal files: %m");
+
+        for (k = 0; k < n; k++) {
+                const JournalVerifyResult *v = results + k;
+
+                f = files[k];
+
+                if (v->error == -EINVAL) {
+                        /* If the key was invalid, the results for the other files are no better */
+                        return v->error;
+                } else if (v->error < 0) {
+                        log_warning_errno(v->error, "FAIL: %s (%m)", f->path);
+                        r = v->error;
                 } else {
                         char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
                         log_info("PASS: %s", f->path);
 
                         if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
-                                if (validated > 0) {
+                                if (v->last_validated > 0) {
                                         log_info("=> Validated from %s to %s, final %s entries not sealed.",
-                                                 format_timestamp_maybe_utc(a, sizeof(a), first),
-                                                 format_timestamp_maybe_utc(b, sizeof(b), validated),
-                                                 format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
-                                } else if (last > 0)
+                                                 format_timestamp_maybe_utc(a, sizeof(a), v->first_contained),
+                                                 format_timestamp_maybe_utc(b, sizeof(b), v->last_validated),
+                                                 format_timespan(c, sizeof(c), v->last_contained > v->last_validated ? v->last_contained - v->last_validated : 0, 0));
+                                } else if (v->last_contained > 0)
                                         log_info("=> No sealing yet, %s of entries not sealed.",
-                                                 format_timespan(c, sizeof(c), last - first, 0));
+                                                 format_timespan(c, sizeof(c), v->last_contained - v->first_contained, 0));
                                 else
                                         log_info("=> No sealing yet, no entries in file.");
                         }
@@ -2550,6 +2572,14 @@ int main(int argc, char *argv[]) {
         if (!arg_follow)
                 (void) pager_open(arg_pager_flags);
 
+        /* We are the only ones writing to stdout, hence skip the locking for each of the many small writes
+         * the output modes do. Unless a human is watching the output line by line, also pass it on to the
+         * pager or whatever else is reading it in large chunks rather than stdio's default 4K. In follow
+         * mode we flush before waiting for new entries anyway. */
+        (void) __fsetlocking(stdout, FSETLOCKING_BYCALLER);
+        if (!isatty(STDOUT_FILENO))
+                (void) setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
         if (!arg_quiet && (arg_lines != 0 || arg_follow)) {
                 usec_t start, end;
                 char start_buf[FORMAT_TIMESTAMP_MAX], end_buf[FORMAT_TIMESTAMP_MAX];
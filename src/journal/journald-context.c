@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <sys/inotify.h>
+
 #if HAVE_SELINUX
 #include <selinux/selinux.h>
 #endif
@@ -48,6 +50,10 @@
  *    stream connection. This should improve cases where a service process logs immediately before exiting and we
  *    previously had trouble associating the log message with the service.
  *
+ * The per-unit data PID 1 leaves for us in /run/systemd/units/ is only reread on refresh if something in that directory
+ * changed since, which we learn about through inotify. The metadata is formatted as journal fields whenever it is
+ * refreshed, so that this doesn't have to be done again for every single log message.
+ *
  * NB: With and without the metadata cache: the implicitly added entry metadata in the journal (with the exception of
  *     UID/PID/GID and SELinux label) must be understood as possibly slightly out of sync (i.e. sometimes slightly older
  *     and sometimes slightly newer than what was current at the log event).
@@ -146,6 +152,16 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
         return 0;
 }
 
+static void client_context_free_meta_fields(ClientContext *c) {
+        assert(c);
+
+        for (size_t i = 0; i < c->meta_fields_n_iovec; i++)
+                free(c->meta_fields_iovec[i].iov_base);
+
+        c->meta_fields_iovec = mfree(c->meta_fields_iovec);
+        c->meta_fields_n_iovec = 0;
+}
+
 static void client_context_reset(Server *s, ClientContext *c) {
         assert(s);
         assert(c);
@@ -185,6 +201,10 @@ static void client_context_reset(Server *s, ClientContext *c) {
 
         c->log_ratelimit_interval = s->ratelimit_interval;
         c->log_ratelimit_burst = s->ratelimit_burst;
+
+        c->units_generation = 0;
+
+        client_context_free_meta_fields(c);
 }
 
 static ClientContext* client_context_free(Server *s, ClientContext *c) {
@@ -288,8 +308,10 @@ static int client_context_read_cgroup(Server *s, ClientContext *c, const char *u
                  * on cgroup v1 and we want to be able to map log messages from them too. */
                 if (unit_id && !c->unit) {
                         c->unit = strdup(unit_id);
-                        if (c->unit)
+                        if (c->unit) {
+                                c->units_generation = 0;
                                 return 0;
+                        }
                 }
 
                 return r;
@@ -319,6 +341,9 @@ static int client_context_read_cgroup(Server *s, ClientContext *c, const char *u
         (void) cg_path_get_user_slice(c->cgroup, &t);
         free_and_replace(c->user_slice, t);
 
+        /* Possibly a different unit now, hence reread its data */
+        c->units_generation = 0;
+
         return 0;
 }
 
@@ -506,6 +531,89 @@ static int client_context_read_log_ratelimit_burst(ClientContext *c) {
         return safe_atou(value, &c->log_ratelimit_burst);
 }
 
+#define META_FIELD_ADD(iovec, n, k)                                     \
+        do {                                                            \
+                if (!(k))                                               \
+                        return -ENOMEM;                                 \
+                iovec[n++] = IOVEC_MAKE_STRING(k);                      \
+        } while (false)
+
+#define META_FIELD_ADD_NUMERIC(iovec, n, value, isset, format, field)   \
+        if (isset(value)) {                                             \
+                char *_k;                                               \
+                if (asprintf(&_k, field "=" format, value) < 0)         \
+                        return -ENOMEM;                                 \
+                iovec[n++] = IOVEC_MAKE_STRING(_k);                     \
+        }
+
+#define META_FIELD_ADD_STRING(iovec, n, value, field)                   \
+        if (!isempty(value))                                            \
+                META_FIELD_ADD(iovec, n, strjoin(field "=", value))
+
+static int client_context_format_meta_fields(ClientContext *c) {
+        struct iovec *iovec;
+
+        assert(c);
+
+        /* Formats the metadata as journal fields. If we fail half-way, we leave what we got so far. */
+
+        client_context_free_meta_fields(c);
+
+        iovec = c->meta_fields_iovec = new(struct iovec, N_IOVEC_META_FIELDS);
+        if (!iovec)
+                return -ENOMEM;
+
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->pid, pid_is_valid, PID_FMT, "_PID");
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->uid, uid_is_valid, UID_FMT, "_UID");
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->gid, gid_is_valid, GID_FMT, "_GID");
+
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->comm, "_COMM");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->exe, "_EXE");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->cmdline, "_CMDLINE");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->capeff, "_CAP_EFFECTIVE");
+        if (c->label_size > 0) {
+                char *k;
+
+                k = new(char, STRLEN("_SELINUX_CONTEXT=") + c->label_size + 1);
+                if (k)
+                        *((char*) mempcpy(stpcpy(k, "_SELINUX_CONTEXT="), c->label, c->label_size)) = 0;
+                META_FIELD_ADD(iovec, c->meta_fields_n_iovec, k);
+        }
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->auditid, audit_session_is_valid, "%" PRIu32, "_AUDIT_SESSION");
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->loginuid, uid_is_valid, UID_FMT, "_AUDIT_LOGINUID");
+
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->cgroup, "_SYSTEMD_CGROUP");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->session, "_SYSTEMD_SESSION");
+        META_FIELD_ADD_NUMERIC(iovec, c->meta_fields_n_iovec, c->owner_uid, uid_is_valid, UID_FMT, "_SYSTEMD_OWNER_UID");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->unit, "_SYSTEMD_UNIT");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->user_unit, "_SYSTEMD_USER_UNIT");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->slice, "_SYSTEMD_SLICE");
+        META_FIELD_ADD_STRING(iovec, c->meta_fields_n_iovec, c->user_slice, "_SYSTEMD_USER_SLICE");
+
+        if (!sd_id128_is_null(c->invocation_id)) {
+                char *k;
+
+                k = new(char, STRLEN("_SYSTEMD_INVOCATION_ID=") + SD_ID128_STRING_MAX);
+                if (k)
+                        sd_id128_to_string(c->invocation_id, stpcpy(k, "_SYSTEMD_INVOCATION_ID="));
+                META_FIELD_ADD(iovec, c->meta_fields_n_iovec, k);
+        }
+
+        assert(c->meta_fields_n_iovec <= N_IOVEC_META_FIELDS);
+        return 0;
+}
+
+static bool client_context_units_stale(Server *s, ClientContext *c) {
+        assert(s);
+        assert(c);
+
+        /* Without a watch on the directory we can't know whether anything changed */
+        if (!s->units_event_source)
+                return true;
+
+        return c->units_generation != s->units_generation;
+}
+
 static void client_context_really_refresh(
                 Server *s,
                 ClientContext *c,
@@ -514,6 +622,8 @@ static void client_context_really_refresh(
                 const char *unit_id,
                 usec_t timestamp) {
 
+        int r;
+
         assert(s);
         assert(c);
         assert(pid_is_valid(c->pid));
@@ -529,13 +639,23 @@ static void client_context_really_refresh(
         (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
 
         (void) client_context_read_cgroup(s, c, unit_id);
-        (void) client_context_read_invocation_id(s, c);
-        (void) client_context_read_log_level_max(s, c);
-        (void) client_context_read_extra_fields(s, c);
-        (void) client_context_read_log_ratelimit_interval(c);
-        (void) client_context_read_log_ratelimit_burst(c);
+
+        if (client_context_units_stale(s, c)) {
+                (void) client_context_read_invocation_id(s, c);
+                (void) client_context_read_log_level_max(s, c);
+                (void) client_context_read_extra_fields(s, c);
+                (void) client_context_read_log_ratelimit_interval(c);
+                (void) client_context_read_log_ratelimit_burst(c);
+
+                c->units_generation = s->units_generation;
+        }
+
+        r = client_context_format_meta_fields(c);
+        if (r < 0)
+                log_warning_errno(r, "Failed to format client metadata, ignoring: %m");
 
         c->timestamp = timestamp;
+        s->client_contexts_refreshes++;
 
         if (c->in_lru) {
                 assert(c->n_ref == 0);
@@ -672,6 +792,7 @@ static int client_context_get_internal(
 
         c = hashmap_get(s->client_contexts, PID_TO_PTR(pid));
         if (c) {
+                s->client_contexts_hits++;
 
                 if (add_ref) {
                         if (c->in_lru) {
@@ -690,6 +811,8 @@ static int client_context_get_internal(
                 return 0;
         }
 
+        s->client_contexts_misses++;
+
         client_context_try_shrink_to(s, cache_max()-1);
 
         r = client_context_new(s, pid, &c);
@@ -790,3 +913,42 @@ void client_context_acquire_default(Server *s) {
 
         }
 }
+
+static int dispatch_units_inotify(sd_event_source *es, const struct inotify_event *event, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        /* We don't bother figuring out which unit the change is about, these changes are rare: each client
+         * simply rereads the data of its unit on its next refresh. */
+        s->units_generation++;
+
+        /* If the directory is gone, we can't watch it anymore, and have to read the data every time again */
+        if (event->mask & IN_IGNORED)
+                s->units_event_source = sd_event_source_disable_unref(s->units_event_source);
+
+        return 0;
+}
+
+int client_context_watch_units(Server *s) {
+        int r;
+
+        assert(s);
+        assert(!s->units_event_source);
+
+        r = sd_event_add_inotify(s->event, &s->units_event_source, "/run/systemd/units",
+                                 IN_CREATE|IN_DELETE|IN_MOVED_TO|IN_MOVED_FROM|IN_CLOSE_WRITE|IN_ONLYDIR|IN_DONT_FOLLOW,
+                                 dispatch_units_inotify, s);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to watch /run/systemd/units/, rereading unit data on every refresh: %m");
+
+        r = sd_event_source_set_priority(s->units_event_source, SD_EVENT_PRIORITY_IMPORTANT);
+        if (r < 0)
+                return log_error_errno(r, "Failed to adjust priority of units watch: %m");
+
+        (void) sd_event_source_set_description(s->units_event_source, "units-watch");
+
+        /* Generation 0 means "not read yet", start counting after that */
+        s->units_generation = 1;
+        return 0;
+}
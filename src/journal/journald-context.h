@@ -55,6 +55,12 @@ struct ClientContext {
 
         usec_t log_ratelimit_interval;
         unsigned log_ratelimit_burst;
+
+        uint64_t units_generation; /* when we last read the per-unit data, 0 if it needs to be read */
+
+        /* All of the above formatted as journal fields, prepared whenever the data is refreshed */
+        struct iovec *meta_fields_iovec;
+        size_t meta_fields_n_iovec;
 };
 
 int client_context_get(
@@ -86,6 +92,8 @@ void client_context_maybe_refresh(
 void client_context_acquire_default(Server *s);
 void client_context_flush_all(Server *s);
 
+int client_context_watch_units(Server *s);
+
 static inline size_t client_context_extra_fields_n_iovec(const ClientContext *c) {
         return c ? c->extra_fields_n_iovec : 0;
 }
@@ -6,13 +6,12 @@
 #include "hashmap.h"
 #include "journald-rate-limit.h"
 #include "list.h"
-#include "random-util.h"
+#include "special.h"
 #include "string-util.h"
 #include "time-util.h"
 
 #define POOLS_MAX 5
-#define BUCKETS_MAX 127
-#define GROUPS_MAX 2047
+#define GROUPS_MAX 65535
 
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
@@ -28,62 +27,126 @@ static const int priority_map[] = {
 typedef struct JournalRateLimitPool JournalRateLimitPool;
 typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
+/* Each pool is a token bucket holding up to burst tokens, which refills at burst tokens per interval. It is
+ * implemented as a GCRA: instead of the number of tokens we only store the time at which the bucket would
+ * be full again, hence refilling needs no timer and no arithmetic that could overflow. */
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
+        usec_t full;
         unsigned suppressed;
 };
 
+/* Groups form a two level hierarchy: every unit belongs to a slice, and a message is only let through if
+ * both the unit and its slice have a token left in the pool for its priority. */
 struct JournalRateLimitGroup {
         JournalRateLimit *parent;
 
         char *id;
 
-        /* Interval is stored to keep track of when the group expires */
-        usec_t interval;
-
         JournalRateLimitPool pools[POOLS_MAX];
-        uint64_t hash;
 
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
+        /* Messages dropped since the group was created. For slices this includes the messages of all
+         * units in it, and n_dropped_limit counts those dropped because of the slice's own budget. */
+        uint64_t n_dropped;
+        uint64_t n_dropped_limit;
+
+        /* Units only */
+        JournalRateLimitGroup *slice;
+        LIST_FIELDS(JournalRateLimitGroup, units);
         LIST_FIELDS(JournalRateLimitGroup, lru);
+
+        /* Slices only */
+        LIST_HEAD(JournalRateLimitGroup, units);
 };
 
 struct JournalRateLimit {
+        Hashmap *units;
+        Hashmap *slices;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
+        /* Units, most recently used first, so that expired ones can be found quickly */
         JournalRateLimitGroup *lru, *lru_tail;
 
-        unsigned n_groups;
-
-        uint8_t hash_key[16];
+        /* The same for all slices, each of which has its own pools though */
+        usec_t slice_interval;
+        unsigned slice_burst;
 };
 
-JournalRateLimit *journal_ratelimit_new(void) {
+JournalRateLimit *journal_ratelimit_new(usec_t slice_interval, unsigned slice_burst) {
         JournalRateLimit *r;
 
-        r = new0(JournalRateLimit, 1);
+        r = new(JournalRateLimit, 1);
         if (!r)
                 return NULL;
 
-        random_bytes(r->hash_key, sizeof(r->hash_key));
+        *r = (JournalRateLimit) {
+                .slice_interval = slice_interval,
+                .slice_burst = slice_burst,
+        };
 
         return r;
 }
 
-static void journal_ratelimit_group_free(JournalRateLimitGroup *g) {
+static bool journal_ratelimit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
+        unsigned i;
+
         assert(g);
 
-        if (g->parent) {
-                assert(g->parent->n_groups > 0);
+        /* A group whose buckets are all full again carries no state worth keeping, except for the
+         * suppressed messages not reported yet. */
 
+        for (i = 0; i < POOLS_MAX; i++)
+                if (g->pools[i].full > ts || g->pools[i].suppressed > 0)
+                        return false;
+
+        return true;
+}
+
+static void journal_ratelimit_slice_free(JournalRateLimitGroup *s) {
+        assert(s);
+        assert(!s->units);
+
+        if (s->parent)
+                hashmap_remove(s->parent->slices, s->id);
+
+        free(s->id);
+        free(s);
+}
+
+static void journal_ratelimit_slice_maybe_free(JournalRateLimitGroup *s, usec_t ts) {
+        assert(s);
+
+        /* Slices are few, keep them around as long as they have something to report */
+        if (s->units || s->n_dropped > 0 || !journal_ratelimit_group_expired(s, ts))
+                return;
+
+        journal_ratelimit_slice_free(s);
+}
+
+static void journal_ratelimit_unit_detach(JournalRateLimitGroup *g) {
+        assert(g);
+
+        if (!g->slice)
+                return;
+
+        LIST_REMOVE(units, g->slice->units, g);
+        g->slice = NULL;
+}
+
+static void journal_ratelimit_unit_free(JournalRateLimitGroup *g, usec_t ts) {
+        JournalRateLimitGroup *s;
+
+        assert(g);
+
+        s = g->slice;
+        journal_ratelimit_unit_detach(g);
+        if (s)
+                journal_ratelimit_slice_maybe_free(s, ts);
+
+        if (g->parent) {
                 if (g->parent->lru_tail == g)
                         g->parent->lru_tail = g->lru_prev;
 
                 LIST_REMOVE(lru, g->parent->lru, g);
-                LIST_REMOVE(bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
-
-                g->parent->n_groups--;
+                hashmap_remove(g->parent->units, g->id);
         }
 
         free(g->id);
@@ -91,43 +154,79 @@ static void journal_ratelimit_group_free(JournalRateLimitGroup *g) {
 }
 
 void journal_ratelimit_free(JournalRateLimit *r) {
+        JournalRateLimitGroup *s;
+
         assert(r);
 
         while (r->lru)
-                journal_ratelimit_group_free(r->lru);
+                journal_ratelimit_unit_free(r->lru, 0);
+
+        while ((s = hashmap_first(r->slices)))
+                journal_ratelimit_slice_free(s);
 
+        hashmap_free(r->units);
+        hashmap_free(r->slices);
         free(r);
 }
 
-static bool journal_ratelimit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
-        unsigned i;
-
-        assert(g);
+static void journal_ratelimit_vacuum(JournalRateLimit *r, usec_t ts) {
+        assert(r);
 
-        for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->interval >= ts)
-                        return false;
+        /* Drops all expired units. Unlike the slices, there may be a lot of them, hence we also make
+         * room for a new one if we hit the limit, even if that means reporting less suppressed
+         * messages. The number of dropped messages of the slice stays accurate either way. */
 
-        return true;
+        while (r->lru_tail &&
+               (hashmap_size(r->units) >= GROUPS_MAX || journal_ratelimit_group_expired(r->lru_tail, ts)))
+                journal_ratelimit_unit_free(r->lru_tail, ts);
 }
 
-static void journal_ratelimit_vacuum(JournalRateLimit *r, usec_t ts) {
+static JournalRateLimitGroup* journal_ratelimit_slice_get(JournalRateLimit *r, const char *id) {
+        JournalRateLimitGroup *s;
+        int k;
+
         assert(r);
+        assert(id);
+
+        s = hashmap_get(r->slices, id);
+        if (s)
+                return s;
+
+        if (hashmap_ensure_allocated(&r->slices, &string_hash_ops) < 0)
+                return NULL;
+
+        s = new0(JournalRateLimitGroup, 1);
+        if (!s)
+                return NULL;
+
+        s->id = strdup(id);
+        if (!s->id)
+                goto fail;
+
+        k = hashmap_put(r->slices, s->id, s);
+        if (k < 0)
+                goto fail;
 
-        /* Makes room for at least one new item, but drop all
-         * expored items too. */
+        s->parent = r;
+        return s;
 
-        while (r->n_groups >= GROUPS_MAX ||
-               (r->lru_tail && journal_ratelimit_group_expired(r->lru_tail, ts)))
-                journal_ratelimit_group_free(r->lru_tail);
+fail:
+        journal_ratelimit_slice_free(s);
+        return NULL;
 }
 
-static JournalRateLimitGroup* journal_ratelimit_group_new(JournalRateLimit *r, const char *id, usec_t interval, usec_t ts) {
+static JournalRateLimitGroup* journal_ratelimit_unit_new(JournalRateLimit *r, const char *id, usec_t ts) {
         JournalRateLimitGroup *g;
+        int k;
 
         assert(r);
         assert(id);
 
+        journal_ratelimit_vacuum(r, ts);
+
+        if (hashmap_ensure_allocated(&r->units, &string_hash_ops) < 0)
+                return NULL;
+
         g = new0(JournalRateLimitGroup, 1);
         if (!g)
                 return NULL;
@@ -136,26 +235,47 @@ static JournalRateLimitGroup* journal_ratelimit_group_new(JournalRateLimit *r, c
         if (!g->id)
                 goto fail;
 
-        g->hash = siphash24_string(g->id, r->hash_key);
-
-        g->interval = interval;
-
-        journal_ratelimit_vacuum(r, ts);
+        k = hashmap_put(r->units, g->id, g);
+        if (k < 0)
+                goto fail;
 
-        LIST_PREPEND(bucket, r->buckets[g->hash % BUCKETS_MAX], g);
         LIST_PREPEND(lru, r->lru, g);
         if (!g->lru_next)
                 r->lru_tail = g;
-        r->n_groups++;
 
         g->parent = r;
         return g;
 
 fail:
-        journal_ratelimit_group_free(g);
+        journal_ratelimit_unit_free(g, ts);
         return NULL;
 }
 
+static int journal_ratelimit_unit_set_slice(JournalRateLimitGroup *g, const char *slice, usec_t ts) {
+        JournalRateLimitGroup *s, *old;
+
+        assert(g);
+        assert(slice);
+
+        if (g->slice && streq(g->slice->id, slice))
+                return 0;
+
+        s = journal_ratelimit_slice_get(g->parent, slice);
+        if (!s)
+                return -ENOMEM;
+
+        /* Units don't move between slices while they run, but a unit name might be reused */
+        old = g->slice;
+        journal_ratelimit_unit_detach(g);
+        if (old)
+                journal_ratelimit_slice_maybe_free(old, ts);
+
+        LIST_PREPEND(units, s->units, g);
+        g->slice = s;
+
+        return 0;
+}
+
 static unsigned burst_modulate(unsigned burst, uint64_t available) {
         unsigned k;
 
@@ -184,12 +304,45 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_ratelimit_test(JournalRateLimit *r, const char *id, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available) {
-        uint64_t h;
+static usec_t pool_increment(usec_t interval, unsigned burst) {
+        /* The time it takes to refill a single token */
+        return MAX(interval / burst, 1U);
+}
+
+static bool pool_has_token(const JournalRateLimitPool *p, usec_t interval, unsigned burst, usec_t ts) {
+        assert(p);
+
+        if (interval == 0 || burst == 0)
+                return true;
+
+        /* A bucket is full at time "full", and loses one token for each increment before that */
+        return usec_add(MAX(p->full, ts), pool_increment(interval, burst)) <= usec_add(ts, interval);
+}
+
+static void pool_take_token(JournalRateLimitPool *p, usec_t interval, unsigned burst, usec_t ts) {
+        assert(p);
+
+        if (interval == 0 || burst == 0)
+                return;
+
+        p->full = usec_add(MAX(p->full, ts), pool_increment(interval, burst));
+}
+
+int journal_ratelimit_test(
+                JournalRateLimit *r,
+                const char *slice,
+                const char *id,
+                usec_t rl_interval,
+                unsigned rl_burst,
+                int priority,
+                uint64_t available,
+                usec_t ts) {
+
+        JournalRateLimitPool *p, *sp;
         JournalRateLimitGroup *g;
-        JournalRateLimitPool *p;
-        unsigned burst;
-        usec_t ts;
+        unsigned burst, slice_burst;
+        bool unit_ok, slice_ok;
+        int k;
 
         assert(id);
 
@@ -203,52 +356,151 @@ int journal_ratelimit_test(JournalRateLimit *r, const char *id, usec_t rl_interv
         if (!r)
                 return 1;
 
-        ts = now(CLOCK_MONOTONIC);
-
-        h = siphash24_string(id, r->hash_key);
-        g = r->buckets[h % BUCKETS_MAX];
-
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
+        if ((rl_interval == 0 || rl_burst == 0) &&
+            (r->slice_interval == 0 || r->slice_burst == 0))
+                return 1;
 
-        if (!g) {
-                g = journal_ratelimit_group_new(r, id, rl_interval, ts);
+        g = hashmap_get(r->units, id);
+        if (g) {
+                /* Most recently used units go first */
+                if (r->lru_tail == g && g->lru_prev)
+                        r->lru_tail = g->lru_prev;
+                LIST_REMOVE(lru, r->lru, g);
+                LIST_PREPEND(lru, r->lru, g);
+        } else {
+                g = journal_ratelimit_unit_new(r, id, ts);
                 if (!g)
                         return -ENOMEM;
-        } else
-                g->interval = rl_interval;
+        }
 
-        if (rl_interval == 0 || rl_burst == 0)
-                return 1;
+        k = journal_ratelimit_unit_set_slice(g, slice ?: SPECIAL_ROOT_SLICE, ts);
+        if (k < 0)
+                return k;
 
         burst = burst_modulate(rl_burst, available);
+        slice_burst = burst_modulate(r->slice_burst, available);
 
         p = &g->pools[priority_map[priority]];
+        sp = &g->slice->pools[priority_map[priority]];
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
-                return 1;
-        }
+        unit_ok = pool_has_token(p, rl_interval, burst, ts);
+        slice_ok = pool_has_token(sp, r->slice_interval, slice_burst, ts);
 
-        if (p->begin + rl_interval < ts) {
+        if (unit_ok && slice_ok) {
                 unsigned s;
 
+                pool_take_token(p, rl_interval, burst, ts);
+                pool_take_token(sp, r->slice_interval, slice_burst, ts);
+
                 s = p->suppressed;
                 p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
 
                 return 1 + s;
         }
 
-        if (p->num < burst) {
-                p->num++;
-                return 1;
-        }
-
         p->suppressed++;
+        g->n_dropped++;
+        g->slice->n_dropped++;
+        if (!slice_ok)
+                g->slice->n_dropped_limit++;
+
         return 0;
 }
+
+static unsigned journal_ratelimit_group_suppressed(JournalRateLimitGroup *g) {
+        unsigned i, n = 0;
+
+        assert(g);
+
+        for (i = 0; i < POOLS_MAX; i++)
+                n += g->pools[i].suppressed;
+
+        return n;
+}
+
+static int journal_ratelimit_slice_build_json(JournalRateLimitGroup *s, JsonVariant **ret) {
+        _cleanup_(json_variant_unrefp) JsonVariant *units = NULL;
+        JsonVariant **array = NULL;
+        JournalRateLimitGroup *g;
+        size_t n = 0, i;
+        int k;
+
+        assert(s);
+        assert(ret);
+
+        LIST_FOREACH(units, g, s->units)
+                n++;
+
+        if (n > 0) {
+                array = new0(JsonVariant*, n);
+                if (!array)
+                        return -ENOMEM;
+        }
+
+        i = 0;
+        LIST_FOREACH(units, g, s->units) {
+                k = json_build(array + i,
+                               JSON_BUILD_OBJECT(
+                                               JSON_BUILD_PAIR("unit", JSON_BUILD_STRING(g->id)),
+                                               JSON_BUILD_PAIR("dropped", JSON_BUILD_UNSIGNED(g->n_dropped)),
+                                               JSON_BUILD_PAIR("suppressed", JSON_BUILD_UNSIGNED(journal_ratelimit_group_suppressed(g)))));
+                if (k < 0)
+                        goto finish;
+
+                i++;
+        }
+
+        k = json_variant_new_array(&units, array, n);
+        if (k < 0)
+                goto finish;
+
+        k = json_build(ret,
+                       JSON_BUILD_OBJECT(
+                                       JSON_BUILD_PAIR("slice", JSON_BUILD_STRING(s->id)),
+                                       JSON_BUILD_PAIR("dropped", JSON_BUILD_UNSIGNED(s->n_dropped)),
+                                       JSON_BUILD_PAIR("droppedBySliceLimit", JSON_BUILD_UNSIGNED(s->n_dropped_limit)),
+                                       JSON_BUILD_PAIR("units", JSON_BUILD_VARIANT(units))));
+
+finish:
+        json_variant_unref_many(array, i);
+        free(array);
+        return k;
+}
+
+int journal_ratelimit_build_json(JournalRateLimit *r, JsonVariant **ret) {
+        _cleanup_(json_variant_unrefp) JsonVariant *slices = NULL;
+        JsonVariant **array = NULL;
+        JournalRateLimitGroup *s;
+        size_t n = 0;
+        Iterator i;
+        int k = 0;
+
+        assert(ret);
+
+        /* Returns the number of dropped messages per slice, and per unit within each slice */
+
+        if (!hashmap_isempty(r ? r->slices : NULL)) {
+                array = new0(JsonVariant*, hashmap_size(r->slices));
+                if (!array)
+                        return -ENOMEM;
+
+                HASHMAP_FOREACH(s, r->slices, i) {
+                        k = journal_ratelimit_slice_build_json(s, array + n);
+                        if (k < 0)
+                                goto finish;
+
+                        n++;
+                }
+        }
+
+        k = json_variant_new_array(&slices, array, n);
+        if (k < 0)
+                goto finish;
+
+        k = json_build(ret, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("slices", JSON_BUILD_VARIANT(slices))));
+
+finish:
+        json_variant_unref_many(array, n);
+        free(array);
+        return k;
+}
@@ -1,10 +1,12 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 #pragma once
 
+#include "json.h"
 #include "time-util.h"
 
 typedef struct JournalRateLimit JournalRateLimit;
 
-JournalRateLimit *journal_ratelimit_new(void);
+JournalRateLimit *journal_ratelimit_new(usec_t slice_interval, unsigned slice_burst);
 void journal_ratelimit_free(JournalRateLimit *r);
-int journal_ratelimit_test(JournalRateLimit *r, const char *id, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available);
+int journal_ratelimit_test(JournalRateLimit *r, const char *slice, const char *id, usec_t rl_interval, unsigned rl_burst, int priority, uint64_t available, usec_t ts);
+int journal_ratelimit_build_json(JournalRateLimit *r, JsonVariant **ret);
@@ -19,6 +19,7 @@
 #include "cgroup-util.h"
 #include "conf-parser.h"
 #include "dirent-util.h"
+#include "event-util.h"
 #include "extract-word.h"
 #include "fd-util.h"
 #include "fileio.h"
@@ -59,6 +60,9 @@
 
 #define USER_JOURNALS_MAX 1024
 
+/* Update our status once we waited this much longer for the disk than reported the last time */
+#define SYNC_STALL_STATUS_USEC (100 * USEC_PER_MSEC)
+
 #define DEFAULT_SYNC_INTERVAL_USEC (5*USEC_PER_MINUTE)
 #define DEFAULT_RATE_LIMIT_INTERVAL (30*USEC_PER_SEC)
 #define DEFAULT_RATE_LIMIT_BURST 10000
@@ -79,6 +83,14 @@
 
 #define IDLE_TIMEOUT_USEC (30*USEC_PER_SEC)
 
+/* How many datagrams to receive on the native and syslog sockets at once, and how much space to reserve for
+ * each. Clients of ours raise their send buffer to 8 MiB, which the kernel doubles, and datagrams can't be larger
+ * than that. The space is only reserved, not populated, and whatever a datagram populated beyond the first
+ * DATAGRAM_BATCH_SLOT_KEEP bytes is returned right after processing it. */
+#define DATAGRAM_BATCH_MAX 16U
+#define DATAGRAM_BATCH_SLOT_SIZE (16U*1024U*1024U)
+#define DATAGRAM_BATCH_SLOT_KEEP (64U*1024U)
+
 static int determine_path_usage(
                 Server *s,
                 const char *path,
@@ -638,6 +650,37 @@ void server_rotate(Server *s) {
         server_process_deferred_closes(s);
 }
 
+static void server_check_sync_stalls(Server *s) {
+        char total[FORMAT_TIMESPAN_MAX], longest[FORMAT_TIMESPAN_MAX];
+        JournalFileSyncStats stats;
+        int r;
+
+        assert(s);
+
+        /* Syncing happens on the offline worker thread, but writing to a file that is still being synced has
+         * to wait for it to finish. If that starts to add up, tell the service manager about it. */
+
+        journal_file_get_sync_stats(&stats);
+        if (stats.stall_usec < usec_add(s->sync_stall_usec_reported, SYNC_STALL_STATUS_USEC))
+                return;
+
+        s->sync_stall_usec_reported = stats.stall_usec;
+
+        log_debug("Waited %s in total for journal files to be synced to disk (%" PRIu64 " times, %s at most).",
+                  format_timespan(total, sizeof(total), stats.stall_usec, USEC_PER_MSEC),
+                  stats.n_stalls,
+                  format_timespan(longest, sizeof(longest), stats.stall_max_usec, USEC_PER_MSEC));
+
+        if (!s->notify_event_source)
+                return;
+
+        s->send_status = true;
+
+        r = sd_event_source_set_enabled(s->notify_event_source, SD_EVENT_ON);
+        if (r < 0)
+                log_warning_errno(r, "Failed to turn on notify event source: %m");
+}
+
 void server_sync(Server *s) {
         JournalFile *f;
         Iterator i;
@@ -662,6 +705,8 @@ void server_sync(Server *s) {
         }
 
         s->sync_scheduled = false;
+
+        server_check_sync_stalls(s);
 }
 
 static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
@@ -676,9 +721,9 @@ static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
         if (verbose)
                 server_space_usage_message(s, storage);
 
-        r = journal_directory_vacuum(storage->path, storage->space.limit,
-                                     storage->metrics.n_max_files, s->max_retention_usec,
-                                     &s->oldest_file_usec, verbose);
+        r = journal_directory_vacuum_cached(&storage->vacuum_state, storage->path, storage->space.limit,
+                                            storage->metrics.n_max_files, s->max_retention_usec,
+                                            &s->oldest_file_usec, verbose);
         if (r < 0 && r != -ENOENT)
                 log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
 
@@ -906,7 +951,7 @@ static void dispatch_message_real(
                 pid_t object_pid) {
 
         char source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)];
-        _cleanup_free_ char *cmdline1 = NULL, *cmdline2 = NULL;
+        _cleanup_free_ char *cmdline = NULL;
         uid_t journal_uid;
         ClientContext *o;
 
@@ -919,32 +964,9 @@ static void dispatch_message_real(
                client_context_extra_fields_n_iovec(c) <= m);
 
         if (c) {
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->pid, pid_t, pid_is_valid, PID_FMT, "_PID");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->uid, uid_t, uid_is_valid, UID_FMT, "_UID");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->gid, gid_t, gid_is_valid, GID_FMT, "_GID");
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->comm, "_COMM"); /* At most TASK_COMM_LENGTH (16 bytes) */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->exe, "_EXE"); /* A path, so at most PATH_MAX (4096 bytes) */
-
-                if (c->cmdline)
-                        /* At most _SC_ARG_MAX (2MB usually), which is too much to put on stack.
-                         * Let's use a heap allocation for this one. */
-                        cmdline1 = set_iovec_string_field(iovec, &n, "_CMDLINE=", c->cmdline);
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->capeff, "_CAP_EFFECTIVE"); /* Read from /proc/.../status */
-                IOVEC_ADD_SIZED_FIELD(iovec, n, c->label, c->label_size, "_SELINUX_CONTEXT");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->auditid, uint32_t, audit_session_is_valid, "%" PRIu32, "_AUDIT_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->loginuid, uid_t, uid_is_valid, UID_FMT, "_AUDIT_LOGINUID");
-
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->cgroup, "_SYSTEMD_CGROUP"); /* A path */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->session, "_SYSTEMD_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->owner_uid, uid_t, uid_is_valid, UID_FMT, "_SYSTEMD_OWNER_UID");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->unit, "_SYSTEMD_UNIT"); /* Unit names are bounded by UNIT_NAME_MAX */
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_unit, "_SYSTEMD_USER_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->slice, "_SYSTEMD_SLICE");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_slice, "_SYSTEMD_USER_SLICE");
-
-                IOVEC_ADD_ID128_FIELD(iovec, n, c->invocation_id, "_SYSTEMD_INVOCATION_ID");
+                /* The client's metadata is formatted already, see client_context_format_meta_fields() */
+                memcpy_safe(iovec + n, c->meta_fields_iovec, c->meta_fields_n_iovec * sizeof(struct iovec));
+                n += c->meta_fields_n_iovec;
 
                 if (c->extra_fields_n_iovec > 0) {
                         memcpy(iovec + n, c->extra_fields_iovec, c->extra_fields_n_iovec * sizeof(struct iovec));
@@ -964,7 +986,7 @@ static void dispatch_message_real(
                 IOVEC_ADD_STRING_FIELD(iovec, n, o->comm, "OBJECT_COMM");
                 IOVEC_ADD_STRING_FIELD(iovec, n, o->exe, "OBJECT_EXE");
                 if (o->cmdline)
-                        cmdline2 = set_iovec_string_field(iovec, &n, "OBJECT_CMDLINE=", o->cmdline);
+                        cmdline = set_iovec_string_field(iovec, &n, "OBJECT_CMDLINE=", o->cmdline);
 
                 IOVEC_ADD_STRING_FIELD(iovec, n, o->capeff, "OBJECT_CAP_EFFECTIVE");
                 IOVEC_ADD_SIZED_FIELD(iovec, n, o->label, o->label_size, "OBJECT_SELINUX_CONTEXT");
@@ -1099,7 +1121,9 @@ void server_dispatch_message(
         if (c && c->unit) {
                 (void) determine_space(s, &available, NULL);
 
-                rl = journal_ratelimit_test(s->ratelimit, c->unit, c->log_ratelimit_interval, c->log_ratelimit_burst, priority & LOG_PRIMASK, available);
+                rl = journal_ratelimit_test(s->ratelimit, c->slice, c->unit,
+                                            c->log_ratelimit_interval, c->log_ratelimit_burst,
+                                            priority & LOG_PRIMASK, available, now(CLOCK_MONOTONIC));
                 if (rl == 0)
                         return;
 
@@ -1251,76 +1275,35 @@ static int server_relinquish_var(Server *s) {
         return 0;
 }
 
-int server_process_datagram(
-                sd_event_source *es,
+/* We use NAME_MAX space for the SELinux label here. The kernel currently enforces no limit, but according to
+ * suggestions from the SELinux people this will change and it will probably be identical to NAME_MAX. For now we
+ * use that, but this should be updated one day when the final limit is known. */
+#define DATAGRAM_CONTROL_SIZE                                   \
+        (CMSG_SPACE(sizeof(struct ucred)) +                     \
+         CMSG_SPACE(sizeof(struct timeval)) +                   \
+         CMSG_SPACE(sizeof(int)) + /* fd */                     \
+         CMSG_SPACE(NAME_MAX) /* selinux label */)
+
+static void server_process_datagram_message(
+                Server *s,
                 int fd,
-                uint32_t revents,
-                void *userdata) {
+                struct msghdr *msghdr,
+                char *buffer,
+                size_t n) {
 
-        Server *s = userdata;
         struct ucred *ucred = NULL;
         struct timeval *tv = NULL;
         struct cmsghdr *cmsg;
         char *label = NULL;
-        size_t label_len = 0, m;
-        struct iovec iovec;
-        ssize_t n;
-        int *fds = NULL, v = 0;
+        size_t label_len = 0;
+        int *fds = NULL;
         size_t n_fds = 0;
 
-        /* We use NAME_MAX space for the SELinux label here. The kernel currently enforces no limit, but
-         * according to suggestions from the SELinux people this will change and it will probably be
-         * identical to NAME_MAX. For now we use that, but this should be updated one day when the final
-         * limit is known. */
-        CMSG_BUFFER_TYPE(CMSG_SPACE(sizeof(struct ucred)) +
-                         CMSG_SPACE(sizeof(struct timeval)) +
-                         CMSG_SPACE(sizeof(int)) + /* fd */
-                         CMSG_SPACE(NAME_MAX) /* selinux label */) control;
-
-        union sockaddr_union sa = {};
-
-        struct msghdr msghdr = {
-                .msg_iov = &iovec,
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-                .msg_name = &sa,
-                .msg_namelen = sizeof(sa),
-        };
-
         assert(s);
-        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
-
-        if (revents != EPOLLIN)
-                return log_error_errno(SYNTHETIC_ERRNO(EIO),
-                                       "Got invalid event from epoll for datagram fd: %" PRIx32,
-                                       revents);
-
-        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
-         * it.) */
-        (void) ioctl(fd, SIOCINQ, &v);
-
-        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
-        m = PAGE_ALIGN(MAX3((size_t) v + 1,
-                            (size_t) LINE_MAX,
-                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
-
-        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
-                return log_oom();
+        assert(msghdr);
+        assert(buffer);
 
-        iovec = IOVEC_MAKE(s->buffer, s->buffer_size - 1); /* Leave room for trailing NUL we add later */
-
-        n = recvmsg_safe(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
-        if (IN_SET(n, -EINTR, -EAGAIN))
-                return 0;
-        if (n == -EXFULL) {
-                log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
-                return 0;
-        }
-        if (n < 0)
-                return log_error_errno(n, "recvmsg() failed: %m");
-
-        CMSG_FOREACH(cmsg, &msghdr)
+        CMSG_FOREACH(cmsg, msghdr)
                 if (cmsg->cmsg_level == SOL_SOCKET &&
                     cmsg->cmsg_type == SCM_CREDENTIALS &&
                     cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
@@ -1344,17 +1327,17 @@ int server_process_datagram(
                 }
 
         /* And a trailing NUL, just in case */
-        s->buffer[n] = 0;
+        buffer[n] = 0;
 
         if (fd == s->syslog_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_syslog_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_syslog_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via syslog socket. Ignoring.");
 
         } else if (fd == s->native_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_native_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_native_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n == 0 && n_fds == 1)
                         server_process_native_file(s, fds[0], ucred, tv, label, label_len);
                 else if (n_fds > 0)
@@ -1364,12 +1347,166 @@ int server_process_datagram(
                 assert(fd == s->audit_fd);
 
                 if (n > 0 && n_fds == 0)
-                        server_process_audit_message(s, s->buffer, n, ucred, &sa, msghdr.msg_namelen);
+                        server_process_audit_message(s, buffer, n, ucred, msghdr->msg_name, msghdr->msg_namelen);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via audit socket. Ignoring.");
         }
 
         close_many(fds, n_fds);
+}
+
+static int server_process_datagram_batch(Server *s, int fd) {
+        CMSG_BUFFER_TYPE(DATAGRAM_CONTROL_SIZE) control[DATAGRAM_BATCH_MAX];
+        struct mmsghdr mmsghdr[DATAGRAM_BATCH_MAX];
+        struct iovec iovec[DATAGRAM_BATCH_MAX];
+        size_t i;
+        int n;
+
+        assert(s);
+        assert(fd == s->native_fd || fd == s->syslog_fd);
+
+        /* Receives up to DATAGRAM_BATCH_MAX datagrams with a single recvmmsg() call. Since we only learn the
+         * size of the first datagram in advance, each one gets a slot large enough for anything a client of
+         * ours can send, in a sparse anonymous mapping. Only the pages datagrams are actually written to get
+         * populated. Returns -EOPNOTSUPP if batching is not available, in which case the caller should
+         * receive the datagram the classic way. */
+
+        if (s->batch_buffer == MAP_FAILED)
+                return -EOPNOTSUPP;
+
+        if (!s->batch_buffer) {
+                s->batch_buffer = mmap(NULL, DATAGRAM_BATCH_MAX * DATAGRAM_BATCH_SLOT_SIZE, PROT_READ|PROT_WRITE,
+                                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+                if (s->batch_buffer == MAP_FAILED) {
+                        log_debug_errno(errno, "Failed to allocate datagram batch buffer, receiving datagrams one by one: %m");
+                        return -EOPNOTSUPP;
+                }
+        }
+
+        for (i = 0; i < DATAGRAM_BATCH_MAX; i++) {
+                /* Leave room for trailing NUL we add later */
+                iovec[i] = IOVEC_MAKE(s->batch_buffer + i * DATAGRAM_BATCH_SLOT_SIZE, DATAGRAM_BATCH_SLOT_SIZE - 1);
+
+                mmsghdr[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_iov = iovec + i,
+                                .msg_iovlen = 1,
+                                .msg_control = control + i,
+                                .msg_controllen = sizeof(control[i]),
+                        },
+                };
+        }
+
+        n = recvmmsg(fd, mmsghdr, DATAGRAM_BATCH_MAX, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, NULL);
+        if (n < 0) {
+                if (IN_SET(errno, EINTR, EAGAIN))
+                        return 0;
+                if (IN_SET(errno, ENOSYS, EPERM)) {
+                        log_debug_errno(errno, "recvmmsg() not available, receiving datagrams one by one: %m");
+                        (void) munmap(s->batch_buffer, DATAGRAM_BATCH_MAX * DATAGRAM_BATCH_SLOT_SIZE);
+                        s->batch_buffer = MAP_FAILED;
+                        return -EOPNOTSUPP;
+                }
+
+                return log_error_errno(errno, "recvmmsg() failed: %m");
+        }
+
+        for (i = 0; i < (size_t) n; i++) {
+                struct msghdr *m = &mmsghdr[i].msg_hdr;
+                size_t l = mmsghdr[i].msg_len;
+
+                if (FLAGS_SET(m->msg_flags, MSG_CTRUNC)) {
+                        cmsg_close_all(m);
+                        log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
+                        continue;
+                }
+                if (FLAGS_SET(m->msg_flags, MSG_TRUNC)) {
+                        cmsg_close_all(m);
+                        log_warning("Got datagram larger than %zu bytes, ignoring.", (size_t) DATAGRAM_BATCH_SLOT_SIZE - 1);
+                        continue;
+                }
+
+                server_process_datagram_message(s, fd, m, iovec[i].iov_base, l);
+
+                /* Don't let one huge message pin its memory forever */
+                if (l >= DATAGRAM_BATCH_SLOT_KEEP)
+                        (void) madvise((uint8_t*) iovec[i].iov_base + DATAGRAM_BATCH_SLOT_KEEP,
+                                       PAGE_ALIGN(l + 1) - DATAGRAM_BATCH_SLOT_KEEP, MADV_DONTNEED);
+        }
+
+        if (n > 1)
+                log_debug("Received %i datagrams in one batch.", n);
+
+        server_refresh_idle_timer(s);
+        return 0;
+}
+
+int server_process_datagram(
+                sd_event_source *es,
+                int fd,
+                uint32_t revents,
+                void *userdata) {
+
+        Server *s = userdata;
+        size_t m;
+        struct iovec iovec;
+        ssize_t n;
+        int v = 0, r;
+
+        CMSG_BUFFER_TYPE(DATAGRAM_CONTROL_SIZE) control;
+
+        union sockaddr_union sa = {};
+
+        struct msghdr msghdr = {
+                .msg_iov = &iovec,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+                .msg_name = &sa,
+                .msg_namelen = sizeof(sa),
+        };
+
+        assert(s);
+        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
+
+        if (revents != EPOLLIN)
+                return log_error_errno(SYNTHETIC_ERRNO(EIO),
+                                       "Got invalid event from epoll for datagram fd: %" PRIx32,
+                                       revents);
+
+        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
+         * it.) */
+        (void) ioctl(fd, SIOCINQ, &v);
+
+        /* Under load the native and syslog sockets usually have a number of small datagrams queued, fetch
+         * as many of them as we can in one go. */
+        if (fd != s->audit_fd && (size_t) v < DATAGRAM_BATCH_SLOT_SIZE) {
+                r = server_process_datagram_batch(s, fd);
+                if (r != -EOPNOTSUPP)
+                        return r;
+        }
+
+        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
+        m = PAGE_ALIGN(MAX3((size_t) v + 1,
+                            (size_t) LINE_MAX,
+                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+
+        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
+                return log_oom();
+
+        iovec = IOVEC_MAKE(s->buffer, s->buffer_size - 1); /* Leave room for trailing NUL we add later */
+
+        n = recvmsg_safe(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        if (IN_SET(n, -EINTR, -EAGAIN))
+                return 0;
+        if (n == -EXFULL) {
+                log_warning("Got message with truncated control data (too many fds sent?), ignoring.");
+                return 0;
+        }
+        if (n < 0)
+                return log_error_errno(n, "recvmsg() failed: %m");
+
+        server_process_datagram_message(s, fd, &msghdr, s->buffer, n);
 
         server_refresh_idle_timer(s);
         return 0;
@@ -1800,12 +1937,31 @@ static int dispatch_notify_event(sd_event_source *es, int fd, uint32_t revents,
                 s->send_watchdog = false;
                 log_debug("Sent WATCHDOG=1 notification.");
 
+        } else if (s->send_status) {
+                char p[STRLEN("STATUS=Processing requests, waited  for disk syncs so far.") + FORMAT_TIMESPAN_MAX],
+                        ts[FORMAT_TIMESPAN_MAX];
+                ssize_t l;
+
+                xsprintf(p, "STATUS=Processing requests, waited %s for disk syncs so far.",
+                         format_timespan(ts, sizeof(ts), s->sync_stall_usec_reported, USEC_PER_MSEC));
+
+                l = send(s->notify_fd, p, strlen(p), MSG_DONTWAIT);
+                if (l < 0) {
+                        if (errno == EAGAIN)
+                                return 0;
+
+                        return log_error_errno(errno, "Failed to send STATUS= notification message: %m");
+                }
+
+                s->send_status = false;
+                log_debug("Sent STATUS= notification.");
+
         } else if (s->stdout_streams_notify_queue)
                 /* Dispatch one stream notification event */
                 stdout_stream_send_notify(s->stdout_streams_notify_queue);
 
         /* Leave us enabled if there's still more to do. */
-        if (s->send_watchdog || s->stdout_streams_notify_queue)
+        if (s->send_watchdog || s->send_status || s->stdout_streams_notify_queue)
                 return 0;
 
         /* There was nothing to do anymore, let's turn ourselves off. */
@@ -1967,6 +2123,140 @@ static int vl_method_synchronize(Varlink *link, JsonVariant *parameters, Varlink
         return 0;
 }
 
+static int vl_method_get_statistics(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        JournalFileSyncStats stats;
+        Server *s = userdata;
+
+        assert(link);
+        assert(s);
+
+        if (json_variant_elements(parameters) > 0)
+                return varlink_error_invalid_parameter(link, parameters);
+
+        journal_file_get_sync_stats(&stats);
+
+        return varlink_replyb(link,
+                              JSON_BUILD_OBJECT(
+                                              JSON_BUILD_PAIR("clientContexts", JSON_BUILD_UNSIGNED(hashmap_size(s->client_contexts))),
+                                              JSON_BUILD_PAIR("clientContextHits", JSON_BUILD_UNSIGNED(s->client_contexts_hits)),
+                                              JSON_BUILD_PAIR("clientContextMisses", JSON_BUILD_UNSIGNED(s->client_contexts_misses)),
+                                              JSON_BUILD_PAIR("clientContextRefreshes", JSON_BUILD_UNSIGNED(s->client_contexts_refreshes)),
+                                              JSON_BUILD_PAIR("syncs", JSON_BUILD_UNSIGNED(stats.n_syncs)),
+                                              JSON_BUILD_PAIR("syncStalls", JSON_BUILD_UNSIGNED(stats.n_stalls)),
+                                              JSON_BUILD_PAIR("syncStallUSec", JSON_BUILD_UNSIGNED(stats.stall_usec)),
+                                              JSON_BUILD_PAIR("syncStallMaxUSec", JSON_BUILD_UNSIGNED(stats.stall_max_usec))));
+}
+
+static int vl_method_get_rate_limits(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        Server *s = userdata;
+        int r;
+
+        assert(link);
+        assert(s);
+
+        if (json_variant_elements(parameters) > 0)
+                return varlink_error_invalid_parameter(link, parameters);
+
+        r = journal_ratelimit_build_json(s->ratelimit, &v);
+        if (r < 0)
+                return r;
+
+        return varlink_reply(link, v);
+}
+
+static int build_event_source_profile_json(EventSourceProfile *p, JsonVariant **ret) {
+        _cleanup_(json_variant_unrefp) JsonVariant *latency = NULL;
+        size_t i, n;
+        int r;
+
+        assert(p);
+        assert(ret);
+
+        /* Skip the empty buckets at the end, latencies of hours don't happen */
+        for (n = ELEMENTSOF(p->latency); n > 1 && p->latency[n - 1] == 0; n--)
+                ;
+
+        for (i = 0; i < n; i++) {
+                _cleanup_(json_variant_unrefp) JsonVariant *u = NULL;
+
+                r = json_variant_new_unsigned(&u, p->latency[i]);
+                if (r < 0)
+                        return r;
+
+                r = json_variant_append_array(&latency, u);
+                if (r < 0)
+                        return r;
+        }
+
+        return json_build(ret,
+                          JSON_BUILD_OBJECT(
+                                          JSON_BUILD_PAIR("description", JSON_BUILD_STRING(p->description)),
+                                          JSON_BUILD_PAIR("dispatches", JSON_BUILD_UNSIGNED(p->n_dispatched)),
+                                          JSON_BUILD_PAIR("totalUSec", JSON_BUILD_UNSIGNED(p->total_usec)),
+                                          JSON_BUILD_PAIR("maxUSec", JSON_BUILD_UNSIGNED(p->max_usec)),
+                                          JSON_BUILD_PAIR("latencyLog2USec", JSON_BUILD_VARIANT(latency))));
+}
+
+static int build_event_profile_json(sd_event *e, JsonVariant **ret) {
+        _cleanup_free_ EventSourceProfile **profiles = NULL;
+        _cleanup_(json_variant_unrefp) JsonVariant *sources = NULL;
+        JsonVariant **array = NULL;
+        size_t n_profiles, n = 0;
+        int r;
+
+        assert(e);
+        assert(ret);
+
+        r = event_get_source_profiles(e, &profiles, &n_profiles);
+        if (r < 0)
+                return r;
+
+        if (n_profiles > 0) {
+                array = new0(JsonVariant*, n_profiles);
+                if (!array)
+                        return -ENOMEM;
+        }
+
+        for (; n < n_profiles; n++) {
+                r = build_event_source_profile_json(profiles[n], array + n);
+                if (r < 0)
+                        goto finish;
+        }
+
+        r = json_variant_new_array(&sources, array, n);
+        if (r < 0)
+                goto finish;
+
+        r = json_build(ret,
+                       JSON_BUILD_OBJECT(
+                                       JSON_BUILD_PAIR("enabled", JSON_BUILD_BOOLEAN(sd_event_get_profiling(e) > 0)),
+                                       JSON_BUILD_PAIR("sources", JSON_BUILD_VARIANT(sources))));
+
+finish:
+        json_variant_unref_many(array, n);
+        free(array);
+        return r;
+}
+
+static int vl_method_get_event_loop_profile(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        Server *s = userdata;
+        int r;
+
+        assert(link);
+        assert(s);
+
+        if (json_variant_elements(parameters) > 0)
+                return varlink_error_invalid_parameter(link, parameters);
+
+        r = build_event_profile_json(s->event, &v);
+        if (r < 0)
+                return r;
+
+        return varlink_reply(link, v);
+}
+
 static int vl_method_rotate(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
         Server *s = userdata;
 
@@ -2054,7 +2344,10 @@ static int server_open_varlink(Server *s, const char *socket, int fd) {
                         "io.systemd.Journal.Synchronize",   vl_method_synchronize,
                         "io.systemd.Journal.Rotate",        vl_method_rotate,
                         "io.systemd.Journal.FlushToVar",    vl_method_flush_to_var,
-                        "io.systemd.Journal.RelinquishVar", vl_method_relinquish_var);
+                        "io.systemd.Journal.RelinquishVar", vl_method_relinquish_var,
+                        "io.systemd.Journal.GetStatistics", vl_method_get_statistics,
+                        "io.systemd.Journal.GetRateLimits", vl_method_get_rate_limits,
+                        "io.systemd.Journal.GetEventLoopProfile", vl_method_get_event_loop_profile);
         if (r < 0)
                 return r;
 
@@ -2260,6 +2553,12 @@ int server_init(Server *s, const char *namespace) {
                 s->ratelimit_interval = s->ratelimit_burst = 0;
         }
 
+        if (!!s->slice_ratelimit_interval != !!s->slice_ratelimit_burst) {
+                log_debug("Setting both slice rate limit interval and burst from "USEC_FMT",%u to 0,0",
+                          s->slice_ratelimit_interval, s->slice_ratelimit_burst);
+                s->slice_ratelimit_interval = s->slice_ratelimit_burst = 0;
+        }
+
         e = getenv("RUNTIME_DIRECTORY");
         if (e)
                 s->runtime_directory = strdup(e);
@@ -2407,7 +2706,7 @@ int server_init(Server *s, const char *namespace) {
         if (r < 0)
                 return r;
 
-        s->ratelimit = journal_ratelimit_new();
+        s->ratelimit = journal_ratelimit_new(s->slice_ratelimit_interval, s->slice_ratelimit_burst);
         if (!s->ratelimit)
                 return log_oom();
 
@@ -2438,6 +2737,7 @@ int server_init(Server *s, const char *namespace) {
 
         (void) server_connect_notify(s);
 
+        (void) client_context_watch_units(s);
         (void) client_context_acquire_default(s);
 
         r = system_journal_open(s, false, false);
@@ -2499,6 +2799,7 @@ void server_done(Server *s) {
         sd_event_source_unref(s->notify_event_source);
         sd_event_source_unref(s->watchdog_event_source);
         sd_event_source_unref(s->idle_event_source);
+        sd_event_source_unref(s->units_event_source);
         sd_event_unref(s->event);
 
         safe_close(s->syslog_fd);
@@ -2516,14 +2817,23 @@ void server_done(Server *s) {
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
         free(s->buffer);
+        if (s->batch_buffer && s->batch_buffer != MAP_FAILED)
+                (void) munmap(s->batch_buffer, DATAGRAM_BATCH_MAX * DATAGRAM_BATCH_SLOT_SIZE);
+        free(s->stream_buffer);
         free(s->tty_path);
         free(s->cgroup_root);
         free(s->hostname_field);
         free(s->runtime_storage.path);
         free(s->system_storage.path);
+
+        journal_vacuum_state_free(s->runtime_storage.vacuum_state);
+        journal_vacuum_state_free(s->system_storage.vacuum_state);
         free(s->runtime_directory);
 
-        mmap_cache_unref(s->mmap);
+        if (s->mmap) {
+                mmap_cache_stats_log_debug(s->mmap);
+                mmap_cache_unref(s->mmap);
+        }
 }
 
 static const char* const storage_table[_STORAGE_MAX] = {
@@ -11,6 +11,7 @@ typedef struct Server Server;
 #include "conf-parser.h"
 #include "hashmap.h"
 #include "journal-file.h"
+#include "journal-vacuum.h"
 #include "journald-context.h"
 #include "journald-rate-limit.h"
 #include "journald-stream.h"
@@ -57,6 +58,8 @@ typedef struct JournalStorage {
 
         JournalMetrics metrics;
         JournalStorageSpace space;
+
+        JournalVacuumState *vacuum_state;
 } JournalStorage;
 
 struct Server {
@@ -97,10 +100,19 @@ struct Server {
         char *buffer;
         size_t buffer_size;
 
+        /* Receive area for batches of datagrams, MAP_FAILED if we can't do batching */
+        char *batch_buffer;
+
+        /* Receive area shared by all stdout streams, see stdout_stream_process() */
+        char *stream_buffer;
+        size_t stream_buffer_size;
+
         JournalRateLimit *ratelimit;
         usec_t sync_interval_usec;
         usec_t ratelimit_interval;
         unsigned ratelimit_burst;
+        usec_t slice_ratelimit_interval;
+        unsigned slice_ratelimit_burst;
 
         JournalStorage runtime_storage;
         JournalStorage system_storage;
@@ -145,9 +157,13 @@ struct Server {
         bool dev_kmsg_readable:1;
 
         bool send_watchdog:1;
+        bool send_status:1;
         bool sent_notify_ready:1;
         bool sync_scheduled:1;
 
+        /* How long we have been waiting for the disk, as of the last status update */
+        usec_t sync_stall_usec_reported;
+
         char machine_id_field[sizeof("_MACHINE_ID=") + 32];
         char boot_id_field[sizeof("_BOOT_ID=") + 32];
         char *hostname_field;
@@ -169,6 +185,14 @@ struct Server {
 
         usec_t last_cache_pid_flush;
 
+        uint64_t client_contexts_hits;
+        uint64_t client_contexts_misses;
+        uint64_t client_contexts_refreshes;
+
+        /* Bumped whenever something in /run/systemd/units/ changes, see client_context_watch_units() */
+        sd_event_source *units_event_source;
+        uint64_t units_generation;
+
         ClientContext *my_context; /* the context of journald itself */
         ClientContext *pid1_context; /* the context of PID 1 */
 
@@ -39,6 +39,10 @@
 
 #define STDOUT_STREAMS_MAX 4096
 
+/* Room we keep in front of every line in the receive buffer, so that the MESSAGE= field can be written
+ * in place, instead of copying each line into a field of its own */
+#define STDOUT_STREAM_HEADROOM STRLEN("MESSAGE=")
+
 typedef enum StdoutStreamState {
         STDOUT_STREAM_IDENTIFIER,
         STDOUT_STREAM_UNIT_ID,
@@ -81,11 +85,16 @@ struct StdoutStream {
 
         bool fdstore:1;
         bool in_notify_queue:1;
+        bool context_refreshed:1;
 
+        /* The incomplete line left over from the last read, if any. Complete lines are processed straight
+         * from the server's receive buffer and never end up here. */
         char *buffer;
         size_t length;
         size_t allocated;
 
+        char *syslog_identifier; /* SYSLOG_IDENTIFIER= field, prepared once */
+
         sd_event_source *event_source;
 
         char *state_file;
@@ -128,6 +137,7 @@ void stdout_stream_free(StdoutStream *s) {
         free(s->unit_id);
         free(s->state_file);
         free(s->buffer);
+        free(s->syslog_identifier);
 
         free(s);
 }
@@ -241,18 +251,38 @@ fail:
         return log_error_errno(r, "Failed to save stream data %s: %m", s->state_file);
 }
 
+static void stdout_stream_refresh_context(StdoutStream *s) {
+        int r;
+
+        assert(s);
+
+        /* Every line read in one go comes from the same process, hence do this once per read, not per line */
+        if (s->context_refreshed)
+                return;
+
+        if (s->context)
+                (void) client_context_maybe_refresh(s->server, s->context, NULL, NULL, 0, NULL, USEC_INFINITY);
+        else if (pid_is_valid(s->ucred.pid)) {
+                r = client_context_acquire(s->server, s->ucred.pid, &s->ucred, s->label, strlen_ptr(s->label), s->unit_id, &s->context);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to acquire client context, ignoring: %m");
+        }
+
+        s->context_refreshed = true;
+}
+
+/* The line p points to must be preceded by STDOUT_STREAM_HEADROOM bytes we may overwrite */
 static int stdout_stream_log(
                 StdoutStream *s,
-                const char *p,
+                char *p,
                 LineBreak line_break) {
 
         struct iovec *iovec;
         int priority;
         char syslog_priority[] = "PRIORITY=\0";
         char syslog_facility[STRLEN("SYSLOG_FACILITY=") + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
+        char *message;
         size_t n = 0, m;
-        int r;
 
         assert(s);
         assert(p);
@@ -260,18 +290,12 @@ static int stdout_stream_log(
         assert(line_break >= 0);
         assert(line_break < _LINE_BREAK_MAX);
 
-        if (s->context)
-                (void) client_context_maybe_refresh(s->server, s->context, NULL, NULL, 0, NULL, USEC_INFINITY);
-        else if (pid_is_valid(s->ucred.pid)) {
-                r = client_context_acquire(s->server, s->ucred.pid, &s->ucred, s->label, strlen_ptr(s->label), s->unit_id, &s->context);
-                if (r < 0)
-                        log_warning_errno(r, "Failed to acquire client context, ignoring: %m");
-        }
+        stdout_stream_refresh_context(s);
 
         priority = s->priority;
 
         if (s->level_prefix)
-                syslog_parse_priority(&p, &priority, false);
+                syslog_parse_priority((const char**) &p, &priority, false);
 
         if (!client_context_test_priority(s->context, priority))
                 return 0;
@@ -305,11 +329,10 @@ static int stdout_stream_log(
                 iovec[n++] = IOVEC_MAKE_STRING(syslog_facility);
         }
 
-        if (s->identifier) {
-                syslog_identifier = strjoin("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        iovec[n++] = IOVEC_MAKE_STRING(syslog_identifier);
-        }
+        if (s->identifier && !s->syslog_identifier)
+                s->syslog_identifier = strjoin("SYSLOG_IDENTIFIER=", s->identifier);
+        if (s->syslog_identifier)
+                iovec[n++] = IOVEC_MAKE_STRING(s->syslog_identifier);
 
         static const char * const line_break_field_table[_LINE_BREAK_MAX] = {
                 [LINE_BREAK_NEWLINE]    = NULL, /* Do not add field if traditional newline */
@@ -326,9 +349,9 @@ static int stdout_stream_log(
         if (c)
                 iovec[n++] = IOVEC_MAKE_STRING(c);
 
-        message = strjoin("MESSAGE=", p);
-        if (message)
-                iovec[n++] = IOVEC_MAKE_STRING(message);
+        /* Everything in front of the line has been processed already, hence we can put the field name there */
+        message = memcpy(p - STDOUT_STREAM_HEADROOM, "MESSAGE=", STDOUT_STREAM_HEADROOM);
+        iovec[n++] = IOVEC_MAKE_STRING(message);
 
         server_dispatch_message(s->server, iovec, n, m, s->context, NULL, priority, 0);
         return 0;
@@ -474,21 +497,14 @@ static int stdout_stream_scan(
         for (;;) {
                 LineBreak line_break;
                 size_t skip, found;
-                char *end1, *end2;
-
-                end1 = memchr(p, '\n', remaining);
-                end2 = memchr(p, 0, end1 ? (size_t) (end1 - p) : remaining);
+                char *end;
 
-                if (end2) {
-                        /* We found a NUL terminator */
-                        found = end2 - p;
-                        skip = found + 1;
-                        line_break = LINE_BREAK_NUL;
-                } else if (end1) {
-                        /* We found a \n terminator */
-                        found = end1 - p;
+                end = memchr2(p, '\n', 0, remaining);
+                if (end) {
+                        /* We found a \n or NUL terminator */
+                        found = end - p;
                         skip = found + 1;
-                        line_break = LINE_BREAK_NEWLINE;
+                        line_break = *end == 0 ? LINE_BREAK_NUL : LINE_BREAK_NEWLINE;
                 } else if (remaining >= s->server->line_max) {
                         /* Force a line break after the maximum line length */
                         found = skip = s->server->line_max;
@@ -525,8 +541,8 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
         size_t limit, consumed;
         struct ucred *ucred;
         struct iovec iovec;
+        char *buffer, *p;
         ssize_t l;
-        char *p;
         int r;
 
         struct msghdr msghdr = {
@@ -543,19 +559,24 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
-        /* If the buffer is almost full, add room for another 1K */
-        if (s->length + 512 >= s->allocated) {
-                if (!GREEDY_REALLOC(s->buffer, s->allocated, s->length + 1 + 1024)) {
-                        log_oom();
-                        goto terminate;
-                }
+        /* All streams read into the same buffer, which is large enough to hold the longest line we accept. A
+         * stream only keeps the incomplete line it is left with after processing, if any, which we put in
+         * front of the newly read data. This way idle streams don't hold on to memory, and complete lines
+         * are never copied around. */
+        if (!GREEDY_REALLOC(s->server->stream_buffer, s->server->stream_buffer_size,
+                            STDOUT_STREAM_HEADROOM + s->server->line_max + 1)) {
+                log_oom();
+                goto terminate;
         }
 
-        /* Try to make use of the allocated buffer in full, but never read more than the configured line size. Also,
-         * always leave room for a terminating NUL we might need to add. */
-        limit = MIN(s->allocated - 1, s->server->line_max);
+        buffer = s->server->stream_buffer + STDOUT_STREAM_HEADROOM;
+        memcpy_safe(buffer, s->buffer, s->length);
+
+        /* Never read more than the configured line size. Also, always leave room for a terminating NUL we
+         * might need to add. */
+        limit = s->server->line_max;
         assert(s->length <= limit);
-        iovec = IOVEC_MAKE(s->buffer + s->length, limit - s->length);
+        iovec = IOVEC_MAKE(buffer + s->length, limit - s->length);
 
         l = recvmsg(s->fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
         if (l < 0) {
@@ -567,8 +588,10 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
         }
         cmsg_close_all(&msghdr);
 
+        s->context_refreshed = false;
+
         if (l == 0) {
-                (void) stdout_stream_scan(s, s->buffer, s->length, /* force_flush = */ LINE_BREAK_EOF, NULL);
+                (void) stdout_stream_scan(s, buffer, s->length, /* force_flush = */ LINE_BREAK_EOF, NULL);
                 goto terminate;
         }
 
@@ -579,15 +602,16 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
         if (ucred && ucred->pid != s->ucred.pid) {
                 /* Force out any previously half-written lines from a different process, before we switch to
                  * the new ucred structure for everything we just added */
-                r = stdout_stream_scan(s, s->buffer, s->length, /* force_flush = */ LINE_BREAK_PID_CHANGE, NULL);
+                r = stdout_stream_scan(s, buffer, s->length, /* force_flush = */ LINE_BREAK_PID_CHANGE, NULL);
                 if (r < 0)
                         goto terminate;
 
                 s->context = client_context_release(s->server, s->context);
+                s->context_refreshed = false;
 
-                p = s->buffer + s->length;
+                p = buffer + s->length;
         } else {
-                p = s->buffer;
+                p = buffer;
                 l += s->length;
         }
 
@@ -599,10 +623,18 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
         if (r < 0)
                 goto terminate;
 
-        /* Move what wasn't consumed to the front of the buffer */
+        /* Keep what wasn't consumed for the next time */
         assert(consumed <= (size_t) l);
         s->length = l - consumed;
-        memmove(s->buffer, p + consumed, s->length);
+
+        if (s->length > 0) {
+                if (!GREEDY_REALLOC(s->buffer, s->allocated, s->length)) {
+                        log_oom();
+                        goto terminate;
+                }
+
+                memcpy(s->buffer, p + consumed, s->length);
+        }
 
         return 1;
 
@@ -43,9 +43,23 @@ struct Context {
         unsigned id;
         Window *window;
 
+        /* The size of the next window we create for this context, and where the last one was, so that we
+         * can tell whether the context is scanning through a file or jumping around in it */
+        uint64_t window_size;
+        MMapFileDescriptor *last_fd;
+        uint64_t last_offset;
+        uint64_t last_size;
+
         LIST_FIELDS(Context, by_window);
 };
 
+typedef enum AccessPattern {
+        ACCESS_UNKNOWN,
+        ACCESS_FORWARD,
+        ACCESS_BACKWARD,
+        ACCESS_RANDOM,
+} AccessPattern;
+
 struct MMapFileDescriptor {
         MMapCache *cache;
         int fd;
@@ -57,7 +71,8 @@ struct MMapCache {
         unsigned n_ref;
         unsigned n_windows;
 
-        unsigned n_hit, n_missed;
+        unsigned n_context_cache_hit, n_window_list_hit, n_missed;
+        unsigned n_evicted, n_sequential, n_random;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
@@ -68,11 +83,23 @@ struct MMapCache {
 
 #define WINDOWS_MIN 64
 
+/* Windows start out at WINDOW_SIZE. Every time a context moves on to the window right next to the previous
+ * one it gets twice as large, up to WINDOW_SIZE_MAX, every time it jumps elsewhere half as large, down to
+ * WINDOW_SIZE_MIN. */
 #if ENABLE_DEBUG_MMAP_CACHE
 /* Tiny windows increase mmap activity and the chance of exposing unsafe use. */
 # define WINDOW_SIZE (page_size())
+# define WINDOW_SIZE_MIN (page_size())
+# define WINDOW_SIZE_MAX (page_size())
 #else
 # define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
+# define WINDOW_SIZE_MIN (1ULL*1024ULL*1024ULL)
+# if __SIZEOF_POINTER__ == 4
+/* Leave some address space for everybody else */
+#  define WINDOW_SIZE_MAX (8ULL*1024ULL*1024ULL)
+# else
+#  define WINDOW_SIZE_MAX (64ULL*1024ULL*1024ULL)
+# endif
 #endif
 
 MMapCache* mmap_cache_new(void) {
@@ -171,6 +198,7 @@ static Window *window_add(MMapCache *m, MMapFileDescriptor *f, int prot, bool ke
                 /* Reuse an existing one */
                 w = m->last_unused;
                 window_unlink(w);
+                m->n_evicted++;
         }
 
         *w = (Window) {
@@ -235,6 +263,10 @@ static void context_attach_window(Context *c, Window *w) {
 
         c->window = w;
         LIST_PREPEND(by_window, w->contexts, c);
+
+        c->last_fd = w->fd;
+        c->last_offset = w->offset;
+        c->last_size = w->size;
 }
 
 static Context *context_add(MMapCache *m, unsigned id) {
@@ -246,12 +278,15 @@ static Context *context_add(MMapCache *m, unsigned id) {
         if (c)
                 return c;
 
-        c = new0(Context, 1);
+        c = new(Context, 1);
         if (!c)
                 return NULL;
 
-        c->cache = m;
-        c->id = id;
+        *c = (Context) {
+                .cache = m,
+                .id = id,
+                .window_size = WINDOW_SIZE,
+        };
 
         assert(!m->contexts[id]);
         m->contexts[id] = c;
@@ -298,6 +333,7 @@ static int make_room(MMapCache *m) {
                 return 0;
 
         window_free(m->last_unused);
+        m->n_evicted++;
         return 1;
 }
 
@@ -418,6 +454,26 @@ static int mmap_try_harder(MMapCache *m, void *addr, MMapFileDescriptor *f, int
         return 0;
 }
 
+static AccessPattern context_access_pattern(Context *c, MMapFileDescriptor *f, uint64_t offset, size_t size) {
+        assert(c);
+        assert(f);
+
+        if (c->last_fd != f || c->last_size == 0)
+                return ACCESS_UNKNOWN;
+
+        /* Right after the previous window, or crossing its end? */
+        if (offset >= c->last_offset &&
+            offset < c->last_offset + c->last_size * 2)
+                return ACCESS_FORWARD;
+
+        /* Or right before it? */
+        if (offset < c->last_offset &&
+            offset + size + c->last_size > c->last_offset)
+                return ACCESS_BACKWARD;
+
+        return ACCESS_RANDOM;
+}
+
 static int add_mmap(
                 MMapCache *m,
                 MMapFileDescriptor *f,
@@ -431,6 +487,7 @@ static int add_mmap(
                 size_t *ret_size) {
 
         uint64_t woffset, wsize;
+        AccessPattern pattern;
         Context *c;
         Window *w;
         void *d;
@@ -442,21 +499,50 @@ static int add_mmap(
         assert(size > 0);
         assert(ret);
 
+        c = context_add(m, context);
+        if (!c)
+                return -ENOMEM;
+
+        pattern = context_access_pattern(c, f, offset, size);
+        switch (pattern) {
+
+        case ACCESS_FORWARD:
+        case ACCESS_BACKWARD:
+                c->window_size = MIN(c->window_size * 2, WINDOW_SIZE_MAX);
+                m->n_sequential++;
+                break;
+
+        case ACCESS_RANDOM:
+                c->window_size = MAX(c->window_size / 2, WINDOW_SIZE_MIN);
+                m->n_random++;
+                break;
+
+        default:
+                break;
+        }
+
         woffset = offset & ~((uint64_t) page_size() - 1ULL);
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
+        if (wsize < c->window_size) {
                 uint64_t delta;
 
-                delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
+                /* When scanning, map what comes next in the direction we are going, otherwise map the
+                 * surroundings of the requested range. */
+                if (pattern == ACCESS_FORWARD)
+                        delta = 0;
+                else if (pattern == ACCESS_BACKWARD)
+                        delta = c->window_size - wsize;
+                else
+                        delta = PAGE_ALIGN((c->window_size - wsize) / 2);
 
-                if (delta > offset)
+                if (delta > woffset)
                         woffset = 0;
                 else
                         woffset -= delta;
 
-                wsize = WINDOW_SIZE;
+                wsize = c->window_size;
         }
 
         if (st) {
@@ -475,9 +561,14 @@ static int add_mmap(
         if (r < 0)
                 return r;
 
-        c = context_add(m, context);
-        if (!c)
-                goto outofmem;
+        /* Tell the kernel what to read ahead. It doesn't read ahead backwards on its own, hence ask for the
+         * whole window in that case. When jumping around, reading ahead is just a waste of I/O. */
+        if (pattern == ACCESS_FORWARD)
+                (void) madvise(d, wsize, MADV_SEQUENTIAL);
+        else if (pattern == ACCESS_BACKWARD)
+                (void) madvise(d, wsize, MADV_WILLNEED);
+        else if (pattern == ACCESS_RANDOM)
+                (void) madvise(d, wsize, MADV_RANDOM);
 
         w = window_add(m, f, prot, keep_always, woffset, wsize, d);
         if (!w)
@@ -520,14 +611,14 @@ int mmap_cache_get(
         /* Check whether the current context is the right one already */
         r = try_context(m, f, prot, context, keep_always, offset, size, ret, ret_size);
         if (r != 0) {
-                m->n_hit++;
+                m->n_context_cache_hit++;
                 return r;
         }
 
         /* Search for a matching mmap */
         r = find_mmap(m, f, prot, context, keep_always, offset, size, ret, ret_size);
         if (r != 0) {
-                m->n_hit++;
+                m->n_window_list_hit++;
                 return r;
         }
 
@@ -540,7 +631,7 @@ int mmap_cache_get(
 unsigned mmap_cache_get_hit(MMapCache *m) {
         assert(m);
 
-        return m->n_hit;
+        return m->n_context_cache_hit + m->n_window_list_hit;
 }
 
 unsigned mmap_cache_get_missed(MMapCache *m) {
@@ -549,16 +640,36 @@ unsigned mmap_cache_get_missed(MMapCache *m) {
         return m->n_missed;
 }
 
-static void mmap_cache_process_sigbus(MMapCache *m) {
+void mmap_cache_stats_log_debug(MMapCache *m) {
+        assert(m);
+
+        log_debug("mmap cache statistics: %u context cache hit, %u window list hit, %u miss (%u sequential, %u random), %u evicted, %u windows",
+                  m->n_context_cache_hit, m->n_window_list_hit, m->n_missed,
+                  m->n_sequential, m->n_random, m->n_evicted, m->n_windows);
+}
+
+static void fd_invalidate_windows(MMapFileDescriptor *f) {
+        Window *w;
+
+        assert(f);
+
+        LIST_FOREACH(by_fd, w, f->windows)
+                window_invalidate(w);
+}
+
+void mmap_cache_process_sigbus_many(MMapCache **caches, size_t n_caches) {
         bool found = false;
         MMapFileDescriptor *f;
         Iterator i;
+        size_t k;
         int r;
 
-        assert(m);
+        assert(caches || n_caches == 0);
 
         /* Iterate through all triggered pages and mark their files as
-         * invalidated */
+         * invalidated. The queue of triggered pages is shared by the whole
+         * process, hence if several caches are used at the same time all of
+         * them need to be looked at together. */
         for (;;) {
                 bool ours;
                 void *addr;
@@ -572,21 +683,22 @@ static void mmap_cache_process_sigbus(MMapCache *m) {
                 }
 
                 ours = false;
-                HASHMAP_FOREACH(f, m->fds, i) {
-                        Window *w;
+                for (k = 0; k < n_caches && !ours; k++)
+                        HASHMAP_FOREACH(f, caches[k]->fds, i) {
+                                Window *w;
+
+                                LIST_FOREACH(by_fd, w, f->windows) {
+                                        if ((uint8_t*) addr >= (uint8_t*) w->ptr &&
+                                            (uint8_t*) addr < (uint8_t*) w->ptr + w->size) {
+                                                found = ours = f->sigbus = true;
+                                                break;
+                                        }
+                                }
 
-                        LIST_FOREACH(by_fd, w, f->windows) {
-                                if ((uint8_t*) addr >= (uint8_t*) w->ptr &&
-                                    (uint8_t*) addr < (uint8_t*) w->ptr + w->size) {
-                                        found = ours = f->sigbus = true;
+                                if (ours)
                                         break;
-                                }
                         }
 
-                        if (ours)
-                                break;
-                }
-
                 /* Didn't find a matching window, give up */
                 if (!ours) {
                         log_error("Unknown SIGBUS page, aborting.");
@@ -601,15 +713,16 @@ static void mmap_cache_process_sigbus(MMapCache *m) {
         if (_likely_(!found))
                 return;
 
-        HASHMAP_FOREACH(f, m->fds, i) {
-                Window *w;
+        for (k = 0; k < n_caches; k++)
+                HASHMAP_FOREACH(f, caches[k]->fds, i)
+                        if (f->sigbus)
+                                fd_invalidate_windows(f);
+}
 
-                if (!f->sigbus)
-                        continue;
+static void mmap_cache_process_sigbus(MMapCache *m) {
+        assert(m);
 
-                LIST_FOREACH(by_fd, w, f->windows)
-                        window_invalidate(w);
-        }
+        mmap_cache_process_sigbus_many(&m, 1);
 }
 
 bool mmap_cache_got_sigbus(MMapCache *m, MMapFileDescriptor *f) {
@@ -621,6 +734,25 @@ bool mmap_cache_got_sigbus(MMapCache *m, MMapFileDescriptor *f) {
         return f->sigbus;
 }
 
+bool mmap_cache_fd_got_sigbus(MMapFileDescriptor *f) {
+        assert(f);
+
+        /* Unlike mmap_cache_got_sigbus() this does not look at the queue of
+         * triggered pages, it only reports what was already processed. */
+
+        return f->sigbus;
+}
+
+void mmap_cache_fd_set_sigbus(MMapFileDescriptor *f) {
+        assert(f);
+
+        /* Marks the file as invalidated, for example because it was found
+         * to be truncated while it was accessed through another cache. */
+
+        f->sigbus = true;
+        fd_invalidate_windows(f);
+}
+
 MMapFileDescriptor* mmap_cache_add_fd(MMapCache *m, int fd) {
         MMapFileDescriptor *f;
         int r;
@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <linux/magic.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/inotify.h>
 #include <sys/vfs.h>
@@ -16,6 +17,7 @@
 #include "catalog.h"
 #include "compress.h"
 #include "dirent-util.h"
+#include "env-util.h"
 #include "env-file.h"
 #include "escape.h"
 #include "fd-util.h"
@@ -33,6 +35,7 @@
 #include "lookup3.h"
 #include "nulstr-util.h"
 #include "path-util.h"
+#include "prioq.h"
 #include "process-util.h"
 #include "replace-var.h"
 #include "stat-util.h"
@@ -104,6 +107,27 @@ static int journal_put_error(sd_journal *j, int r, const char *path) {
         return 0;
 }
 
+static void open_deferred_files_for_location(sd_journal *j, direction_t direction);
+
+static void files_prioq_clear(sd_journal *j) {
+        JournalFile *f;
+
+        assert(j);
+
+        while ((f = prioq_pop(j->files_prioq)))
+                f->prioq_idx = PRIOQ_IDX_NULL;
+
+        j->files_prioq = prioq_free(j->files_prioq);
+}
+
+static void files_prioq_remove(sd_journal *j, JournalFile *f) {
+        assert(j);
+        assert(f);
+
+        (void) prioq_remove(j->files_prioq, f, &f->prioq_idx);
+        f->prioq_idx = PRIOQ_IDX_NULL;
+}
+
 static void detach_location(sd_journal *j) {
         Iterator i;
         JournalFile *f;
@@ -113,6 +137,8 @@ static void detach_location(sd_journal *j) {
         j->current_file = NULL;
         j->current_field = 0;
 
+        files_prioq_clear(j);
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i)
                 journal_file_reset_location(f);
 }
@@ -817,8 +843,242 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         }
 }
 
+/* Finding the first entry after a seek means bisecting the entry arrays of every single file, which for
+ * archived files that dropped out of the page cache is dominated by I/O. If many files need that at once,
+ * spread them over a couple of threads. */
+#define PARALLEL_SEEK_FILES_MIN 16U
+#define PARALLEL_SEEK_THREADS_MAX 8U
+
+typedef struct SeekJob {
+        JournalFile *file;
+        MMapCache *cache;
+        MMapFileDescriptor *cache_fd;
+} SeekJob;
+
+typedef struct SeekJobs {
+        sd_journal *journal;
+        SeekJob *jobs;
+        unsigned n_jobs;
+        unsigned next;
+        MMapCache *caches[PARALLEL_SEEK_THREADS_MAX];
+        unsigned n_caches;
+        unsigned next_cache;
+        direction_t direction;
+} SeekJobs;
+
+static void seek_file_with_cache(sd_journal *j, SeekJob *job, direction_t direction, MMapCache *m) {
+        JournalFile *f = job->file;
+        MMapFileDescriptor *saved_fd = f->cache_fd;
+        MMapCache *saved_mmap = f->mmap;
+        HashItem *data_hash_table = f->data_hash_table, *field_hash_table = f->field_hash_table;
+        BloomFilterObject *bloom_filter = f->bloom_filter;
+        int r;
+
+        f->cache_fd = mmap_cache_add_fd(m, f->fd);
+        if (!f->cache_fd) {
+                f->cache_fd = saved_fd;
+                return;
+        }
+        f->mmap = m;
+
+        /* Errors are left for the caller, which will simply try again and then drop the file */
+        r = next_beyond_location(j, f, direction);
+        if (r == 0)
+                f->location_type = LOCATION_TAIL;
+
+        /* Anything we mapped through the private cache goes away with it later */
+        if (f->data_hash_table != data_hash_table) {
+                f->data_hash_table = NULL;
+                f->data_hash_table_offset = 0;
+        }
+        if (f->field_hash_table != field_hash_table)
+                f->field_hash_table = NULL;
+        if (f->bloom_filter != bloom_filter)
+                f->bloom_filter = NULL;
+
+        /* The windows are only released once all threads are done, see seek_jobs_finish() */
+        job->cache = m;
+        job->cache_fd = f->cache_fd;
+
+        f->cache_fd = saved_fd;
+        f->mmap = saved_mmap;
+}
+
+static void *seek_jobs_thread(void *arg) {
+        SeekJobs *s = arg;
+        MMapCache *m;
+        unsigned i;
+
+        (void) pthread_setname_np(pthread_self(), "journal-seek");
+
+        /* The mmap cache is not thread-safe, hence every thread maps the files it looks at through its own
+         * cache. */
+        i = __sync_fetch_and_add(&s->next_cache, 1);
+        assert(i < s->n_caches);
+        m = s->caches[i];
+
+        for (;;) {
+                i = __sync_fetch_and_add(&s->next, 1);
+                if (i >= s->n_jobs)
+                        break;
+
+                seek_file_with_cache(s->journal, s->jobs + i, s->direction, m);
+        }
+
+        return NULL;
+}
+
+static void seek_jobs_finish(SeekJobs *s) {
+        MMapCache *caches[1 + PARALLEL_SEEK_THREADS_MAX];
+        unsigned i;
+
+        assert(s);
+
+        /* The queue of pages that triggered SIGBUS is shared by all threads, hence it may only be processed
+         * once all of them are done, and against all caches at once, including the one of the journal
+         * itself, which might have entries queued from before. */
+        caches[0] = s->journal->mmap;
+        memcpy(caches + 1, s->caches, s->n_caches * sizeof(MMapCache*));
+        mmap_cache_process_sigbus_many(caches, 1 + s->n_caches);
+
+        for (i = 0; i < s->n_jobs; i++) {
+                SeekJob *job = s->jobs + i;
+
+                if (!job->cache_fd)
+                        continue;
+
+                /* If the file was truncated under us, whatever we found in it is garbage. Carry the
+                 * information over to the file's own cache, which from now on makes it look empty, just
+                 * like when the SIGBUS had hit there, and forget the location. */
+                if (mmap_cache_fd_got_sigbus(job->cache_fd)) {
+                        log_debug("File %s was truncated while positioning it.", job->file->path);
+                        mmap_cache_fd_set_sigbus(job->file->cache_fd);
+                        journal_file_reset_location(job->file);
+                }
+
+                mmap_cache_free_fd(job->cache, job->cache_fd);
+        }
+
+        for (i = 0; i < s->n_caches; i++)
+                mmap_cache_unref(s->caches[i]);
+}
+
+static bool file_needs_seek(JournalFile *f, direction_t direction) {
+        assert(f);
+
+        /* Mirrors next_beyond_location(): a file needs to be positioned from scratch unless it already was
+         * for this direction. */
+        return f->prioq_idx == PRIOQ_IDX_NULL &&
+                (f->last_direction != direction ||
+                 (f->current_offset == 0 && f->location_type != LOCATION_TAIL));
+}
+
+static void seek_files_parallel(sd_journal *j, const void **files, unsigned n_files, direction_t direction) {
+        _cleanup_free_ SeekJob *jobs = NULL;
+        pthread_t threads[PARALLEL_SEEK_THREADS_MAX - 1];
+        unsigned i, n = 0, n_threads = 0, n_cpus;
+        sigset_t ss, saved_ss;
+        SeekJobs s;
+        long k;
+        int r;
+
+        assert(j);
+
+        if (n_files < PARALLEL_SEEK_FILES_MIN)
+                return;
+
+        r = getenv_bool("SYSTEMD_JOURNAL_PARALLEL_SEEK");
+        if (r == 0)
+                return;
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_PARALLEL_SEEK environment variable, ignoring.");
+
+        k = sysconf(_SC_NPROCESSORS_ONLN);
+        n_cpus = k > 1 ? (unsigned) MIN(k, (long) PARALLEL_SEEK_THREADS_MAX) : 1;
+        if (n_cpus <= 1)
+                return;
+
+        for (i = 0; i < n_files; i++)
+                if (file_needs_seek((JournalFile*) files[i], direction))
+                        n++;
+
+        if (n < PARALLEL_SEEK_FILES_MIN)
+                return;
+
+        jobs = new0(SeekJob, n);
+        if (!jobs)
+                return;
+
+        n = 0;
+        for (i = 0; i < n_files; i++)
+                if (file_needs_seek((JournalFile*) files[i], direction))
+                        jobs[n++].file = (JournalFile*) files[i];
+
+        s = (SeekJobs) {
+                .journal = j,
+                .jobs = jobs,
+                .n_jobs = n,
+                .direction = direction,
+        };
+
+        /* One cache for each thread we might start, and one for ourselves */
+        for (i = 0; i < MIN(n_cpus, n / (PARALLEL_SEEK_FILES_MIN / 2)); i++) {
+                s.caches[i] = mmap_cache_new();
+                if (!s.caches[i])
+                        break;
+
+                s.n_caches++;
+        }
+        if (s.n_caches < 2) {
+                /* Not worth it */
+                for (i = 0; i < s.n_caches; i++)
+                        mmap_cache_unref(s.caches[i]);
+                return;
+        }
+
+        /* Like the offlining thread, these threads shouldn't handle any signals, except for SIGBUS, which
+         * the sigbus logic needs to see on the thread that touched the truncated file. */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(sigdelset(&ss, SIGBUS) >= 0);
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0) {
+                for (i = 0; i < s.n_caches; i++)
+                        mmap_cache_unref(s.caches[i]);
+                return;
+        }
+
+        for (i = 0; i < s.n_caches - 1; i++) {
+                r = pthread_create(threads + n_threads, NULL, seek_jobs_thread, &s);
+                if (r > 0) {
+                        log_debug_errno(r, "Failed to start seek thread, ignoring: %m");
+                        break;
+                }
+
+                n_threads++;
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        (void) seek_jobs_thread(&s);
+
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        seek_jobs_finish(&s);
+
+        log_debug("Positioned %u journal files using %u additional threads.", n, n_threads);
+}
+
+static int files_prioq_compare_down(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) a, (JournalFile*) b);
+}
+
+static int files_prioq_compare_up(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) b, (JournalFile*) a);
+}
+
 static int real_journal_next(sd_journal *j, direction_t direction) {
-        JournalFile *new_file = NULL;
+        JournalFile *new_file;
         unsigned i, n_files;
         const void **files;
         Object *o;
@@ -827,13 +1087,34 @@ static int real_journal_next(sd_journal *j, direction_t direction) {
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
 
+        /* Files that are positioned on their next candidate entry are kept in a priority queue, so that we
+         * don't have to compare all of them again for every single entry. Only the file we took the last
+         * entry from, files that were at their end and files that were added since need to be looked at. The
+         * queue is dropped whenever the location is reset or we change direction. */
+        if (j->files_prioq && j->files_prioq_direction != direction)
+                files_prioq_clear(j);
+
+        if (!j->files_prioq || j->deferred_files_dirty)
+                open_deferred_files_for_location(j, direction);
+
         r = iterated_cache_get(j->files_cache, NULL, &files, &n_files);
         if (r < 0)
                 return r;
 
+        r = prioq_ensure_allocated(&j->files_prioq,
+                                   direction == DIRECTION_DOWN ? files_prioq_compare_down : files_prioq_compare_up);
+        if (r < 0)
+                return r;
+
+        j->files_prioq_direction = direction;
+
+        seek_files_parallel(j, files, n_files, direction);
+
         for (i = 0; i < n_files; i++) {
                 JournalFile *f = (JournalFile *)files[i];
-                bool found;
+
+                if (f->prioq_idx != PRIOQ_IDX_NULL)
+                        continue;
 
                 r = next_beyond_location(j, f, direction);
                 if (r < 0) {
@@ -845,22 +1126,47 @@ static int real_journal_next(sd_journal *j, direction_t direction) {
                         continue;
                 }
 
+                r = prioq_put(j->files_prioq, f, &f->prioq_idx);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Entries which exist in more than one file sort next to each other. Advance the files at the front
+         * of the queue until they point to an entry that is actually different from what we were previously
+         * looking at, so that all of them but one are suppressed. */
+        for (;;) {
+                int k;
+
+                new_file = prioq_peek(j->files_prioq);
                 if (!new_file)
-                        found = true;
-                else {
-                        int k;
+                        return 0;
+
+                if (j->current_location.type != LOCATION_DISCRETE)
+                        break;
+
+                k = compare_with_location(new_file, &j->current_location, j->current_file);
+                if (direction == DIRECTION_DOWN ? k > 0 : k < 0)
+                        break;
 
-                        k = journal_file_compare_locations(f, new_file);
+                files_prioq_remove(j, new_file);
 
-                        found = direction == DIRECTION_DOWN ? k < 0 : k > 0;
+                r = next_beyond_location(j, new_file, direction);
+                if (r < 0) {
+                        log_debug_errno(r, "Can't iterate through %s, ignoring: %m", new_file->path);
+                        remove_file_real(j, new_file);
+                        continue;
+                } else if (r == 0) {
+                        new_file->location_type = LOCATION_TAIL;
+                        continue;
                 }
 
-                if (found)
-                        new_file = f;
+                r = prioq_put(j->files_prioq, new_file, &new_file->prioq_idx);
+                if (r < 0)
+                        return r;
         }
 
-        if (!new_file)
-                return 0;
+        /* The file we pick is advanced again on the next call, hence take it out of the queue */
+        files_prioq_remove(j, new_file);
 
         r = journal_file_move_to_object(new_file, OBJECT_ENTRY, new_file->current_offset, &o);
         if (r < 0)
@@ -1251,13 +1557,13 @@ static bool path_has_prefix(sd_journal *j, const char *path, const char *prefix)
         return path_startswith(path, prefix);
 }
 
-static void track_file_disposition(sd_journal *j, JournalFile *f) {
+static void track_file_disposition(sd_journal *j, const char *path) {
         assert(j);
-        assert(f);
+        assert(path);
 
-        if (!j->has_runtime_files && path_has_prefix(j, f->path, "/run"))
+        if (!j->has_runtime_files && path_has_prefix(j, path, "/run"))
                 j->has_runtime_files = true;
-        else if (!j->has_persistent_files && path_has_prefix(j, f->path, "/var"))
+        else if (!j->has_persistent_files && path_has_prefix(j, path, "/var"))
                 j->has_persistent_files = true;
 }
 
@@ -1364,7 +1670,7 @@ static int add_any_file(
 
         f->last_seen_generation = j->generation;
 
-        track_file_disposition(j, f);
+        track_file_disposition(j, f->path);
         check_network(j, f->fd);
 
         j->current_invalidate_counter++;
@@ -1404,9 +1710,178 @@ static int add_file_by_name(
                 return 0;
 
         path = prefix_roota(prefix, filename);
+
+        /* Archived files don't change anymore, hence there's no need to open deferred files just because
+         * they were touched */
+        if (hashmap_contains(j->deferred_files, path))
+                return 0;
+
         return add_any_file(j, -1, path);
 }
 
+static DeferredFile* deferred_file_free(DeferredFile *d) {
+        if (!d)
+                return NULL;
+
+        free(d->path);
+        free(d->entry.filename);
+        return mfree(d);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(DeferredFile*, deferred_file_free);
+DEFINE_PRIVATE_HASH_OPS_WITH_VALUE_DESTRUCTOR(deferred_file_hash_ops, char, path_hash_func, path_compare,
+                                              DeferredFile, deferred_file_free);
+
+static int defer_file_by_name(
+                sd_journal *j,
+                const char *prefix,
+                const char *filename,
+                const JournalIndexEntry *e) {
+
+        DeferredFile *d;
+        JournalFile *f;
+        const char *path;
+        int r;
+
+        assert(j);
+        assert(prefix);
+        assert(filename);
+        assert(e);
+
+        /* Like add_file_by_name(), but for archived files the index of their directory told us about. We only
+         * remember those, and open them once we know we need them, see real_journal_next(). */
+
+        if (j->no_new_files)
+                return 0;
+
+        if (!file_type_wanted(j->flags, filename))
+                return 0;
+
+        path = prefix_roota(prefix, filename);
+
+        f = ordered_hashmap_get(j->files, path);
+        if (f)
+                return add_any_file(j, -1, path);
+
+        d = hashmap_get(j->deferred_files, path);
+        if (d) {
+                d->last_seen_generation = j->generation;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(&j->deferred_files, &deferred_file_hash_ops);
+        if (r < 0)
+                return r;
+
+        d = new(DeferredFile, 1);
+        if (!d)
+                return -ENOMEM;
+
+        *d = (DeferredFile) {
+                .entry = *e,
+                .last_seen_generation = j->generation,
+        };
+        d->entry.filename = NULL;
+
+        d->path = strdup(path);
+        if (!d->path) {
+                free(d);
+                return -ENOMEM;
+        }
+
+        r = hashmap_put(j->deferred_files, d->path, d);
+        if (r < 0) {
+                deferred_file_free(d);
+                return r;
+        }
+
+        track_file_disposition(j, d->path);
+        j->deferred_files_dirty = true;
+        j->current_invalidate_counter++;
+
+        log_debug("File %s deferred.", d->path);
+        return 0;
+}
+
+static int open_deferred_file(sd_journal *j, const char *path) {
+        _cleanup_(deferred_file_freep) DeferredFile *d = NULL;
+        unsigned c;
+        int r;
+
+        assert(j);
+        assert(path);
+
+        d = hashmap_remove(j->deferred_files, path);
+        if (!d)
+                return 0;
+
+        /* Users were told about the file when it was deferred already, hence opening it is no change */
+        c = j->current_invalidate_counter;
+        r = add_any_file(j, -1, d->path);
+        j->current_invalidate_counter = c;
+
+        return r;
+}
+
+int journal_open_deferred_files(sd_journal *j) {
+        DeferredFile *d;
+        Iterator i;
+        int r = 0;
+
+        assert(j);
+
+        HASHMAP_FOREACH(d, j->deferred_files, i) {
+                int k;
+
+                k = open_deferred_file(j, d->path);
+                if (k < 0 && r >= 0)
+                        r = k;
+        }
+
+        return r;
+}
+
+bool journal_has_files(sd_journal *j) {
+        assert(j);
+
+        return !ordered_hashmap_isempty(j->files) || !hashmap_isempty(j->deferred_files);
+}
+
+static bool deferred_file_needed(sd_journal *j, DeferredFile *d, direction_t direction) {
+        const Location *l;
+
+        assert(j);
+        assert(d);
+
+        /* Returns false if the file can't contain any entry beyond the current location in the specified
+         * direction, so that there's no point in opening it */
+
+        l = &j->current_location;
+        if (!IN_SET(l->type, LOCATION_SEEK, LOCATION_DISCRETE) || !l->realtime_set)
+                return true;
+
+        if (direction == DIRECTION_DOWN)
+                return !journal_index_entry_before(&d->entry, l->seqnum_set ? &l->seqnum_id : NULL, l->seqnum, l->realtime);
+
+        return !journal_index_entry_after(&d->entry, l->seqnum_set ? &l->seqnum_id : NULL, l->seqnum, l->realtime);
+}
+
+static void open_deferred_files_for_location(sd_journal *j, direction_t direction) {
+        DeferredFile *d;
+        Iterator i;
+
+        assert(j);
+
+        /* Moving in one direction never brings files we skipped back into range, hence this only needs to
+         * be done after the location was reset, when changing direction, or if files were added. */
+
+        HASHMAP_FOREACH(d, j->deferred_files, i)
+                if (deferred_file_needed(j, d, direction))
+                        (void) open_deferred_file(j, d->path);
+
+        j->deferred_files_dirty = false;
+}
+
 static void remove_file_by_name(
                 sd_journal *j,
                 const char *prefix,
@@ -1420,6 +1895,9 @@ static void remove_file_by_name(
         assert(filename);
 
         path = prefix_roota(prefix, filename);
+
+        deferred_file_free(hashmap_remove(j->deferred_files, path));
+
         f = ordered_hashmap_get(j->files, path);
         if (!f)
                 return;
@@ -1432,6 +1910,7 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
         assert(f);
 
         (void) ordered_hashmap_remove(j->files, f->path);
+        files_prioq_remove(j, f);
 
         log_debug("File %s removed.", f->path);
 
@@ -1571,16 +2050,34 @@ static int directory_open(sd_journal *j, const char *path, DIR **ret) {
 static int add_directory(sd_journal *j, const char *prefix, const char *dirname);
 
 static void directory_enumerate(sd_journal *j, Directory *m, DIR *d) {
+        _cleanup_hashmap_free_ Hashmap *index = NULL;
         struct dirent *de;
+        int r;
 
         assert(j);
         assert(m);
         assert(d);
 
+        if (j->use_index) {
+                r = journal_index_load(dirfd(d), &index);
+                if (r < 0 && r != -ENOENT)
+                        log_debug_errno(r, "Failed to load journal index of %s, ignoring: %m", m->path);
+        }
+
         FOREACH_DIRENT_ALL(de, d, goto fail) {
 
-                if (dirent_is_journal_file(de))
-                        (void) add_file_by_name(j, m->path, de->d_name);
+                if (dirent_is_journal_file(de)) {
+                        JournalIndexEntry *e;
+
+                        /* Only trust the index if it talks about the very same file, and never for
+                         * disposed files, which it only lists for vacuuming */
+                        e = hashmap_get(index, de->d_name);
+                        if (e && !journal_index_entry_is_disposed(e) &&
+                            de->d_type == DT_REG && e->inode == de->d_ino)
+                                (void) defer_file_by_name(j, m->path, de->d_name, e);
+                        else
+                                (void) add_file_by_name(j, m->path, de->d_name);
+                }
 
                 if (m->is_root && dirent_is_journal_subdir(de))
                         (void) add_directory(j, m->path, de->d_name);
@@ -1898,6 +2395,7 @@ static int allocate_inotify(sd_journal *j) {
 
 static sd_journal *journal_new(int flags, const char *path, const char *namespace) {
         _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        int r;
 
         j = new0(sd_journal, 1);
         if (!j)
@@ -1938,6 +2436,11 @@ static sd_journal *journal_new(int flags, const char *path, const char *namespac
         if (!j->files_cache || !j->directories_by_path || !j->mmap)
                 return NULL;
 
+        r = getenv_bool("SYSTEMD_JOURNAL_INDEX");
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_INDEX environment variable, ignoring.");
+        j->use_index = r != 0;
+
         return TAKE_PTR(j);
 }
 
@@ -2162,8 +2665,10 @@ _public_ void sd_journal_close(sd_journal *j) {
 
         sd_journal_flush_matches(j);
 
+        prioq_free(j->files_prioq);
         ordered_hashmap_free_with_destructor(j->files, journal_file_close);
         iterated_cache_free(j->files_cache);
+        hashmap_free(j->deferred_files);
 
         while ((d = hashmap_first(j->directories_by_path)))
                 remove_directory(j, d);
@@ -2177,7 +2682,7 @@ _public_ void sd_journal_close(sd_journal *j) {
         safe_close(j->inotify_fd);
 
         if (j->mmap) {
-                log_debug("mmap cache statistics: %u hit, %u miss", mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap));
+                mmap_cache_stats_log_debug(j->mmap);
                 mmap_cache_unref(j->mmap);
         }
 
@@ -2307,20 +2812,21 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
         field_length = strlen(field);
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 uint64_t p, l;
-                le64_t le_hash;
+                le64_t le_hash = 0;
                 size_t t;
                 int compression;
 
-                p = le64toh(o->entry.items[i].object_offset);
-                le_hash = o->entry.items[i].hash;
+                p = journal_file_entry_item_object_offset(f, o, i);
+                if (!JOURNAL_HEADER_COMPACT(f->header))
+                        le_hash = o->entry.items.regular[i].hash;
                 r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
                 if (r < 0)
                         return r;
 
-                if (le_hash != o->data.hash)
+                if (!JOURNAL_HEADER_COMPACT(f->header) && le_hash != o->data.hash)
                         return -EBADMSG;
 
                 l = le64toh(o->object.size) - offsetof(Object, data.payload);
@@ -2328,10 +2834,16 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
 #if HAVE_COMPRESSION
-                        r = decompress_startswith(compression,
-                                                  o->data.payload, l,
-                                                  &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=');
+                        CompressDictionary *d;
+
+                        r = journal_file_get_dictionary(f, &d);
+                        if (r < 0)
+                                return r;
+
+                        r = decompress_startswith_dict(compression, d,
+                                                       o->data.payload, l,
+                                                       &f->compress_buffer, &f->compress_buffer_size,
+                                                       field, field_length, '=');
                         if (r < 0)
                                 log_debug_errno(r, "Cannot decompress %s object of length %"PRIu64" at offset "OFSfmt": %m",
                                                 object_compressed_to_string(compression), l, p);
@@ -2339,10 +2851,10 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                                 size_t rsize;
 
-                                r = decompress_blob(compression,
-                                                    o->data.payload, l,
-                                                    &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                    j->data_threshold);
+                                r = decompress_blob_dict(compression, d,
+                                                         o->data.payload, l,
+                                                         &f->compress_buffer, &f->compress_buffer_size, &rsize,
+                                                         j->data_threshold);
                                 if (r < 0)
                                         return r;
 
@@ -2395,12 +2907,17 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
         compression = o->object.flags & OBJECT_COMPRESSION_MASK;
         if (compression) {
 #if HAVE_COMPRESSION
+                CompressDictionary *d;
                 size_t rsize;
                 int r;
 
-                r = decompress_blob(compression,
-                                    o->data.payload, l, &f->compress_buffer,
-                                    &f->compress_buffer_size, &rsize, j->data_threshold);
+                r = journal_file_get_dictionary(f, &d);
+                if (r < 0)
+                        return r;
+
+                r = decompress_blob_dict(compression, d,
+                                         o->data.payload, l, &f->compress_buffer,
+                                         &f->compress_buffer_size, &rsize, j->data_threshold);
                 if (r < 0)
                         return r;
 
@@ -2440,17 +2957,17 @@ _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t
         if (r < 0)
                 return r;
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         if (j->current_field >= n)
                 return 0;
 
-        p = le64toh(o->entry.items[j->current_field].object_offset);
-        le_hash = o->entry.items[j->current_field].hash;
+        p = journal_file_entry_item_object_offset(f, o, j->current_field);
+        le_hash = JOURNAL_HEADER_COMPACT(f->header) ? 0 : o->entry.items.regular[j->current_field].hash;
         r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
         if (r < 0)
                 return r;
 
-        if (le_hash != o->data.hash)
+        if (!JOURNAL_HEADER_COMPACT(f->header) && le_hash != o->data.hash)
                 return -EBADMSG;
 
         r = return_data(j, f, o, data, size);
@@ -2550,6 +3067,7 @@ _public_ int sd_journal_get_timeout(sd_journal *j, uint64_t *timeout_usec) {
 }
 
 static void process_q_overflow(sd_journal *j) {
+        DeferredFile *d;
         JournalFile *f;
         Directory *m;
         Iterator i;
@@ -2575,6 +3093,15 @@ static void process_q_overflow(sd_journal *j) {
                 remove_file_real(j, f);
         }
 
+        HASHMAP_FOREACH(d, j->deferred_files, i) {
+
+                if (d->last_seen_generation == j->generation)
+                        continue;
+
+                log_debug("File '%s' hasn't been seen in this enumeration, removing.", d->path);
+                deferred_file_free(hashmap_remove(j->deferred_files, d->path));
+        }
+
         HASHMAP_FOREACH(m, j->directories_by_path, i) {
 
                 if (m->last_seen_generation == j->generation)
@@ -2743,6 +3270,7 @@ _public_ int sd_journal_wait(sd_journal *j, uint64_t timeout_usec) {
 }
 
 _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from, uint64_t *to) {
+        DeferredFile *d;
         Iterator i;
         JournalFile *f;
         bool first = true;
@@ -2775,6 +3303,21 @@ _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from,
                 }
         }
 
+        /* No need to open archived files for this, the index knows as much as their headers */
+        HASHMAP_FOREACH(d, j->deferred_files, i) {
+                if (d->entry.head_realtime == 0 || d->entry.tail_realtime == 0)
+                        continue;
+
+                if (first) {
+                        fmin = d->entry.head_realtime;
+                        tmax = d->entry.tail_realtime;
+                        first = false;
+                } else {
+                        fmin = MIN(d->entry.head_realtime, fmin);
+                        tmax = MAX(d->entry.tail_realtime, tmax);
+                }
+        }
+
         if (from)
                 *from = fmin;
         if (to)
@@ -2794,6 +3337,8 @@ _public_ int sd_journal_get_cutoff_monotonic_usec(sd_journal *j, sd_id128_t boot
         assert_return(from || to, -EINVAL);
         assert_return(from != to, -EINVAL);
 
+        (void) journal_open_deferred_files(j);
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 usec_t fr, t;
 
@@ -2829,6 +3374,8 @@ void journal_print_header(sd_journal *j) {
 
         assert(j);
 
+        (void) journal_open_deferred_files(j);
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 if (newline)
                         putchar('\n');
@@ -2840,6 +3387,7 @@ void journal_print_header(sd_journal *j) {
 }
 
 _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
+        DeferredFile *d;
         Iterator i;
         JournalFile *f;
         uint64_t sum = 0;
@@ -2857,6 +3405,9 @@ _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
                 sum += (uint64_t) st.st_blocks * 512ULL;
         }
 
+        HASHMAP_FOREACH(d, j->deferred_files, i)
+                sum += d->entry.size;
+
         *bytes = sum;
         return 0;
 }
@@ -2897,6 +3448,8 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 if (j->unique_file_lost)
                         return 0;
 
+                (void) journal_open_deferred_files(j);
+
                 j->unique_file = ordered_hashmap_first(j->files);
                 if (!j->unique_file)
                         return 0;
@@ -3022,6 +3575,8 @@ _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
                 if (j->fields_file_lost)
                         return 0;
 
+                (void) journal_open_deferred_files(j);
+
                 j->fields_file = ordered_hashmap_first(j->files);
                 if (!j->fields_file)
                         return 0;
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <pthread.h>
 #include <sys/stat.h>
 
 #if HAVE_LZ4
@@ -264,6 +265,133 @@ static void test_lz4_decompress_partial(void) {
 }
 #endif
 
+#if HAVE_ZSTD
+static size_t sample_message(char *buf, unsigned i) {
+        /* Short, similar but not identical log messages, like a service would write them */
+        return sprintf(buf, "MESSAGE=Accepted publickey for user%u from 192.168.%u.%u port %u ssh2: RSA SHA256:%08x",
+                       i % 13, i % 7, i % 251, 40000 + i * 7 % 20000, i * 2654435761U);
+}
+
+static void test_compress_dictionary(void) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL, *r_only = NULL;
+        _cleanup_free_ char *samples = NULL, *buf = NULL;
+        _cleanup_free_ size_t *sizes = NULL;
+        _cleanup_free_ void *dict = NULL;
+        size_t n = 2000, i, samples_size = 0, dict_size, plain_total = 0, dict_total = 0, alloc = 0, usize;
+        char msg[256], compressed[256];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(samples = new(char, n * sizeof(msg)));
+        assert_se(sizes = new(size_t, n));
+        for (i = 0; i < n; i++) {
+                sizes[i] = sample_message(samples + samples_size, i);
+                samples_size += sizes[i];
+        }
+
+        /* Nothing to learn from */
+        assert_se(compress_dictionary_train(samples, sizes, 1, 4096, &dict, &dict_size) == -ENODATA);
+
+        assert_se(compress_dictionary_train(samples, sizes, n, 4096, &dict, &dict_size) >= 0);
+        assert_se(dict_size > 0 && dict_size <= 4096);
+        assert_se(compress_dictionary_new(dict, dict_size, true, &d) >= 0);
+        assert_se(compress_dictionary_new(dict, dict_size, false, &r_only) >= 0);
+
+        /* Raw bytes don't make a dictionary */
+        assert_se(compress_dictionary_new("garbage", 7, false, &r_only) == -EBADMSG);
+
+        for (i = n; i < n + 100; i++) {
+                size_t l, csize;
+
+                l = sample_message(msg, i);
+
+                assert_se(compress_blob_zstd(msg, l, compressed, sizeof(compressed), &csize) == 0);
+                plain_total += csize;
+
+                assert_se(compress_blob_zstd_dict(d, msg, l, compressed, sizeof(compressed), &csize) == 0);
+                dict_total += csize;
+
+                /* Frames made with the dictionary can only be read with it */
+                assert_se(decompress_blob_zstd(compressed, csize, (void**) &buf, &alloc, &usize, 0) == -EBADMSG);
+                assert_se(decompress_blob_zstd_dict(r_only, compressed, csize, (void**) &buf, &alloc, &usize, 0) == 0);
+                assert_se(usize == l);
+                assert_se(memcmp(buf, msg, l) == 0);
+
+                assert_se(decompress_startswith_dict(OBJECT_COMPRESSED_ZSTD, r_only, compressed, csize,
+                                                     (void**) &buf, &alloc, "MESSAGE", 7, '=') > 0);
+                assert_se(decompress_startswith_dict(OBJECT_COMPRESSED_ZSTD, r_only, compressed, csize,
+                                                     (void**) &buf, &alloc, "MESSAGE", 7, 'x') == 0);
+        }
+
+        /* Frames made without one are still read fine */
+        assert_se(compress_blob_zstd(msg, strlen(msg), compressed, sizeof(compressed), &usize) == 0);
+        assert_se(decompress_blob_dict(OBJECT_COMPRESSED_ZSTD, r_only, compressed, usize, (void**) &buf, &alloc, &usize, 0) == 0);
+        assert_se(usize == strlen(msg));
+
+        log_info("100 messages of %zu bytes: %zu bytes compressed without dictionary, %zu bytes with a dictionary of %zu bytes",
+                 strlen(msg), plain_total, dict_total, dict_size);
+        assert_se(dict_total * 2 < plain_total);
+}
+
+static void test_decompress_zstd_claimed_size(void) {
+        _cleanup_free_ char *buf = NULL, *zeros = NULL;
+        size_t alloc = 0, usize, csize;
+        char compressed[4096];
+
+        /* A frame with a single raw block of 16 bytes, whose header claims a content size of 1 TiB */
+        static const uint8_t frame[] = {
+                0x28, 0xb5, 0x2f, 0xfd,                         /* magic */
+                0xe0,                                           /* single segment, 8 byte content size */
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, /* 1 TiB */
+                0x81, 0x00, 0x00,                               /* last raw block of 16 bytes */
+                'f', 'o', 'o', 'b', 'a', 'r', 'f', 'o', 'o', 'b', 'a', 'r', 'f', 'o', 'o', 'b',
+        };
+
+        log_info("/* %s */", __func__);
+
+        /* Such a claim must not be believed, the frame is simply broken */
+        assert_se(decompress_blob_zstd(frame, sizeof(frame), (void**) &buf, &alloc, &usize, 0) == -EBADMSG);
+        assert_se(alloc < 1024 * 1024);
+
+        /* While data that really is that compressible still decompresses fine */
+        assert_se(zeros = new0(char, 4 * 1024 * 1024));
+        assert_se(compress_blob_zstd(zeros, 4 * 1024 * 1024, compressed, sizeof(compressed), &csize) == 0);
+        assert_se(decompress_blob_zstd(compressed, csize, (void**) &buf, &alloc, &usize, 0) == 0);
+        assert_se(usize == 4 * 1024 * 1024);
+        assert_se(memeqzero(buf, usize));
+}
+
+static void *contexts_thread(void *p) {
+        _cleanup_free_ char *buf = NULL;
+        size_t alloc = 0, csize, usize;
+        char msg[256], compressed[256];
+
+        sample_message(msg, 0);
+
+        /* Leaves the per-thread contexts behind on purpose, they must be released when the thread exits */
+        assert_se(compress_blob_zstd(msg, strlen(msg), compressed, sizeof(compressed), &csize) == 0);
+        assert_se(decompress_blob_zstd(compressed, csize, (void**) &buf, &alloc, &usize, 0) == 0);
+        assert_se(usize == strlen(msg));
+#if HAVE_XZ
+        assert_se(compress_blob_xz(msg, strlen(msg), compressed, sizeof(compressed), &csize) == 0);
+#endif
+
+        return NULL;
+}
+
+static void test_compress_thread_contexts(void) {
+        pthread_t t;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        for (i = 0; i < 4; i++) {
+                assert_se(pthread_create(&t, NULL, contexts_thread, NULL) == 0);
+                assert_se(pthread_join(t, NULL) == 0);
+        }
+}
+#endif
+
 int main(int argc, char *argv[]) {
 #if HAVE_COMPRESSION
         _unused_ const char text[] =
@@ -358,6 +486,10 @@ int main(int argc, char *argv[]) {
                              compress_stream_zstd, decompress_stream_zstd, srcfile);
 
         test_decompress_startswith_short("ZSTD", compress_blob_zstd, decompress_startswith_zstd);
+
+        test_compress_dictionary();
+        test_decompress_zstd_claimed_size();
+        test_compress_thread_contexts();
 #else
         log_info("/* ZSTD test skipped */");
 #endif
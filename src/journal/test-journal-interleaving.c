@@ -7,12 +7,21 @@
 
 #include "alloc-util.h"
 #include "chattr-util.h"
+#include "fd-util.h"
+#include "fs-util.h"
+#include "glob-util.h"
 #include "io-util.h"
 #include "journal-file.h"
+#include "journal-index.h"
+#include "journal-internal.h"
 #include "journal-vacuum.h"
 #include "log.h"
 #include "parse-util.h"
 #include "rm-rf.h"
+#include "sigbus.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
 #include "tests.h"
 #include "util.h"
 
@@ -131,6 +140,28 @@ static void setup_interleaved(void) {
         test_close(two);
 }
 
+#define MANY_FILES 64
+#define MANY_FILES_ENTRIES 8
+
+static void setup_many_files(void) {
+        JournalFile *files[MANY_FILES];
+        int i;
+
+        /* Enough files for sd_journal_next() to position them from several threads */
+        for (i = 0; i < MANY_FILES; i++) {
+                char name[STRLEN("many-.journal") + DECIMAL_STR_MAX(int)];
+
+                xsprintf(name, "many-%i.journal", i);
+                files[i] = test_open(name);
+        }
+
+        for (i = 0; i < MANY_FILES * MANY_FILES_ENTRIES; i++)
+                append_number(files[i % MANY_FILES], i + 1, NULL);
+
+        for (i = 0; i < MANY_FILES; i++)
+                test_close(files[i]);
+}
+
 static void mkdtemp_chdir_chattr(char *path) {
         assert_se(mkdtemp(path));
         assert_se(chdir(path) >= 0);
@@ -196,6 +227,247 @@ static void test_skip(void (*setup)(void)) {
         puts("------------------------------------------------------------");
 }
 
+static void test_many_files(void) {
+        char t[] = "/var/tmp/journal-many-XXXXXX";
+        unsigned n = MANY_FILES * MANY_FILES_ENTRIES;
+        const char *parallel;
+        sd_journal *j;
+
+        mkdtemp_chdir_chattr(t);
+
+        setup_many_files();
+
+        /* Both ways to position the files must yield the same, strictly interleaved order */
+        FOREACH_STRING(parallel, "1", "0") {
+                assert_se(setenv("SYSTEMD_JOURNAL_PARALLEL_SEEK", parallel, 1) >= 0);
+
+                assert_ret(sd_journal_open_directory(&j, t, 0));
+                assert_ret(sd_journal_seek_head(j));
+                assert_ret(sd_journal_next(j));
+                test_check_numbers_down(j, n);
+                sd_journal_close(j);
+
+                assert_ret(sd_journal_open_directory(&j, t, 0));
+                assert_ret(sd_journal_seek_tail(j));
+                assert_ret(sd_journal_previous(j));
+                test_check_numbers_up(j, n);
+
+                /* Change direction twice, which repositions all files each time */
+                assert_se(sd_journal_next_skip(j, n / 2) == (int) n / 2);
+                test_check_number(j, 1 + n / 2);
+                assert_se(sd_journal_previous_skip(j, n / 4) == (int) n / 4);
+                test_check_number(j, 1 + n / 2 - n / 4);
+                sd_journal_close(j);
+        }
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_PARALLEL_SEEK") >= 0);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_many_files_truncated(void) {
+        char t[] = "/var/tmp/journal-truncated-XXXXXX";
+        unsigned n = 0;
+        sd_journal *j;
+
+        mkdtemp_chdir_chattr(t);
+
+        setup_many_files();
+
+        sigbus_install();
+        assert_se(setenv("SYSTEMD_JOURNAL_PARALLEL_SEEK", "1", 1) >= 0);
+
+        /* A file that is truncated after it was opened is dropped, no matter which thread notices */
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_se(truncate("many-5.journal", page_size()) >= 0);
+
+        assert_ret(sd_journal_seek_head(j));
+        while (sd_journal_next(j) > 0)
+                n++;
+        assert_se(n == (MANY_FILES - 1) * MANY_FILES_ENTRIES);
+
+        sd_journal_close(j);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_PARALLEL_SEEK") >= 0);
+        sigbus_reset();
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define ARCHIVED_FILES 4
+#define ARCHIVED_FILES_ENTRIES 4
+
+static void setup_archived_files(int first, int n) {
+        int i;
+
+        for (i = first; i < first + n; i++) {
+                char name[STRLEN("archived-.journal") + DECIMAL_STR_MAX(int)];
+                JournalFile *f;
+                int k;
+
+                xsprintf(name, "archived-%i.journal", i);
+                f = test_open(name);
+                for (k = 1; k <= ARCHIVED_FILES_ENTRIES; k++)
+                        append_number(f, i * ARCHIVED_FILES_ENTRIES + k, NULL);
+
+                assert_ret(journal_file_archive(f));
+                test_close(f);
+        }
+}
+
+static void test_archived_files_index(void) {
+        char t[] = "/var/tmp/journal-index-XXXXXX";
+        unsigned n = ARCHIVED_FILES * ARCHIVED_FILES_ENTRIES, m = n / 2 + 2;
+        const char *use_index;
+        uint64_t realtime;
+        sd_journal *j;
+        int i;
+
+        mkdtemp_chdir_chattr(t);
+
+        setup_archived_files(0, ARCHIVED_FILES);
+        assert_se(access(JOURNAL_INDEX_FILENAME, F_OK) >= 0);
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_ret(sd_journal_seek_head(j));
+        assert_se(sd_journal_next_skip(j, m) == (int) m);
+        test_check_number(j, m);
+        assert_ret(sd_journal_get_realtime_usec(j, &realtime));
+        sd_journal_close(j);
+
+        /* With the index, only the files with entries beyond the location need to be opened */
+        FOREACH_STRING(use_index, "1", "0") {
+                bool indexed = streq(use_index, "1");
+
+                assert_se(setenv("SYSTEMD_JOURNAL_INDEX", use_index, 1) >= 0);
+
+                assert_ret(sd_journal_open_directory(&j, t, 0));
+                assert_se(ordered_hashmap_size(j->files) == (indexed ? 0 : ARCHIVED_FILES));
+
+                assert_ret(sd_journal_seek_realtime_usec(j, realtime));
+                assert_ret(sd_journal_next(j));
+                for (i = m; i <= (int) n; i++) {
+                        test_check_number(j, i);
+                        assert_se(sd_journal_next(j) == (i < (int) n));
+                }
+                assert_se(ordered_hashmap_size(j->files) == (indexed ? ARCHIVED_FILES - (m - 1) / ARCHIVED_FILES_ENTRIES : ARCHIVED_FILES));
+
+                assert_ret(sd_journal_seek_realtime_usec(j, realtime));
+                assert_ret(sd_journal_previous(j));
+                test_check_number(j, m);
+                sd_journal_close(j);
+
+                assert_ret(sd_journal_open_directory(&j, t, 0));
+                assert_ret(sd_journal_seek_head(j));
+                assert_ret(sd_journal_next(j));
+                test_check_numbers_down(j, n);
+                sd_journal_close(j);
+        }
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_INDEX") >= 0);
+
+        /* Vacuuming everything away drops the index too */
+        assert_se(journal_directory_vacuum(".", 1, 0, 0, NULL, true) >= 0);
+        assert_se(access(JOURNAL_INDEX_FILENAME, F_OK) < 0 && errno == ENOENT);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_incremental_vacuum(void) {
+        _cleanup_(journal_vacuum_state_freep) JournalVacuumState *state = NULL;
+        char t[] = "/var/tmp/journal-vacuum-XXXXXX";
+        _cleanup_hashmap_free_ Hashmap *index = NULL;
+        const char *junk = "junk@0000000000000001-0000000000000001.journal~";
+        _cleanup_close_ int dir_fd = -1;
+        JournalFile *f;
+        sd_journal *j;
+
+        mkdtemp_chdir_chattr(t);
+        assert_se((dir_fd = open(t, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0);
+
+        setup_archived_files(0, ARCHIVED_FILES);
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 100, 0, NULL, true) >= 0);
+
+        /* Files archived since are picked up from the index, files that aren't in the index only once the
+         * whole directory is looked at again */
+        setup_archived_files(ARCHIVED_FILES, 2);
+        assert_se(touch(junk) >= 0);
+
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 2, 0, NULL, true) >= 0);
+        assert_se(access(junk, F_OK) >= 0);
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_ret(sd_journal_seek_head(j));
+        assert_se(sd_journal_next(j) > 0);
+        test_check_number(j, ARCHIVED_FILES * ARCHIVED_FILES_ENTRIES + 1);
+        sd_journal_close(j);
+
+        assert_ret(journal_index_load(dir_fd, &index));
+        assert_se(hashmap_size(index) == 2);
+
+        /* Starting from scratch, the empty file is found and removed */
+        assert_se(journal_directory_vacuum(".", 0, 2, 0, NULL, true) >= 0);
+        assert_se(access(junk, F_OK) < 0 && errno == ENOENT);
+
+        /* Removals by somebody else are picked up too */
+        assert_se(journal_directory_vacuum(".", 0, 1, 0, NULL, true) >= 0);
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 1, 0, NULL, true) >= 0);
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_ret(sd_journal_seek_head(j));
+        assert_se(sd_journal_next(j) > 0);
+        test_check_number(j, (ARCHIVED_FILES + 1) * ARCHIVED_FILES_ENTRIES + 1);
+        sd_journal_close(j);
+
+        index = hashmap_free(index);
+        assert_ret(journal_index_load(dir_fd, &index));
+        assert_se(hashmap_size(index) == 1);
+
+        /* Files disposed of are added to the index as well, hence an empty one is removed right away */
+        f = test_open("disposed.journal");
+        test_close(f);
+        assert_se(journal_file_dispose(dir_fd, "disposed.journal") >= 0);
+        assert_se(glob_exists("disposed@*.journal~") > 0);
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 100, 0, NULL, true) >= 0);
+        assert_se(glob_exists("disposed@*.journal~") == 0);
+
+        /* Once adding a file to the index failed, we don't know what's missing, and look at all files again */
+        assert_se(touch(junk) >= 0);
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 100, 0, NULL, true) >= 0);
+        assert_se(access(junk, F_OK) >= 0);
+
+        f = test_open("active.journal");
+        assert_se(journal_index_add_file(f, "active.journal") == -EINVAL);
+        test_close(f);
+
+        assert_se(journal_directory_vacuum_cached(&state, ".", 0, 100, 0, NULL, true) >= 0);
+        assert_se(access(junk, F_OK) < 0 && errno == ENOENT);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 static void test_sequence_numbers(void) {
 
         char t[] = "/var/tmp/journal-seq-XXXXXX";
@@ -290,6 +562,11 @@ int main(int argc, char *argv[]) {
         test_skip(setup_sequential);
         test_skip(setup_interleaved);
 
+        test_many_files();
+        test_many_files_truncated();
+        test_archived_files_index();
+        test_incremental_vacuum();
+
         test_sequence_numbers();
 
         return 0;
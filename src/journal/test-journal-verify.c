@@ -11,6 +11,7 @@
 #include "journal-verify.h"
 #include "log.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
 #include "terminal-util.h"
 #include "tests.h"
 #include "util.h"
@@ -51,6 +52,187 @@ static int raw_verify(const char *fn, const char *verification_key) {
         return r;
 }
 
+static void generate(const char *fn, unsigned n_entries) {
+        char payload[STRLEN("PAYLOAD=") + 4096] = "PAYLOAD=";
+        JournalFile *f;
+        unsigned n;
+
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (n = 0; n < n_entries; n++) {
+                char message[STRLEN("MESSAGE=message ") + DECIMAL_STR_MAX(unsigned)],
+                        random_field[STRLEN("RANDOM=") + DECIMAL_STR_MAX(long)],
+                        counter[STRLEN("COUNTER=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[4];
+                struct dual_timestamp ts;
+                size_t n_iovec = 3;
+
+                dual_timestamp_get(&ts);
+
+                /* Lots of data objects, some shared by many entries, some by few */
+                xsprintf(message, "MESSAGE=message %u", n);
+                xsprintf(random_field, "RANDOM=%lu", random() % RANDOM_RANGE);
+                xsprintf(counter, "COUNTER=%u", n % 1000);
+
+                iovec[0] = IOVEC_MAKE_STRING(message);
+                iovec[1] = IOVEC_MAKE_STRING(random_field);
+                iovec[2] = IOVEC_MAKE_STRING(counter);
+
+                /* Some compressed ones too, so that the verification threads decompress */
+                if (n % 100 == 0) {
+                        memset(payload + STRLEN("PAYLOAD="), 'a' + n / 100 % 26, sizeof(payload) - STRLEN("PAYLOAD="));
+                        iovec[n_iovec++] = IOVEC_MAKE(payload, sizeof(payload));
+                }
+
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, n_iovec, NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+}
+
+static void swap_entries(const char *fn, uint64_t i) {
+        uint8_t a[sizeof(le64_t)], b[sizeof(le64_t)];
+        uint64_t offset = 0, first = 0, p, q;
+        size_t size;
+        JournalFile *f;
+        int fd;
+
+        /* Swaps the i-th and the following entry in the main entry array, which then isn't sorted anymore */
+
+        assert_se(journal_file_open(-1, fn, O_RDONLY, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(i + 1 < le64toh(f->header->n_entries));
+
+        size = JOURNAL_HEADER_COMPACT(f->header) ? sizeof(le32_t) : sizeof(le64_t);
+
+        p = le64toh(f->header->entry_array_offset);
+        for (;;) {
+                Object *o;
+                uint64_t m;
+
+                assert_se(p > 0);
+                assert_se(journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, p, &o) >= 0);
+
+                m = journal_file_entry_array_n_items(f, o);
+                if (i + 1 < first + m) {
+                        offset = p + offsetof(EntryArrayObject, items) + (i - first) * size;
+                        break;
+                }
+
+                first += m;
+                p = le64toh(o->entry_array.next_entry_array_offset);
+        }
+
+        (void) journal_file_close(f);
+
+        /* Both entries need to be in the same entry array */
+        assert_se(offset > 0);
+
+        fd = open(fn, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+
+        q = offset + size;
+        assert_se(pread(fd, a, size, offset) == (ssize_t) size);
+        assert_se(pread(fd, b, size, q) == (ssize_t) size);
+        assert_se(pwrite(fd, b, size, offset) == (ssize_t) size);
+        assert_se(pwrite(fd, a, size, q) == (ssize_t) size);
+
+        safe_close(fd);
+}
+
+static void verify_files(char **fns, size_t n, unsigned n_threads, JournalVerifyResult *results) {
+        JournalFile *files[n];
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                assert_se(journal_file_open(-1, fns[i], O_RDONLY, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, files + i) == 0);
+
+        assert_se(journal_files_verify(files, n, NULL, n_threads, results, false) >= 0);
+
+        for (i = 0; i < n; i++)
+                (void) journal_file_close(files[i]);
+}
+
+static void test_verify_threads(void) {
+        char *fns[] = { (char*) "threads-0.journal", (char*) "threads-1.journal", (char*) "threads-2.journal" };
+        JournalVerifyResult results[ELEMENTSOF(fns)];
+        size_t i;
+
+        log_info("Verifying with threads...");
+
+        for (i = 0; i < ELEMENTSOF(fns); i++)
+                generate(fns[i], 20000);
+
+        /* One file split up between threads, and several files at once */
+        verify_files(fns, 1, 4, results);
+        assert_se(results[0].error >= 0);
+
+        verify_files(fns, ELEMENTSOF(fns), 4, results);
+        for (i = 0; i < ELEMENTSOF(fns); i++)
+                assert_se(results[i].error >= 0);
+
+        /* Problems are found no matter which thread looks at them */
+        swap_entries(fns[1], 15000);
+
+        verify_files(fns + 1, 1, 4, results);
+        assert_se(results[0].error == -EBADMSG);
+
+        verify_files(fns + 1, 1, 1, results);
+        assert_se(results[0].error == -EBADMSG);
+
+        verify_files(fns, ELEMENTSOF(fns), 4, results);
+        assert_se(results[0].error >= 0);
+        assert_se(results[1].error == -EBADMSG);
+        assert_se(results[2].error >= 0);
+
+        for (i = 0; i < ELEMENTSOF(fns); i++)
+                assert_se(unlink(fns[i]) >= 0);
+}
+
+static void test_verify_benchmark(void) {
+        char *fns[4], span1[FORMAT_TIMESPAN_MAX], span2[FORMAT_TIMESPAN_MAX], span3[FORMAT_TIMESPAN_MAX];
+        JournalVerifyResult results[ELEMENTSOF(fns)];
+        unsigned n_entries;
+        usec_t ts, one, split, all;
+        size_t i;
+
+        /* Large files with lots of entries and data objects */
+        n_entries = slow_tests_enabled() ? 500000 : 50000;
+
+        log_info("Generating %zu files with %u entries each...", ELEMENTSOF(fns), n_entries);
+
+        for (i = 0; i < ELEMENTSOF(fns); i++) {
+                assert_se(asprintf(fns + i, "benchmark-%zu.journal", i) >= 0);
+                generate(fns[i], n_entries);
+        }
+
+        ts = now(CLOCK_MONOTONIC);
+        verify_files(fns, 1, 1, results);
+        one = now(CLOCK_MONOTONIC) - ts;
+        assert_se(results[0].error >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        verify_files(fns, 1, 0, results);
+        split = now(CLOCK_MONOTONIC) - ts;
+        assert_se(results[0].error >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        verify_files(fns, ELEMENTSOF(fns), 0, results);
+        all = now(CLOCK_MONOTONIC) - ts;
+        for (i = 0; i < ELEMENTSOF(fns); i++)
+                assert_se(results[i].error >= 0);
+
+        log_info("One file: %s with one thread, %s with one thread per CPU; %zu files: %s",
+                 format_timespan(span1, sizeof(span1), one, USEC_PER_MSEC),
+                 format_timespan(span2, sizeof(span2), split, USEC_PER_MSEC),
+                 ELEMENTSOF(fns),
+                 format_timespan(span3, sizeof(span3), all, USEC_PER_MSEC));
+
+        for (i = 0; i < ELEMENTSOF(fns); i++) {
+                assert_se(unlink(fns[i]) >= 0);
+                free(fns[i]);
+        }
+}
+
 int main(int argc, char *argv[]) {
         char t[] = "/var/tmp/journal-XXXXXX";
         unsigned n;
@@ -128,6 +310,9 @@ int main(int argc, char *argv[]) {
                 }
         }
 
+        test_verify_threads();
+        test_verify_benchmark();
+
         log_info("Exiting...");
 
         assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
@@ -1,16 +1,29 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "sd-journal.h"
+
+#include "alloc-util.h"
 #include "chattr-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "format-util.h"
+#include "fs-util.h"
 #include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "log.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
 #include "tests.h"
+#include "time-util.h"
 
 static bool arg_keep = false;
 
@@ -157,6 +170,474 @@ static void test_empty(void) {
         (void) journal_file_close(f4);
 }
 
+#define N_GROW_BATCHES 10
+#define N_GROW_BATCH_ENTRIES 4000
+
+static void test_growable_hash_table_one(bool grow) {
+        dual_timestamp ts;
+        JournalFile *f;
+        uint64_t n_buckets;
+        char t[] = "/var/tmp/journal-XXXXXX";
+        unsigned i, j;
+
+        test_setup_logging(LOG_INFO);
+
+        log_info("/* %s(%s) */", __func__, yes_no(grow));
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_GROWABLE_HASH_TABLE", one_zero(grow), 1) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_GROWABLE_HASH_TABLE") >= 0);
+
+        assert_se(JOURNAL_HEADER_GROWABLE_HASH_TABLE(f->header) == grow);
+        n_buckets = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+
+        /* Every entry carries a new unique value, so that the number of data objects keeps growing. If the
+         * hash table grows along, the time it takes to append a batch should stay roughly the same. */
+        for (i = 0; i < N_GROW_BATCHES; i++) {
+                char buf[FORMAT_TIMESPAN_MAX];
+                usec_t start;
+
+                start = now(CLOCK_MONOTONIC);
+
+                for (j = 0; j < N_GROW_BATCH_ENTRIES; j++) {
+                        char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+                        struct iovec iovec[2];
+
+                        xsprintf(field, "UNIQUE=%u", i * N_GROW_BATCH_ENTRIES + j);
+                        iovec[0] = IOVEC_MAKE_STRING(field);
+                        iovec[1] = IOVEC_MAKE_STRING("COMMON=1");
+
+                        assert_se(dual_timestamp_get(&ts));
+                        assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+                }
+
+                log_info("Batch %u: %s for %u entries, %"PRIu64" data objects, %"PRIu64" hash table entries, deepest chain %"PRIu64,
+                         i, format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - start, 1),
+                         N_GROW_BATCH_ENTRIES,
+                         le64toh(f->header->n_data),
+                         le64toh(f->header->data_hash_table_size) / sizeof(HashItem),
+                         le64toh(f->header->data_hash_chain_depth));
+        }
+
+        if (grow) {
+                assert_se(le64toh(f->header->data_hash_table_size) / sizeof(HashItem) > n_buckets);
+                assert_se(le64toh(f->header->n_data) * 4 <= le64toh(f->header->data_hash_table_size) / sizeof(HashItem) * 3);
+                assert_se(!journal_file_rotate_suggested(f, 0));
+        } else {
+                assert_se(le64toh(f->header->data_hash_table_size) / sizeof(HashItem) == n_buckets);
+                assert_se(journal_file_rotate_suggested(f, 0));
+        }
+
+        /* Everything we wrote before and after the table was replaced must still be found */
+        for (j = 0; j < N_GROW_BATCHES * N_GROW_BATCH_ENTRIES; j += 97) {
+                char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(field, "UNIQUE=%u", j);
+                assert_se(journal_file_find_data_object(f, field, strlen(field), NULL, NULL) == 1);
+        }
+        assert_se(journal_file_find_data_object(f, "UNIQUE=foo", STRLEN("UNIQUE=foo"), NULL, NULL) == 0);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_growable_hash_table(void) {
+        test_growable_hash_table_one(true);
+        test_growable_hash_table_one(false);
+}
+
+static void test_bloom_filter(void) {
+        _cleanup_free_ char *archived = NULL;
+        char t[] = "/var/tmp/journal-XXXXXX";
+        unsigned i, n_false_positives = 0;
+        dual_timestamp ts;
+        JournalFile *f;
+
+        test_setup_logging(LOG_INFO);
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < 1000; i++) {
+                char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[2];
+
+                xsprintf(field, "UNIQUE=%u", i);
+                iovec[0] = IOVEC_MAKE_STRING(field);
+                iovec[1] = IOVEC_MAKE_STRING("COMMON=1");
+
+                assert_se(dual_timestamp_get(&ts));
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        /* Nothing to consult while the file is still being written to */
+        assert_se(!JOURNAL_HEADER_BLOOM_FILTER(f->header));
+
+        assert_se(asprintf(&archived, "test@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                           SD_ID128_FORMAT_VAL(f->header->seqnum_id),
+                           le64toh(f->header->head_entry_seqnum),
+                           le64toh(f->header->head_entry_realtime)) >= 0);
+
+        /* If the file can't be archived, it continues to be written to, hence must not get a filter yet */
+        assert_se(mkdir(archived, 0755) >= 0);
+        assert_se(touch(strjoina(archived, "/busy")) >= 0);
+        assert_se(journal_file_archive(f) < 0);
+        assert_se(!JOURNAL_HEADER_BLOOM_FILTER(f->header));
+        assert_se(rm_rf(archived, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        assert_se(dual_timestamp_get(&ts));
+        assert_se(journal_file_append_entry(f, &ts, NULL, &IOVEC_MAKE_STRING("LATE=1"), 1, NULL, NULL, NULL) == 0);
+
+        assert_se(journal_file_archive(f) >= 0);
+        (void) journal_file_close(f);
+
+        assert_se(journal_file_open(-1, archived, O_RDONLY, 0, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_BLOOM_FILTER(f->header));
+        assert_se(journal_file_find_data_object(f, "LATE=1", STRLEN("LATE=1"), NULL, NULL) == 1);
+
+        /* Everything that's in the file must be found */
+        for (i = 0; i < 1000; i++) {
+                char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(field, "UNIQUE=%u", i);
+                assert_se(journal_file_find_data_object(f, field, strlen(field), NULL, NULL) == 1);
+        }
+        assert_se(journal_file_find_data_object(f, "COMMON=1", STRLEN("COMMON=1"), NULL, NULL) == 1);
+
+        /* And most of what isn't shouldn't even need a look at the hash table */
+        for (i = 1000; i < 11000; i++) {
+                char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(field, "UNIQUE=%u", i);
+                assert_se(journal_file_find_data_object(f, field, strlen(field), NULL, NULL) == 0);
+
+                if (journal_file_bloom_filter_may_contain(f, journal_file_hash_data(f, field, strlen(field))) > 0)
+                        n_false_positives++;
+        }
+
+        log_info("Bloom filter false positive rate: %.2f%%", n_false_positives / 100.0);
+        assert_se(n_false_positives < 500);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_bloom_filter_full(void) {
+        _cleanup_hashmap_free_ Hashmap *index = NULL;
+        char t[] = "/var/tmp/journal-XXXXXX";
+        _cleanup_free_ char *archived = NULL;
+        _cleanup_close_ int dir_fd = -1;
+        JournalMetrics metrics;
+        JournalIndexEntry *e;
+        dual_timestamp ts;
+        struct stat st;
+        JournalFile *f;
+        unsigned i;
+        int r;
+
+        test_setup_logging(LOG_INFO);
+
+        mkdtemp_chdir_chattr(t);
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = 1024 * 1024;
+        metrics.keep_free = 0;
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, &metrics, NULL, NULL, NULL, &f) == 0);
+
+        /* Files are usually archived because they hit their size limit, they need a filter most of all */
+        for (i = 0;; i++) {
+                char field[STRLEN("UNIQUE=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(field, "UNIQUE=%u", i);
+
+                assert_se(dual_timestamp_get(&ts));
+                r = journal_file_append_entry(f, &ts, NULL, &IOVEC_MAKE_STRING(field), 1, NULL, NULL, NULL);
+                if (r == -E2BIG)
+                        break;
+                assert_se(r == 0);
+        }
+
+        assert_se(i > 0);
+        assert_se(fstat(f->fd, &st) >= 0);
+        assert_se((uint64_t) st.st_size == f->metrics.max_size);
+
+        assert_se(asprintf(&archived, "test@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                           SD_ID128_FORMAT_VAL(f->header->seqnum_id),
+                           le64toh(f->header->head_entry_seqnum),
+                           le64toh(f->header->head_entry_realtime)) >= 0);
+
+        assert_se(journal_file_archive(f) >= 0);
+        assert_se(JOURNAL_HEADER_BLOOM_FILTER(f->header));
+        assert_se(fstat(f->fd, &st) >= 0);
+        assert_se((uint64_t) st.st_size > f->metrics.max_size);
+        (void) journal_file_close(f);
+
+        /* The index entry is only added once the filter is in place, hence must account for it */
+        assert_se((dir_fd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) >= 0);
+        assert_se(journal_index_load(dir_fd, &index) >= 0);
+        assert_se(e = hashmap_get(index, archived));
+        assert_se(e->size >= (uint64_t) st.st_size);
+
+        assert_se(journal_file_open(-1, archived, O_RDONLY, 0, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_BLOOM_FILTER(f->header));
+        assert_se(journal_file_find_data_object(f, "UNIQUE=0", STRLEN("UNIQUE=0"), NULL, NULL) == 1);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void append_typical_entry(JournalFile *f, unsigned i, dual_timestamp *ts, sd_id128_t boot_id) {
+        char message[STRLEN("MESSAGE=Processing request  of a benchmark, which took a while to complete") + DECIMAL_STR_MAX(unsigned)],
+                pid[STRLEN("_PID=") + DECIMAL_STR_MAX(unsigned)],
+                line[STRLEN("CODE_LINE=") + DECIMAL_STR_MAX(unsigned)];
+        struct iovec iovec[8];
+
+        /* Roughly what a typical service message looks like: a few fields that repeat, and a few that don't */
+
+        xsprintf(message, "MESSAGE=Processing request %u of a benchmark, which took a while to complete", i);
+        xsprintf(pid, "_PID=%u", i % 97);
+        xsprintf(line, "CODE_LINE=%u", i % 13);
+
+        iovec[0] = IOVEC_MAKE_STRING(message);
+        iovec[1] = IOVEC_MAKE_STRING(pid);
+        iovec[2] = IOVEC_MAKE_STRING(line);
+        iovec[3] = IOVEC_MAKE_STRING("PRIORITY=6");
+        iovec[4] = IOVEC_MAKE_STRING("SYSLOG_IDENTIFIER=test-journal");
+        iovec[5] = IOVEC_MAKE_STRING("_SYSTEMD_UNIT=test-journal-benchmark.service");
+        iovec[6] = IOVEC_MAKE_STRING("_CMDLINE=/usr/lib/systemd/tests/test-journal --benchmark");
+        iovec[7] = IOVEC_MAKE_STRING("_EXE=/usr/lib/systemd/tests/test-journal");
+
+        ts->realtime++;
+        ts->monotonic++;
+        assert_se(journal_file_append_entry(f, ts, &boot_id, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+}
+
+static uint64_t append_benchmark_one(const char *label, const char *keyed, const char *fast, unsigned n, sd_id128_t boot_id) {
+        char t[] = "/var/tmp/journal-XXXXXX";
+        char bytes[FORMAT_BYTES_MAX], span[FORMAT_TIMESPAN_MAX];
+        uint64_t xor_hash;
+        dual_timestamp ts;
+        usec_t start, d;
+        JournalFile *f;
+        Object *o;
+        unsigned i;
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_KEYED_HASH", keyed, 1) >= 0);
+        assert_se(setenv("SYSTEMD_JOURNAL_FAST_KEYED_HASH", fast, 1) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_KEYED_HASH(f->header) == streq(keyed, "1"));
+        assert_se(JOURNAL_HEADER_FAST_KEYED_HASH(f->header) == (streq(keyed, "1") && streq(fast, "1")));
+
+        dual_timestamp_get(&ts);
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n; i++)
+                append_typical_entry(f, i, &ts, boot_id);
+
+        d = now(CLOCK_MONOTONIC) - start;
+        log_info("%-10s %u entries in %s, %.0f entries/s, file size %s",
+                 label, n, format_timespan(span, sizeof span, d, USEC_PER_MSEC),
+                 (double) n * USEC_PER_SEC / MAX(d, (usec_t) 1),
+                 format_bytes(bytes, sizeof bytes, le64toh(f->header->arena_size)));
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        assert_se(journal_file_next_entry(f, 0, DIRECTION_UP, &o, NULL) == 1);
+        xor_hash = le64toh(o->entry.xor_hash);
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return xor_hash;
+}
+
+static void test_append_benchmark(void) {
+        unsigned n = slow_tests_enabled() ? 200000 : 5000;
+        uint64_t jenkins, siphash24, siphash13, siphash13_again;
+        sd_id128_t boot_id;
+
+        assert_se(sd_id128_randomize(&boot_id) >= 0);
+
+        jenkins = append_benchmark_one("jenkins", "0", "0", n, boot_id);
+        siphash24 = append_benchmark_one("siphash24", "1", "0", n, boot_id);
+        siphash13 = append_benchmark_one("siphash13", "1", "1", n, boot_id);
+
+        /* The XOR hash must not depend on the file the entry is in */
+        siphash13_again = append_benchmark_one("siphash13", "1", "1", n, boot_id);
+        assert_se(siphash13 == siphash13_again);
+        assert_se(jenkins == siphash24);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_KEYED_HASH") >= 0);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_FAST_KEYED_HASH") >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_compact_one(bool compact, unsigned n, uint64_t *ret_index, uint64_t *ret_total) {
+        char t[] = "/var/tmp/journal-XXXXXX";
+        uint64_t p, index = 0;
+        dual_timestamp ts;
+        sd_id128_t boot_id;
+        JournalFile *f;
+        Object *o;
+        unsigned i;
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", one_zero(compact), 1) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_COMPACT(f->header) == compact);
+
+        assert_se(sd_id128_randomize(&boot_id) >= 0);
+        dual_timestamp_get(&ts);
+
+        for (i = 0; i < n; i++)
+                append_typical_entry(f, i, &ts, boot_id);
+
+        /* Everything that is only there to find entries: the entries themselves and all entry arrays */
+        for (p = le64toh(f->header->header_size); p <= le64toh(f->header->tail_object_offset); p += ALIGN64(le64toh(o->object.size))) {
+                assert_se(journal_file_move_to_object(f, OBJECT_UNUSED, p, &o) == 0);
+                if (IN_SET(o->object.type, OBJECT_ENTRY, OBJECT_ENTRY_ARRAY))
+                        index += ALIGN64(le64toh(o->object.size));
+        }
+
+        /* Bisection must work just the same */
+        for (i = 1; i <= n; i += n / 7) {
+                assert_se(journal_file_move_to_entry_by_seqnum(f, i, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i);
+        }
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        *ret_index = index;
+        *ret_total = p;
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+static void test_compact(void) {
+        unsigned n = slow_tests_enabled() ? 200000 : 20000;
+        uint64_t regular_index, regular_total, compact_index, compact_total;
+        char a[FORMAT_BYTES_MAX], b[FORMAT_BYTES_MAX], c[FORMAT_BYTES_MAX], d[FORMAT_BYTES_MAX];
+
+        test_compact_one(false, n, &regular_index, &regular_total);
+        test_compact_one(true, n, &compact_index, &compact_total);
+
+        /* Whatever is saved on disk is also saved in the page cache when reading the file back */
+        log_info("%u entries, regular: %s (%s entries and entry arrays), compact: %s (%s), saving %.1f%%",
+                 n,
+                 format_bytes(a, sizeof a, regular_total), format_bytes(b, sizeof b, regular_index),
+                 format_bytes(c, sizeof c, compact_total), format_bytes(d, sizeof d, compact_index),
+                 100.0 * (regular_total - compact_total) / regular_total);
+
+        assert_se(compact_index < regular_index);
+        assert_se(regular_total - compact_total == regular_index - compact_index);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_offline_worker(void) {
+        JournalFile *files[4] = {};
+        JournalFileSyncStats before, after;
+        char t[] = "/var/tmp/journal-offline-XXXXXX", span[FORMAT_TIMESPAN_MAX];
+        dual_timestamp ts;
+        sd_id128_t boot_id;
+        unsigned i;
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(sd_id128_randomize(&boot_id) >= 0);
+        dual_timestamp_get(&ts);
+
+        for (i = 0; i < ELEMENTSOF(files); i++) {
+                char fn[STRLEN("test-.journal") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(fn, "test-%u.journal", i);
+                assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, files + i) == 0);
+                append_typical_entry(files[i], i, &ts, boot_id);
+        }
+
+        journal_file_get_sync_stats(&before);
+
+        /* All files are synced by the same worker thread, and asking again while a file is still being
+         * synced must not queue it a second time */
+        for (i = 0; i < ELEMENTSOF(files); i++) {
+                assert_se(journal_file_set_offline(files[i], false) >= 0);
+                assert_se(journal_file_set_offline(files[i], false) >= 0);
+        }
+
+        /* Waiting for the last file first doesn't mean waiting for all the others, it's taken back from
+         * the worker if it didn't get to it yet */
+        for (i = ELEMENTSOF(files); i > 0; i--) {
+                assert_se(journal_file_set_offline(files[i-1], true) >= 0);
+                assert_se(files[i-1]->header->state == STATE_OFFLINE);
+                assert_se(!journal_file_is_offlining(files[i-1]));
+        }
+
+        journal_file_get_sync_stats(&after);
+        assert_se(after.n_syncs == before.n_syncs + ELEMENTSOF(files));
+
+        log_info("Offline worker: %" PRIu64 " syncs, callers stalled %" PRIu64 " times for %s",
+                 after.n_syncs - before.n_syncs, after.n_stalls - before.n_stalls,
+                 format_timespan(span, sizeof(span), after.stall_usec - before.stall_usec, 0));
+
+        /* Writing brings the files back online, even if an offline is still in flight */
+        for (i = 0; i < ELEMENTSOF(files); i++) {
+                assert_se(journal_file_set_offline(files[i], false) >= 0);
+                append_typical_entry(files[i], ELEMENTSOF(files) + i, &ts, boot_id);
+                assert_se(files[i]->header->state == STATE_ONLINE);
+                assert_se(le64toh(files[i]->header->n_entries) == 2);
+        }
+
+        for (i = 0; i < ELEMENTSOF(files); i++)
+                (void) journal_file_close(files[i]);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 #if HAVE_COMPRESSION
 static bool check_compressed(uint64_t compress_threshold, uint64_t data_size) {
         dual_timestamp ts;
@@ -219,6 +700,172 @@ static bool check_compressed(uint64_t compress_threshold, uint64_t data_size) {
         return is_compressed;
 }
 
+static void test_compress_large_fields(void) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        char t[] = "/var/tmp/journal-XXXXXX";
+        struct iovec iovec[5];
+        dual_timestamp ts;
+        JournalFile *f;
+        unsigned i, n = 0;
+        char *blobs[5];
+        Object *o;
+        uint64_t p;
+
+        test_setup_logging(LOG_INFO);
+
+        mkdtemp_chdir_chattr(t);
+
+        /* Several large, compressible fields in one entry */
+        for (i = 0; i < ELEMENTSOF(blobs); i++) {
+                size_t k, l = 128 * 1024;
+
+                assert_se(blobs[i] = malloc(l));
+                k = sprintf(blobs[i], "FIELD%u=", i);
+                for (; k < l; k++)
+                        blobs[i][k] = 'a' + (k * (i + 1)) % 7;
+
+                iovec[i] = IOVEC_MAKE(blobs[i], l);
+        }
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        /* Once more, now everything is already in the file */
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+
+        /* All fields ended up compressed, and the file is far smaller than the data */
+        assert_se(le64toh(f->header->n_data) == ELEMENTSOF(blobs));
+        assert_se(le64toh(f->header->tail_object_offset) < ELEMENTSOF(blobs) * 128 * 1024 / 4);
+
+        assert_se(journal_file_next_entry(f, 0, DIRECTION_DOWN, &o, &p) == 1);
+        for (i = 0; i < journal_file_entry_n_items(f, o); i++) {
+                Object *d;
+
+                assert_se(journal_file_move_to_object(f, OBJECT_DATA, journal_file_entry_item_object_offset(f, o, i), &d) == 0);
+                assert_se(d->object.flags & OBJECT_COMPRESSION_MASK);
+                assert_se(journal_file_move_to_object(f, OBJECT_ENTRY, p, &o) == 0);
+        }
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        (void) journal_file_close(f);
+
+        /* And reading them back gives us what we put in */
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+        assert_se(sd_journal_set_data_threshold(j, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                for (i = 0; i < ELEMENTSOF(blobs); i++) {
+                        char field[STRLEN("FIELD") + DECIMAL_STR_MAX(unsigned)];
+                        const void *d;
+                        size_t l;
+
+                        xsprintf(field, "FIELD%u", i);
+                        assert_se(sd_journal_get_data(j, field, &d, &l) >= 0);
+                        assert_se(l == iovec[i].iov_len);
+                        assert_se(memcmp(d, blobs[i], l) == 0);
+                }
+
+                n++;
+        }
+        assert_se(n == 2);
+
+        for (i = 0; i < ELEMENTSOF(blobs); i++)
+                free(blobs[i]);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#if HAVE_ZSTD
+static size_t dictionary_message(char *buf, unsigned i) {
+        return sprintf(buf, "MESSAGE=Connection from 10.%u.%u.%u port %u closed after %u requests [preauth]",
+                       i % 3, i % 17, i % 241, 1024 + i * 37 % 60000, i * 7 % 1000);
+}
+
+static void test_compression_dictionary(void) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        char t[] = "/var/tmp/journal-XXXXXX", buf[256];
+        unsigned i, n = 6000, n_compressed = 0;
+        uint64_t p, before = 0, after = 0;
+        dual_timestamp ts;
+        JournalFile *f;
+        Object *o;
+
+        test_setup_logging(LOG_INFO);
+
+        mkdtemp_chdir_chattr(t);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(!JOURNAL_HEADER_ZSTD_DICTIONARY(f->header));
+
+        /* Small, similar messages, each too short to be compressed on its own */
+        for (i = 0; i < n; i++) {
+                struct iovec iovec;
+
+                iovec = IOVEC_MAKE(buf, dictionary_message(buf, i));
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+
+                /* Pick up where the dictionary was added, and continue in a new writer once it is */
+                if (i == n * 3 / 4) {
+                        assert_se(JOURNAL_HEADER_ZSTD_DICTIONARY(f->header));
+                        (void) journal_file_close(f);
+                        assert_se(journal_file_open(-1, "test.journal", O_RDWR, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+                }
+        }
+
+        for (p = le64toh(f->header->header_size); p <= le64toh(f->header->tail_object_offset); p += ALIGN64(le64toh(o->object.size))) {
+                assert_se(journal_file_move_to_object(f, OBJECT_UNUSED, p, &o) == 0);
+                if (o->object.type != OBJECT_DATA)
+                        continue;
+
+                if (p < le64toh(f->header->dictionary_offset)) {
+                        assert_se(!(o->object.flags & OBJECT_COMPRESSION_MASK));
+                        before += le64toh(o->object.size) - offsetof(Object, data.payload);
+                } else {
+                        n_compressed += !!(o->object.flags & OBJECT_COMPRESSED_ZSTD);
+                        after += le64toh(o->object.size) - offsetof(Object, data.payload);
+                }
+        }
+
+        log_info("Data objects: %"PRIu64" bytes before the dictionary, %"PRIu64" bytes after, %u compressed",
+                 before, after, n_compressed);
+        assert_se(n_compressed > 0);
+        assert_se(after < before / 2);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        (void) journal_file_close(f);
+
+        /* Readers decompress with the dictionary transparently */
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        i = 0;
+        SD_JOURNAL_FOREACH(j) {
+                const void *d;
+                size_t l;
+
+                assert_se(sd_journal_get_data(j, "MESSAGE", &d, &l) >= 0);
+                assert_se(l == dictionary_message(buf, i));
+                assert_se(memcmp(d, buf, l) == 0);
+                i++;
+        }
+        assert_se(i == n);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
 static void test_min_compress_size(void) {
         /* Note that XZ will actually fail to compress anything under 80 bytes, so you have to choose the limits
          * carefully */
@@ -251,8 +898,18 @@ int main(int argc, char *argv[]) {
 
         test_non_empty();
         test_empty();
+        test_growable_hash_table();
+        test_bloom_filter();
+        test_bloom_filter_full();
+        test_append_benchmark();
+        test_compact();
+        test_offline_worker();
 #if HAVE_COMPRESSION
         test_min_compress_size();
+        test_compress_large_fields();
+#endif
+#if HAVE_ZSTD
+        test_compression_dictionary();
 #endif
 
         return 0;
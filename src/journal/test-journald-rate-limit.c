@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <syslog.h>
+
+#include "journald-rate-limit.h"
+#include "stdio-util.h"
+#include "tests.h"
+
+#define TS (42 * USEC_PER_SEC)
+
+static void test_unit(void) {
+        JournalRateLimit *r;
+        unsigned i;
+
+        assert_se(r = journal_ratelimit_new(0, 0));
+
+        /* Without any limits nothing is tracked */
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", 0, 0, LOG_INFO, 0, TS) == 1);
+
+        for (i = 0; i < 10; i++)
+                assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 1);
+
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 0);
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 0);
+
+        /* Other priorities and other units have their own buckets */
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_ERR, 0, TS) == 1);
+        assert_se(journal_ratelimit_test(r, "system.slice", "bar.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 1);
+
+        /* A token is refilled every 100ms, and the next message reports what was dropped before */
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + 99 * USEC_PER_MSEC) == 0);
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + 100 * USEC_PER_MSEC) == 1 + 3);
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + 100 * USEC_PER_MSEC) == 0);
+
+        /* After a full interval the bucket is full again */
+        for (i = 0; i < 10; i++)
+                assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + 2 * USEC_PER_SEC) == 1 + (i == 0));
+        assert_se(journal_ratelimit_test(r, "system.slice", "foo.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + 2 * USEC_PER_SEC) == 0);
+
+        journal_ratelimit_free(r);
+}
+
+static uint64_t slice_dropped(JsonVariant *v, const char *slice, const char *field) {
+        JsonVariant *s;
+
+        JSON_VARIANT_ARRAY_FOREACH(s, json_variant_by_key(v, "slices"))
+                if (streq(json_variant_string(json_variant_by_key(s, "slice")), slice))
+                        return json_variant_unsigned(json_variant_by_key(s, field));
+
+        return UINT64_MAX;
+}
+
+static void test_slice(void) {
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        JournalRateLimit *r;
+        unsigned i;
+
+        /* Two services in the same slice share its budget, services in other slices are not affected */
+        assert_se(r = journal_ratelimit_new(USEC_PER_SEC, 15));
+
+        for (i = 0; i < 10; i++)
+                assert_se(journal_ratelimit_test(r, "noisy.slice", "a.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 1);
+        for (i = 0; i < 5; i++)
+                assert_se(journal_ratelimit_test(r, "noisy.slice", "b.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 1);
+        for (i = 0; i < 7; i++)
+                assert_se(journal_ratelimit_test(r, "noisy.slice", "b.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 0);
+        assert_se(journal_ratelimit_test(r, "noisy.slice", "a.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 0);
+
+        for (i = 0; i < 10; i++)
+                assert_se(journal_ratelimit_test(r, "quiet.slice", "c.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS) == 1);
+
+        /* Messages without a slice are accounted to the root slice */
+        assert_se(journal_ratelimit_test(r, NULL, "d.service", USEC_PER_SEC, 1, LOG_INFO, 0, TS) == 1);
+        assert_se(journal_ratelimit_test(r, NULL, "d.service", USEC_PER_SEC, 1, LOG_INFO, 0, TS) == 0);
+
+        assert_se(journal_ratelimit_build_json(r, &v) >= 0);
+        json_variant_dump(v, JSON_FORMAT_PRETTY|JSON_FORMAT_COLOR_AUTO, NULL, NULL);
+
+        assert_se(slice_dropped(v, "noisy.slice", "dropped") == 8);
+        assert_se(slice_dropped(v, "noisy.slice", "droppedBySliceLimit") == 8);
+        assert_se(slice_dropped(v, "quiet.slice", "dropped") == 0);
+        assert_se(slice_dropped(v, "-.slice", "dropped") == 1);
+        assert_se(slice_dropped(v, "-.slice", "droppedBySliceLimit") == 0);
+
+        /* The suppressed messages are reported once the slice has tokens again */
+        assert_se(journal_ratelimit_test(r, "noisy.slice", "b.service", USEC_PER_SEC, 10, LOG_INFO, 0, TS + USEC_PER_SEC) == 1 + 7);
+
+        journal_ratelimit_free(r);
+}
+
+static void test_many_units(void) {
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        usec_t ts, spent;
+        JournalRateLimit *r;
+        unsigned i, n;
+
+        /* Lots of units must neither slow things down nor make us forget what was dropped */
+        n = slow_tests_enabled() ? 60000 : 20000;
+
+        assert_se(r = journal_ratelimit_new(USEC_PER_SEC, 1000000));
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < 3 * n; i++) {
+                char unit[STRLEN("unit-.service") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(unit, "unit-%u.service", i % n);
+                assert_se(journal_ratelimit_test(r, "many.slice", unit, USEC_PER_SEC, 2, LOG_INFO, 0, TS) == (i < 2 * n));
+        }
+        spent = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("%u units: %.1f ns per message", n, (double) spent * NSEC_PER_USEC / (3 * n));
+
+        assert_se(journal_ratelimit_build_json(r, &v) >= 0);
+        assert_se(slice_dropped(v, "many.slice", "dropped") == n);
+
+        /* The next message of a unit reports what was dropped, the slice still knows about all of it */
+        assert_se(journal_ratelimit_test(r, "many.slice", "unit-0.service", USEC_PER_SEC, 2, LOG_INFO, 0, TS + USEC_PER_SEC) == 1 + 1);
+        assert_se(journal_ratelimit_test(r, "many.slice", "new.service", USEC_PER_SEC, 2, LOG_INFO, 0, TS + USEC_PER_SEC) == 1);
+
+        v = json_variant_unref(v);
+        assert_se(journal_ratelimit_build_json(r, &v) >= 0);
+        assert_se(slice_dropped(v, "many.slice", "dropped") == n);
+
+        journal_ratelimit_free(r);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_unit();
+        test_slice();
+        test_many_units();
+
+        return 0;
+}
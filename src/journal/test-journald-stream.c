@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "format-util.h"
+#include "journald-context.h"
+#include "journald-server.h"
+#include "journald-stream.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "tests.h"
+#include "time-util.h"
+#include "tmpfile-util.h"
+
+typedef struct Client {
+        int fd;
+        const char *data;
+        size_t size;
+        size_t written;
+} Client;
+
+static void server_setup(Server *s, const char *runtime_directory) {
+        *s = (Server) {
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .max_level_kmsg = LOG_DEBUG,
+                .line_max = 48*1024,
+                .dev_kmsg_fd = -1,
+                .notify_fd = -1,
+                .runtime_directory = (char*) runtime_directory,
+        };
+
+        assert_se(sd_event_new(&s->event) >= 0);
+}
+
+static void server_teardown(Server *s) {
+        assert_se(s->n_stdout_streams == 0);
+
+        client_context_flush_all(s);
+        free(s->stream_buffer);
+        sd_event_unref(s->event);
+}
+
+static void client_connect(Server *s, Client *c, const char *data, size_t size) {
+        int fds[2];
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, fds) >= 0);
+        assert_se(stdout_stream_install(s, fds[0], NULL) >= 0);
+
+        *c = (Client) {
+                .fd = fds[1],
+                .data = data,
+                .size = size,
+        };
+}
+
+/* Writes at most max bytes of what is left, and closes the connection once everything is written. Returns
+ * true if there is more to write. */
+static bool client_write(Client *c, size_t max) {
+        ssize_t l;
+
+        if (c->fd < 0)
+                return false;
+
+        l = write(c->fd, c->data + c->written, MIN(c->size - c->written, max));
+        if (l < 0) {
+                assert_se(errno == EAGAIN);
+                return true;
+        }
+
+        c->written += l;
+        if (c->written < c->size)
+                return true;
+
+        c->fd = safe_close(c->fd);
+        return false;
+}
+
+static const char* line_text(char *buf, size_t i) {
+        /* Lines of varying length */
+        sprintf(buf, "line %zu%s", i, i % 7 == 0 ? ", padded to make it a bit longer than the others" : "");
+        return buf;
+}
+
+static size_t line_append(char *p, size_t i, bool prefix) {
+        char buf[128];
+
+        /* Some lines come with a priority prefix, and some are terminated by NUL */
+        return sprintf(p, "%s%s%c",
+                       prefix && i % 3 == 0 ? "<3>" : "",
+                       line_text(buf, i),
+                       i % 5 == 0 ? '\0' : '\n');
+}
+
+static void test_stream_lines(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        _cleanup_free_ char *data = NULL, *expected = NULL, *got = NULL;
+        char kmsg[] = "/tmp/test-journald-stream-kmsg.XXXXXX";
+        _cleanup_close_ int kmsg_fd = -1;
+        size_t i, n = 500, size;
+        Server s;
+        Client c;
+
+        assert_se(mkdtemp_malloc("/tmp/test-journald-stream-XXXXXX", &t) >= 0);
+        server_setup(&s, t);
+
+        /* Forwarding to kmsg happens before anything else is done with a line, use it to see what we got */
+        assert_se((kmsg_fd = mkostemp_safe(kmsg)) >= 0);
+        assert_se(unlink(kmsg) >= 0);
+        s.dev_kmsg_fd = kmsg_fd;
+
+        assert_se(data = new(char, 64 + n * 128));
+        assert_se(expected = strdup(""));
+
+        /* Identifier, unit, priority, level prefix, forwarding to syslog, kmsg and console */
+        size = sprintf(data, "test\nfoo.service\n6\n1\n0\n1\n0\n");
+
+        for (i = 0; i < n; i++) {
+                char header[STRLEN("<>test[]: ") + 2 * DECIMAL_STR_MAX(int)], buf[128];
+
+                size += line_append(data + size, i, true);
+
+                xsprintf(header, "<%i>test[" PID_FMT "]: ", LOG_USER | (i % 3 == 0 ? LOG_ERR : LOG_INFO), getpid_cached());
+                assert_se(strextend(&expected, header, line_text(buf, i), "\n", NULL));
+        }
+
+        /* Dribble the data in, so that lines are split across reads in all possible ways */
+        client_connect(&s, &c, data, size);
+        while (client_write(&c, 7))
+                while (sd_event_run(s.event, 0) > 0)
+                        ;
+
+        while (s.n_stdout_streams > 0)
+                assert_se(sd_event_run(s.event, USEC_INFINITY) >= 0);
+
+        assert_se(lseek(kmsg_fd, 0, SEEK_SET) == 0);
+        assert_se(read_full_stream(take_fdopen(&kmsg_fd, "r"), &got, NULL) >= 0);
+        assert_se(streq(got, expected));
+
+        server_teardown(&s);
+}
+
+static void test_stream_benchmark(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *t = NULL;
+        _cleanup_free_ Client *clients = NULL;
+        _cleanup_free_ char *data = NULL;
+        char span[FORMAT_TIMESPAN_MAX];
+        size_t i, n_streams, n_lines = 2000, size;
+        usec_t spent = 0;
+        Server s;
+
+        /* Lots of services logging a bit each, which is what journald usually sees */
+        n_streams = slow_tests_enabled() ? 1000 : 100;
+
+        assert_se(mkdtemp_malloc("/tmp/test-journald-stream-XXXXXX", &t) >= 0);
+        server_setup(&s, t);
+
+        assert_se(data = new(char, 64 + n_lines * 128));
+
+        size = sprintf(data, "bench\nbench.service\n6\n0\n0\n0\n0\n");
+        for (i = 0; i < n_lines; i++)
+                size += line_append(data + size, i, false);
+
+        assert_se(clients = new(Client, n_streams));
+        for (i = 0; i < n_streams; i++)
+                client_connect(&s, clients + i, data, size);
+
+        while (s.n_stdout_streams > 0) {
+                bool more = false;
+                usec_t ts;
+
+                for (i = 0; i < n_streams; i++)
+                        if (client_write(clients + i, SIZE_MAX))
+                                more = true;
+
+                ts = now(CLOCK_MONOTONIC);
+                assert_se(sd_event_run(s.event, more ? 0 : USEC_INFINITY) >= 0);
+                spent += now(CLOCK_MONOTONIC) - ts;
+        }
+
+        log_info("%zu streams, %zu lines each: %s, %.1f ns per line",
+                 n_streams, n_lines,
+                 format_timespan(span, sizeof(span), spent, USEC_PER_MSEC),
+                 (double) spent * NSEC_PER_USEC / (n_streams * n_lines));
+
+        server_teardown(&s);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_stream_lines();
+        test_stream_benchmark();
+
+        return 0;
+}
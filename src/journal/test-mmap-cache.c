@@ -6,12 +6,20 @@
 #include <unistd.h>
 
 #include "fd-util.h"
+#include "log.h"
 #include "macro.h"
 #include "mmap-cache.h"
+#include "random-util.h"
+#include "tests.h"
+#include "time-util.h"
 #include "tmpfile-util.h"
 #include "util.h"
 
-int main(int argc, char *argv[]) {
+#define SCAN_FILE_SIZE (64ULL*1024ULL*1024ULL)
+#define SCAN_STEP 512ULL
+#define RANDOM_LOOKUPS 100000U
+
+static void test_basic(void) {
         MMapFileDescriptor *fx;
         int x, y, z, r;
         char px[] = "/tmp/testmmapXXXXXXX", py[] = "/tmp/testmmapYXXXXXX", pz[] = "/tmp/testmmapZXXXXXX";
@@ -61,6 +69,113 @@ int main(int argc, char *argv[]) {
         safe_close(x);
         safe_close(y);
         safe_close(z);
+}
+
+static void check_at(MMapCache *m, MMapFileDescriptor *f, struct stat *st, uint64_t offset) {
+        void *p;
+
+        assert_se(mmap_cache_get(m, f, PROT_READ, 0, false, offset, sizeof(uint64_t), st, &p, NULL) > 0);
+        assert_se(*(uint64_t*) p == offset);
+}
+
+typedef enum Pattern {
+        PATTERN_FORWARD,
+        PATTERN_BACKWARD,
+        PATTERN_RANDOM,
+} Pattern;
+
+static unsigned run_pattern(int fd, Pattern pattern) {
+        char buf[FORMAT_TIMESPAN_MAX];
+        MMapFileDescriptor *f;
+        uint64_t offset;
+        unsigned missed, i;
+        struct stat st;
+        MMapCache *m;
+        usec_t start;
+
+        assert_se(fstat(fd, &st) >= 0);
+
+        /* Use a fresh cache every time, so that we don't benefit from the windows of the previous run */
+        assert_se(m = mmap_cache_new());
+        assert_se(f = mmap_cache_add_fd(m, fd));
+
+        start = now(CLOCK_MONOTONIC);
+
+        switch (pattern) {
+
+        case PATTERN_FORWARD:
+                /* Like journalctl going through a file from the beginning */
+                for (offset = 0; offset < SCAN_FILE_SIZE; offset += SCAN_STEP)
+                        check_at(m, f, &st, offset);
+                break;
+
+        case PATTERN_BACKWARD:
+                /* Like journalctl --reverse */
+                for (offset = SCAN_FILE_SIZE; offset > 0; offset -= SCAN_STEP)
+                        check_at(m, f, &st, offset - SCAN_STEP);
+                break;
+
+        case PATTERN_RANDOM:
+                /* Like bisecting through entry arrays */
+                for (i = 0; i < RANDOM_LOOKUPS; i++)
+                        check_at(m, f, &st, random_u64() % SCAN_FILE_SIZE & ~(sizeof(uint64_t) - 1));
+                break;
+        }
+
+        missed = mmap_cache_get_missed(m);
+
+        log_info("%s: %s, %u windows mapped",
+                 pattern == PATTERN_FORWARD ? "Forward scan" :
+                 pattern == PATTERN_BACKWARD ? "Backward scan" : "Random lookups",
+                 format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - start, 1),
+                 missed);
+        mmap_cache_stats_log_debug(m);
+
+        mmap_cache_free_fd(m, f);
+        mmap_cache_unref(m);
+
+        return missed;
+}
+
+static void test_access_patterns(void) {
+        char path[] = "/tmp/testmmapPXXXXXX";
+        _cleanup_close_ int fd = -1;
+        unsigned i, missed;
+        uint64_t offset;
+
+        /* Each 64bit word in the file contains its own offset */
+        fd = mkostemp_safe(path);
+        assert_se(fd >= 0);
+        unlink(path);
+
+        for (offset = 0; offset < SCAN_FILE_SIZE; ) {
+                uint64_t words[4096];
+
+                for (i = 0; i < ELEMENTSOF(words); i++, offset += sizeof(uint64_t))
+                        words[i] = offset;
+
+                assert_se(write(fd, words, sizeof(words)) == sizeof(words));
+        }
+
+        /* Windows grow while scanning, hence we need fewer of them than with fixed 8 MiB windows */
+        missed = run_pattern(fd, PATTERN_FORWARD);
+#if !ENABLE_DEBUG_MMAP_CACHE
+        assert_se(missed < SCAN_FILE_SIZE / (8ULL*1024ULL*1024ULL));
+#endif
+
+        missed = run_pattern(fd, PATTERN_BACKWARD);
+#if !ENABLE_DEBUG_MMAP_CACHE
+        assert_se(missed < SCAN_FILE_SIZE / (8ULL*1024ULL*1024ULL));
+#endif
+
+        (void) run_pattern(fd, PATTERN_RANDOM);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_DEBUG);
+
+        test_basic();
+        test_access_patterns();
 
         return 0;
 }
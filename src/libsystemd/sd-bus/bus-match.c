@@ -48,14 +48,105 @@
  *      ` BUS_MATCH_LEAF: E
  */
 
+/* The value nodes below a compare node are always kept in a hash table, keyed by their value, so that a
+ * message is only ever compared against the values that can match it, however many there are:
+ *
+ *  - For exact matches, that's a single lookup of the value in the message.
+ *
+ *  - For path_namespace= and argNnamespace=, a match is the value itself or one of its prefixes ending
+ *    right before or after a separator, see simple_pattern_check(). Hence we look up each of these
+ *    prefixes, which is like walking down a trie of the labels of the value.
+ *
+ *  - For argNpath=, matches are the prefixes of the value ending in '/', and if the value itself ends in
+ *    '/', everything below it. For the latter we additionally index each match by all its proper
+ *    prefixes ending in '/'.
+ *
+ *  - For sender=, without knowing the well-known names of a sender we let all well-known names match any
+ *    unique name, hence we keep them in a set of their own.
+ */
+
 static bool BUS_MATCH_IS_COMPARE(enum bus_match_node_type t) {
         return t >= BUS_MATCH_SENDER && t <= BUS_MATCH_ARG_HAS_LAST;
 }
 
-static bool BUS_MATCH_CAN_HASH(enum bus_match_node_type t) {
-        return (t >= BUS_MATCH_MESSAGE_TYPE && t <= BUS_MATCH_PATH) ||
-                (t >= BUS_MATCH_ARG && t <= BUS_MATCH_ARG_LAST) ||
-                (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST);
+static bool BUS_MATCH_IS_ARG_PATH(enum bus_match_node_type t) {
+        return t >= BUS_MATCH_ARG_PATH && t <= BUS_MATCH_ARG_PATH_LAST;
+}
+
+/* These two temporarily cut the value of the node short in place, in order to look up its prefixes without
+ * allocating anything, so that removing never fails. */
+
+static int bus_match_prefixes_add(struct bus_match_node *c, struct bus_match_node *n) {
+        char *v, *p;
+        int r;
+
+        assert(c);
+        assert(n);
+
+        v = n->value.str;
+
+        /* Index the node by all prefixes of its value that end in '/', except for the value itself */
+        for (p = v; (p = strchr(p, '/')) && p[1]; p++) {
+                _cleanup_free_ char *key = NULL;
+                char saved = p[1];
+                Set *s;
+
+                p[1] = 0;
+                s = hashmap_get(c->compare.by_prefix, v);
+                if (!s)
+                        key = strdup(v);
+                p[1] = saved;
+
+                if (!s) {
+                        if (!key)
+                                return -ENOMEM;
+
+                        s = set_new(NULL);
+                        if (!s)
+                                return -ENOMEM;
+
+                        r = hashmap_put(c->compare.by_prefix, key, s);
+                        if (r < 0) {
+                                set_free(s);
+                                return r;
+                        }
+
+                        TAKE_PTR(key);
+                }
+
+                r = set_put(s, n);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static void bus_match_prefixes_remove(struct bus_match_node *c, struct bus_match_node *n) {
+        char *v, *p;
+
+        assert(c);
+        assert(n);
+
+        v = n->value.str;
+
+        for (p = v; (p = strchr(p, '/')) && p[1]; p++) {
+                char saved = p[1], *key;
+                Set *s;
+
+                p[1] = 0;
+                s = hashmap_get2(c->compare.by_prefix, v, (void**) &key);
+                if (s) {
+                        set_remove(s, n);
+
+                        if (set_isempty(s)) {
+                                hashmap_remove(c->compare.by_prefix, v);
+                                set_free(s);
+                                free(key);
+                        }
+                }
+                p[1] = saved;
+        }
 }
 
 static void bus_match_node_free(struct bus_match_node *node) {
@@ -81,13 +172,19 @@ static void bus_match_node_free(struct bus_match_node *node) {
         }
 
         if (node->type == BUS_MATCH_VALUE) {
-                /* We might be in the parent's hash table, so clean
-                 * this up */
+                /* We are in the parent's hash table, and maybe
+                 * its other indexes, so clean this up */
 
                 if (node->parent->type == BUS_MATCH_MESSAGE_TYPE)
-                        hashmap_remove(node->parent->compare.children, UINT_TO_PTR(node->value.u8));
-                else if (BUS_MATCH_CAN_HASH(node->parent->type) && node->value.str)
-                        hashmap_remove(node->parent->compare.children, node->value.str);
+                        hashmap_remove_value(node->parent->compare.children, UINT_TO_PTR(node->value.u8), node);
+                else if (node->value.str) {
+                        hashmap_remove_value(node->parent->compare.children, node->value.str, node);
+
+                        if (BUS_MATCH_IS_ARG_PATH(node->parent->type))
+                                bus_match_prefixes_remove(node->parent, node);
+                        else if (node->parent->type == BUS_MATCH_SENDER)
+                                set_remove(node->parent->compare.well_known, node);
+                }
 
                 free(node->value.str);
         }
@@ -95,6 +192,12 @@ static void bus_match_node_free(struct bus_match_node *node) {
         if (BUS_MATCH_IS_COMPARE(node->type)) {
                 assert(hashmap_isempty(node->compare.children));
                 hashmap_free(node->compare.children);
+
+                assert(hashmap_isempty(node->compare.by_prefix));
+                hashmap_free(node->compare.by_prefix);
+
+                assert(set_isempty(node->compare.well_known));
+                set_free(node->compare.well_known);
         }
 
         free(node);
@@ -116,123 +219,223 @@ static bool bus_match_node_maybe_free(struct bus_match_node *node) {
         return true;
 }
 
-static bool value_node_test(
+static bool bus_match_modified(sd_bus *bus) {
+        return bus && bus->match_callbacks_modified;
+}
+
+static int bus_match_run_value(
+                sd_bus *bus,
                 struct bus_match_node *node,
-                enum bus_match_node_type parent_type,
-                uint8_t value_u8,
-                const char *value_str,
-                char **value_strv,
+                const void *key,
                 sd_bus_message *m) {
 
-        assert(node);
-        assert(node->type == BUS_MATCH_VALUE);
+        struct bus_match_node *found;
 
-        /* Tests parameters against this value node, doing prefix
-         * magic and stuff. */
+        found = hashmap_get(node->compare.children, key);
+        if (!found)
+                return 0;
 
-        switch (parent_type) {
+        return bus_match_run(bus, found, m);
+}
 
-        case BUS_MATCH_MESSAGE_TYPE:
-                return node->value.u8 == value_u8;
+static int bus_match_run_sender(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *test_str,
+                sd_bus_message *m) {
 
-        case BUS_MATCH_SENDER:
-                if (streq_ptr(node->value.str, value_str))
-                        return true;
+        struct bus_match_node *c;
+        Iterator i;
+        int r;
 
-                if (m->creds.mask & SD_BUS_CREDS_WELL_KNOWN_NAMES) {
-                        char **i;
+        if (test_str) {
+                r = bus_match_run_value(bus, node, test_str, m);
+                if (r != 0 || bus_match_modified(bus))
+                        return r;
+        }
 
-                        /* on kdbus we have the well known names list
-                         * in the credentials, let's make use of that
-                         * for an accurate match */
+        if (m->creds.mask & SD_BUS_CREDS_WELL_KNOWN_NAMES) {
+                char **name;
 
-                        STRV_FOREACH(i, m->creds.well_known_names)
-                                if (streq_ptr(node->value.str, *i))
-                                        return true;
+                /* on kdbus we have the well known names list
+                 * in the credentials, let's make use of that
+                 * for an accurate match */
 
-                } else {
+                STRV_FOREACH(name, m->creds.well_known_names) {
+                        if (streq_ptr(*name, test_str))
+                                continue;
+
+                        r = bus_match_run_value(bus, node, *name, m);
+                        if (r != 0 || bus_match_modified(bus))
+                                return r;
+                }
+
+        } else if (test_str && test_str[0] == ':') {
 
-                        /* If we don't have kdbus, we don't know the
-                         * well-known names of the senders. In that,
-                         * let's just hope that dbus-daemon doesn't
-                         * send us stuff we didn't want. */
+                /* If we don't have kdbus, we don't know the
+                 * well-known names of the senders. In that,
+                 * let's just hope that dbus-daemon doesn't
+                 * send us stuff we didn't want. */
 
-                        if (node->value.str[0] != ':' && value_str && value_str[0] == ':')
-                                return true;
+                SET_FOREACH(c, node->compare.well_known, i) {
+                        r = bus_match_run(bus, c, m);
+                        if (r != 0 || bus_match_modified(bus))
+                                return r;
                 }
+        }
 
-                return false;
+        return 0;
+}
 
-        case BUS_MATCH_DESTINATION:
-        case BUS_MATCH_INTERFACE:
-        case BUS_MATCH_MEMBER:
-        case BUS_MATCH_PATH:
-        case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
+static int bus_match_run_namespace(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                char separator,
+                const char *test_str,
+                sd_bus_message *m) {
 
-                if (value_str)
-                        return streq_ptr(node->value.str, value_str);
+        _cleanup_free_ char *copy = NULL;
+        char *p;
+        int r;
 
-                return false;
+        if (!test_str)
+                return 0;
 
-        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST: {
-                char **i;
+        /* See simple_pattern_check(): the value itself, and the prefixes that are followed by a separator,
+         * with and without it. Each of them is looked up only once. */
 
-                STRV_FOREACH(i, value_strv)
-                        if (streq_ptr(node->value.str, *i))
-                                return true;
+        r = bus_match_run_value(bus, node, test_str, m);
+        if (r != 0 || bus_match_modified(bus))
+                return r;
 
-                return false;
+        copy = strdup(test_str);
+        if (!copy)
+                return -ENOMEM;
+
+        for (p = copy; (p = strchr(p, separator)); p++) {
+                char saved;
+
+                *p = 0;
+                r = bus_match_run_value(bus, node, copy, m);
+                *p = separator;
+                if (r != 0 || bus_match_modified(bus))
+                        return r;
+
+                /* If a separator or nothing follows, the next round or the value itself covers this */
+                if (p[1] == 0 || p[1] == separator)
+                        continue;
+
+                saved = p[1];
+                p[1] = 0;
+                r = bus_match_run_value(bus, node, copy, m);
+                p[1] = saved;
+                if (r != 0 || bus_match_modified(bus))
+                        return r;
         }
 
-        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
-                if (value_str)
-                        return namespace_simple_pattern(node->value.str, value_str);
+        return 0;
+}
 
-                return false;
+static int bus_match_run_path(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *test_str,
+                sd_bus_message *m) {
 
-        case BUS_MATCH_PATH_NAMESPACE:
-                return path_simple_pattern(node->value.str, value_str);
+        struct bus_match_node *c;
+        _cleanup_free_ char *copy = NULL;
+        char *p;
+        Iterator i;
+        Set *below;
+        int r;
 
-        case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
-                if (value_str)
-                        return path_complex_pattern(node->value.str, value_str);
+        if (!test_str)
+                return 0;
 
-                return false;
+        /* See complex_pattern_check(): the value itself, its prefixes ending in '/', and if it ends in '/'
+         * itself, everything below it. */
 
-        default:
-                assert_not_reached("Invalid node type");
+        r = bus_match_run_value(bus, node, test_str, m);
+        if (r != 0 || bus_match_modified(bus))
+                return r;
+
+        copy = strdup(test_str);
+        if (!copy)
+                return -ENOMEM;
+
+        for (p = copy; (p = strchr(p, '/')) && p[1]; p++) {
+                char saved = p[1];
+
+                p[1] = 0;
+                r = bus_match_run_value(bus, node, copy, m);
+                p[1] = saved;
+                if (r != 0 || bus_match_modified(bus))
+                        return r;
+        }
+
+        if (!endswith(test_str, "/"))
+                return 0;
+
+        below = hashmap_get(node->compare.by_prefix, test_str);
+        SET_FOREACH(c, below, i) {
+                r = bus_match_run(bus, c, m);
+                if (r != 0 || bus_match_modified(bus))
+                        return r;
         }
+
+        return 0;
 }
 
-static bool value_node_same(
+static int bus_match_run_values(
+                sd_bus *bus,
                 struct bus_match_node *node,
-                enum bus_match_node_type parent_type,
-                uint8_t value_u8,
-                const char *value_str) {
+                uint8_t test_u8,
+                const char *test_str,
+                char **test_strv,
+                sd_bus_message *m) {
 
-        /* Tests parameters against this value node, not doing prefix
-         * magic and stuff, i.e. this one actually compares the match
-         * itself. */
+        int r;
 
         assert(node);
-        assert(node->type == BUS_MATCH_VALUE);
 
-        switch (parent_type) {
+        switch (node->type) {
 
         case BUS_MATCH_MESSAGE_TYPE:
-                return node->value.u8 == value_u8;
+                return bus_match_run_value(bus, node, UINT_TO_PTR(test_u8), m);
 
         case BUS_MATCH_SENDER:
+                return bus_match_run_sender(bus, node, test_str, m);
+
         case BUS_MATCH_DESTINATION:
         case BUS_MATCH_INTERFACE:
         case BUS_MATCH_MEMBER:
         case BUS_MATCH_PATH:
         case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
-        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
-        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
+                if (!test_str)
+                        return 0;
+
+                return bus_match_run_value(bus, node, test_str, m);
+
+        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST: {
+                char **i;
+
+                STRV_FOREACH(i, test_strv) {
+                        r = bus_match_run_value(bus, node, *i, m);
+                        if (r != 0 || bus_match_modified(bus))
+                                return r;
+                }
+
+                return 0;
+        }
+
         case BUS_MATCH_PATH_NAMESPACE:
+                return bus_match_run_namespace(bus, node, '/', test_str, m);
+
+        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
+                return bus_match_run_namespace(bus, node, '.', test_str, m);
+
         case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
-                return streq(node->value.str, value_str);
+                return bus_match_run_path(bus, node, test_str, m);
 
         default:
                 assert_not_reached("Invalid node type");
@@ -379,53 +582,9 @@ int bus_match_run(
                 assert_not_reached("Unknown match type.");
         }
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
-                struct bus_match_node *found;
-
-                /* Lookup via hash table, nice! So let's jump directly. */
-
-                if (test_str)
-                        found = hashmap_get(node->compare.children, test_str);
-                else if (test_strv) {
-                        char **i;
-
-                        STRV_FOREACH(i, test_strv) {
-                                found = hashmap_get(node->compare.children, *i);
-                                if (found) {
-                                        r = bus_match_run(bus, found, m);
-                                        if (r != 0)
-                                                return r;
-                                }
-                        }
-
-                        found = NULL;
-                } else if (node->type == BUS_MATCH_MESSAGE_TYPE)
-                        found = hashmap_get(node->compare.children, UINT_TO_PTR(test_u8));
-                else
-                        found = NULL;
-
-                if (found) {
-                        r = bus_match_run(bus, found, m);
-                        if (r != 0)
-                                return r;
-                }
-        } else {
-                struct bus_match_node *c;
-
-                /* No hash table, so let's iterate manually... */
-
-                for (c = node->child; c; c = c->next) {
-                        if (!value_node_test(c, node->type, test_u8, test_str, test_strv, m))
-                                continue;
-
-                        r = bus_match_run(bus, c, m);
-                        if (r != 0)
-                                return r;
-
-                        if (bus && bus->match_callbacks_modified)
-                                return 0;
-                }
-        }
+        r = bus_match_run_values(bus, node, test_u8, test_str, test_strv, m);
+        if (r != 0)
+                return r;
 
         if (bus && bus->match_callbacks_modified)
                 return 0;
@@ -447,6 +606,7 @@ static int bus_match_add_compare_value(
         assert(where);
         assert(IN_SET(where->type, BUS_MATCH_ROOT, BUS_MATCH_VALUE));
         assert(BUS_MATCH_IS_COMPARE(t));
+        assert(t == BUS_MATCH_MESSAGE_TYPE || value_str);
         assert(ret);
 
         for (c = where->child; c && c->type != t; c = c->next)
@@ -458,12 +618,8 @@ static int bus_match_add_compare_value(
 
                 if (t == BUS_MATCH_MESSAGE_TYPE)
                         n = hashmap_get(c->compare.children, UINT_TO_PTR(value_u8));
-                else if (BUS_MATCH_CAN_HASH(t))
+                else
                         n = hashmap_get(c->compare.children, value_str);
-                else {
-                        for (n = c->child; n && !value_node_same(n, t, value_u8, value_str); n = n->next)
-                                ;
-                }
 
                 if (n) {
                         *ret = n;
@@ -486,15 +642,21 @@ static int bus_match_add_compare_value(
                         c->next->prev = c;
                 where->child = c;
 
-                if (t == BUS_MATCH_MESSAGE_TYPE) {
-                        c->compare.children = hashmap_new(NULL);
-                        if (!c->compare.children) {
+                c->compare.children = hashmap_new(t == BUS_MATCH_MESSAGE_TYPE ? NULL : &string_hash_ops);
+                if (!c->compare.children) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+
+                if (BUS_MATCH_IS_ARG_PATH(t)) {
+                        c->compare.by_prefix = hashmap_new(&string_hash_ops);
+                        if (!c->compare.by_prefix) {
                                 r = -ENOMEM;
                                 goto fail;
                         }
-                } else if (BUS_MATCH_CAN_HASH(t)) {
-                        c->compare.children = hashmap_new(&string_hash_ops);
-                        if (!c->compare.children) {
+                } else if (t == BUS_MATCH_SENDER) {
+                        c->compare.well_known = set_new(NULL);
+                        if (!c->compare.well_known) {
                                 r = -ENOMEM;
                                 goto fail;
                         }
@@ -517,21 +679,23 @@ static int bus_match_add_compare_value(
                 }
         }
 
-        n->parent = c;
-        if (c->compare.children) {
+        if (t == BUS_MATCH_MESSAGE_TYPE)
+                r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
+        else
+                r = hashmap_put(c->compare.children, n->value.str, n);
+        if (r < 0)
+                goto fail;
 
-                if (t == BUS_MATCH_MESSAGE_TYPE)
-                        r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
-                else
-                        r = hashmap_put(c->compare.children, n->value.str, n);
+        /* From now on the node is known to its parent, and bus_match_node_free() takes care of all of it */
+        n->parent = c;
 
-                if (r < 0)
-                        goto fail;
-        } else {
-                n->next = c->child;
-                if (n->next)
-                        n->next->prev = n;
-                c->child = n;
+        if (BUS_MATCH_IS_ARG_PATH(t))
+                r = bus_match_prefixes_add(c, n);
+        else if (t == BUS_MATCH_SENDER && n->value.str[0] != ':')
+                r = set_put(c->compare.well_known, n);
+        if (r < 0) {
+                bus_match_node_free(TAKE_PTR(n));
+                goto fail;
         }
 
         *ret = n;
@@ -960,7 +1124,7 @@ void bus_match_free(struct bus_match_node *node) {
         if (!node)
                 return;
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
+        if (BUS_MATCH_IS_COMPARE(node->type)) {
                 Iterator i;
 
                 HASHMAP_FOREACH(c, node->compare.children, i)
@@ -1053,7 +1217,7 @@ void bus_match_dump(struct bus_match_node *node, unsigned level) {
         else
                 putchar('\n');
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
+        if (BUS_MATCH_IS_COMPARE(node->type)) {
                 Iterator i;
 
                 HASHMAP_FOREACH(c, node->compare.children, i)
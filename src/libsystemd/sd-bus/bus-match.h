@@ -4,6 +4,7 @@
 #include "sd-bus.h"
 
 #include "hashmap.h"
+#include "set.h"
 
 enum bus_match_node_type {
         BUS_MATCH_ROOT,
@@ -43,8 +44,13 @@ struct bus_match_node {
                         struct match_callback *callback;
                 } leaf;
                 struct {
-                        /* If this is set, then the child is NULL */
+                        /* The value nodes below, by their value. The child is always NULL. */
                         Hashmap *children;
+                        /* For argNpath: the value nodes by each of their proper prefixes ending in '/', to
+                         * find the ones below a path quickly */
+                        Hashmap *by_prefix;
+                        /* For sender: the value nodes of well-known names, which match all unique names */
+                        Set *well_known;
                 } compare;
         };
 };
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include "alloc-util.h"
+#include "bus-internal.h"
 #include "bus-match.h"
 #include "bus-message.h"
 #include "bus-slot.h"
@@ -7,7 +9,10 @@
 #include "log.h"
 #include "macro.h"
 #include "memory-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
 #include "tests.h"
+#include "time-util.h"
 
 static bool mask[32];
 
@@ -68,6 +73,211 @@ static void test_match_scope(const char *match, enum bus_match_scope scope) {
         bus_match_parse_free(components, n_components);
 }
 
+static void run_one(sd_bus *bus, struct bus_match_node *root, const char *path, const char *sender, const char *arg0) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+        assert_se(sd_bus_message_new_signal(bus, &m, path, "bar.x", "waldo") >= 0);
+        if (sender)
+                assert_se(sd_bus_message_set_sender(m, sender) >= 0);
+        assert_se(sd_bus_message_append(m, "s", arg0) >= 0);
+        assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+
+        zero(mask);
+        assert_se(bus_match_run(NULL, root, m) == 0);
+}
+
+static void test_prefix_matches(sd_bus *bus) {
+        static const char* const namespaces[] = {
+                "", "org", "org.", "org.foo", "org.foo.", "org.foo.bar", "orgfoo", "org..foo", ".org",
+        };
+        static const char* const paths[] = {
+                "", "/", "/a", "/a/", "/a/b", "/a/b/", "/a/bc", "/ab", "a/", "//",
+        };
+        static const char* const object_paths[] = {
+                "/", "/a", "/a/b", "/a/b/c", "/a/bc", "/ab",
+        };
+        static const char* const senders[] = {
+                ":1.1", ":1.2", "org.foo", "org.bar",
+        };
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        sd_bus_slot slots[ELEMENTSOF(mask)];
+        unsigned i, j;
+
+        log_info("/* %s */", __func__);
+
+        /* Check the lookups against the plain pattern checks, with all kinds of prefixes */
+
+        for (i = 0; i < ELEMENTSOF(namespaces); i++)
+                assert_se(match_add(slots, &root, strjoina("arg0namespace='", namespaces[i], "'"), i) >= 0);
+        for (j = 0; j < ELEMENTSOF(namespaces); j++) {
+                run_one(bus, &root, "/", NULL, namespaces[j]);
+                for (i = 0; i < ELEMENTSOF(namespaces); i++)
+                        assert_se(mask[i] == namespace_simple_pattern(namespaces[i], namespaces[j]));
+        }
+        bus_match_free(&root);
+
+        for (i = 0; i < ELEMENTSOF(paths); i++)
+                assert_se(match_add(slots, &root, strjoina("arg0path='", paths[i], "'"), i) >= 0);
+        for (j = 0; j < ELEMENTSOF(paths); j++) {
+                run_one(bus, &root, "/", NULL, paths[j]);
+                for (i = 0; i < ELEMENTSOF(paths); i++)
+                        assert_se(mask[i] == path_complex_pattern(paths[i], paths[j]));
+        }
+
+        /* Removing some of them must keep the others working */
+        for (i = 0; i < ELEMENTSOF(paths); i += 2)
+                assert_se(bus_match_remove(&root, &slots[i].match_callback) > 0);
+        for (j = 0; j < ELEMENTSOF(paths); j++) {
+                run_one(bus, &root, "/", NULL, paths[j]);
+                for (i = 0; i < ELEMENTSOF(paths); i++)
+                        assert_se(mask[i] == (i % 2 == 1 && path_complex_pattern(paths[i], paths[j])));
+        }
+        bus_match_free(&root);
+
+        for (i = 0; i < ELEMENTSOF(paths); i++)
+                assert_se(match_add(slots, &root, strjoina("path_namespace='", paths[i], "'"), i) >= 0);
+        for (j = 0; j < ELEMENTSOF(object_paths); j++) {
+                run_one(bus, &root, object_paths[j], NULL, "");
+                for (i = 0; i < ELEMENTSOF(paths); i++)
+                        assert_se(mask[i] == path_simple_pattern(paths[i], object_paths[j]));
+        }
+        bus_match_free(&root);
+
+        /* Without knowing the well-known names of a sender, we let all of them match unique senders */
+        for (i = 0; i < ELEMENTSOF(senders); i++)
+                assert_se(match_add(slots, &root, strjoina("sender='", senders[i], "'"), i) >= 0);
+        for (j = 0; j < ELEMENTSOF(senders); j++) {
+                run_one(bus, &root, "/", senders[j], "");
+                for (i = 0; i < ELEMENTSOF(senders); i++)
+                        assert_se(mask[i] == (streq(senders[i], senders[j]) ||
+                                              (senders[i][0] != ':' && senders[j][0] == ':')));
+        }
+        bus_match_free(&root);
+}
+
+#define N_RULES 10000U
+
+static unsigned n_hits = 0;
+
+static int count_filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        n_hits++;
+        return 0;
+}
+
+static void test_benchmark(sd_bus *bus) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        _cleanup_free_ sd_bus_slot *slots = NULL;
+        sd_bus_message *messages[4 * 100];
+        unsigned i, k, n_expected = 0, n_rounds = slow_tests_enabled() ? 100 : 10;
+        usec_t ts;
+
+        log_info("/* %s */", __func__);
+
+        /* Lots of clients watching the properties of their units, the owners of names, or paths */
+        assert_se(slots = new0(sd_bus_slot, N_RULES));
+
+        for (i = 0; i < N_RULES; i++) {
+                struct bus_match_component *components = NULL;
+                unsigned n_components = 0;
+                char match[256];
+
+                switch (i % 5) {
+                case 0:
+                        xsprintf(match, "type='signal',sender='org.freedesktop.systemd1',interface='org.freedesktop.DBus.Properties',"
+                                 "member='PropertiesChanged',path='/org/freedesktop/systemd1/unit/unit%u'", i);
+                        break;
+                case 1:
+                        xsprintf(match, "type='signal',path_namespace='/org/freedesktop/systemd1/unit/unit%u'", i);
+                        break;
+                case 2:
+                        xsprintf(match, "type='signal',member='NameOwnerChanged',arg0namespace='org.example.service%u'", i);
+                        break;
+                case 3:
+                        xsprintf(match, "type='signal',arg0path='/org/example/%u/'", i);
+                        break;
+                case 4:
+                        xsprintf(match, "type='signal',sender=':1.%u'", i);
+                        break;
+                }
+
+                assert_se(bus_match_parse(match, &components, &n_components) >= 0);
+                slots[i].match_callback.callback = count_filter;
+                assert_se(bus_match_add(&root, components, n_components, &slots[i].match_callback) >= 0);
+                bus_match_parse_free(components, n_components);
+        }
+
+        /* Every fifth message hits one of the rules, for all kinds of them */
+        for (i = 0; i < ELEMENTSOF(messages); i++) {
+                char path[STRLEN("/org/freedesktop/systemd1/unit/unit") + DECIMAL_STR_MAX(unsigned)];
+                char arg0[STRLEN("org.example.service.") + DECIMAL_STR_MAX(unsigned)];
+                char sender[STRLEN(":1.") + DECIMAL_STR_MAX(unsigned)];
+                sd_bus_message *m;
+
+                k = (i / 4) * 7 + i % 4;
+
+                switch (i % 4) {
+                case 0:
+                        xsprintf(path, "/org/freedesktop/systemd1/unit/unit%u", k);
+                        assert_se(sd_bus_message_new_signal(bus, &m, path, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+                        assert_se(sd_bus_message_set_sender(m, "org.freedesktop.systemd1") >= 0);
+                        assert_se(sd_bus_message_append(m, "s", "org.freedesktop.systemd1.Unit") >= 0);
+                        n_expected += IN_SET(k % 5, 0, 1);
+                        break;
+                case 1:
+                        xsprintf(arg0, "org.example.service%u.Sub", k);
+                        assert_se(sd_bus_message_new_signal(bus, &m, "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameOwnerChanged") >= 0);
+                        assert_se(sd_bus_message_append(m, "sss", arg0, "", ":1.1") >= 0);
+                        n_expected += k % 5 == 2;
+                        break;
+                case 2:
+                        xsprintf(arg0, "/org/example/%u/object", k);
+                        assert_se(sd_bus_message_new_signal(bus, &m, "/", "bar.x", "Changed") >= 0);
+                        assert_se(sd_bus_message_append(m, "s", arg0) >= 0);
+                        n_expected += k % 5 == 3;
+                        break;
+                case 3:
+                        xsprintf(sender, ":1.%u", k);
+                        assert_se(sd_bus_message_new_signal(bus, &m, "/", "bar.x", "Ping") >= 0);
+                        assert_se(sd_bus_message_set_sender(m, sender) >= 0);
+                        n_expected += k % 5 == 4;
+                        break;
+                }
+
+                assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+                messages[i] = m;
+        }
+
+        n_hits = 0;
+        ts = now(CLOCK_MONOTONIC);
+
+        for (k = 0; k < n_rounds; k++)
+                for (i = 0; i < ELEMENTSOF(messages); i++)
+                        assert_se(bus_match_run(NULL, &root, messages[i]) == 0);
+
+        log_info("%u rules: %.1f µs per message",
+                 N_RULES, (double) (now(CLOCK_MONOTONIC) - ts) / (n_rounds * ELEMENTSOF(messages)));
+
+        assert_se(n_hits == n_rounds * n_expected);
+
+        /* Take half of them away again, one by one */
+        for (i = 0; i < N_RULES; i += 2)
+                assert_se(bus_match_remove(&root, &slots[i].match_callback) > 0);
+
+        n_hits = 0;
+        for (i = 0; i < ELEMENTSOF(messages); i++)
+                assert_se(bus_match_run(NULL, &root, messages[i]) == 0);
+        assert_se(n_hits <= n_expected);
+
+        for (i = 0; i < ELEMENTSOF(messages); i++)
+                sd_bus_message_unref(messages[i]);
+
+        bus_match_free(&root);
+}
+
 int main(int argc, char *argv[]) {
         struct bus_match_node root = {
                 .type = BUS_MATCH_ROOT,
@@ -144,5 +354,8 @@ int main(int argc, char *argv[]) {
         test_match_scope("member='gurke',path='/org/freedesktop/DBus/Local'", BUS_MATCH_LOCAL);
         test_match_scope("arg2='piep',sender='org.freedesktop.DBus',member='waldo'", BUS_MATCH_DRIVER);
 
+        test_prefix_matches(bus);
+        test_benchmark(bus);
+
         return 0;
 }
@@ -0,0 +1,744 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "event-io.h"
+#include "fd-util.h"
+#include "list.h"
+#include "log.h"
+#include "missing_syscall.h"
+
+#define EVENT_IO_ENTRIES_DEFAULT 256U
+
+typedef enum EventIOOperation {
+        EVENT_IO_READ,
+        EVENT_IO_WRITE,
+        EVENT_IO_RECVMSG,
+        EVENT_IO_SENDMSG,
+        _EVENT_IO_OPERATION_MAX,
+} EventIOOperation;
+
+struct EventIORequest {
+        EventIOContext *context;
+
+        EventIOOperation operation;
+        int fd;
+        void *buf;
+        size_t size;
+        struct msghdr *mh;
+        int flags;
+
+        event_io_handler_t handler;
+        void *userdata;
+
+        bool cancelled;
+
+        /* Only used without io_uring */
+        sd_event_source *source;
+
+        LIST_FIELDS(EventIORequest, pending);
+        LIST_FIELDS(EventIORequest, cancelled);
+};
+
+struct EventIOContext {
+        sd_event *event;
+
+        /* All requests whose handlers were not called yet */
+        LIST_HEAD(EventIORequest, pending);
+        unsigned n_pending;
+
+        /* Without io_uring, cancelled requests are finished from here, so that handlers are never called
+         * from within event_io_request_cancel() */
+        LIST_HEAD(EventIORequest, cancelled);
+        sd_event_source *cancelled_source;
+
+        bool freeing;
+
+        int ring_fd;
+
+#if HAVE_IO_URING
+        int event_fd;
+        sd_event_source *ring_source;
+
+        void *ring;
+        size_t ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned sq_entries;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* Queued in the ring, but not submitted to the kernel yet */
+        unsigned n_unsubmitted;
+#endif
+};
+
+static void event_io_request_finish(EventIORequest *req, ssize_t result) {
+        EventIOContext *c;
+
+        assert(req);
+
+        c = req->context;
+
+        LIST_REMOVE(pending, c->pending, req);
+        assert(c->n_pending > 0);
+        c->n_pending--;
+
+        req->source = sd_event_source_disable_unref(req->source);
+
+        if (req->cancelled && IN_SET(result, -EINTR, -ECANCELED))
+                result = -ECANCELED;
+
+        req->handler(req, result, req->userdata);
+        free(req);
+}
+
+/* Without io_uring, requests wait for their fds to become ready and then do the syscall themselves */
+
+static ssize_t event_io_request_perform(EventIORequest *req) {
+        ssize_t n;
+
+        assert(req);
+
+        switch (req->operation) {
+
+        case EVENT_IO_READ:
+                n = read(req->fd, req->buf, req->size);
+                break;
+
+        case EVENT_IO_WRITE:
+                n = write(req->fd, req->buf, req->size);
+                break;
+
+        case EVENT_IO_RECVMSG:
+                n = recvmsg(req->fd, req->mh, req->flags);
+                break;
+
+        case EVENT_IO_SENDMSG:
+                n = sendmsg(req->fd, req->mh, req->flags);
+                break;
+
+        default:
+                assert_not_reached("Unknown I/O operation");
+        }
+
+        return n < 0 ? -errno : n;
+}
+
+static int event_io_request_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        EventIORequest *req = userdata;
+        ssize_t n;
+
+        assert(req);
+
+        n = event_io_request_perform(req);
+        if (IN_SET(n, -EAGAIN, -EINTR))
+                return 0; /* Somebody else was quicker, keep waiting */
+
+        event_io_request_finish(req, n);
+        return 0;
+}
+
+static int event_io_request_defer(sd_event_source *s, void *userdata) {
+        EventIORequest *req = userdata;
+
+        assert(req);
+
+        event_io_request_finish(req, event_io_request_perform(req));
+        return 0;
+}
+
+static int event_io_request_submit_fallback(EventIORequest *req) {
+        uint32_t events;
+        int r;
+
+        assert(req);
+
+        events = IN_SET(req->operation, EVENT_IO_READ, EVENT_IO_RECVMSG) ? EPOLLIN : EPOLLOUT;
+
+        r = sd_event_add_io(req->context->event, &req->source, req->fd, events, event_io_request_ready, req);
+        if (r == -EEXIST) {
+                _cleanup_close_ int fd = -1;
+
+                /* The fd is watched already, by another request or by an event source of the caller. The
+                 * loop can watch the same file through another fd though. */
+                fd = fcntl(req->fd, F_DUPFD_CLOEXEC, 3);
+                if (fd < 0)
+                        return -errno;
+
+                r = sd_event_add_io(req->context->event, &req->source, fd, events, event_io_request_ready, req);
+                if (r < 0)
+                        return r;
+
+                r = sd_event_source_set_io_fd_own(req->source, true);
+                if (r < 0)
+                        return r;
+
+                TAKE_FD(fd);
+        } else if (r == -EPERM)
+                /* Regular files can't be polled, they are always ready */
+                r = sd_event_add_defer(req->context->event, &req->source, event_io_request_defer, req);
+        if (r < 0)
+                return r;
+
+        (void) sd_event_source_set_description(req->source, "event-io-request");
+        return 0;
+}
+
+static int event_io_cancelled_dispatch(sd_event_source *s, void *userdata) {
+        EventIOContext *c = userdata;
+        EventIORequest *req;
+
+        assert(c);
+
+        while ((req = c->cancelled)) {
+                LIST_REMOVE(cancelled, c->cancelled, req);
+                event_io_request_finish(req, -ECANCELED);
+        }
+
+        return 0;
+}
+
+static void event_io_request_cancel_fallback(EventIORequest *req) {
+        EventIOContext *c;
+
+        assert(req);
+
+        c = req->context;
+
+        req->source = sd_event_source_disable_unref(req->source);
+
+        LIST_PREPEND(cancelled, c->cancelled, req);
+        (void) sd_event_source_set_enabled(c->cancelled_source, SD_EVENT_ONESHOT);
+}
+
+#if HAVE_IO_URING
+
+/* With io_uring, requests are queued in the submission ring as they come, and submitted together right
+ * before the loop goes to sleep. The kernel signals completions through an eventfd. */
+
+static struct io_uring_sqe* event_io_uring_get_sqe(EventIOContext *c) {
+        struct io_uring_sqe *sqe;
+        unsigned tail;
+
+        assert(c);
+
+        /* We are the only ones moving the tail, the kernel only moves the head */
+        tail = *c->sq_tail;
+        if (tail - __atomic_load_n(c->sq_head, __ATOMIC_ACQUIRE) >= c->sq_entries)
+                return NULL;
+
+        sqe = c->sqes + (tail & *c->sq_mask);
+        *sqe = (struct io_uring_sqe) {};
+
+        c->sq_array[tail & *c->sq_mask] = tail & *c->sq_mask;
+
+        return sqe;
+}
+
+static void event_io_uring_queue_sqe(EventIOContext *c) {
+        assert(c);
+
+        __atomic_store_n(c->sq_tail, *c->sq_tail + 1, __ATOMIC_RELEASE);
+        c->n_unsubmitted++;
+}
+
+static int event_io_uring_enter(EventIOContext *c, unsigned min_complete) {
+        int n;
+
+        assert(c);
+
+        for (;;) {
+                n = io_uring_enter(c->ring_fd, c->n_unsubmitted, min_complete,
+                                   min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                }
+
+                assert((unsigned) n <= c->n_unsubmitted);
+                c->n_unsubmitted -= n;
+
+                return n;
+        }
+}
+
+static int event_io_uring_submit(EventIOContext *c) {
+        int r;
+
+        assert(c);
+
+        while (c->n_unsubmitted > 0) {
+                r = event_io_uring_enter(c, 0);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -EAGAIN;
+        }
+
+        return 0;
+}
+
+static void event_io_uring_reap(EventIOContext *c) {
+        unsigned head;
+
+        assert(c);
+
+        for (;;) {
+                while ((head = *c->cq_head) != __atomic_load_n(c->cq_tail, __ATOMIC_ACQUIRE)) {
+                        struct io_uring_cqe *cqe = c->cqes + (head & *c->cq_mask);
+                        EventIORequest *req = UINT64_TO_PTR(cqe->user_data);
+                        ssize_t result = cqe->res;
+
+                        /* Hand the entry back before calling anything, the handler might queue more */
+                        __atomic_store_n(c->cq_head, head + 1, __ATOMIC_RELEASE);
+
+                        /* Cancellations don't refer to any request of their own */
+                        if (req)
+                                event_io_request_finish(req, result);
+                }
+
+#ifdef IORING_SQ_CQ_OVERFLOW
+                /* Completions that didn't fit into the ring are kept back by the kernel until asked for */
+                if (__atomic_load_n(c->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+                        if (io_uring_enter(c->ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL) < 0 && errno != EINTR)
+                                break;
+                        continue;
+                }
+#endif
+                break;
+        }
+}
+
+static int event_io_uring_request_submit(EventIORequest *req) {
+        EventIOContext *c;
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(req);
+
+        c = req->context;
+
+        sqe = event_io_uring_get_sqe(c);
+        if (!sqe) {
+                /* The ring is full, make room */
+                r = event_io_uring_submit(c);
+                if (r < 0)
+                        return r;
+
+                sqe = event_io_uring_get_sqe(c);
+                if (!sqe)
+                        return -EBUSY;
+        }
+
+        sqe->fd = req->fd;
+        sqe->user_data = PTR_TO_UINT64(req);
+
+        switch (req->operation) {
+
+        case EVENT_IO_READ:
+        case EVENT_IO_WRITE:
+                sqe->opcode = req->operation == EVENT_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe->addr = PTR_TO_UINT64(req->buf);
+                sqe->len = MIN(req->size, (size_t) UINT32_MAX);
+                sqe->off = (uint64_t) -1; /* The current file position, like read() and write() */
+                break;
+
+        case EVENT_IO_RECVMSG:
+        case EVENT_IO_SENDMSG:
+                sqe->opcode = req->operation == EVENT_IO_RECVMSG ? IORING_OP_RECVMSG : IORING_OP_SENDMSG;
+                sqe->addr = PTR_TO_UINT64(req->mh);
+                sqe->len = 1;
+                sqe->msg_flags = req->flags;
+                break;
+
+        default:
+                assert_not_reached("Unknown I/O operation");
+        }
+
+        event_io_uring_queue_sqe(c);
+        return 0;
+}
+
+static void event_io_uring_request_cancel(EventIORequest *req) {
+        EventIOContext *c;
+        struct io_uring_sqe *sqe;
+
+        assert(req);
+
+        c = req->context;
+
+        /* If there's no room for this, the request simply completes at some point */
+        sqe = event_io_uring_get_sqe(c);
+        if (!sqe && event_io_uring_submit(c) >= 0)
+                sqe = event_io_uring_get_sqe(c);
+        if (!sqe)
+                return;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = PTR_TO_UINT64(req);
+
+        event_io_uring_queue_sqe(c);
+}
+
+static int event_io_uring_prepare(sd_event_source *s, void *userdata) {
+        EventIOContext *c = userdata;
+        int r;
+
+        assert(c);
+
+        r = event_io_uring_submit(c);
+        if (r < 0)
+                log_debug_errno(r, "Failed to submit I/O requests, retrying later: %m");
+
+        return 0;
+}
+
+static int event_io_uring_dispatch(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        EventIOContext *c = userdata;
+        eventfd_t x;
+
+        assert(c);
+
+        if (eventfd_read(fd, &x) < 0 && errno != EAGAIN)
+                return log_debug_errno(errno, "Failed to read from io_uring eventfd: %m");
+
+        event_io_uring_reap(c);
+        return 0;
+}
+
+static int event_io_uring_probe(EventIOContext *c) {
+        static const uint8_t needed[] = {
+                IORING_OP_READ,
+                IORING_OP_WRITE,
+                IORING_OP_RECVMSG,
+                IORING_OP_SENDMSG,
+                IORING_OP_ASYNC_CANCEL,
+        };
+        _cleanup_free_ struct io_uring_probe *probe = NULL;
+        size_t i;
+
+        assert(c);
+
+        probe = malloc0(offsetof(struct io_uring_probe, ops) + 256 * sizeof(struct io_uring_probe_op));
+        if (!probe)
+                return -ENOMEM;
+
+        if (io_uring_register(c->ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+                return -errno;
+
+        for (i = 0; i < ELEMENTSOF(needed); i++)
+                if (needed[i] >= probe->ops_len || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EOPNOTSUPP),
+                                               "io_uring does not support operation %u.", needed[i]);
+
+        return 0;
+}
+
+static int event_io_uring_setup(EventIOContext *c, unsigned n_entries) {
+        struct io_uring_params p = {};
+        int r;
+
+        assert(c);
+
+        c->ring_fd = io_uring_setup(n_entries, &p);
+        if (c->ring_fd < 0)
+                return -errno;
+
+        /* Everything that came with Linux 5.6 */
+        if (!FLAGS_SET(p.features, IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_RW_CUR_POS))
+                return log_debug_errno(SYNTHETIC_ERRNO(EOPNOTSUPP), "io_uring lacks features we need.");
+
+        r = event_io_uring_probe(c);
+        if (r < 0)
+                return r;
+
+        c->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                           p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        c->ring = mmap(NULL, c->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, c->ring_fd, IORING_OFF_SQ_RING);
+        if (c->ring == MAP_FAILED) {
+                c->ring = NULL;
+                return -errno;
+        }
+
+        c->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        c->sqes = mmap(NULL, c->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, c->ring_fd, IORING_OFF_SQES);
+        if (c->sqes == MAP_FAILED) {
+                c->sqes = NULL;
+                return -errno;
+        }
+
+        c->sq_entries = p.sq_entries;
+        c->sq_head = (unsigned*) ((uint8_t*) c->ring + p.sq_off.head);
+        c->sq_tail = (unsigned*) ((uint8_t*) c->ring + p.sq_off.tail);
+        c->sq_mask = (unsigned*) ((uint8_t*) c->ring + p.sq_off.ring_mask);
+        c->sq_flags = (unsigned*) ((uint8_t*) c->ring + p.sq_off.flags);
+        c->sq_array = (unsigned*) ((uint8_t*) c->ring + p.sq_off.array);
+        c->cq_head = (unsigned*) ((uint8_t*) c->ring + p.cq_off.head);
+        c->cq_tail = (unsigned*) ((uint8_t*) c->ring + p.cq_off.tail);
+        c->cq_mask = (unsigned*) ((uint8_t*) c->ring + p.cq_off.ring_mask);
+        c->cqes = (struct io_uring_cqe*) ((uint8_t*) c->ring + p.cq_off.cqes);
+
+        c->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (c->event_fd < 0)
+                return -errno;
+
+        if (io_uring_register(c->ring_fd, IORING_REGISTER_EVENTFD, &c->event_fd, 1) < 0)
+                return -errno;
+
+        r = sd_event_add_io(c->event, &c->ring_source, c->event_fd, EPOLLIN, event_io_uring_dispatch, c);
+        if (r < 0)
+                return r;
+
+        r = sd_event_source_set_prepare(c->ring_source, event_io_uring_prepare);
+        if (r < 0)
+                return r;
+
+        (void) sd_event_source_set_description(c->ring_source, "event-io-uring");
+
+        log_debug("Using io_uring with %u entries for I/O requests.", p.sq_entries);
+        return 0;
+}
+
+static void event_io_uring_done(EventIOContext *c) {
+        assert(c);
+
+        c->ring_source = sd_event_source_disable_unref(c->ring_source);
+        c->event_fd = safe_close(c->event_fd);
+
+        if (c->sqes)
+                (void) munmap(c->sqes, c->sqes_size);
+        if (c->ring)
+                (void) munmap(c->ring, c->ring_size);
+        c->sqes = c->ring = NULL;
+
+        c->ring_fd = safe_close(c->ring_fd);
+}
+#endif
+
+int event_io_context_new(sd_event *e, unsigned n_entries, EventIOContext **ret) {
+        _cleanup_(event_io_context_freep) EventIOContext *c = NULL;
+        int r;
+
+        assert(e);
+        assert(ret);
+
+        c = new(EventIOContext, 1);
+        if (!c)
+                return -ENOMEM;
+
+        *c = (EventIOContext) {
+                .event = sd_event_ref(e),
+                .ring_fd = -1,
+#if HAVE_IO_URING
+                .event_fd = -1,
+#endif
+        };
+
+        r = sd_event_add_defer(e, &c->cancelled_source, event_io_cancelled_dispatch, c);
+        if (r < 0)
+                return r;
+
+        r = sd_event_source_set_enabled(c->cancelled_source, SD_EVENT_OFF);
+        if (r < 0)
+                return r;
+
+        (void) sd_event_source_set_description(c->cancelled_source, "event-io-cancelled");
+
+#if HAVE_IO_URING
+        r = getenv_bool_secure("SD_EVENT_IO_URING");
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SD_EVENT_IO_URING, ignoring: %m");
+        if (r != 0) {
+                r = event_io_uring_setup(c, n_entries > 0 ? n_entries : EVENT_IO_ENTRIES_DEFAULT);
+                if (r < 0) {
+                        /* Old kernels, seccomp filters, … */
+                        log_debug_errno(r, "Failed to set up io_uring, using regular syscalls for I/O requests: %m");
+                        event_io_uring_done(c);
+                }
+        }
+#endif
+
+        *ret = TAKE_PTR(c);
+        return 0;
+}
+
+EventIOContext* event_io_context_free(EventIOContext *c) {
+        EventIORequest *req;
+
+        if (!c)
+                return NULL;
+
+        /* Nothing new may come in while we wait for the rest to go */
+        c->freeing = true;
+
+#if HAVE_IO_URING
+        if (c->ring_fd >= 0) {
+                LIST_FOREACH(pending, req, c->pending)
+                        if (!req->cancelled) {
+                                req->cancelled = true;
+                                event_io_uring_request_cancel(req);
+                        }
+
+                /* The kernel may still write into the buffers of the requests until they completed */
+                while (c->n_pending > 0) {
+                        int r;
+
+                        r = event_io_uring_enter(c, 1);
+                        if (r < 0) {
+                                /* Closing the ring would leave the rest to the kernel, which might still
+                                 * write into buffers that are gone by then */
+                                log_debug_errno(r, "Failed to wait for cancelled I/O requests, leaking io_uring: %m");
+                                c->ring_fd = -1;
+                                break;
+                        }
+
+                        event_io_uring_reap(c);
+                }
+        }
+#endif
+
+        c->cancelled = NULL;
+        while ((req = c->pending)) {
+                req->cancelled = true;
+                event_io_request_finish(req, -ECANCELED);
+        }
+
+#if HAVE_IO_URING
+        event_io_uring_done(c);
+#endif
+
+        sd_event_source_disable_unref(c->cancelled_source);
+        sd_event_unref(c->event);
+
+        return mfree(c);
+}
+
+bool event_io_context_uses_uring(EventIOContext *c) {
+        assert(c);
+
+        return c->ring_fd >= 0;
+}
+
+unsigned event_io_context_pending(EventIOContext *c) {
+        assert(c);
+
+        return c->n_pending;
+}
+
+static int event_io_submit(
+                EventIOContext *c,
+                EventIOOperation operation,
+                int fd,
+                void *buf,
+                size_t size,
+                struct msghdr *mh,
+                int flags,
+                event_io_handler_t handler,
+                void *userdata,
+                EventIORequest **ret) {
+
+        _cleanup_free_ EventIORequest *req = NULL;
+        int r;
+
+        assert(c);
+        assert(fd >= 0);
+        assert(handler);
+
+        if (c->freeing)
+                return -ESHUTDOWN;
+
+        req = new(EventIORequest, 1);
+        if (!req)
+                return -ENOMEM;
+
+        *req = (EventIORequest) {
+                .context = c,
+                .operation = operation,
+                .fd = fd,
+                .buf = buf,
+                .size = size,
+                .mh = mh,
+                .flags = flags,
+                .handler = handler,
+                .userdata = userdata,
+        };
+
+#if HAVE_IO_URING
+        if (c->ring_fd >= 0)
+                r = event_io_uring_request_submit(req);
+        else
+#endif
+                r = event_io_request_submit_fallback(req);
+        if (r < 0) {
+                req->source = sd_event_source_unref(req->source);
+                return r;
+        }
+
+        LIST_PREPEND(pending, c->pending, req);
+        c->n_pending++;
+
+        if (ret)
+                *ret = req;
+
+        TAKE_PTR(req);
+        return 0;
+}
+
+int event_io_read(EventIOContext *c, int fd, void *buf, size_t size, event_io_handler_t handler, void *userdata, EventIORequest **ret) {
+        assert(buf || size == 0);
+
+        return event_io_submit(c, EVENT_IO_READ, fd, buf, size, NULL, 0, handler, userdata, ret);
+}
+
+int event_io_write(EventIOContext *c, int fd, const void *buf, size_t size, event_io_handler_t handler, void *userdata, EventIORequest **ret) {
+        assert(buf || size == 0);
+
+        return event_io_submit(c, EVENT_IO_WRITE, fd, (void*) buf, size, NULL, 0, handler, userdata, ret);
+}
+
+int event_io_recvmsg(EventIOContext *c, int fd, struct msghdr *mh, int flags, event_io_handler_t handler, void *userdata, EventIORequest **ret) {
+        assert(mh);
+
+        return event_io_submit(c, EVENT_IO_RECVMSG, fd, NULL, 0, mh, flags, handler, userdata, ret);
+}
+
+int event_io_sendmsg(EventIOContext *c, int fd, const struct msghdr *mh, int flags, event_io_handler_t handler, void *userdata, EventIORequest **ret) {
+        assert(mh);
+
+        return event_io_submit(c, EVENT_IO_SENDMSG, fd, NULL, 0, (struct msghdr*) mh, flags, handler, userdata, ret);
+}
+
+void event_io_request_cancel(EventIORequest *req) {
+        assert(req);
+
+        if (req->cancelled)
+                return;
+
+        req->cancelled = true;
+
+#if HAVE_IO_URING
+        if (req->context->ring_fd >= 0) {
+                event_io_uring_request_cancel(req);
+                return;
+        }
+#endif
+
+        event_io_request_cancel_fallback(req);
+}
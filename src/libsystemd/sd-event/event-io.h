@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "sd-event.h"
+
+#include "macro.h"
+
+/* An I/O context lets a loop carry out reads and writes on its behalf, instead of only telling it when an fd
+ * is ready and leaving the syscalls to each event source. Where possible this is done with an io_uring:
+ * operations are submitted in one batch right before the loop goes to sleep, and their completions are
+ * collected in one go once it wakes up. Where io_uring is not available, or turned off with
+ * $SD_EVENT_IO_URING=0, the same is done with regular event sources and syscalls, so users don't need to
+ * care. */
+
+typedef struct EventIOContext EventIOContext;
+typedef struct EventIORequest EventIORequest;
+
+/* Called exactly once for each request that was submitted successfully, in the thread of the loop. The
+ * result is the number of bytes transferred or a negative errno, -ECANCELED if the request was cancelled
+ * before it completed. Buffers passed in must stay around until then. */
+typedef void (*event_io_handler_t)(EventIORequest *r, ssize_t result, void *userdata);
+
+int event_io_context_new(sd_event *e, unsigned n_entries, EventIOContext **ret);
+
+/* Cancels whatever is still going on and calls the handlers of these requests. Must not be called from
+ * within a handler. */
+EventIOContext* event_io_context_free(EventIOContext *c);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventIOContext*, event_io_context_free);
+
+bool event_io_context_uses_uring(EventIOContext *c);
+unsigned event_io_context_pending(EventIOContext *c);
+
+/* Reads and writes happen at the current file position. The returned request is only valid until its
+ * handler is called, ret may be NULL. */
+int event_io_read(EventIOContext *c, int fd, void *buf, size_t size, event_io_handler_t handler, void *userdata, EventIORequest **ret);
+int event_io_write(EventIOContext *c, int fd, const void *buf, size_t size, event_io_handler_t handler, void *userdata, EventIORequest **ret);
+int event_io_recvmsg(EventIOContext *c, int fd, struct msghdr *mh, int flags, event_io_handler_t handler, void *userdata, EventIORequest **ret);
+int event_io_sendmsg(EventIOContext *c, int fd, const struct msghdr *mh, int flags, event_io_handler_t handler, void *userdata, EventIORequest **ret);
+
+void event_io_request_cancel(EventIORequest *r);
@@ -11,6 +11,7 @@
 #include "hashmap.h"
 #include "list.h"
 #include "prioq.h"
+#include "timer-wheel.h"
 
 typedef enum EventSourceType {
         SOURCE_IO,
@@ -55,6 +56,9 @@ struct sd_event_source {
 
         char *description;
 
+        /* The accounting entry for the description, looked up on first dispatch with profiling on */
+        struct EventSourceProfile *profile;
+
         EventSourceType type:5;
         signed int enabled:3;
         bool pending:1;
@@ -85,6 +89,8 @@ struct sd_event_source {
                         usec_t next, accuracy;
                         unsigned earliest_index;
                         unsigned latest_index;
+                        TimerWheelEntry earliest_entry;
+                        TimerWheelEntry latest_entry;
                 } time;
                 struct {
                         sd_event_signal_handler_t callback;
@@ -135,6 +141,17 @@ struct clock_data {
 
         Prioq *earliest;
         Prioq *latest;
+
+        /* Alternatively, if $SD_EVENT_TIMER_WHEEL is set, two timer wheels with the same orderings, which
+         * only contain the enabled event sources that aren't pending yet. This makes moving timers
+         * around O(1) rather than O(log n), which matters if there are many of them. */
+        TimerWheel *earliest_wheel;
+        TimerWheel *latest_wheel;
+
+        /* All event sources of this clock. The wheels have room reserved for each of them, so that
+         * sources can always be put back after they were moved. */
+        unsigned n_sources;
+
         usec_t next;
 
         bool needs_rearm:1;
@@ -0,0 +1,535 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "event-thread.h"
+#include "fd-util.h"
+#include "list.h"
+#include "log.h"
+#include "pthread-util.h"
+
+typedef struct EventMessage EventMessage;
+
+struct EventMessage {
+        event_mailbox_handler_t handler;
+        event_mailbox_destroy_t destroy;
+        void *userdata;
+
+        /* Whether some other worker of a pool may take the message over */
+        bool stealable;
+
+        LIST_FIELDS(EventMessage, messages);
+};
+
+struct EventMailbox {
+        unsigned n_ref;
+
+        /* Only touched in the thread of the loop */
+        sd_event_source *source;
+
+        /* Protects everything below */
+        pthread_mutex_t mutex;
+
+        /* The loop is only woken up when the first message is queued, the others are picked up together with
+         * it. The fd stays around as long as the mailbox does, so that posting never races against closing. */
+        int fd;
+        bool closed;
+
+        LIST_HEAD(EventMessage, queue);
+        EventMessage *queue_tail;
+        unsigned n_stealable; /* also read without the lock, to skip mailboxes with nothing to steal */
+
+        /* Queued messages plus the ones currently being dispatched, i.e. how much the loop has to do */
+        unsigned n_queued;
+};
+
+typedef struct EventWorker {
+        EventWorkerPool *pool;
+        unsigned idx;
+
+        pthread_t thread;
+        bool started;
+
+        /* Only touched by the worker itself */
+        sd_event *event;
+
+        EventMailbox *mailbox;
+} EventWorker;
+
+struct EventWorkerPool {
+        pthread_mutex_t mutex;
+        pthread_cond_t ready;
+        unsigned n_ready;
+        int error;
+
+        unsigned next;
+
+        EventWorker *workers;
+        unsigned n_workers;
+};
+
+static void event_message_finish(EventMessage *msg, bool dispatch) {
+        assert(msg);
+
+        if (dispatch)
+                msg->handler(msg->userdata);
+
+        if (msg->destroy)
+                msg->destroy(msg->userdata);
+
+        free(msg);
+}
+
+static void event_mailbox_finish_list(EventMailbox *m, EventMessage *list, bool dispatch) {
+        EventMessage *msg;
+
+        assert(m);
+
+        /* The handler might close the mailbox, in which case the rest of the list is only destroyed */
+        while ((msg = list)) {
+                LIST_REMOVE(messages, list, msg);
+                event_message_finish(msg, dispatch && !m->closed);
+
+                assert_se(__sync_fetch_and_sub(&m->n_queued, 1) > 0);
+        }
+}
+
+static EventMessage* event_mailbox_take_all(EventMailbox *m) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *l = NULL;
+        EventMessage *list;
+
+        assert(m);
+
+        l = pthread_mutex_lock_assert(&m->mutex);
+
+        list = TAKE_PTR(m->queue);
+        m->queue_tail = NULL;
+        __atomic_store_n(&m->n_stealable, 0, __ATOMIC_RELAXED);
+
+        return list;
+}
+
+static EventMessage* event_mailbox_steal(EventMailbox *m) {
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *l = NULL;
+        EventMessage *msg;
+
+        assert(m);
+
+        if (__atomic_load_n(&m->n_stealable, __ATOMIC_RELAXED) == 0)
+                return NULL;
+
+        l = pthread_mutex_lock_assert(&m->mutex);
+
+        if (m->closed)
+                return NULL;
+
+        /* Take the one that was posted last, i.e. the one the owner would get to last */
+        for (msg = m->queue_tail; msg; msg = msg->messages_prev)
+                if (msg->stealable)
+                        break;
+        if (!msg)
+                return NULL;
+
+        if (m->queue_tail == msg)
+                m->queue_tail = msg->messages_prev;
+        LIST_REMOVE(messages, m->queue, msg);
+
+        __sync_fetch_and_sub(&m->n_stealable, 1);
+        assert_se(__sync_fetch_and_sub(&m->n_queued, 1) > 0);
+
+        return msg;
+}
+
+static int event_mailbox_dispatch(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        _cleanup_(event_mailbox_unrefp) EventMailbox *m = event_mailbox_ref(userdata);
+        eventfd_t x;
+
+        assert(m);
+
+        if (eventfd_read(fd, &x) < 0 && errno != EAGAIN)
+                return log_debug_errno(errno, "Failed to read from mailbox eventfd: %m");
+
+        /* Everything that is posted from now on wakes us up again */
+        event_mailbox_finish_list(m, event_mailbox_take_all(m), true);
+
+        return 0;
+}
+
+int event_mailbox_new(sd_event *e, EventMailbox **ret) {
+        _cleanup_(event_mailbox_unrefp) EventMailbox *m = NULL;
+        int r;
+
+        assert(e);
+        assert(ret);
+
+        m = new(EventMailbox, 1);
+        if (!m)
+                return -ENOMEM;
+
+        *m = (EventMailbox) {
+                .n_ref = 1,
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK),
+        };
+        if (m->fd < 0)
+                return -errno;
+
+        r = sd_event_add_io(e, &m->source, m->fd, EPOLLIN, event_mailbox_dispatch, m);
+        if (r < 0)
+                return r;
+
+        (void) sd_event_source_set_description(m->source, "event-mailbox");
+
+        *ret = TAKE_PTR(m);
+        return 0;
+}
+
+int event_mailbox_set_priority(EventMailbox *m, int64_t priority) {
+        assert(m);
+
+        if (!m->source)
+                return -ESHUTDOWN;
+
+        return sd_event_source_set_priority(m->source, priority);
+}
+
+void event_mailbox_close(EventMailbox *m) {
+        EventMessage *list;
+
+        if (!m || !m->source)
+                return;
+
+        assert_se(pthread_mutex_lock(&m->mutex) == 0);
+        m->closed = true;
+        list = TAKE_PTR(m->queue);
+        m->queue_tail = NULL;
+        __atomic_store_n(&m->n_stealable, 0, __ATOMIC_RELAXED);
+        assert_se(pthread_mutex_unlock(&m->mutex) == 0);
+
+        m->source = sd_event_source_disable_unref(m->source);
+
+        event_mailbox_finish_list(m, list, false);
+}
+
+static EventMailbox* event_mailbox_free(EventMailbox *m) {
+        assert(m);
+
+        /* Only legitimate in the loop's thread if this wasn't closed before */
+        event_mailbox_close(m);
+
+        safe_close(m->fd);
+        assert_se(pthread_mutex_destroy(&m->mutex) == 0);
+
+        return mfree(m);
+}
+
+EventMailbox* event_mailbox_ref(EventMailbox *m) {
+        if (!m)
+                return NULL;
+
+        assert_se(__sync_fetch_and_add(&m->n_ref, 1) > 0);
+        return m;
+}
+
+EventMailbox* event_mailbox_unref(EventMailbox *m) {
+        if (!m)
+                return NULL;
+
+        if (__sync_sub_and_fetch(&m->n_ref, 1) == 0)
+                event_mailbox_free(m);
+
+        return NULL;
+}
+
+static int event_mailbox_post_internal(
+                EventMailbox *m,
+                event_mailbox_handler_t handler,
+                event_mailbox_destroy_t destroy,
+                void *userdata,
+                bool stealable) {
+
+        _unused_ _cleanup_(pthread_mutex_unlock_assertp) pthread_mutex_t *l = NULL;
+        _cleanup_free_ EventMessage *msg = NULL;
+
+        assert(m);
+        assert(handler);
+
+        msg = new(EventMessage, 1);
+        if (!msg)
+                return -ENOMEM;
+
+        *msg = (EventMessage) {
+                .handler = handler,
+                .destroy = destroy,
+                .userdata = userdata,
+                .stealable = stealable,
+        };
+
+        l = pthread_mutex_lock_assert(&m->mutex);
+
+        if (m->closed)
+                return -ESHUTDOWN;
+
+        /* Writing while holding the lock makes sure the loop can't take the queue in between and miss the
+         * wakeup. The counter can't realistically overflow, as we only write to it when the queue was empty. */
+        if (!m->queue && eventfd_write(m->fd, 1) < 0)
+                return -errno;
+
+        LIST_INSERT_AFTER(messages, m->queue, m->queue_tail, msg);
+        m->queue_tail = msg;
+
+        if (stealable)
+                __sync_fetch_and_add(&m->n_stealable, 1);
+        __sync_fetch_and_add(&m->n_queued, 1);
+
+        TAKE_PTR(msg);
+        return 0;
+}
+
+int event_mailbox_post(EventMailbox *m, event_mailbox_handler_t handler, event_mailbox_destroy_t destroy, void *userdata) {
+        return event_mailbox_post_internal(m, handler, destroy, userdata, false);
+}
+
+unsigned event_mailbox_queued(EventMailbox *m) {
+        assert(m);
+
+        return __atomic_load_n(&m->n_queued, __ATOMIC_RELAXED);
+}
+
+static void event_worker_exit(void *userdata) {
+        EventWorker *w = userdata;
+
+        (void) sd_event_exit(w->event, 0);
+}
+
+static bool event_worker_steal(EventWorker *w) {
+        EventWorkerPool *p;
+        unsigned i;
+
+        assert(w);
+
+        p = w->pool;
+
+        /* Our own messages come first, they are dispatched in the next iteration */
+        if (event_mailbox_queued(w->mailbox) > 0)
+                return false;
+
+        for (i = 1; i < p->n_workers; i++) {
+                EventWorker *v = p->workers + (w->idx + i) % p->n_workers;
+                EventMessage *msg;
+
+                if (!v->mailbox)
+                        continue;
+
+                msg = event_mailbox_steal(v->mailbox);
+                if (!msg)
+                        continue;
+
+                event_message_finish(msg, true);
+                return true;
+        }
+
+        return false;
+}
+
+static void* event_worker_thread(void *arg) {
+        EventWorker *w = arg;
+        EventWorkerPool *p = w->pool;
+        EventMailbox *m = NULL;
+        int r;
+
+        (void) pthread_setname_np(pthread_self(), "event-worker");
+
+        r = sd_event_default(&w->event);
+        if (r >= 0)
+                r = event_mailbox_new(w->event, &m);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        w->mailbox = m;
+        if (r < 0 && p->error >= 0)
+                p->error = r;
+        p->n_ready++;
+        assert_se(pthread_cond_broadcast(&p->ready) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        if (r < 0) {
+                w->event = sd_event_unref(w->event);
+                return NULL;
+        }
+
+        for (;;) {
+                r = sd_event_run(w->event, (uint64_t) -1);
+                if (r < 0) {
+                        log_debug_errno(r, "Event loop of worker %u failed: %m", w->idx);
+                        break;
+                }
+
+                if (sd_event_get_state(w->event) == SD_EVENT_FINISHED)
+                        break;
+
+                while (event_worker_steal(w))
+                        ;
+        }
+
+        /* Whatever is still queued now is destroyed, and everything posted later is refused */
+        event_mailbox_close(w->mailbox);
+        w->event = sd_event_unref(w->event);
+
+        return NULL;
+}
+
+static unsigned event_worker_pool_n_workers(void) {
+        long k;
+
+        k = sysconf(_SC_NPROCESSORS_ONLN);
+        return k > 1 ? (unsigned) MIN(k, (long) EVENT_WORKER_POOL_MAX) : 1;
+}
+
+int event_worker_pool_new(unsigned n_workers, EventWorkerPool **ret) {
+        _cleanup_(event_worker_pool_freep) EventWorkerPool *p = NULL;
+        sigset_t ss, saved_ss;
+        unsigned i, n_started = 0;
+        int r, k;
+
+        assert(n_workers <= EVENT_WORKER_POOL_MAX);
+        assert(ret);
+
+        if (n_workers == 0)
+                n_workers = event_worker_pool_n_workers();
+
+        p = new(EventWorkerPool, 1);
+        if (!p)
+                return -ENOMEM;
+
+        *p = (EventWorkerPool) {
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .ready = PTHREAD_COND_INITIALIZER,
+        };
+
+        p->workers = new0(EventWorker, n_workers);
+        if (!p->workers)
+                return -ENOMEM;
+
+        p->n_workers = n_workers;
+
+        /* Signals are left to the thread that created the pool, workers only ever look at their mailboxes
+         * and whatever their handlers add to their loops. Don't block SIGBUS though, handlers might access
+         * memory mapped files. */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(sigdelset(&ss, SIGBUS) >= 0);
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
+
+        for (i = 0; i < n_workers; i++) {
+                EventWorker *w = p->workers + i;
+
+                w->pool = p;
+                w->idx = i;
+
+                r = pthread_create(&w->thread, NULL, event_worker_thread, w);
+                if (r > 0) {
+                        r = -r;
+                        break;
+                }
+
+                w->started = true;
+                n_started++;
+        }
+
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+
+        /* Wait until every worker that was started has its loop and mailbox set up, so that we can post to
+         * them right away */
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        while (p->n_ready < n_started)
+                assert_se(pthread_cond_wait(&p->ready, &p->mutex) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        if (r < 0)
+                return r;
+        if (k > 0)
+                return -k;
+        if (p->error < 0)
+                return p->error;
+
+        log_debug("Started %u event loop workers.", n_workers);
+
+        *ret = TAKE_PTR(p);
+        return 0;
+}
+
+EventWorkerPool* event_worker_pool_free(EventWorkerPool *p) {
+        unsigned i;
+
+        if (!p)
+                return NULL;
+
+        /* Every worker finishes what was posted to it before, then exits */
+        for (i = 0; i < p->n_workers; i++)
+                if (p->workers[i].mailbox)
+                        (void) event_mailbox_post(p->workers[i].mailbox, event_worker_exit, NULL, p->workers + i);
+
+        for (i = 0; i < p->n_workers; i++)
+                if (p->workers[i].started)
+                        assert_se(pthread_join(p->workers[i].thread, NULL) == 0);
+
+        /* Only now, as workers look into each other's mailboxes until they are all gone */
+        for (i = 0; i < p->n_workers; i++)
+                event_mailbox_unref(p->workers[i].mailbox);
+
+        free(p->workers);
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+        assert_se(pthread_cond_destroy(&p->ready) == 0);
+
+        return mfree(p);
+}
+
+unsigned event_worker_pool_size(EventWorkerPool *p) {
+        assert(p);
+
+        return p->n_workers;
+}
+
+static EventWorker* event_worker_pool_pick(EventWorkerPool *p) {
+        EventWorker *best = NULL;
+        unsigned i, start, best_queued = UINT_MAX;
+
+        assert(p);
+
+        /* Start somewhere else every time, so that idle workers get their turns */
+        start = __sync_fetch_and_add(&p->next, 1);
+
+        for (i = 0; i < p->n_workers; i++) {
+                EventWorker *w = p->workers + (start + i) % p->n_workers;
+                unsigned n;
+
+                n = event_mailbox_queued(w->mailbox);
+                if (n == 0)
+                        return w;
+                if (n < best_queued) {
+                        best = w;
+                        best_queued = n;
+                }
+        }
+
+        return best;
+}
+
+int event_worker_pool_post(EventWorkerPool *p, unsigned worker, event_mailbox_handler_t handler, event_mailbox_destroy_t destroy, void *userdata) {
+        assert(p);
+        assert(worker == EVENT_WORKER_ANY || worker < p->n_workers);
+        assert(handler);
+
+        if (worker != EVENT_WORKER_ANY)
+                return event_mailbox_post_internal(p->workers[worker].mailbox, handler, destroy, userdata, false);
+
+        return event_mailbox_post_internal(event_worker_pool_pick(p)->mailbox, handler, destroy, userdata, true);
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <limits.h>
+
+#include "sd-event.h"
+
+#include "macro.h"
+
+/* An event loop is only ever used from a single thread. A mailbox is the one way for other threads to get
+ * work done in a specific loop: messages posted to it from any thread are dispatched in the loop's thread,
+ * in the order they were posted. A worker pool runs a number of such loops in threads of their own. */
+
+typedef struct EventMailbox EventMailbox;
+typedef struct EventWorkerPool EventWorkerPool;
+
+/* Called in the thread of the loop the message is dispatched in */
+typedef void (*event_mailbox_handler_t)(void *userdata);
+
+/* Called exactly once for every message that was posted successfully, after the handler or instead of it if
+ * the mailbox is closed before the message could be dispatched. May be called in any thread. */
+typedef void (*event_mailbox_destroy_t)(void *userdata);
+
+/* Must be called in the thread of the loop. The mailbox must be closed in that thread before the loop goes
+ * away, while references to the mailbox itself may be held and dropped by any thread. */
+int event_mailbox_new(sd_event *e, EventMailbox **ret);
+int event_mailbox_set_priority(EventMailbox *m, int64_t priority);
+void event_mailbox_close(EventMailbox *m);
+
+EventMailbox* event_mailbox_ref(EventMailbox *m);
+EventMailbox* event_mailbox_unref(EventMailbox *m);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventMailbox*, event_mailbox_unref);
+
+/* May be called from any thread. Returns -ESHUTDOWN if the mailbox is closed, in which case neither
+ * callback is called. */
+int event_mailbox_post(EventMailbox *m, event_mailbox_handler_t handler, event_mailbox_destroy_t destroy, void *userdata);
+unsigned event_mailbox_queued(EventMailbox *m);
+
+#define EVENT_WORKER_POOL_MAX 64U
+#define EVENT_WORKER_ANY UINT_MAX
+
+/* Each worker runs its own loop, which is the default loop of the worker's thread, i.e. handlers may use
+ * sd_event_default() to add event sources to it. With 0 workers the number of CPUs is used. */
+int event_worker_pool_new(unsigned n_workers, EventWorkerPool **ret);
+EventWorkerPool* event_worker_pool_free(EventWorkerPool *p);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventWorkerPool*, event_worker_pool_free);
+
+unsigned event_worker_pool_size(EventWorkerPool *p);
+
+/* Messages posted to a specific worker are dispatched in its loop, in order. Messages posted to
+ * EVENT_WORKER_ANY are handed to an idle or the least busy worker, and may be taken over by any worker that
+ * runs out of work before they are dispatched. */
+int event_worker_pool_post(EventWorkerPool *p, unsigned worker, event_mailbox_handler_t handler, event_mailbox_destroy_t destroy, void *userdata);
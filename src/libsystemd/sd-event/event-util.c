@@ -2,6 +2,8 @@
 
 #include <errno.h>
 
+#include "alloc-util.h"
+#include "errno-util.h"
 #include "event-source.h"
 #include "event-util.h"
 #include "log.h"
@@ -97,3 +99,40 @@ int event_source_is_enabled(sd_event_source *s) {
 
         return sd_event_source_get_enabled(s, NULL);
 }
+
+void event_dump_source_profiles(sd_event *e, FILE *f, const char *prefix) {
+        _cleanup_free_ EventSourceProfile **profiles = NULL;
+        size_t n, i;
+        int r;
+
+        assert(e);
+        assert(f);
+
+        if (sd_event_get_profiling(e) <= 0)
+                return;
+
+        r = event_get_source_profiles(e, &profiles, &n);
+        if (r < 0) {
+                fprintf(f, "%sFailed to get event source profiles: %s\n", strempty(prefix), strerror_safe(r));
+                return;
+        }
+
+        for (i = 0; i < n; i++) {
+                EventSourceProfile *p = profiles[i];
+                char a[FORMAT_TIMESPAN_MAX], b[FORMAT_TIMESPAN_MAX];
+                size_t j, m;
+
+                fprintf(f, "%sEvent source %s: %" PRIu64 " dispatches, %s total, %s max, latency histogram",
+                        strempty(prefix), p->description, p->n_dispatched,
+                        format_timespan(a, sizeof(a), p->total_usec, 1),
+                        format_timespan(b, sizeof(b), p->max_usec, 1));
+
+                /* Skip the empty buckets at the end, latencies of hours don't happen */
+                for (m = ELEMENTSOF(p->latency); m > 1 && p->latency[m - 1] == 0; m--)
+                        ;
+                for (j = 0; j < m; j++)
+                        fprintf(f, " %u", p->latency[j]);
+
+                fputc('\n', f);
+        }
+}
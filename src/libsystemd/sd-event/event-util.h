@@ -2,12 +2,30 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "sd-event.h"
 
+#include "time-util.h"
+
 int event_reset_time(sd_event *e, sd_event_source **s,
                      clockid_t clock, uint64_t usec, uint64_t accuracy,
                      sd_event_time_handler_t callback, void *userdata,
                      int64_t priority, const char *description, bool force_reset);
 int event_source_disable(sd_event_source *s);
 int event_source_is_enabled(sd_event_source *s);
+
+/* With profiling enabled, sources are accounted for by their description, or, if they have none, by their
+ * type in parentheses, e.g. "(io)". */
+typedef struct EventSourceProfile {
+        uint64_t n_dispatched;
+        usec_t total_usec;
+        usec_t max_usec;
+        /* Logarithmic histogram of the time from the wakeup of the loop to the dispatch, 2^0 ... 2^63 us */
+        unsigned latency[sizeof(usec_t) * 8];
+        char description[];
+} EventSourceProfile;
+
+/* Returns the entries sorted by the total time spent in them, the array needs to be freed, the entries not */
+int event_get_source_profiles(sd_event *e, EventSourceProfile ***ret, size_t *ret_n);
+void event_dump_source_profiles(sd_event *e, FILE *f, const char *prefix);
@@ -11,6 +11,7 @@
 #include "alloc-util.h"
 #include "env-util.h"
 #include "event-source.h"
+#include "event-util.h"
 #include "fd-util.h"
 #include "fs-util.h"
 #include "hashmap.h"
@@ -22,6 +23,7 @@
 #include "process-util.h"
 #include "set.h"
 #include "signal-util.h"
+#include "sort-util.h"
 #include "string-table.h"
 #include "string-util.h"
 #include "strxcpyx.h"
@@ -29,6 +31,9 @@
 
 #define DEFAULT_ACCURACY_USEC (250 * USEC_PER_MSEC)
 
+/* Beyond this many different descriptions, sources are accounted for together */
+#define SOURCE_PROFILES_MAX 1024U
+
 static bool EVENT_SOURCE_WATCH_PIDFD(sd_event_source *s) {
         /* Returns true if this is a PID event source and can be implemented by watching EPOLLIN */
         return s &&
@@ -105,6 +110,8 @@ struct sd_event {
         bool need_process_child:1;
         bool watchdog:1;
         bool profile_delays:1;
+        bool profile_sources:1;
+        bool timer_wheel:1;
 
         int exit_code;
 
@@ -122,6 +129,9 @@ struct sd_event {
 
         usec_t last_run, last_log;
         unsigned delays[sizeof(usec_t) * 8];
+
+        /* description → EventSourceProfile, filled in while profile_sources is set */
+        Hashmap *source_profiles;
 };
 
 static thread_local sd_event *default_event = NULL;
@@ -227,6 +237,30 @@ static int latest_time_prioq_compare(const void *a, const void *b) {
         return CMP(time_event_source_latest(x), time_event_source_latest(y));
 }
 
+static sd_event_source* clock_data_earliest(struct clock_data *d) {
+        TimerWheelEntry *w;
+
+        assert(d);
+
+        if (!d->earliest_wheel)
+                return prioq_peek(d->earliest);
+
+        w = timer_wheel_peek(d->earliest_wheel);
+        return w ? container_of(w, sd_event_source, time.earliest_entry) : NULL;
+}
+
+static sd_event_source* clock_data_latest(struct clock_data *d) {
+        TimerWheelEntry *w;
+
+        assert(d);
+
+        if (!d->latest_wheel)
+                return prioq_peek(d->latest);
+
+        w = timer_wheel_peek(d->latest_wheel);
+        return w ? container_of(w, sd_event_source, time.latest_entry) : NULL;
+}
+
 static int exit_prioq_compare(const void *a, const void *b) {
         const sd_event_source *x = a, *y = b;
 
@@ -250,6 +284,8 @@ static void free_clock_data(struct clock_data *d) {
         safe_close(d->fd);
         prioq_free(d->earliest);
         prioq_free(d->latest);
+        timer_wheel_free(d->earliest_wheel);
+        timer_wheel_free(d->latest_wheel);
 }
 
 static sd_event *event_free(sd_event *e) {
@@ -291,6 +327,8 @@ static sd_event *event_free(sd_event *e) {
 
         free(e->event_queue);
 
+        hashmap_free_free(e->source_profiles);
+
         return mfree(e);
 }
 
@@ -344,6 +382,16 @@ _public_ int sd_event_new(sd_event** ret) {
                 e->profile_delays = true;
         }
 
+        r = getenv_bool_secure("SD_EVENT_TIMER_WHEEL");
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SD_EVENT_TIMER_WHEEL, ignoring: %m");
+        e->timer_wheel = r > 0;
+
+        r = getenv_bool_secure("SD_EVENT_PROFILE_SOURCES");
+        if (r < 0 && r != -ENXIO)
+                log_debug_errno(r, "Failed to parse $SD_EVENT_PROFILE_SOURCES, ignoring: %m");
+        e->profile_sources = r > 0;
+
         *ret = e;
         return 0;
 
@@ -529,6 +577,37 @@ static struct clock_data* event_get_clock_data(sd_event *e, EventSourceType t) {
         }
 }
 
+static void event_source_time_reshuffle(sd_event_source *s) {
+        struct clock_data *d;
+
+        assert(s);
+        assert(EVENT_SOURCE_IS_TIME(s->type));
+
+        d = event_get_clock_data(s->event, s->type);
+        assert(d);
+
+        d->needs_rearm = true;
+
+        if (!d->earliest_wheel) {
+                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
+                prioq_reshuffle(d->latest, s, &s->time.latest_index);
+                return;
+        }
+
+        /* The wheels only know about the sources that may still elapse, i.e. the ones the prioqs would
+         * order first. Moving a source is cheap, hence simply take it out and put it back in. Room for all
+         * sources is reserved when they are added, hence this can't fail half-way through, which would
+         * leave the source in neither wheel. */
+        (void) timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+        (void) timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
+
+        if (s->enabled == SD_EVENT_OFF || s->pending)
+                return;
+
+        assert_se(timer_wheel_put(d->earliest_wheel, &s->time.earliest_entry, s->time.next) >= 0);
+        assert_se(timer_wheel_put(d->latest_wheel, &s->time.latest_entry, time_event_source_latest(s)) >= 0);
+}
+
 static void event_free_signal_data(sd_event *e, struct signal_data *d) {
         assert(e);
 
@@ -734,7 +813,12 @@ static void source_disconnect(sd_event_source *s) {
 
                 prioq_remove(d->earliest, s, &s->time.earliest_index);
                 prioq_remove(d->latest, s, &s->time.latest_index);
+                (void) timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+                (void) timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
                 d->needs_rearm = true;
+
+                assert(d->n_sources > 0);
+                d->n_sources--;
                 break;
         }
 
@@ -910,16 +994,8 @@ static int source_set_pending(sd_event_source *s, bool b) {
         } else
                 assert_se(prioq_remove(s->event->pending, s, &s->pending_index));
 
-        if (EVENT_SOURCE_IS_TIME(s->type)) {
-                struct clock_data *d;
-
-                d = event_get_clock_data(s->event, s->type);
-                assert(d);
-
-                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                d->needs_rearm = true;
-        }
+        if (EVENT_SOURCE_IS_TIME(s->type))
+                event_source_time_reshuffle(s);
 
         if (s->type == SOURCE_SIGNAL && !b) {
                 struct signal_data *d;
@@ -1104,13 +1180,31 @@ _public_ int sd_event_add_time(
         d = event_get_clock_data(e, type);
         assert(d);
 
-        r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
-        if (r < 0)
-                return r;
+        if (e->timer_wheel) {
+                r = timer_wheel_ensure_allocated(&d->earliest_wheel);
+                if (r < 0)
+                        return r;
 
-        r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
-        if (r < 0)
-                return r;
+                r = timer_wheel_ensure_allocated(&d->latest_wheel);
+                if (r < 0)
+                        return r;
+
+                r = timer_wheel_reserve(d->earliest_wheel, d->n_sources + 1);
+                if (r < 0)
+                        return r;
+
+                r = timer_wheel_reserve(d->latest_wheel, d->n_sources + 1);
+                if (r < 0)
+                        return r;
+        } else {
+                r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
+                if (r < 0)
+                        return r;
+
+                r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
+                if (r < 0)
+                        return r;
+        }
 
         if (d->fd < 0) {
                 r = event_setup_timer_fd(e, d, clock);
@@ -1122,22 +1216,29 @@ _public_ int sd_event_add_time(
         if (!s)
                 return -ENOMEM;
 
+        d->n_sources++;
+
         s->time.next = usec;
         s->time.accuracy = accuracy == 0 ? DEFAULT_ACCURACY_USEC : accuracy;
         s->time.callback = callback;
         s->time.earliest_index = s->time.latest_index = PRIOQ_IDX_NULL;
+        s->time.earliest_entry = s->time.latest_entry = TIMER_WHEEL_ENTRY_NULL;
         s->userdata = userdata;
         s->enabled = SD_EVENT_ONESHOT;
 
         d->needs_rearm = true;
 
-        r = prioq_put(d->earliest, s, &s->time.earliest_index);
-        if (r < 0)
-                return r;
+        if (d->earliest_wheel)
+                event_source_time_reshuffle(s);
+        else {
+                r = prioq_put(d->earliest, s, &s->time.earliest_index);
+                if (r < 0)
+                        return r;
 
-        r = prioq_put(d->latest, s, &s->time.latest_index);
-        if (r < 0)
-                return r;
+                r = prioq_put(d->latest, s, &s->time.latest_index);
+                if (r < 0)
+                        return r;
+        }
 
         if (ret)
                 *ret = s;
@@ -1912,6 +2013,9 @@ _public_ int sd_event_source_set_description(sd_event_source *s, const char *des
         assert_return(s, -EINVAL);
         assert_return(!event_pid_changed(s->event), -ECHILD);
 
+        /* Look the accounting entry up again on the next dispatch */
+        s->profile = NULL;
+
         return free_and_strdup(&s->description, description);
 }
 
@@ -2216,18 +2320,11 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
 
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
                         s->enabled = m;
@@ -2286,18 +2383,11 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
 
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
 
@@ -2378,7 +2468,6 @@ _public_ int sd_event_source_get_time(sd_event_source *s, uint64_t *usec) {
 }
 
 _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
         int r;
 
         assert_return(s, -EINVAL);
@@ -2392,13 +2481,7 @@ _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
 
         s->time.next = usec;
 
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
-
+        event_source_time_reshuffle(s);
         return 0;
 }
 
@@ -2413,7 +2496,6 @@ _public_ int sd_event_source_get_time_accuracy(sd_event_source *s, uint64_t *use
 }
 
 _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
         int r;
 
         assert_return(s, -EINVAL);
@@ -2431,12 +2513,7 @@ _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec
 
         s->time.accuracy = usec;
 
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
-
+        event_source_time_reshuffle(s);
         return 0;
 }
 
@@ -2708,7 +2785,7 @@ static int event_arm_timer(
         else
                 d->needs_rearm = false;
 
-        a = prioq_peek(d->earliest);
+        a = clock_data_earliest(d);
         if (!a || a->enabled == SD_EVENT_OFF || a->time.next == USEC_INFINITY) {
 
                 if (d->fd < 0)
@@ -2726,7 +2803,7 @@ static int event_arm_timer(
                 return 0;
         }
 
-        b = prioq_peek(d->latest);
+        b = clock_data_latest(d);
         assert_se(b && b->enabled != SD_EVENT_OFF);
 
         t = sleep_between(e, a->time.next, time_event_source_latest(b));
@@ -2807,7 +2884,7 @@ static int process_timer(
         assert(d);
 
         for (;;) {
-                s = prioq_peek(d->earliest);
+                s = clock_data_earliest(d);
                 if (!s ||
                     s->time.next > n ||
                     s->enabled == SD_EVENT_OFF ||
@@ -2818,9 +2895,7 @@ static int process_timer(
                 if (r < 0)
                         return r;
 
-                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                d->needs_rearm = true;
+                event_source_time_reshuffle(s);
         }
 
         return 0;
@@ -3142,8 +3217,65 @@ static int process_inotify(sd_event *e) {
         return done;
 }
 
+static EventSourceProfile* source_get_profile(sd_event_source *s) {
+        EventSourceProfile *p;
+        sd_event *e;
+        const char *key;
+        int r;
+
+        assert(s);
+
+        if (s->profile)
+                return s->profile;
+
+        e = s->event;
+
+        key = s->description ?: strjoina("(", event_source_type_to_string(s->type), ")");
+
+        p = hashmap_get(e->source_profiles, key);
+        if (!p && hashmap_size(e->source_profiles) >= SOURCE_PROFILES_MAX) {
+                key = "(other)";
+                p = hashmap_get(e->source_profiles, key);
+        }
+        if (!p) {
+                r = hashmap_ensure_allocated(&e->source_profiles, &string_hash_ops);
+                if (r < 0)
+                        return NULL;
+
+                p = malloc0(offsetof(EventSourceProfile, description) + strlen(key) + 1);
+                if (!p)
+                        return NULL;
+
+                strcpy(p->description, key);
+
+                r = hashmap_put(e->source_profiles, p->description, p);
+                if (r < 0)
+                        return mfree(p);
+        }
+
+        /* Entries stay around as long as the loop does, hence it's fine to keep a pointer to it */
+        return (s->profile = p);
+}
+
+static void source_profile_account(EventSourceProfile *p, usec_t wakeup, usec_t before, usec_t after) {
+        usec_t t;
+
+        assert(p);
+
+        t = usec_sub_unsigned(after, before);
+
+        p->n_dispatched++;
+        p->total_usec = usec_add(p->total_usec, t);
+        p->max_usec = MAX(p->max_usec, t);
+
+        if (wakeup > 0 && wakeup <= before)
+                p->latency[u64log2(before - wakeup)]++;
+}
+
 static int source_dispatch(sd_event_source *s) {
         EventSourceType saved_type;
+        EventSourceProfile *profile = NULL;
+        usec_t wakeup = 0, before = 0;
         int r = 0;
 
         assert(s);
@@ -3182,6 +3314,15 @@ static int source_dispatch(sd_event_source *s) {
                         return r;
         }
 
+        if (s->event->profile_sources) {
+                /* If the entry can't be allocated, this dispatch simply isn't accounted for. The time the
+                 * loop woke up at is meaningless for exit sources, they are dispatched one by one later. */
+                profile = source_get_profile(s);
+                if (s->type != SOURCE_EXIT)
+                        wakeup = s->event->timestamp.monotonic;
+                before = now(CLOCK_MONOTONIC);
+        }
+
         s->dispatching = true;
 
         switch (s->type) {
@@ -3260,6 +3401,9 @@ static int source_dispatch(sd_event_source *s) {
 
         s->dispatching = false;
 
+        if (profile)
+                source_profile_account(profile, wakeup, before, now(CLOCK_MONOTONIC));
+
         if (r < 0)
                 log_debug_errno(r, "Event source %s (type %s) returned error, disabling: %m",
                                 strna(s->description), event_source_type_to_string(saved_type));
@@ -3892,6 +4036,88 @@ _public_ int sd_event_get_iteration(sd_event *e, uint64_t *ret) {
         return 0;
 }
 
+_public_ int sd_event_set_profiling(sd_event *e, int b) {
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        /* What was accounted for so far is kept when turning this off, so that it can still be looked at */
+        e->profile_sources = b;
+        return 0;
+}
+
+_public_ int sd_event_get_profiling(sd_event *e) {
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        return e->profile_sources;
+}
+
+_public_ int sd_event_get_source_profile(
+                sd_event *e,
+                const char *description,
+                uint64_t *ret_n_dispatched,
+                uint64_t *ret_total_usec,
+                uint64_t *ret_max_usec) {
+
+        EventSourceProfile *p;
+
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(description, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        p = hashmap_get(e->source_profiles, description);
+        if (!p)
+                return -ENXIO;
+
+        if (ret_n_dispatched)
+                *ret_n_dispatched = p->n_dispatched;
+        if (ret_total_usec)
+                *ret_total_usec = p->total_usec;
+        if (ret_max_usec)
+                *ret_max_usec = p->max_usec;
+
+        return 0;
+}
+
+static int source_profile_compare(EventSourceProfile * const *a, EventSourceProfile * const *b) {
+        int r;
+
+        r = CMP((*b)->total_usec, (*a)->total_usec);
+        if (r != 0)
+                return r;
+
+        return strcmp((*a)->description, (*b)->description);
+}
+
+int event_get_source_profiles(sd_event *e, EventSourceProfile ***ret, size_t *ret_n) {
+        _cleanup_free_ EventSourceProfile **array = NULL;
+        EventSourceProfile *p;
+        size_t n = 0;
+        Iterator i;
+
+        assert(e);
+        assert(ret);
+        assert(ret_n);
+
+        if (!hashmap_isempty(e->source_profiles)) {
+                array = new(EventSourceProfile*, hashmap_size(e->source_profiles));
+                if (!array)
+                        return -ENOMEM;
+
+                HASHMAP_FOREACH(p, e->source_profiles, i)
+                        array[n++] = p;
+
+                typesafe_qsort(array, n, source_profile_compare);
+        }
+
+        *ret = TAKE_PTR(array);
+        *ret_n = n;
+        return 0;
+}
+
 _public_ int sd_event_source_set_destroy_callback(sd_event_source *s, sd_event_destroy_t callback) {
         assert_return(s, -EINVAL);
 
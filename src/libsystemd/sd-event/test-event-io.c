@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "event-io.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "log.h"
+#include "macro.h"
+#include "string-util.h"
+#include "tests.h"
+#include "time-util.h"
+#include "tmpfile-util.h"
+
+typedef struct Result {
+        unsigned n_called;
+        ssize_t result;
+} Result;
+
+static void record_handler(EventIORequest *req, ssize_t result, void *userdata) {
+        Result *res = userdata;
+
+        res->n_called++;
+        res->result = result;
+}
+
+static void run_until_done(sd_event *e, EventIOContext *c) {
+        while (event_io_context_pending(c) > 0)
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+}
+
+static void test_pipe(sd_event *e, EventIOContext *c) {
+        _cleanup_close_pair_ int p[2] = { -1, -1 };
+        Result rd = {}, wr = {};
+        char buf[32] = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(pipe2(p, O_CLOEXEC|O_NONBLOCK) >= 0);
+
+        /* The read is queued first and has to wait for the write */
+        assert_se(event_io_read(c, p[0], buf, sizeof(buf), record_handler, &rd, NULL) >= 0);
+        assert_se(event_io_write(c, p[1], "hello", 5, record_handler, &wr, NULL) >= 0);
+
+        /* Nothing happens before the loop runs */
+        assert_se(rd.n_called == 0 && wr.n_called == 0);
+        assert_se(event_io_context_pending(c) == 2);
+
+        run_until_done(e, c);
+
+        assert_se(wr.n_called == 1 && wr.result == 5);
+        assert_se(rd.n_called == 1 && rd.result == 5);
+        assert_se(streq(buf, "hello"));
+
+        /* End of file */
+        p[1] = safe_close(p[1]);
+        assert_se(event_io_read(c, p[0], buf, sizeof(buf), record_handler, &rd, NULL) >= 0);
+        run_until_done(e, c);
+        assert_se(rd.n_called == 2 && rd.result == 0);
+}
+
+static void test_socket(sd_event *e, EventIOContext *c) {
+        _cleanup_close_pair_ int s[2] = { -1, -1 };
+        char in[16] = {}, out[] = "message";
+        struct iovec iov_in = IOVEC_INIT(in, sizeof(in)), iov_out = IOVEC_INIT(out, sizeof(out));
+        struct msghdr mh_in = { .msg_iov = &iov_in, .msg_iovlen = 1 }, mh_out = { .msg_iov = &iov_out, .msg_iovlen = 1 };
+        Result rd = {}, wr = {}, rd2 = {};
+        char buf[16];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, s) >= 0);
+
+        /* Reading from and writing to the same fd at the same time */
+        assert_se(event_io_recvmsg(c, s[0], &mh_in, 0, record_handler, &rd, NULL) >= 0);
+        assert_se(event_io_sendmsg(c, s[0], &mh_out, 0, record_handler, &wr, NULL) >= 0);
+        assert_se(event_io_read(c, s[1], buf, sizeof(buf), record_handler, &rd2, NULL) >= 0);
+
+        while (wr.n_called == 0 || rd2.n_called == 0)
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+
+        assert_se(wr.n_called == 1 && wr.result == sizeof(out));
+        assert_se(rd2.n_called == 1 && rd2.result == sizeof(out));
+        assert_se(streq(buf, "message"));
+        assert_se(rd.n_called == 0);
+        assert_se(event_io_context_pending(c) == 1);
+
+        assert_se(write(s[1], "reply", 6) == 6);
+        run_until_done(e, c);
+        assert_se(rd.n_called == 1 && rd.result == 6);
+        assert_se(streq(in, "reply"));
+}
+
+static void test_file(sd_event *e, EventIOContext *c) {
+        char name[] = "/tmp/test-event-io.XXXXXX";
+        _cleanup_close_ int fd = -1;
+        Result rd = {}, wr = {};
+        char buf[16] = {};
+
+        log_info("/* %s */", __func__);
+
+        /* Regular files can't be polled */
+        fd = mkostemp_safe(name);
+        assert_se(fd >= 0);
+        assert_se(unlink(name) >= 0);
+
+        assert_se(event_io_write(c, fd, "file", 4, record_handler, &wr, NULL) >= 0);
+        run_until_done(e, c);
+        assert_se(wr.n_called == 1 && wr.result == 4);
+
+        /* Requests use the file position */
+        assert_se(lseek(fd, 0, SEEK_CUR) == 4);
+        assert_se(lseek(fd, 1, SEEK_SET) == 1);
+
+        assert_se(event_io_read(c, fd, buf, sizeof(buf), record_handler, &rd, NULL) >= 0);
+        run_until_done(e, c);
+        assert_se(rd.n_called == 1 && rd.result == 3);
+        assert_se(streq(buf, "ile"));
+}
+
+static void test_cancel(sd_event *e, EventIOContext *c) {
+        _cleanup_close_pair_ int p[2] = { -1, -1 };
+        Result rd = {};
+        EventIORequest *req;
+        char buf[8];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(pipe2(p, O_CLOEXEC|O_NONBLOCK) >= 0);
+
+        assert_se(event_io_read(c, p[0], buf, sizeof(buf), record_handler, &rd, &req) >= 0);
+
+        /* Let the request get going first */
+        assert_se(sd_event_run(e, 0) >= 0);
+        assert_se(rd.n_called == 0);
+
+        event_io_request_cancel(req);
+        event_io_request_cancel(req);
+        assert_se(rd.n_called == 0);
+
+        run_until_done(e, c);
+        assert_se(rd.n_called == 1 && rd.result == -ECANCELED);
+
+        /* Nothing more arrives for the cancelled request */
+        assert_se(write(p[1], "x", 1) == 1);
+        assert_se(sd_event_run(e, 0) >= 0);
+        assert_se(rd.n_called == 1);
+}
+
+static void test_free(sd_event *e, bool uring) {
+        _cleanup_close_pair_ int p[2] = { -1, -1 };
+        EventIOContext *c;
+        Result rd[3] = {};
+        char buf[3][8];
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(pipe2(p, O_CLOEXEC|O_NONBLOCK) >= 0);
+        assert_se(event_io_context_new(e, 0, &c) >= 0);
+        assert_se(event_io_context_uses_uring(c) == uring);
+
+        /* Whatever is still in flight when the context goes is cancelled, submitted or not */
+        assert_se(event_io_read(c, p[0], buf[0], sizeof(buf[0]), record_handler, rd + 0, NULL) >= 0);
+        assert_se(sd_event_run(e, 0) >= 0);
+        for (i = 1; i < ELEMENTSOF(rd); i++)
+                assert_se(event_io_read(c, p[0], buf[i], sizeof(buf[i]), record_handler, rd + i, NULL) >= 0);
+
+        event_io_context_free(c);
+
+        for (i = 0; i < ELEMENTSOF(rd); i++)
+                assert_se(rd[i].n_called == 1 && rd[i].result == -ECANCELED);
+}
+
+static unsigned n_round_trips;
+
+static void bench_handler(EventIORequest *req, ssize_t result, void *userdata) {
+        assert_se(result == 1);
+        n_round_trips++;
+}
+
+static void test_benchmark(sd_event *e, EventIOContext *c) {
+        _cleanup_close_pair_ int s[2] = { -1, -1 };
+        unsigned i, n = slow_tests_enabled() ? 1U << 17 : 1U << 14;
+        char in[64], out[64] = {};
+        usec_t ts;
+
+        /* Lots of small reads and writes, queued together per iteration */
+        assert_se(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, s) >= 0);
+
+        n_round_trips = 0;
+        ts = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n; i += ELEMENTSOF(in)) {
+                unsigned j;
+
+                for (j = 0; j < ELEMENTSOF(in); j++) {
+                        assert_se(event_io_read(c, s[1], in + j, 1, bench_handler, NULL, NULL) >= 0);
+                        assert_se(event_io_write(c, s[0], out + j, 1, bench_handler, NULL, NULL) >= 0);
+                }
+
+                run_until_done(e, c);
+        }
+
+        assert_se(n_round_trips == 2 * n);
+
+        log_info("%s: %.1f µs per read and write", event_io_context_uses_uring(c) ? "io_uring" : "epoll",
+                 (double) (now(CLOCK_MONOTONIC) - ts) / n);
+}
+
+static void test_all(bool uring) {
+        _cleanup_(event_io_context_freep) EventIOContext *c = NULL;
+        sd_event *e;
+
+        log_info("/* %s(%s) */", __func__, yes_no(uring));
+
+        assert_se(setenv("SD_EVENT_IO_URING", yes_no(uring), 1) >= 0);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(event_io_context_new(e, 8, &c) >= 0);
+        assert_se(event_io_context_uses_uring(c) == uring);
+
+        test_pipe(e, c);
+        test_socket(e, c);
+        test_file(e, c);
+        test_cancel(e, c);
+        test_benchmark(e, c);
+        test_free(e, uring);
+
+        c = event_io_context_free(c);
+        sd_event_unref(e);
+
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        EventIOContext *c;
+        sd_event *e;
+        bool have_uring;
+
+        test_setup_logging(LOG_DEBUG);
+
+        /* Whether io_uring works here depends on the kernel, and on seccomp filters of the environment */
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(event_io_context_new(e, 0, &c) >= 0);
+        have_uring = event_io_context_uses_uring(c);
+        event_io_context_free(c);
+        sd_event_unref(e);
+
+        test_all(false);
+
+        if (have_uring)
+                test_all(true);
+        else
+                log_notice("io_uring is not available, skipping.");
+
+        return 0;
+}
@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "event-thread.h"
+#include "log.h"
+#include "macro.h"
+#include "memory-util.h"
+#include "tests.h"
+#include "time-util.h"
+
+#define N_PRODUCERS 4U
+#define N_MESSAGES 20000U
+#define N_WORKERS 4U
+
+/* Messages carry who posted them and their sequence number */
+#define MESSAGE(idx, seq) UINT_TO_PTR((idx) << 24 | (seq))
+#define MESSAGE_IDX(userdata) (PTR_TO_UINT(userdata) >> 24)
+#define MESSAGE_SEQ(userdata) (PTR_TO_UINT(userdata) & 0xFFFFFFU)
+
+static pthread_t main_thread;
+static sd_event *main_event = NULL;
+static EventMailbox *main_mailbox = NULL;
+
+static unsigned n_handled = 0, n_destroyed = 0, n_expected = 0;
+static unsigned last_seq[CONST_MAX(N_PRODUCERS, N_WORKERS)];
+
+static void reset_counters(unsigned expected) {
+        n_handled = n_destroyed = 0;
+        n_expected = expected;
+        memzero(last_seq, sizeof(last_seq));
+}
+
+static void count_destroy(void *userdata) {
+        __sync_fetch_and_add(&n_destroyed, 1);
+}
+
+static void count_handled(void *userdata) {
+        assert_se(pthread_equal(pthread_self(), main_thread));
+
+        if (++n_handled == n_expected)
+                assert_se(sd_event_exit(main_event, 0) >= 0);
+}
+
+typedef struct Producer {
+        pthread_t thread;
+        EventMailbox *mailbox;
+        event_mailbox_handler_t handler;
+        unsigned idx;
+        unsigned n_posted;
+        bool until_shutdown;
+} Producer;
+
+static void* producer_thread(void *arg) {
+        Producer *p = arg;
+        unsigned i;
+        int r;
+
+        for (i = 0; p->until_shutdown || i < N_MESSAGES; i++) {
+                r = event_mailbox_post(p->mailbox, p->handler, count_destroy, MESSAGE(p->idx, i % N_MESSAGES));
+                if (r == -ESHUTDOWN) {
+                        assert_se(p->until_shutdown);
+                        break;
+                }
+                assert_se(r >= 0);
+
+                p->n_posted++;
+        }
+
+        /* The last reference might be ours, dropping it here must be fine */
+        event_mailbox_unref(p->mailbox);
+        return NULL;
+}
+
+static void start_producers(Producer producers[], EventMailbox *m, event_mailbox_handler_t handler, bool until_shutdown) {
+        unsigned i;
+
+        for (i = 0; i < N_PRODUCERS; i++) {
+                producers[i] = (Producer) {
+                        .mailbox = event_mailbox_ref(m),
+                        .handler = handler,
+                        .idx = i,
+                        .until_shutdown = until_shutdown,
+                };
+
+                assert_se(pthread_create(&producers[i].thread, NULL, producer_thread, producers + i) == 0);
+        }
+}
+
+static unsigned join_producers(Producer producers[]) {
+        unsigned i, n = 0;
+
+        for (i = 0; i < N_PRODUCERS; i++) {
+                assert_se(pthread_join(producers[i].thread, NULL) == 0);
+                n += producers[i].n_posted;
+        }
+
+        return n;
+}
+
+static void order_handler(void *userdata) {
+        unsigned idx = MESSAGE_IDX(userdata);
+
+        assert_se(idx < N_PRODUCERS);
+
+        /* Messages of each producer arrive in the order they were posted */
+        assert_se(MESSAGE_SEQ(userdata) == last_seq[idx]);
+        last_seq[idx]++;
+
+        count_handled(userdata);
+}
+
+static void test_mailbox_order(void) {
+        Producer producers[N_PRODUCERS];
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        reset_counters(N_PRODUCERS * N_MESSAGES);
+
+        assert_se(sd_event_new(&main_event) >= 0);
+        assert_se(event_mailbox_new(main_event, &main_mailbox) >= 0);
+
+        start_producers(producers, main_mailbox, order_handler, false);
+        assert_se(sd_event_loop(main_event) >= 0);
+        assert_se(join_producers(producers) == N_PRODUCERS * N_MESSAGES);
+
+        assert_se(n_handled == N_PRODUCERS * N_MESSAGES);
+        assert_se(n_destroyed == N_PRODUCERS * N_MESSAGES);
+        for (i = 0; i < N_PRODUCERS; i++)
+                assert_se(last_seq[i] == N_MESSAGES);
+
+        event_mailbox_close(main_mailbox);
+        main_mailbox = event_mailbox_unref(main_mailbox);
+        main_event = sd_event_unref(main_event);
+}
+
+static void close_handler(void *userdata) {
+        /* Close from within a handler, with more messages of the same batch still to go */
+        if (++n_handled == n_expected) {
+                event_mailbox_close(main_mailbox);
+                assert_se(sd_event_exit(main_event, 0) >= 0);
+        }
+}
+
+static void test_mailbox_teardown(void) {
+        Producer producers[N_PRODUCERS];
+        unsigned n;
+
+        log_info("/* %s */", __func__);
+
+        reset_counters(N_MESSAGES / 2);
+
+        assert_se(sd_event_new(&main_event) >= 0);
+        assert_se(event_mailbox_new(main_event, &main_mailbox) >= 0);
+
+        /* The producers keep posting until they are refused, and drop their references afterwards, so the
+         * last one is dropped in one of their threads */
+        start_producers(producers, main_mailbox, close_handler, true);
+        assert_se(sd_event_loop(main_event) >= 0);
+
+        assert_se(event_mailbox_post(main_mailbox, close_handler, count_destroy, NULL) == -ESHUTDOWN);
+        main_mailbox = event_mailbox_unref(main_mailbox);
+        main_event = sd_event_unref(main_event);
+
+        n = join_producers(producers);
+        log_info("Handled %u of %u messages.", n_handled, n);
+
+        /* Nothing is handled after closing, but everything that was posted is destroyed exactly once */
+        assert_se(n_handled == N_MESSAGES / 2);
+        assert_se(n_destroyed == n);
+}
+
+static void pinned_handler(void *userdata) {
+        unsigned idx = MESSAGE_IDX(userdata);
+        sd_event *e = NULL;
+
+        assert_se(idx < N_WORKERS);
+        assert_se(!pthread_equal(pthread_self(), main_thread));
+
+        /* Only ever touched from the thread of this worker */
+        assert_se(MESSAGE_SEQ(userdata) == last_seq[idx]);
+        last_seq[idx]++;
+
+        /* Handlers run in the worker's own loop */
+        assert_se(sd_event_default(&e) >= 0);
+        assert_se(e != main_event);
+        assert_se(sd_event_get_state(e) == SD_EVENT_RUNNING);
+        sd_event_unref(e);
+
+        assert_se(event_mailbox_post(main_mailbox, count_handled, count_destroy, userdata) >= 0);
+}
+
+static void any_handler(void *userdata) {
+        assert_se(!pthread_equal(pthread_self(), main_thread));
+
+        /* Keep a worker busy every now and then, so that others take over its messages */
+        if (MESSAGE_SEQ(userdata) % 100 == 0)
+                (void) usleep(10 * USEC_PER_MSEC);
+
+        assert_se(event_mailbox_post(main_mailbox, count_handled, count_destroy, userdata) >= 0);
+}
+
+static void test_worker_pool(void) {
+        _cleanup_(event_worker_pool_freep) EventWorkerPool *p = NULL;
+        unsigned i, j, n = N_MESSAGES / 10;
+
+        log_info("/* %s */", __func__);
+
+        /* Every message is posted back to the main loop once it is done */
+        reset_counters(2 * N_WORKERS * n);
+
+        assert_se(sd_event_new(&main_event) >= 0);
+        assert_se(event_mailbox_new(main_event, &main_mailbox) >= 0);
+
+        assert_se(event_worker_pool_new(N_WORKERS, &p) >= 0);
+        assert_se(event_worker_pool_size(p) == N_WORKERS);
+
+        for (j = 0; j < n; j++)
+                for (i = 0; i < N_WORKERS; i++) {
+                        assert_se(event_worker_pool_post(p, i, pinned_handler, count_destroy, MESSAGE(i, j)) >= 0);
+                        assert_se(event_worker_pool_post(p, EVENT_WORKER_ANY, any_handler, count_destroy, MESSAGE(i, j)) >= 0);
+                }
+
+        assert_se(sd_event_loop(main_event) >= 0);
+
+        p = event_worker_pool_free(p);
+
+        assert_se(n_handled == 2 * N_WORKERS * n);
+        assert_se(n_destroyed == 2 * 2 * N_WORKERS * n);
+        for (i = 0; i < N_WORKERS; i++)
+                assert_se(last_seq[i] == n);
+
+        event_mailbox_close(main_mailbox);
+        main_mailbox = event_mailbox_unref(main_mailbox);
+        main_event = sd_event_unref(main_event);
+}
+
+static void slow_handler(void *userdata) {
+        (void) usleep(100);
+        __sync_fetch_and_add(&n_handled, 1);
+}
+
+static void test_worker_pool_teardown(void) {
+        EventWorkerPool *p;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        reset_counters(0);
+
+        /* Going away with lots of work still queued must neither lose nor leak anything */
+        assert_se(event_worker_pool_new(0, &p) >= 0);
+
+        for (i = 0; i < N_MESSAGES / 10; i++)
+                assert_se(event_worker_pool_post(p, i % 3 == 0 ? i % event_worker_pool_size(p) : EVENT_WORKER_ANY,
+                                                 slow_handler, count_destroy, NULL) >= 0);
+
+        event_worker_pool_free(p);
+
+        log_info("Handled %u of %u messages.", n_handled, N_MESSAGES / 10);
+        assert_se(n_destroyed == N_MESSAGES / 10);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        main_thread = pthread_self();
+
+        test_mailbox_order();
+        test_mailbox_teardown();
+        test_worker_pool();
+        test_worker_pool_teardown();
+
+        return 0;
+}
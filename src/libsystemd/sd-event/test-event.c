@@ -5,7 +5,9 @@
 #include "sd-event.h"
 
 #include "alloc-util.h"
+#include "event-util.h"
 #include "fd-util.h"
+#include "fileio.h"
 #include "fs-util.h"
 #include "log.h"
 #include "macro.h"
@@ -590,6 +592,183 @@ static void test_pidfd(void) {
         sd_event_unref(e);
 }
 
+static unsigned n_timers_fired = 0;
+
+static int many_timers_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        uint64_t n;
+
+        assert_se(sd_event_now(sd_event_source_get_event(s), CLOCK_MONOTONIC, &n) >= 0);
+        assert_se(usec <= n);
+
+        /* Only the timers that were moved close get here */
+        assert_se(PTR_TO_UINT(userdata) % 100 == 0);
+
+        n_timers_fired++;
+        return 0;
+}
+
+static void test_many_timers(bool with_wheel) {
+        _cleanup_free_ sd_event_source **sources = NULL;
+        sd_event *e = NULL;
+        usec_t ts, spent;
+        unsigned i, j, n = 100000;
+        uint64_t t;
+
+        log_info("/* %s(%s) */", __func__, yes_no(with_wheel));
+
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", yes_no(with_wheel), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sources = new(sd_event_source*, n));
+
+        srand(0);
+        assert_se(sd_event_now(e, CLOCK_MONOTONIC, &t) >= 0);
+
+        for (i = 0; i < n; i++)
+                assert_se(sd_event_add_time(e, &sources[i], CLOCK_MONOTONIC, t + USEC_PER_HOUR + rand() % USEC_PER_HOUR, 0,
+                                            many_timers_handler, UINT_TO_PTR(i)) >= 0);
+
+        /* Rearming timers all the time without anything elapsing is the common case, e.g. for idle
+         * timeouts that are pushed out whenever there is traffic, i.e. behind most of the others */
+        ts = now(CLOCK_MONOTONIC);
+        for (j = 0; j < 10; j++)
+                for (i = 0; i < n; i++)
+                        assert_se(sd_event_source_set_time(sources[i], t + USEC_PER_HOUR + (j + 1) * USEC_PER_MINUTE + i) >= 0);
+        spent = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("%u timers: %.1f ns per rearm", n, (double) spent * NSEC_PER_USEC / (10 * n));
+
+        /* Now move every 100th close, and turn some off again, so that exactly these elapse */
+        for (i = 0; i < n; i += 100) {
+                assert_se(sd_event_source_set_time(sources[i], t + rand() % (10 * USEC_PER_MSEC)) >= 0);
+                assert_se(sd_event_source_set_time_accuracy(sources[i], 1) >= 0);
+        }
+        for (i = 1; i < n; i += 1000)
+                assert_se(sd_event_source_set_enabled(sources[i], SD_EVENT_OFF) >= 0);
+
+        n_timers_fired = 0;
+        while (n_timers_fired < n / 100)
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+
+        assert_se(sd_event_run(e, 10 * USEC_PER_MSEC) == 0);
+        assert_se(n_timers_fired == n / 100);
+
+        /* The elapsed ones are off now, turning them on again makes them elapse right away */
+        for (i = 0; i < n; i += 1000)
+                assert_se(sd_event_source_set_enabled(sources[i], SD_EVENT_ONESHOT) >= 0);
+        while (n_timers_fired < n / 100 + n / 1000)
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+
+        for (i = 0; i < n; i++)
+                sd_event_source_unref(sources[i]);
+
+        sd_event_unref(e);
+        assert_se(unsetenv("SD_EVENT_TIMER_WHEEL") >= 0);
+}
+
+static int slow_handler(sd_event_source *s, void *userdata) {
+        (void) usleep(2 * USEC_PER_MSEC);
+        return 0;
+}
+
+static int rename_handler(sd_event_source *s, void *userdata) {
+        /* What comes after this is accounted for under the new name */
+        assert_se(sd_event_source_set_description(s, "renamed") >= 0);
+        return 0;
+}
+
+static void test_profiling(void) {
+        _cleanup_free_ EventSourceProfile **profiles = NULL;
+        _cleanup_free_ char *dump = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        sd_event_source *slow, *unnamed, *s;
+        uint64_t n, total, max;
+        sd_event *e = NULL;
+        size_t n_profiles;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_get_profiling(e) == 0);
+
+        /* Everything is oneshot, so that each iteration dispatches what was just turned on */
+        assert_se(sd_event_add_defer(e, &slow, slow_handler, NULL) >= 0);
+        assert_se(sd_event_source_set_description(slow, "slow") >= 0);
+
+        /* Nothing is accounted for while this is off */
+        assert_se(sd_event_run(e, 0) > 0);
+        assert_se(sd_event_get_source_profile(e, "slow", NULL, NULL, NULL) == -ENXIO);
+
+        assert_se(sd_event_set_profiling(e, true) >= 0);
+        assert_se(sd_event_get_profiling(e) > 0);
+
+        for (i = 0; i < 3; i++) {
+                assert_se(sd_event_source_set_enabled(slow, SD_EVENT_ONESHOT) >= 0);
+                assert_se(sd_event_run(e, 0) > 0);
+        }
+
+        for (i = 0; i < 2; i++) {
+                assert_se(sd_event_add_defer(e, &s, slow_handler, NULL) >= 0);
+                assert_se(sd_event_source_set_description(s, "shared") >= 0);
+                assert_se(sd_event_source_set_floating(s, true) >= 0);
+                sd_event_source_unref(s);
+        }
+        for (i = 0; i < 2; i++)
+                assert_se(sd_event_run(e, 0) > 0);
+
+        assert_se(sd_event_add_defer(e, &unnamed, rename_handler, NULL) >= 0);
+        assert_se(sd_event_run(e, 0) > 0);
+        assert_se(sd_event_source_set_enabled(unnamed, SD_EVENT_ONESHOT) >= 0);
+        assert_se(sd_event_run(e, 0) > 0);
+
+        assert_se(sd_event_set_profiling(e, false) >= 0);
+        assert_se(sd_event_source_set_enabled(slow, SD_EVENT_ONESHOT) >= 0);
+        assert_se(sd_event_run(e, 0) > 0);
+
+        assert_se(sd_event_get_source_profile(e, "slow", &n, &total, &max) >= 0);
+        assert_se(n == 3);
+        assert_se(max >= 2 * USEC_PER_MSEC);
+        assert_se(total >= 3 * 2 * USEC_PER_MSEC && total >= max);
+
+        assert_se(sd_event_get_source_profile(e, "shared", &n, &total, &max) >= 0);
+        assert_se(n == 2);
+        assert_se(total >= 2 * 2 * USEC_PER_MSEC);
+
+        assert_se(sd_event_get_source_profile(e, "(defer)", &n, NULL, NULL) >= 0);
+        assert_se(n == 1);
+        assert_se(sd_event_get_source_profile(e, "renamed", &n, NULL, NULL) >= 0);
+        assert_se(n == 1);
+        assert_se(sd_event_get_source_profile(e, "nothing", NULL, NULL, NULL) == -ENXIO);
+
+        /* The most expensive one comes first */
+        assert_se(event_get_source_profiles(e, &profiles, &n_profiles) >= 0);
+        assert_se(n_profiles == 4);
+        assert_se(streq(profiles[0]->description, "slow"));
+        for (i = 1; i < n_profiles; i++)
+                assert_se(profiles[i - 1]->total_usec >= profiles[i]->total_usec);
+
+        /* Every dispatch has a latency */
+        for (i = 0, n = 0; i < ELEMENTSOF(profiles[0]->latency); i++)
+                n += profiles[0]->latency[i];
+        assert_se(n == 3);
+
+        /* Nothing to dump when off */
+        assert_se(f = open_memstream_unlocked(&dump, &n_profiles));
+        event_dump_source_profiles(e, f, "\t");
+        assert_se(fflush_and_check(f) >= 0);
+        assert_se(isempty(dump));
+
+        assert_se(sd_event_set_profiling(e, true) >= 0);
+        event_dump_source_profiles(e, f, "\t");
+        assert_se(fflush_and_check(f) >= 0);
+        log_info("Profile:\n%s", dump);
+        assert_se(startswith(dump, "\tEvent source slow: 3 dispatches"));
+
+        sd_event_source_unref(slow);
+        sd_event_source_unref(unnamed);
+        sd_event_unref(e);
+}
+
 int main(int argc, char *argv[]) {
         test_setup_logging(LOG_INFO);
 
@@ -604,5 +783,10 @@ int main(int argc, char *argv[]) {
 
         test_pidfd();
 
+        test_many_timers(false);
+        test_many_timers(true);
+
+        test_profiling();
+
         return 0;
 }
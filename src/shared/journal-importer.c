@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 #include "alloc-util.h"
+#include "compress.h"
 #include "errno-util.h"
 #include "escape.h"
 #include "fd-util.h"
@@ -20,6 +21,8 @@ enum {
         IMPORTER_STATE_DATA_START,  /* reading binary data header */
         IMPORTER_STATE_DATA,        /* reading binary data */
         IMPORTER_STATE_DATA_FINISH, /* expecting newline */
+        IMPORTER_STATE_FRAME_START, /* reading binary frame header */
+        IMPORTER_STATE_FRAME,       /* reading binary frame payload */
         IMPORTER_STATE_EOF,         /* done */
 };
 
@@ -31,6 +34,7 @@ void journal_importer_cleanup(JournalImporter *imp) {
 
         free(imp->name);
         free(imp->buf);
+        free(imp->batch);
         iovw_free_contents(&imp->iovw, false);
 }
 
@@ -113,8 +117,9 @@ static int get_line(JournalImporter *imp, char **line, size_t *size) {
 static int fill_fixed_size(JournalImporter *imp, void **data, size_t size) {
 
         assert(imp);
-        assert(IN_SET(imp->state, IMPORTER_STATE_DATA_START, IMPORTER_STATE_DATA, IMPORTER_STATE_DATA_FINISH));
-        assert(size <= DATA_SIZE_MAX);
+        assert(IN_SET(imp->state, IMPORTER_STATE_DATA_START, IMPORTER_STATE_DATA, IMPORTER_STATE_DATA_FINISH,
+                      IMPORTER_STATE_FRAME_START, IMPORTER_STATE_FRAME));
+        assert(size <= ENTRY_SIZE_MAX);
         assert(imp->offset <= imp->filled);
         assert(imp->filled <= imp->size);
         assert(imp->buf || imp->size == 0);
@@ -280,7 +285,7 @@ static int process_special_field(JournalImporter *imp, char *line) {
         return 0;
 }
 
-int journal_importer_process_data(JournalImporter *imp) {
+static int process_data_one(JournalImporter *imp) {
         int r;
 
         switch(imp->state) {
@@ -326,9 +331,13 @@ int journal_importer_process_data(JournalImporter *imp) {
                         }
 
                         line[n] = '\0';
-                        r = process_special_field(imp, line);
-                        if (r != 0)
-                                return r < 0 ? r : 0;
+
+                        /* All special fields start with an underscore, don't bother checking the others */
+                        if (line[0] == '_') {
+                                r = process_special_field(imp, line);
+                                if (r != 0)
+                                        return r < 0 ? r : 0;
+                        }
 
                         r = iovw_put(&imp->iovw, line, n);
                         if (r < 0)
@@ -413,6 +422,217 @@ int journal_importer_process_data(JournalImporter *imp) {
         }
 }
 
+static int import_binary_entry(JournalImporter *imp, const char *p, size_t size) {
+        JournalBinaryEntryHeader h;
+        uint64_t x;
+        int r;
+
+        assert(imp);
+        assert(p);
+
+        if (size < sizeof(h))
+                return log_error_errno(SYNTHETIC_ERRNO(EBADMSG), "Binary entry too short.");
+
+        memcpy(&h, p, sizeof(h));
+        p += sizeof(h);
+        size -= sizeof(h);
+
+        x = le64toh(h.realtime);
+        if (!VALID_REALTIME(x)) {
+                log_warning("Realtime timestamp out of range, ignoring: %"PRIu64, x);
+                return -ERANGE;
+        }
+        imp->ts.realtime = x;
+
+        x = le64toh(h.monotonic);
+        if (!VALID_MONOTONIC(x)) {
+                log_warning("Monotonic timestamp out of range, ignoring: %"PRIu64, x);
+                return -ERANGE;
+        }
+        imp->ts.monotonic = x;
+
+        imp->boot_id = h.boot_id;
+
+        /* The fields are used right where they are, without copying */
+        while (size > 0) {
+                const char *sep;
+                uint64_t l;
+
+                if (size < sizeof(uint64_t))
+                        return log_error_errno(SYNTHETIC_ERRNO(EBADMSG), "Truncated field in binary entry.");
+
+                l = unaligned_read_le64(p);
+                p += sizeof(uint64_t);
+                size -= sizeof(uint64_t);
+
+                if (l > size)
+                        return log_error_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Field of %"PRIu64" bytes exceeds binary entry.", l);
+
+                sep = memchr(p, '=', l);
+                if (sep && journal_field_valid(p, sep - p, true)) {
+                        if (imp->iovw.count >= ENTRY_FIELD_COUNT_MAX) {
+                                /* The rest of the frame is skipped, so don't leave half an entry behind */
+                                iovw_free_contents(&imp->iovw, false);
+                                return log_error_errno(SYNTHETIC_ERRNO(E2BIG),
+                                                       "Binary entry has more than " STRINGIFY(ENTRY_FIELD_COUNT_MAX) " fields.");
+                        }
+
+                        r = iovw_put(&imp->iovw, (char*) p, l);
+                        if (r < 0)
+                                return r;
+                } else
+                        log_debug("Ignoring invalid field in binary entry.");
+
+                p += l;
+                size -= l;
+        }
+
+        log_trace("Received binary entry with %zu fields", imp->iovw.count);
+        return 1;
+}
+
+static int import_batch_entry(JournalImporter *imp) {
+        JournalBinaryFrameHeader h;
+        const char *p;
+        uint64_t size;
+        size_t left;
+
+        assert(imp);
+        assert(imp->batch_offset < imp->batch_size);
+
+        p = (const char*) imp->batch + imp->batch_offset;
+        left = imp->batch_size - imp->batch_offset;
+
+        if (left < sizeof(h))
+                goto invalid;
+
+        memcpy(&h, p, sizeof(h));
+        size = le64toh(h.size);
+        if (h.type != JOURNAL_BINARY_FRAME_ENTRY || size > left - sizeof(h))
+                goto invalid;
+
+        imp->batch_offset += sizeof(h) + size;
+
+        return import_binary_entry(imp, p + sizeof(h), size);
+
+invalid:
+        /* Don't look at the rest of the batch anymore */
+        imp->batch_offset = imp->batch_size;
+        return log_error_errno(SYNTHETIC_ERRNO(EBADMSG), "Invalid frame in batch.");
+}
+
+static int process_binary_one(JournalImporter *imp) {
+        void *data;
+        int r;
+
+        /* Whatever is left of the last batch comes first */
+        if (imp->batch_offset < imp->batch_size)
+                return import_batch_entry(imp);
+
+        /* Nothing is read yet, we start out as if we were looking for a line */
+        if (imp->state == IMPORTER_STATE_LINE)
+                imp->state = IMPORTER_STATE_FRAME_START;
+
+        switch (imp->state) {
+
+        case IMPORTER_STATE_FRAME_START: {
+                JournalBinaryFrameHeader h;
+                uint64_t size;
+
+                assert(imp->data_size == 0);
+
+                r = fill_fixed_size(imp, &data, sizeof(h));
+                if (r < 0)
+                        return r;
+                if (r == 0) {
+                        imp->state = IMPORTER_STATE_EOF;
+                        return 0;
+                }
+
+                memcpy(&h, data, sizeof(h));
+                size = le64toh(h.size);
+
+                switch (h.type) {
+
+                case JOURNAL_BINARY_FRAME_ENTRY:
+                        if (size > ENTRY_SIZE_MAX)
+                                return log_error_errno(SYNTHETIC_ERRNO(ENOBUFS),
+                                                       "Entry is bigger than %u bytes.", ENTRY_SIZE_MAX);
+                        break;
+
+                case JOURNAL_BINARY_FRAME_BATCH:
+                        if (size > JOURNAL_BINARY_BATCH_MAX)
+                                return log_error_errno(SYNTHETIC_ERRNO(ENOBUFS),
+                                                       "Batch is bigger than %u bytes.", JOURNAL_BINARY_BATCH_MAX);
+                        break;
+
+                default:
+                        return log_error_errno(SYNTHETIC_ERRNO(EBADMSG),
+                                               "Unknown binary frame type %u.", h.type);
+                }
+
+                imp->frame_type = h.type;
+                imp->frame_compression = h.compression;
+                imp->data_size = size;
+                imp->state = IMPORTER_STATE_FRAME;
+
+                return 0; /* continue */
+        }
+
+        case IMPORTER_STATE_FRAME: {
+                size_t size = imp->data_size;
+
+                r = fill_fixed_size(imp, &data, size);
+                if (r < 0)
+                        return r;
+                if (r == 0) {
+                        imp->state = IMPORTER_STATE_EOF;
+                        return 0;
+                }
+
+                imp->data_size = 0;
+                imp->state = IMPORTER_STATE_FRAME_START;
+
+                if (imp->frame_type == JOURNAL_BINARY_FRAME_ENTRY)
+                        return import_binary_entry(imp, data, size);
+
+                r = decompress_blob(imp->frame_compression, data, size,
+                                    &imp->batch, &imp->batch_allocated, &imp->batch_size,
+                                    JOURNAL_BINARY_BATCH_MAX);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to decompress batch of %zu bytes: %m", size);
+
+                imp->batch_offset = 0;
+
+                return 0; /* continue */
+        }
+
+        default:
+                assert_not_reached("wtf?");
+        }
+}
+
+int journal_importer_process_data(JournalImporter *imp) {
+        int (*process_one)(JournalImporter *imp);
+        int r;
+
+        assert(imp);
+
+        /* Works through as much of the buffered (or readable) data as needed to assemble one full entry, so
+         * that callers only hear back from us once per entry instead of once per field. Returns 1 when an
+         * entry is ready, 0 on EOF, and negative on errors, including -EAGAIN when a passive importer needs
+         * more data to be pushed to it. */
+
+        process_one = imp->binary ? process_binary_one : process_data_one;
+
+        do
+                r = process_one(imp);
+        while (r == 0 && imp->state != IMPORTER_STATE_EOF);
+
+        return r;
+}
+
 int journal_importer_push_data(JournalImporter *imp, const char *data, size_t size) {
         assert(imp);
         assert(imp->state != IMPORTER_STATE_EOF);
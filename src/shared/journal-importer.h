@@ -9,6 +9,8 @@
 #include "sd-id128.h"
 
 #include "io-util.h"
+#include "macro.h"
+#include "sparse-endian.h"
 #include "time-util.h"
 
 /* Make sure not to make this smaller than the maximum coredump size.
@@ -25,9 +27,40 @@
 /* The maximum number of fields in an entry */
 #define ENTRY_FIELD_COUNT_MAX 1024
 
+/* Besides the textual export format, entries may be transferred in a binary format, which is cheaper to
+ * generate and can be parsed without looking at every byte. The stream is a sequence of frames, each
+ * starting with a JournalBinaryFrameHeader:
+ *
+ *   JOURNAL_BINARY_FRAME_ENTRY: a JournalBinaryEntryHeader, followed by the fields, each a little endian
+ *                               64bit length followed by "FIELD=value" of that length.
+ *   JOURNAL_BINARY_FRAME_BATCH: a sequence of entry frames, compressed with the algorithm specified in the
+ *                               header, as an OBJECT_COMPRESSED_* flag. At most JOURNAL_BINARY_BATCH_MAX
+ *                               bytes when decompressed. */
+#define JOURNAL_BINARY_CONTENT_TYPE "application/vnd.fdo.journal.binary"
+#define JOURNAL_BINARY_BATCH_MAX (4U*1024U*1024U)
+
+enum {
+        JOURNAL_BINARY_FRAME_ENTRY = 1,
+        JOURNAL_BINARY_FRAME_BATCH = 2,
+};
+
+typedef struct JournalBinaryFrameHeader {
+        le64_t size;            /* of the payload following the header */
+        uint8_t type;
+        uint8_t compression;
+        uint8_t reserved[6];
+} _packed_ JournalBinaryFrameHeader;
+
+typedef struct JournalBinaryEntryHeader {
+        le64_t realtime;
+        le64_t monotonic;
+        sd_id128_t boot_id;
+} _packed_ JournalBinaryEntryHeader;
+
 typedef struct JournalImporter {
         int fd;
         bool passive_fd;
+        bool binary;       /* expect the binary format rather than the export format */
         char *name;
 
         char *buf;
@@ -39,6 +72,14 @@ typedef struct JournalImporter {
         size_t field_len;  /* used for binary fields: the field name length */
         size_t data_size;  /* and the size of the binary data chunk being processed */
 
+        uint8_t frame_type;        /* used for binary frames: the type of frame being read */
+        uint8_t frame_compression; /* and how it is compressed */
+
+        void *batch;       /* decompressed batch of binary entries */
+        size_t batch_allocated;
+        size_t batch_size;
+        size_t batch_offset;
+
         struct iovec_wrapper iovw;
 
         int state;
@@ -93,7 +93,7 @@ int journal_access_check_and_warn(sd_journal *j, bool quiet, bool want_other_use
         assert(j);
 
         if (hashmap_isempty(j->errors)) {
-                if (ordered_hashmap_isempty(j->files) && !quiet)
+                if (!journal_has_files(j) && !quiet)
                         log_notice("No journal files were found.");
 
                 return 0;
@@ -103,7 +103,7 @@ int journal_access_check_and_warn(sd_journal *j, bool quiet, bool want_other_use
                 if (!quiet)
                         (void) access_check_var_log_journal(j, want_other_users);
 
-                if (ordered_hashmap_isempty(j->files))
+                if (!journal_has_files(j))
                         r = log_error_errno(EACCES, "No journal files were opened due to insufficient permissions.");
         }
 
@@ -175,6 +175,7 @@ typedef enum JsonFormatFlags {
 
 int json_variant_format(JsonVariant *v, JsonFormatFlags flags, char **ret);
 void json_variant_dump(JsonVariant *v, JsonFormatFlags flags, FILE *f, const char *prefix);
+void json_format_string(FILE *f, const char *s, size_t n, JsonFormatFlags flags);
 
 int json_variant_filter(JsonVariant **v, char **to_remove);
 
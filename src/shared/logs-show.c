@@ -13,6 +13,7 @@
 #include "sd-journal.h"
 
 #include "alloc-util.h"
+#include "escape.h"
 #include "fd-util.h"
 #include "format-util.h"
 #include "hashmap.h"
@@ -31,6 +32,7 @@
 #include "parse-util.h"
 #include "pretty-print.h"
 #include "process-util.h"
+#include "sort-util.h"
 #include "sparse-endian.h"
 #include "stdio-util.h"
 #include "string-table.h"
@@ -230,8 +232,7 @@ static bool print_multiline(
                 bool continuation = line > 0;
                 bool tail_line;
                 int len;
-                for (end = pos; end < message + message_len && *end != '\n'; end++)
-                        ;
+                end = memchr(pos, '\n', message + message_len - pos) ?: message + message_len;
                 len = end - pos;
                 assert(len >= 0);
 
@@ -851,6 +852,16 @@ void json_escape(
                 fputc('"', f);
 
                 while (l > 0) {
+                        size_t n;
+
+                        /* Write out everything that needs no escaping in one go */
+                        n = escape_span(p, l, "\"\\", true);
+                        fwrite(p, 1, n, f);
+                        p += n;
+                        l -= n;
+                        if (l == 0)
+                                break;
+
                         if (IN_SET(*p, '"', '\\')) {
                                 fputc('\\', f);
                                 fputc(*p, f);
@@ -959,6 +970,228 @@ static int update_json_data_split(
         return update_json_data(h, flags, name, eq + 1, size - (eq - (const char*) data) - 1);
 }
 
+typedef struct JsonField {
+        const char *data;       /* "NAME=value", once all fields are collected */
+        size_t offset;
+        size_t name_len;
+        size_t size;            /* of the value */
+        size_t index;
+} JsonField;
+
+typedef struct JsonFields {
+        char *buffer;
+        size_t buffer_used, buffer_allocated;
+        JsonField *fields;
+        size_t n_fields, n_allocated;
+} JsonFields;
+
+static void json_fields_done(JsonFields *j) {
+        assert(j);
+
+        free(j->buffer);
+        free(j->fields);
+}
+
+static int json_fields_add(JsonFields *j, const char *name, size_t name_len, const void *value, size_t size) {
+        char *p;
+
+        assert(j);
+        assert(name);
+        assert(value || size == 0);
+
+        /* The data returned by sd_journal_enumerate_data() is only valid until the next call, hence copy
+         * it. Entries are collected into one buffer, that is only rarely grown. */
+        if (!GREEDY_REALLOC(j->buffer, j->buffer_allocated, MAX(j->buffer_used + name_len + 1 + size, 4096U)))
+                return log_oom();
+        if (!GREEDY_REALLOC(j->fields, j->n_allocated, MAX(j->n_fields + 1, 64U)))
+                return log_oom();
+
+        p = mempcpy(j->buffer + j->buffer_used, name, name_len);
+        *(p++) = '=';
+        memcpy_safe(p, value, size);
+
+        j->fields[j->n_fields] = (JsonField) {
+                .offset = j->buffer_used,
+                .name_len = name_len,
+                .size = size,
+                .index = j->n_fields,
+        };
+
+        j->buffer_used += name_len + 1 + size;
+        j->n_fields++;
+
+        return 0;
+}
+
+static int json_field_compare(const JsonField *a, const JsonField *b) {
+        int r;
+
+        r = memcmp(a->data, b->data, MIN(a->name_len, b->name_len));
+        if (r != 0)
+                return r;
+
+        r = CMP(a->name_len, b->name_len);
+        if (r != 0)
+                return r;
+
+        /* Keep multiple values of the same field in the order they were logged in */
+        return CMP(a->index, b->index);
+}
+
+static bool json_field_same_name(const JsonField *a, const JsonField *b) {
+        return a->name_len == b->name_len && memcmp(a->data, b->data, a->name_len) == 0;
+}
+
+static void json_field_write_value(FILE *f, OutputFlags flags, const JsonField *field) {
+        const char *value;
+        size_t i;
+
+        value = field->data + field->name_len + 1;
+
+        /* Same as update_json_data() */
+        if (!(flags & OUTPUT_SHOW_ALL) && field->name_len + 1 + field->size >= JSON_THRESHOLD)
+                fputs("null", f);
+        else if (utf8_is_printable(value, field->size))
+                json_format_string(f, value, field->size, 0);
+        else {
+                fputc('[', f);
+                for (i = 0; i < field->size; i++)
+                        fprintf(f, i > 0 ? ",%u" : "%u", (uint8_t) value[i]);
+                fputc(']', f);
+        }
+}
+
+/* Writes the entry right away, without building a JsonVariant object first. That's a lot cheaper, as it
+ * doesn't need to allocate anything per field, and is used whenever the output is not meant for humans
+ * anyway, i.e. is neither pretty printed nor colored. The output is the same as json_variant_dump() would
+ * generate, except that fields are ordered by name. */
+static int output_json_stream(
+                FILE *f,
+                sd_journal *j,
+                OutputMode mode,
+                OutputFlags flags,
+                const Set *output_fields) {
+
+        char sid[SD_ID128_STRING_MAX], usecbuf[DECIMAL_STR_MAX(usec_t)];
+        _cleanup_(json_fields_done) JsonFields fields = {};
+        _cleanup_free_ char *cursor = NULL;
+        uint64_t realtime, monotonic;
+        sd_id128_t boot_id;
+        size_t i, k;
+        int r;
+
+        assert(j);
+
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(j, &monotonic, &boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        r = sd_journal_get_cursor(j, &cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get cursor: %m");
+
+        r = json_fields_add(&fields, "__CURSOR", STRLEN("__CURSOR"), cursor, strlen(cursor));
+        if (r < 0)
+                return r;
+
+        xsprintf(usecbuf, USEC_FMT, realtime);
+        r = json_fields_add(&fields, "__REALTIME_TIMESTAMP", STRLEN("__REALTIME_TIMESTAMP"), usecbuf, strlen(usecbuf));
+        if (r < 0)
+                return r;
+
+        xsprintf(usecbuf, USEC_FMT, monotonic);
+        r = json_fields_add(&fields, "__MONOTONIC_TIMESTAMP", STRLEN("__MONOTONIC_TIMESTAMP"), usecbuf, strlen(usecbuf));
+        if (r < 0)
+                return r;
+
+        sd_id128_to_string(boot_id, sid);
+        r = json_fields_add(&fields, "_BOOT_ID", STRLEN("_BOOT_ID"), sid, strlen(sid));
+        if (r < 0)
+                return r;
+
+        for (;;) {
+                const void *data;
+                const char *eq;
+                size_t size;
+
+                r = sd_journal_enumerate_data(j, &data, &size);
+                if (r == -EBADMSG) {
+                        log_debug_errno(r, "Skipping message we can't read: %m");
+                        return 0;
+                }
+                if (r < 0)
+                        return log_error_errno(r, "Failed to read journal: %m");
+                if (r == 0)
+                        break;
+
+                /* Same as update_json_data_split() */
+                if (memory_startswith(data, size, "_BOOT_ID="))
+                        continue;
+
+                eq = memchr(data, '=', MIN(size, JSON_THRESHOLD));
+                if (!eq || eq == data)
+                        continue;
+
+                if (output_fields && !set_contains(output_fields, strndupa(data, eq - (const char*) data)))
+                        continue;
+
+                r = json_fields_add(&fields, data, eq - (const char*) data, eq + 1, size - (eq - (const char*) data) - 1);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < fields.n_fields; i++)
+                fields.fields[i].data = fields.buffer + fields.fields[i].offset;
+
+        /* Sorting brings multiple values of the same field next to each other */
+        typesafe_qsort(fields.fields, fields.n_fields, json_field_compare);
+
+        if (mode == OUTPUT_JSON_SSE)
+                fputs("data: ", f);
+        if (mode == OUTPUT_JSON_SEQ)
+                fputc('\x1e', f); /* ASCII Record Separator */
+
+        fputc('{', f);
+
+        for (i = 0; i < fields.n_fields; i = k) {
+                const JsonField *field = fields.fields + i;
+
+                for (k = i + 1; k < fields.n_fields && json_field_same_name(field, fields.fields + k); k++)
+                        ;
+
+                if (i > 0)
+                        fputc(',', f);
+
+                json_format_string(f, field->data, field->name_len, 0);
+                fputc(':', f);
+
+                if (k == i + 1)
+                        json_field_write_value(f, flags, field);
+                else {
+                        size_t l;
+
+                        fputc('[', f);
+                        for (l = i; l < k; l++) {
+                                if (l > i)
+                                        fputc(',', f);
+                                json_field_write_value(f, flags, fields.fields + l);
+                        }
+                        fputc(']', f);
+                }
+        }
+
+        fputs("}\n", f);
+
+        if (mode == OUTPUT_JSON_SSE)
+                fputc('\n', f);
+
+        return 0;
+}
+
 static int output_json(
                 FILE *f,
                 sd_journal *j,
@@ -984,6 +1217,9 @@ static int output_json(
 
         (void) sd_journal_set_data_threshold(j, flags & OUTPUT_SHOW_ALL ? 0 : JSON_THRESHOLD);
 
+        if (mode != OUTPUT_JSON_PRETTY && !FLAGS_SET(flags, OUTPUT_COLOR))
+                return output_json_stream(f, j, mode, flags, output_fields);
+
         r = sd_journal_get_realtime_usec(j, &realtime);
         if (r < 0)
                 return log_error_errno(r, "Failed to get realtime timestamp: %m");
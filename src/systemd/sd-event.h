@@ -112,6 +112,9 @@ int sd_event_get_exit_code(sd_event *e, int *code);
 int sd_event_set_watchdog(sd_event *e, int b);
 int sd_event_get_watchdog(sd_event *e);
 int sd_event_get_iteration(sd_event *e, uint64_t *ret);
+int sd_event_set_profiling(sd_event *e, int b);
+int sd_event_get_profiling(sd_event *e);
+int sd_event_get_source_profile(sd_event *e, const char *description, uint64_t *ret_n_dispatched, uint64_t *ret_total_usec, uint64_t *ret_max_usec);
 
 sd_event_source* sd_event_source_ref(sd_event_source *s);
 sd_event_source* sd_event_source_unref(sd_event_source *s);
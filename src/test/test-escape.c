@@ -3,7 +3,9 @@
 #include "alloc-util.h"
 #include "escape.h"
 #include "macro.h"
+#include "random-util.h"
 #include "tests.h"
+#include "time-util.h"
 
 static void test_cescape(void) {
         _cleanup_free_ char *t;
@@ -12,6 +14,83 @@ static void test_cescape(void) {
         assert_se(streq(t, "abc\\\\\\\"\\b\\f\\n\\r\\t\\v\\a\\003\\177\\234\\313"));
 }
 
+static void test_escape_span(void) {
+        char buf[64];
+        size_t i, j;
+
+        assert_se(escape_span("", 0, "", false) == 0);
+        assert_se(escape_span("abc", 3, "", false) == 3);
+        assert_se(escape_span("abc\"def", 7, "\"", false) == 3);
+        assert_se(escape_span("abc\"def", 7, "", false) == 7);
+        assert_se(escape_span("ab\177c", 4, "", true) == 2);
+        assert_se(escape_span("abąc", 5, "", false) == 2);
+        assert_se(escape_span("abąc", 5, "", true) == 5);
+
+        /* Every position relative to every alignment */
+        for (i = 0; i < 32; i++)
+                for (j = 0; j < 32; j++) {
+                        memset(buf, 'x', sizeof(buf));
+                        buf[i + j] = "\n\\\177\200"[j % 4];
+
+                        assert_se(escape_span(buf + i, sizeof(buf) - i, "\\", false) == j);
+                        assert_se(escape_span(buf + i, sizeof(buf) - i, "\\", true) == (j % 4 == 3 ? sizeof(buf) - i : j));
+                }
+}
+
+static void test_cescape_random(void) {
+        static const char chars[] = "abc \"\\'\n\t\001\177\200\377";
+        char buf[128], expected[sizeof(buf) * 4 + 1];
+        unsigned k;
+
+        /* Compare with escaping one character at a time */
+        for (k = 0; k < 1000; k++) {
+                _cleanup_free_ char *t = NULL;
+                size_t i;
+                char *e;
+
+                for (i = 0; i < sizeof(buf); i++)
+                        buf[i] = random_u32() % 4 != 0 ? 'x' : chars[random_u32() % (sizeof(chars) - 1)];
+
+                for (i = 0, e = expected; i < sizeof(buf); i++)
+                        e += cescape_char(buf[i], e);
+                *e = 0;
+
+                assert_se(t = cescape_length(buf, sizeof(buf)));
+                assert_se(streq(t, expected));
+        }
+}
+
+static void test_cescape_benchmark(void) {
+        _cleanup_free_ char *text = NULL, *escaped = NULL, *t = NULL;
+        char span1[FORMAT_TIMESPAN_MAX], span2[FORMAT_TIMESPAN_MAX];
+        size_t i, size = 4 * 1024 * 1024;
+        usec_t ts, ts_reference;
+        char *e;
+
+        assert_se(text = new(char, size));
+        for (i = 0; i < size; i++)
+                text[i] = i % 81 == 80 ? '\n' : 'a' + i % 26;
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(t = cescape_length(text, size));
+        ts = now(CLOCK_MONOTONIC) - ts;
+
+        assert_se(escaped = new(char, size * 4 + 1));
+
+        ts_reference = now(CLOCK_MONOTONIC);
+        for (i = 0, e = escaped; i < size; i++)
+                e += cescape_char(text[i], e);
+        *e = 0;
+        ts_reference = now(CLOCK_MONOTONIC) - ts_reference;
+
+        assert_se(streq(t, escaped));
+
+        log_info("cescape() of %zu bytes of text: %s, character by character: %s",
+                 size,
+                 format_timespan(span1, sizeof(span1), ts, 1),
+                 format_timespan(span2, sizeof(span2), ts_reference, 1));
+}
+
 static void test_xescape(void) {
         _cleanup_free_ char *t;
 
@@ -185,6 +264,9 @@ int main(int argc, char *argv[]) {
         test_setup_logging(LOG_DEBUG);
 
         test_cescape();
+        test_escape_span();
+        test_cescape_random();
+        test_cescape_benchmark();
         test_xescape();
         test_xescape_full(false);
         test_xescape_full(true);
@@ -3,13 +3,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "alloc-util.h"
+#include "compress.h"
 #include "log.h"
 #include "journal-importer.h"
 #include "path-util.h"
 #include "string-util.h"
 #include "tests.h"
+#include "unaligned.h"
 
 static void assert_iovec_entry(const struct iovec *iovec, const char* content) {
         assert_se(strlen(content) == iovec->iov_len);
@@ -68,11 +71,193 @@ static void test_bad_input(void) {
         assert_se(journal_importer_eof(&imp));
 }
 
+static void test_push_data(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        static const char data[] =
+                "__CURSOR=s=1;i=1\n"
+                "__REALTIME_TIMESTAMP=1478389147837945\n"
+                "MESSAGE=first\n"
+                "BINARY\n"
+                "\x05\0\0\0\0\0\0\0a\nb=c\n"
+                "\n"
+                "MESSAGE=second\n"
+                "\n";
+        size_t i, chunk, n_entries = 0;
+        int r;
+
+        imp.fd = STDIN_FILENO; /* not read from */
+        imp.passive_fd = true;
+
+        /* Pushed in pieces of all sizes, every entry is returned in a single call once complete */
+        for (chunk = 1; chunk <= sizeof(data) - 1; chunk++)
+                for (i = 0; i < sizeof(data) - 1; i += chunk) {
+                        assert_se(journal_importer_push_data(&imp, data + i, MIN(chunk, sizeof(data) - 1 - i)) >= 0);
+
+                        while ((r = journal_importer_process_data(&imp)) == 1) {
+                                if (n_entries++ % 2 == 0) {
+                                        assert_se(imp.iovw.count == 2);
+                                        assert_se(imp.ts.realtime == 1478389147837945);
+                                        assert_iovec_entry(&imp.iovw.iovec[0], "MESSAGE=first");
+                                        assert_se(imp.iovw.iovec[1].iov_len == 12);
+                                        assert_se(memcmp(imp.iovw.iovec[1].iov_base, "BINARY=a\nb=c", 12) == 0);
+                                } else {
+                                        assert_se(imp.iovw.count == 1);
+                                        assert_iovec_entry(&imp.iovw.iovec[0], "MESSAGE=second");
+                                }
+
+                                journal_importer_drop_iovw(&imp);
+                        }
+                        assert_se(r == -EAGAIN);
+                }
+
+        assert_se(n_entries == 2 * (sizeof(data) - 1));
+        assert_se(journal_importer_bytes_remaining(&imp) == 0);
+}
+
+static size_t binary_entry_append(char *p, uint64_t realtime, const char *message) {
+        JournalBinaryFrameHeader h;
+        JournalBinaryEntryHeader e = {
+                .realtime = htole64(realtime),
+                .monotonic = htole64(4711),
+        };
+        static const char bin[] = "BINARY=a\nb\0c";
+        size_t n = sizeof(h);
+
+        memcpy(p + n, &e, sizeof(e));
+        n += sizeof(e);
+
+        unaligned_write_le64(p + n, strlen(message));
+        n += sizeof(uint64_t);
+        n = stpcpy(p + n, message) - p;
+
+        unaligned_write_le64(p + n, sizeof(bin) - 1);
+        n += sizeof(uint64_t);
+        memcpy(p + n, bin, sizeof(bin) - 1);
+        n += sizeof(bin) - 1;
+
+        h = (JournalBinaryFrameHeader) {
+                .size = htole64(n - sizeof(h)),
+                .type = JOURNAL_BINARY_FRAME_ENTRY,
+        };
+        memcpy(p, &h, sizeof(h));
+
+        return n;
+}
+
+static void test_binary(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        char entries[4096], data[8192];
+        size_t i, n = 0, size = 0, n_entries = 0, n_expected = 2;
+        JournalBinaryFrameHeader h;
+        int r;
+
+        imp.fd = STDIN_FILENO; /* not read from */
+        imp.passive_fd = true;
+        imp.binary = true;
+
+        size = binary_entry_append(data, 1478389147837945, "MESSAGE=first");
+        size += binary_entry_append(data + size, 1478389147837946, "MESSAGE=second");
+
+        /* The same entries once more, compressed into a batch, as long as we have some compression */
+        for (i = 0; i < 16; i++)
+                n += binary_entry_append(entries + n, 1478389147837947 + i, "MESSAGE=batched, and some more text to compress");
+
+        r = compress_blob(entries, n, data + size + sizeof(h), sizeof(data) - size - sizeof(h), &n);
+        if (r >= 0) {
+                h = (JournalBinaryFrameHeader) {
+                        .size = htole64(n),
+                        .type = JOURNAL_BINARY_FRAME_BATCH,
+                        .compression = r,
+                };
+                memcpy(data + size, &h, sizeof(h));
+                size += sizeof(h) + n;
+                n_expected += 16;
+        } else
+                log_info_errno(r, "Not testing compressed batches: %m");
+
+        for (i = 0; i < size; i += 3) {
+                assert_se(journal_importer_push_data(&imp, data + i, MIN(3u, size - i)) >= 0);
+
+                while ((r = journal_importer_process_data(&imp)) == 1) {
+                        assert_se(imp.iovw.count == 2);
+                        assert_se(imp.ts.realtime == 1478389147837945 + n_entries);
+                        assert_se(imp.ts.monotonic == 4711);
+                        assert_iovec_entry(&imp.iovw.iovec[0],
+                                           n_entries == 0 ? "MESSAGE=first" :
+                                           n_entries == 1 ? "MESSAGE=second" :
+                                           "MESSAGE=batched, and some more text to compress");
+                        assert_se(imp.iovw.iovec[1].iov_len == 12);
+                        assert_se(memcmp(imp.iovw.iovec[1].iov_base, "BINARY=a\nb\0c", 12) == 0);
+
+                        n_entries++;
+                        journal_importer_drop_iovw(&imp);
+                }
+                assert_se(r == -EAGAIN);
+        }
+
+        assert_se(n_entries == n_expected);
+        assert_se(journal_importer_bytes_remaining(&imp) == 0);
+}
+
+static void test_binary_too_many_fields(void) {
+        _cleanup_(journal_importer_cleanup) JournalImporter imp = JOURNAL_IMPORTER_INIT(-1);
+        JournalBinaryEntryHeader e = {
+                .realtime = htole64(1478389147837945),
+                .monotonic = htole64(4711),
+        };
+        _cleanup_free_ char *data = NULL;
+        JournalBinaryFrameHeader h;
+        size_t i, n;
+
+        imp.fd = STDIN_FILENO; /* not read from */
+        imp.passive_fd = true;
+        imp.binary = true;
+
+        assert_se(data = malloc(sizeof(h) + sizeof(e) + (ENTRY_FIELD_COUNT_MAX + 1) * (sizeof(uint64_t) + 3) + 4096));
+
+        n = sizeof(h);
+        memcpy(data + n, &e, sizeof(e));
+        n += sizeof(e);
+
+        for (i = 0; i < ENTRY_FIELD_COUNT_MAX + 1; i++) {
+                unaligned_write_le64(data + n, 3);
+                n += sizeof(uint64_t);
+                memcpy(data + n, "F=x", 3);
+                n += 3;
+        }
+
+        h = (JournalBinaryFrameHeader) {
+                .size = htole64(n - sizeof(h)),
+                .type = JOURNAL_BINARY_FRAME_ENTRY,
+        };
+        memcpy(data, &h, sizeof(h));
+
+        /* The entry after the oversized one is read just fine */
+        n += binary_entry_append(data + n, 1478389147837946, "MESSAGE=after");
+
+        assert_se(journal_importer_push_data(&imp, data, n) >= 0);
+
+        assert_se(journal_importer_process_data(&imp) == -E2BIG);
+        assert_se(imp.iovw.count == 0);
+
+        assert_se(journal_importer_process_data(&imp) == 1);
+        assert_se(imp.iovw.count == 2);
+        assert_se(imp.ts.realtime == 1478389147837946);
+        assert_iovec_entry(&imp.iovw.iovec[0], "MESSAGE=after");
+        journal_importer_drop_iovw(&imp);
+
+        assert_se(journal_importer_process_data(&imp) == -EAGAIN);
+        assert_se(journal_importer_bytes_remaining(&imp) == 0);
+}
+
 int main(int argc, char **argv) {
         test_setup_logging(LOG_DEBUG);
 
         test_basic_parsing();
         test_bad_input();
+        test_push_data();
+        test_binary();
+        test_binary_too_many_fields();
 
         return 0;
 }
@@ -85,6 +85,35 @@ static void test_short_hashes(void) {
         }
 }
 
+static void test_siphash13(const uint8_t *key) {
+        const uint8_t other[16] = { 0x22, 0x24, 0x41, 0x22, 0x55, 0x77, 0x88, 0x07,
+                                    0x23, 0x09, 0x23, 0x14, 0x0c, 0x33, 0x0e, 0x0f};
+        uint8_t buf[65];
+        uint64_t a, b;
+        size_t i;
+
+        for (i = 0; i < sizeof buf; i++)
+                buf[i] = i;
+
+        assert_se(siphash13(buf, 0, key) == 0xabac0158050fc4dc);
+        assert_se(siphash13(buf, 15, key) == 0xd320d86d2a519956);
+        assert_se(siphash13(buf, 64, key) == 0xf17997ec4b4a6065);
+
+        /* Both halves of a pair must match the single hashes, for all lengths and alignments */
+        for (i = 0; i <= 64; i++) {
+                siphash13_pair(buf, i, key, other, &a, &b);
+                assert_se(a == siphash13(buf, i, key));
+                assert_se(b == siphash13(buf, i, other));
+                assert_se(a != b);
+
+                if (i < 64) {
+                        siphash13_pair(buf + 1, i, key, other, &a, &b);
+                        assert_se(a == siphash13(buf + 1, i, key));
+                        assert_se(b == siphash13(buf + 1, i, other));
+                }
+        }
+}
+
 /* see https://131002.net/siphash/siphash.pdf, Appendix A */
 int main(int argc, char *argv[]) {
         const uint8_t in[15]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
@@ -104,4 +133,5 @@ int main(int argc, char *argv[]) {
         do_test(in_buf + 4, sizeof(in), key);
 
         test_short_hashes();
+        test_siphash13(key);
 }
@@ -540,6 +540,28 @@ static void test_memory_startswith(void) {
         assert_se(!memory_startswith("xxx", 4, "xxxx"));
 }
 
+static void test_memchr2(void) {
+        char buf[64];
+        size_t i, j;
+
+        assert_se(!memchr2(NULL, '\n', 0, 0));
+        assert_se(!memchr2("abc", '\n', 0, 3));
+        assert_se(streq(memchr2("ab\ncd", '\n', 0, 6), "\ncd"));
+        assert_se(streq(memchr2("ab\0c\nd", '\n', 0, 6), ""));
+
+        /* Every position, relative to every alignment, with either byte found first */
+        for (i = 0; i < 32; i++)
+                for (j = 0; j < 31; j++) {
+                        memset(buf, 'x', sizeof(buf));
+                        buf[i + j] = j % 2 == 0 ? '\n' : 0;
+                        buf[i + j + 1] = j % 2 == 0 ? 0 : '\n';
+
+                        assert_se(memchr2(buf + i, '\n', 0, sizeof(buf) - i) == buf + i + j);
+                        assert_se(memchr2(buf + i, 0, '\n', sizeof(buf) - i) == buf + i + j);
+                        assert_se(!memchr2(buf + i, '\n', 0, j));
+                }
+}
+
 static void test_memory_startswith_no_case(void) {
         assert_se(streq(memory_startswith_no_case("", 0, ""), ""));
         assert_se(streq(memory_startswith_no_case("", 1, ""), ""));
@@ -741,6 +763,7 @@ int main(int argc, char *argv[]) {
         test_first_word();
         test_strlen_ptr();
         test_memory_startswith();
+        test_memchr2();
         test_memory_startswith_no_case();
         test_string_truncate_lines();
         test_string_extract_line();
@@ -0,0 +1,177 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "sort-util.h"
+#include "tests.h"
+#include "timer-wheel.h"
+
+#define N 1024*4
+
+struct test {
+        TimerWheelEntry entry;
+        uint64_t value;
+};
+
+static int uint64_compare(const uint64_t *a, const uint64_t *b) {
+        return CMP(*a, *b);
+}
+
+static uint64_t random_key(unsigned i) {
+        /* Small and large keys, ones that are close to each other and duplicates */
+        switch (i % 4) {
+        case 0:
+                return (uint64_t) rand();
+        case 1:
+                return (uint64_t) rand() % 100;
+        case 2:
+                return ((uint64_t) rand() << 32) | (uint64_t) rand();
+        default:
+                return UINT64_MAX - (uint64_t) rand() % 3;
+        }
+}
+
+static void test_sorted(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        _cleanup_free_ struct test *t = NULL;
+        uint64_t buffer[N];
+        unsigned i;
+
+        srand(0);
+
+        assert_se(w = timer_wheel_new());
+        assert_se(t = new(struct test, N));
+
+        assert_se(!timer_wheel_peek(w));
+        assert_se(!timer_wheel_pop(w));
+
+        for (i = 0; i < N; i++) {
+                t[i].entry = TIMER_WHEEL_ENTRY_NULL;
+                t[i].value = buffer[i] = random_key(i);
+                assert_se(timer_wheel_put(w, &t[i].entry, t[i].value) >= 0);
+                assert_se(timer_wheel_entry_linked(&t[i].entry));
+
+                /* Look at the smallest one every now and then, so that later ones may end up before the
+                 * base */
+                if (i % 100 == 0)
+                        assert_se(timer_wheel_peek(w));
+        }
+
+        typesafe_qsort(buffer, ELEMENTSOF(buffer), uint64_compare);
+
+        for (i = 0; i < N; i++) {
+                TimerWheelEntry *e;
+
+                assert_se(timer_wheel_size(w) == N - i);
+
+                assert_se(e = timer_wheel_pop(w));
+                assert_se(e->key == buffer[i]);
+                assert_se(container_of(e, struct test, entry)->value == buffer[i]);
+                assert_se(!timer_wheel_entry_linked(e));
+        }
+
+        assert_se(timer_wheel_size(w) == 0);
+        assert_se(!timer_wheel_pop(w));
+}
+
+static void test_rearm(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        _cleanup_free_ struct test *t = NULL;
+        uint64_t now = 1000000;
+        unsigned i, j;
+
+        srand(0);
+
+        assert_se(w = timer_wheel_new());
+        assert_se(t = new(struct test, N));
+
+        for (i = 0; i < N; i++) {
+                t[i].entry = TIMER_WHEEL_ENTRY_NULL;
+                t[i].value = now + rand() % 10000000;
+                assert_se(timer_wheel_put(w, &t[i].entry, t[i].value) >= 0);
+        }
+
+        /* Move time forward, rearm and remove random timers in between, and check that whatever comes
+         * first is really the smallest one */
+        for (j = 0; j < 1000; j++) {
+                TimerWheelEntry *e;
+                uint64_t min = UINT64_MAX;
+
+                for (i = 0; i < 50; i++) {
+                        struct test *x = t + rand() % N;
+
+                        (void) timer_wheel_remove(w, &x->entry);
+
+                        if (rand() % 4 == 0)
+                                continue;
+
+                        /* Sometimes before everything else that's there */
+                        x->value = now + (rand() % 3 == 0 ? rand() % 1000 : rand() % 10000000);
+                        assert_se(timer_wheel_put(w, &x->entry, x->value) >= 0);
+                }
+
+                for (i = 0; i < N; i++)
+                        if (timer_wheel_entry_linked(&t[i].entry))
+                                min = MIN(min, t[i].value);
+
+                e = timer_wheel_peek(w);
+                if (min == UINT64_MAX)
+                        assert_se(!e);
+                else {
+                        assert_se(e);
+                        assert_se(e->key == min);
+                }
+
+                while ((e = timer_wheel_peek(w)) && e->key <= now)
+                        assert_se(timer_wheel_pop(w) == e);
+
+                now += rand() % 100000;
+        }
+}
+
+static void test_reserve(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        _cleanup_free_ struct test *t = NULL;
+        TimerWheelEntry *e;
+        unsigned i;
+
+        assert_se(w = timer_wheel_new());
+        assert_se(t = new(struct test, N));
+        assert_se(timer_wheel_reserve(w, N) >= 0);
+
+        /* Move the base up, so that all entries put in below end up before it */
+        t[0].entry = TIMER_WHEEL_ENTRY_NULL;
+        t[0].value = UINT64_MAX;
+        assert_se(timer_wheel_put(w, &t[0].entry, t[0].value) >= 0);
+        assert_se(timer_wheel_peek(w) == &t[0].entry);
+
+        for (i = 1; i < N; i++) {
+                t[i].entry = TIMER_WHEEL_ENTRY_NULL;
+                t[i].value = N - i;
+                assert_se(timer_wheel_put(w, &t[i].entry, t[i].value) >= 0);
+        }
+
+        assert_se(timer_wheel_size(w) == N);
+
+        /* Reserving less than there is room for already is a NOP */
+        assert_se(timer_wheel_reserve(w, 1) >= 0);
+
+        for (i = 1; i < N; i++) {
+                assert_se(e = timer_wheel_pop(w));
+                assert_se(e->key == i);
+        }
+
+        assert_se(timer_wheel_pop(w) == &t[0].entry);
+        assert_se(!timer_wheel_peek(w));
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_sorted();
+        test_rearm();
+        test_reserve();
+
+        return 0;
+}
@@ -1,8 +1,11 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include "alloc-util.h"
+#include "random-util.h"
 #include "string-util.h"
 #include "strv.h"
+#include "tests.h"
+#include "time-util.h"
 #include "utf8.h"
 #include "util.h"
 
@@ -18,6 +21,79 @@ static void test_utf8_is_printable(void) {
         assert_se(utf8_is_printable("\t", 1));
 }
 
+/* What utf8_is_printable() does, one character at a time */
+static bool utf8_is_printable_reference(const char *str, size_t length) {
+        while (length > 0) {
+                char32_t c;
+                int l;
+
+                l = utf8_encoded_valid_unichar(str, length);
+                if (l < 0)
+                        return false;
+
+                assert_se(utf8_encoded_to_unichar(str, &c) >= 0);
+                if ((c < ' ' && !IN_SET(c, '\t', '\n')) || (c >= 0x7F && c <= 0x9F))
+                        return false;
+
+                str += l;
+                length -= l;
+        }
+
+        return true;
+}
+
+static void test_utf8_is_printable_random(void) {
+        static const char *const pieces[] = {
+                "a", " ", "~", "\t", "\n", "\r", "\177", "\302\205", "ą", "\342\204\242", "\341\204", "\377",
+        };
+        char buf[128];
+        unsigned k;
+
+        log_info("/* %s */", __func__);
+
+        /* Mostly printable ASCII, with a bit of everything else sprinkled in at random places, so that both
+         * the vectorized and the byte-wise parts get to see all of it */
+        for (k = 0; k < 2000; k++) {
+                size_t n = 0, i;
+
+                while (n < sizeof(buf) - 4) {
+                        const char *p;
+
+                        p = random_u32() % 8 != 0 ? "x" : pieces[random_u32() % ELEMENTSOF(pieces)];
+                        n = stpcpy(buf + n, p) - buf;
+                }
+
+                for (i = 0; i < 32; i++)
+                        assert_se(utf8_is_printable(buf + i, n - i) == utf8_is_printable_reference(buf + i, n - i));
+        }
+}
+
+static void test_utf8_is_printable_benchmark(void) {
+        _cleanup_free_ char *text = NULL;
+        char span1[FORMAT_TIMESPAN_MAX], span2[FORMAT_TIMESPAN_MAX];
+        size_t i, size = 4 * 1024 * 1024;
+        usec_t t, t_reference;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(text = new(char, size));
+        for (i = 0; i < size; i++)
+                text[i] = i % 81 == 80 ? '\n' : 'a' + i % 26;
+
+        t = now(CLOCK_MONOTONIC);
+        assert_se(utf8_is_printable(text, size));
+        t = now(CLOCK_MONOTONIC) - t;
+
+        t_reference = now(CLOCK_MONOTONIC);
+        assert_se(utf8_is_printable_reference(text, size));
+        t_reference = now(CLOCK_MONOTONIC) - t_reference;
+
+        log_info("utf8_is_printable() on %zu bytes of ASCII: %s, character by character: %s",
+                 size,
+                 format_timespan(span1, sizeof(span1), t, 1),
+                 format_timespan(span2, sizeof(span2), t_reference, 1));
+}
+
 static void test_utf8_is_valid(void) {
         log_info("/* %s */", __func__);
 
@@ -218,6 +294,8 @@ static void test_utf8_to_utf16(void) {
 int main(int argc, char *argv[]) {
         test_utf8_is_valid();
         test_utf8_is_printable();
+        test_utf8_is_printable_random();
+        test_utf8_is_printable_benchmark();
         test_ascii_is_valid();
         test_ascii_is_valid_n();
         test_utf8_encoded_valid_unichar();